@@ -0,0 +1,274 @@
+/*
+  admin.c -- the proxy's internal admin HTTP server.
+*/
+
+#include "admin.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define ADMIN_MAX_REQUEST 65536 // admin requests are small, bodies included
+#define ADMIN_TIMEOUT_SECONDS 5  // longest one client may hold the single admin thread
+
+struct admin_route
+{
+    char path[64];
+    AdminHandler handler;
+};
+
+static struct admin_route routes[ADMIN_MAX_HANDLERS];
+static int nroutes;
+static int admin_socket = -1;
+static int admin_port;
+static int admin_wait;    // seconds to keep trying a port still held by the proxy being replaced
+static int admin_stopped;
+
+int Admin_register(const char *path, AdminHandler handler)
+{
+    if (nroutes == ADMIN_MAX_HANDLERS || strlen(path) >= sizeof(routes[0].path))
+        return -1;
+    strcpy(routes[nroutes].path, path);
+    routes[nroutes].handler = handler;
+    nroutes++;
+    return 0;
+}
+
+void Admin_write(struct AdminReply *reply, const char *data, size_t len)
+{
+    if (reply->len + len + 1 > reply->cap)
+    {
+        size_t cap = reply->cap ? reply->cap : 4096;
+        while (reply->len + len + 1 > cap)
+            cap *= 2;
+        reply->data = (char *)realloc(reply->data, cap);
+        reply->cap = cap;
+    }
+    memcpy(reply->data + reply->len, data, len);
+    reply->len += len;
+    reply->data[reply->len] = '\0';
+}
+
+void Admin_printf(struct AdminReply *reply, const char *format, ...)
+{
+    char line[1024];
+    va_list args;
+
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (n < (int)sizeof(line))
+    {
+        Admin_write(reply, line, n);
+        return;
+    }
+
+    // Longer than the line buffer, format again into the reply itself
+    char *big = (char *)malloc(n + 1);
+    va_start(args, format);
+    vsnprintf(big, n + 1, format, args);
+    va_end(args);
+    Admin_write(reply, big, n);
+    free(big);
+}
+
+int Admin_queryParam(const char *query, const char *key, char *value, size_t value_len)
+{
+    size_t key_len = strlen(key);
+    const char *p = query;
+
+    while (p != NULL && *p)
+    {
+        const char *end = strchr(p, '&');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len > key_len && p[key_len] == '=' && !strncmp(p, key, key_len))
+        {
+            size_t n = len - key_len - 1 < value_len - 1 ? len - key_len - 1 : value_len - 1;
+            memcpy(value, p + key_len + 1, n);
+            value[n] = '\0';
+            return 1;
+        }
+        p = end ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+static const char *status_text(int status)
+{
+    switch (status)
+    {
+    case 200:
+        return "OK";
+    case 400:
+        return "Bad Request";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    default:
+        return "Error";
+    }
+}
+
+/* Read one request, dispatch it and answer; the connection is then closed */
+static void admin_serve(int client)
+{
+    char *req = (char *)malloc(ADMIN_MAX_REQUEST + 1);
+    int total = 0;
+    char *head_end = NULL;
+    long body_len = 0;
+    time_t deadline = time(NULL) + ADMIN_TIMEOUT_SECONDS; // a client trickling bytes is cut off too
+
+    while (total < ADMIN_MAX_REQUEST && time(NULL) < deadline)
+    {
+        int n = recv(client, req + total, ADMIN_MAX_REQUEST - total, 0);
+        if (n <= 0)
+            break;
+        total += n;
+        req[total] = '\0';
+        if (head_end == NULL && (head_end = strstr(req, "\r\n\r\n")) != NULL)
+        {
+            char *cl = strcasestr(req, "\r\nContent-Length:");
+            if (cl != NULL && cl < head_end)
+                body_len = atol(cl + 17);
+        }
+        if (head_end != NULL && total - (head_end + 4 - req) >= body_len)
+            break;
+    }
+
+    struct AdminReply reply = {200, "text/plain; charset=utf-8", NULL, 0, 0};
+    char method[16] = "";
+    char target[1024] = "";
+
+    if (head_end == NULL || sscanf(req, "%15s %1023s", method, target) != 2)
+    {
+        reply.status = 400;
+        Admin_printf(&reply, "bad request\n");
+    }
+    else
+    {
+        char *query = strchr(target, '?');
+        if (query != NULL)
+            *query++ = '\0';
+        else
+            query = (char *)"";
+
+        int found = 0;
+        for (int i = 0; i < nroutes && !found; i++)
+        {
+            if (!strcmp(routes[i].path, target))
+            {
+                routes[i].handler(method, query, head_end + 4, &reply);
+                found = 1;
+            }
+        }
+        if (!found)
+        {
+            reply.status = 404;
+            Admin_printf(&reply, "unknown admin path %s\n", target);
+        }
+    }
+
+    char head[256];
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                            reply.status, status_text(reply.status), reply.content_type, reply.len);
+    send(client, head, head_len, MSG_NOSIGNAL);
+    for (size_t sent = 0; sent < reply.len;)
+    {
+        ssize_t n = send(client, reply.data + sent, reply.len - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    free(reply.data);
+    free(req);
+}
+
+/* Listening socket on 127.0.0.1:port, -1 if it is taken */
+static int admin_bind(int port)
+{
+    struct sockaddr_in addr;
+    int reuse = 1;
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0)
+        return -1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // admin is never exposed
+    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(s, 16) < 0)
+    {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+static void *admin_thread(void *arg)
+{
+    (void)arg;
+    // The proxy being replaced lets go of the port once it starts draining
+    for (int i = 0; admin_socket < 0 && i < admin_wait * 10 && !__atomic_load_n(&admin_stopped, __ATOMIC_ACQUIRE); i++)
+    {
+        usleep(100000);
+        __atomic_store_n(&admin_socket, admin_bind(admin_port), __ATOMIC_RELEASE);
+    }
+    if (admin_socket < 0)
+    {
+        fprintf(stderr, "Admin port %d is not free, running without the admin interface\n", admin_port);
+        return NULL;
+    }
+
+    while (1)
+    {
+        int client = accept(admin_socket, NULL, NULL);
+        if (client < 0)
+        {
+            if (__atomic_load_n(&admin_stopped, __ATOMIC_ACQUIRE))
+                break;
+            continue;
+        }
+        // Clients are served one at a time: one that stalls must not wedge /metrics and /config
+        struct timeval timeout = {ADMIN_TIMEOUT_SECONDS, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        admin_serve(client);
+        close(client);
+    }
+    close(admin_socket);
+    return NULL;
+}
+
+int Admin_start(int port, int wait_seconds)
+{
+    admin_port = port;
+    admin_wait = wait_seconds;
+    admin_socket = admin_bind(port);
+    if (admin_socket < 0 && wait_seconds == 0)
+        return -1;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, admin_thread, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+void Admin_stop()
+{
+    __atomic_store_n(&admin_stopped, 1, __ATOMIC_RELEASE);
+    int s = __atomic_load_n(&admin_socket, __ATOMIC_ACQUIRE);
+    if (s >= 0)
+        shutdown(s, SHUT_RDWR); // wakes the admin thread up in accept(), which closes the port
+}
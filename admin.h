@@ -0,0 +1,55 @@
+/*
+ * admin.h -- the proxy's internal admin HTTP server.
+ *
+ * The admin server listens on its own port (loopback only) and is served by
+ * a single thread, one request at a time, away from client traffic. Other
+ * modules register a handler per path; a handler fills an AdminReply which
+ * is sent back with a Content-Length.
+ */
+
+#include <stddef.h>
+
+#ifndef PROXY_ADMIN
+#define PROXY_ADMIN
+
+#define ADMIN_MAX_HANDLERS 16
+
+struct AdminReply
+{
+    int status;               // HTTP status, 200 unless the handler says otherwise
+    const char *content_type; // defaults to text/plain
+    char *data;               // response body
+    size_t len;
+    size_t cap;
+};
+
+/*
+   Handler for one admin path. method is the request method, query the part
+   after '?' (empty string if none) and body the request body (may be empty).
+ */
+typedef void (*AdminHandler)(const char *method, const char *query, const char *body,
+                             struct AdminReply *reply);
+
+/* Serve path with handler; returns -1 if the handler table is full */
+int Admin_register(const char *path, AdminHandler handler);
+
+/*
+   Start the admin thread listening on 127.0.0.1:port; returns -1 on error.
+   If the port is taken and wait_seconds > 0, the thread keeps trying to
+   bind it for that long instead, as during a hot restart.
+ */
+int Admin_start(int port, int wait_seconds);
+
+/* Close the admin port, for a successor to bind it */
+void Admin_stop();
+
+/* Append formatted text to a reply body */
+void Admin_printf(struct AdminReply *reply, const char *format, ...);
+
+/* Append raw bytes to a reply body */
+void Admin_write(struct AdminReply *reply, const char *data, size_t len);
+
+/* Value of key in a query string ("a=1&b=2"), copied to value; 1 if found */
+int Admin_queryParam(const char *query, const char *key, char *value, size_t value_len);
+
+#endif
@@ -0,0 +1,64 @@
+/*
+  admission.c -- admission control for the client slot queue.
+*/
+
+#include "admission.h"
+#include <limits.h>
+#include <pthread.h>
+
+static long target_us = ADMISSION_TARGET_MS * 1000L;
+static long interval_us = ADMISSION_INTERVAL_MS * 1000L;
+static pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+static long interval_end;        // when the current interval is judged
+static long min_wait = LONG_MAX; // shortest wait seen in it
+static int overloaded;
+
+long Admission_timeoutUs()
+{
+    long target = __atomic_load_n(&target_us, __ATOMIC_RELAXED);
+    if (target == 0)
+        return -1;
+    return __atomic_load_n(&overloaded, __ATOMIC_RELAXED) ? target : __atomic_load_n(&interval_us, __ATOMIC_RELAXED);
+}
+
+void Admission_observe(long now_us, long waited_us)
+{
+    pthread_mutex_lock(&admission_lock);
+    if (waited_us < min_wait)
+        min_wait = waited_us;
+    if (now_us >= interval_end)
+    {
+        // A queue that never drained below the target for a whole interval is standing, not a burst
+        __atomic_store_n(&overloaded, min_wait > __atomic_load_n(&target_us, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        min_wait = LONG_MAX;
+        interval_end = now_us + __atomic_load_n(&interval_us, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&admission_lock);
+}
+
+long Admission_overloaded()
+{
+    return __atomic_load_n(&overloaded, __ATOMIC_RELAXED);
+}
+
+int Admission_setTarget(long ms)
+{
+    if (ms < 0 || ms > 60000)
+        return -1;
+    __atomic_store_n(&target_us, ms * 1000, __ATOMIC_RELAXED);
+    if (ms == 0)
+        __atomic_store_n(&overloaded, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+long Admission_target() { return __atomic_load_n(&target_us, __ATOMIC_RELAXED) / 1000; }
+
+int Admission_setInterval(long ms)
+{
+    if (ms < 1 || ms > 60000)
+        return -1;
+    __atomic_store_n(&interval_us, ms * 1000, __ATOMIC_RELAXED);
+    return 0;
+}
+
+long Admission_interval() { return __atomic_load_n(&interval_us, __ATOMIC_RELAXED) / 1000; }
@@ -0,0 +1,37 @@
+/*
+ * admission.h -- admission control for the client slot queue.
+ *
+ * An accepted connection queues for one of the max_clients slots. Rather
+ * than letting the queue grow without bound during a burst, the queue is
+ * managed the way CoDel manages a packet queue: the shortest wait seen over
+ * each interval tells a standing queue from a passing burst. While no
+ * connection got a slot within the target delay for a whole interval the
+ * proxy is overloaded and connections give up queueing after the target
+ * delay; otherwise they wait at most one interval. A connection that gives
+ * up is still answered from the cache on a hit, and with 503 and
+ * Retry-After otherwise, so the slots go to requests that can finish in
+ * time while hits keep being served.
+ */
+
+#ifndef PROXY_ADMISSION
+#define PROXY_ADMISSION
+
+#define ADMISSION_TARGET_MS 5       // default acceptable standing queue delay, 0 disables shedding
+#define ADMISSION_INTERVAL_MS 100   // default interval, and longest wait while not overloaded
+#define ADMISSION_RETRY_AFTER 1     // seconds shed clients are told to wait
+
+/* How long a connection may wait for a slot now, in microseconds; -1 for as long as it takes */
+long Admission_timeoutUs();
+
+/* Account a connection that waited waited_us for a slot (or gave up after it) at now_us */
+void Admission_observe(long now_us, long waited_us);
+
+/* 1 while connections give up after the target delay */
+long Admission_overloaded();
+
+int Admission_setTarget(long ms); // -1 if out of range
+long Admission_target();
+int Admission_setInterval(long ms); // -1 if out of range
+long Admission_interval();
+
+#endif
@@ -0,0 +1,352 @@
+/*
+  cachesim.c -- replays a request trace recorded with `proxy -w` against
+  cache models of different sizes and eviction policies.
+
+  Every lookup in the trace (a GET or HEAD that consulted the cache) is a
+  hit if the model holds the key; a miss whose response was cacheable is
+  inserted, evicting entries while the model is over its size. Successful
+  unsafe requests drop their key. Entries are charged an estimate of what
+  cache.c charges (the glibc chunk holding element, key and response) and
+  responses larger than the element limit are never stored.
+
+  Policies: lru (the proxy's own, with exact rather than 1s recency), fifo
+  (no promotion on hit) and lfu (fewest hits, oldest access breaks ties).
+
+  Usage: cachesim [-p lru,fifo,lfu] [-s size,...] [-e max_element,...] <trace>
+  Sizes take K, M or G suffixes; default sizes double from 1M to 1G.
+*/
+
+#include "../log.h"
+#include "../cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_CONFIGS 32
+
+enum
+{
+    POLICY_LRU,
+    POLICY_FIFO,
+    POLICY_LFU
+};
+
+const char *policy_names[] = {"lru", "fifo", "lfu"};
+
+struct ReplayRecord *records;
+long nrecords;
+int *ids;     // dense id of each record's key
+long nkeys;
+
+/* Per key state of one simulation run */
+struct Entry
+{
+    int cached;
+    long charge;     // bytes accounted while cached
+    int prev, next;  // recency/insertion list (lru, fifo)
+    int heap_pos;    // position in the heap (lfu)
+    long hits;
+    long last;       // index of the last access, ties in lfu
+};
+
+struct Entry *entries;
+int list_head, list_tail; // head is the next victim
+int *heap;                // lfu min-heap of ids by (hits, last)
+int heap_len;
+
+long parseSize(const char *s)
+{
+    char *end;
+    double v = strtod(s, &end);
+    if (*end == 'K' || *end == 'k')
+        v *= 1 << 10;
+    else if (*end == 'M' || *end == 'm')
+        v *= 1 << 20;
+    else if (*end == 'G' || *end == 'g')
+        v *= 1 << 30;
+    return (long)v;
+}
+
+/* Parse a comma separated list of sizes; returns how many */
+int parseSizes(char *list, long *out)
+{
+    int n = 0;
+    for (char *tok = strtok(list, ","); tok != NULL && n < MAX_CONFIGS; tok = strtok(NULL, ","))
+        out[n++] = parseSize(tok);
+    return n;
+}
+
+/* Size of the malloc chunk cache.c allocates for an element, as glibc rounds it */
+long charge(const struct ReplayRecord *r)
+{
+    long bytes = sizeof(cache_element) + r->key_len + 1 + r->size + 1 + CACHE_CHUNK_OVERHEAD;
+    return bytes < 32 ? 32 : (bytes + 15) & ~15L;
+}
+
+int compareHash(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Maps every key hash of the trace to a dense id
+ */
+void assignIds()
+{
+    unsigned long *keys = (unsigned long *)malloc(nrecords * sizeof(unsigned long));
+    for (long i = 0; i < nrecords; i++)
+        keys[i] = records[i].key_hash;
+    qsort(keys, nrecords, sizeof(unsigned long), compareHash);
+    nkeys = 0;
+    for (long i = 0; i < nrecords; i++)
+        if (nkeys == 0 || keys[nkeys - 1] != keys[i])
+            keys[nkeys++] = keys[i];
+
+    ids = (int *)malloc(nrecords * sizeof(int));
+    for (long i = 0; i < nrecords; i++)
+    {
+        unsigned long *found = (unsigned long *)bsearch(&records[i].key_hash, keys, nkeys,
+                                                        sizeof(unsigned long), compareHash);
+        ids[i] = found - keys;
+    }
+    free(keys);
+}
+
+void listUnlink(int id)
+{
+    struct Entry *e = &entries[id];
+    if (e->prev >= 0)
+        entries[e->prev].next = e->next;
+    else
+        list_head = e->next;
+    if (e->next >= 0)
+        entries[e->next].prev = e->prev;
+    else
+        list_tail = e->prev;
+}
+
+void listAppend(int id)
+{
+    struct Entry *e = &entries[id];
+    e->prev = list_tail;
+    e->next = -1;
+    if (list_tail >= 0)
+        entries[list_tail].next = id;
+    else
+        list_head = id;
+    list_tail = id;
+}
+
+int heapLess(int a, int b)
+{
+    struct Entry *x = &entries[a], *y = &entries[b];
+    return x->hits < y->hits || (x->hits == y->hits && x->last < y->last);
+}
+
+void heapSwap(int i, int j)
+{
+    int t = heap[i];
+    heap[i] = heap[j];
+    heap[j] = t;
+    entries[heap[i]].heap_pos = i;
+    entries[heap[j]].heap_pos = j;
+}
+
+void heapFix(int i)
+{
+    while (i > 0 && heapLess(heap[i], heap[(i - 1) / 2]))
+    {
+        heapSwap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (1)
+    {
+        int smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < heap_len && heapLess(heap[l], heap[smallest]))
+            smallest = l;
+        if (r < heap_len && heapLess(heap[r], heap[smallest]))
+            smallest = r;
+        if (smallest == i)
+            break;
+        heapSwap(i, smallest);
+        i = smallest;
+    }
+}
+
+void drop(int policy, int id)
+{
+    if (policy == POLICY_LFU)
+    {
+        int pos = entries[id].heap_pos;
+        heapSwap(pos, --heap_len);
+        if (pos < heap_len)
+            heapFix(pos);
+    }
+    else
+        listUnlink(id);
+    entries[id].cached = 0;
+}
+
+int victim(int policy)
+{
+    return policy == POLICY_LFU ? heap[0] : list_head;
+}
+
+/**
+ * @brief Replays the whole trace against one cache configuration
+ */
+void simulate(int policy, long max_size, long max_element)
+{
+    long used = 0;
+    long lookups = 0, hits = 0, bytes = 0, hit_bytes = 0, evictions = 0;
+
+    memset(entries, 0, nkeys * sizeof(struct Entry));
+    list_head = list_tail = -1;
+    heap_len = 0;
+
+    for (long i = 0; i < nrecords; i++)
+    {
+        struct ReplayRecord *r = &records[i];
+        int id = ids[i];
+        struct Entry *e = &entries[id];
+
+        if (r->flags & REPLAY_INVALIDATE)
+        {
+            if (e->cached)
+            {
+                drop(policy, id);
+                used -= e->charge;
+            }
+            continue;
+        }
+        if (!(r->flags & REPLAY_LOOKUP))
+            continue;
+
+        lookups++;
+        bytes += r->size;
+        e->last = i;
+        if (e->cached)
+        {
+            hits++;
+            hit_bytes += r->size;
+            e->hits++;
+            if (policy == POLICY_LRU)
+            {
+                listUnlink(id);
+                listAppend(id);
+            }
+            else if (policy == POLICY_LFU)
+                heapFix(e->heap_pos);
+            continue;
+        }
+
+        long bytes = charge(r);
+        if (!(r->flags & REPLAY_CACHEABLE) || bytes > max_element || bytes > max_size)
+            continue;
+        while (used + bytes > max_size)
+        {
+            int v = victim(policy);
+            drop(policy, v);
+            used -= entries[v].charge;
+            evictions++;
+        }
+        e->cached = 1;
+        e->charge = bytes;
+        e->hits = 0;
+        used += bytes;
+        if (policy == POLICY_LFU)
+        {
+            heap[heap_len] = id;
+            e->heap_pos = heap_len++;
+            heapFix(e->heap_pos);
+        }
+        else
+            listAppend(id);
+    }
+
+    printf("%-6s %12ld %12ld %10ld %9.4f %9.4f %10ld\n", policy_names[policy], max_element, max_size,
+           lookups, lookups ? (double)hits / lookups : 0, bytes ? (double)hit_bytes / bytes : 0, evictions);
+}
+
+int main(int argc, char *argv[])
+{
+    long sizes[MAX_CONFIGS], elements[MAX_CONFIGS];
+    int nsizes = 0, nelements = 0;
+    int policies[3] = {POLICY_LRU, -1, -1};
+    int npolicies = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:s:e:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            npolicies = 0;
+            for (char *tok = strtok(optarg, ","); tok != NULL && npolicies < 3; tok = strtok(NULL, ","))
+            {
+                int p;
+                for (p = 0; p < 3 && strcmp(tok, policy_names[p]); p++)
+                    ;
+                if (p == 3)
+                {
+                    fprintf(stderr, "Unknown policy %s\n", tok);
+                    exit(1);
+                }
+                policies[npolicies++] = p;
+            }
+            break;
+        case 's':
+            nsizes = parseSizes(optarg, sizes);
+            break;
+        case 'e':
+            nelements = parseSizes(optarg, elements);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "Usage: %s [-p lru,fifo,lfu] [-s size,...] [-e max_element,...] <trace>\n", argv[0]);
+        exit(1);
+    }
+    if (nsizes == 0)
+        for (long s = 1 << 20; s <= 1L << 30; s *= 2)
+            sizes[nsizes++] = s;
+    if (nelements == 0)
+        elements[nelements++] = MAX_ELEMENT_SIZE;
+
+    FILE *in = fopen(argv[optind], "rb");
+    if (in == NULL)
+    {
+        perror("cachesim: trace");
+        exit(1);
+    }
+    fseek(in, 0, SEEK_END);
+    nrecords = ftell(in) / sizeof(struct ReplayRecord);
+    rewind(in);
+    records = (struct ReplayRecord *)malloc((nrecords ? nrecords : 1) * sizeof(struct ReplayRecord));
+    nrecords = fread(records, sizeof(struct ReplayRecord), nrecords, in);
+    fclose(in);
+
+    assignIds();
+    entries = (struct Entry *)malloc((nkeys ? nkeys : 1) * sizeof(struct Entry));
+    heap = (int *)malloc((nkeys ? nkeys : 1) * sizeof(int));
+    printf("%ld requests, %ld distinct keys\n", nrecords, nkeys);
+    printf("%-6s %12s %12s %10s %9s %9s %10s\n", "policy", "max_element", "cache_size", "lookups",
+           "hit", "byte_hit", "evictions");
+
+    for (int p = 0; p < npolicies; p++)
+        for (int e = 0; e < nelements; e++)
+            for (int s = 0; s < nsizes; s++)
+                simulate(policies[p], sizes[s], elements[e]);
+
+    free(records);
+    free(ids);
+    free(entries);
+    free(heap);
+    return 0;
+}
@@ -0,0 +1,313 @@
+/*
+  loadgen.c -- load generator for the proxy.
+
+  Worker threads request http://<origin>/obj/<k> through the proxy, one
+  connection per request as the proxy serves them, with k drawn from a
+  Zipf distribution over the key space. Closed loop by default: each
+  worker sends its next request when the previous one finishes. With -r
+  the load is open loop: requests are due on a fixed schedule and latency
+  is measured from when a request was due, not when it was sent, so a
+  stalled proxy cannot hide its queueing (coordinated omission).
+
+  With -A the proxy's /metrics is read before and after the run to report
+  the cache hit ratio.
+
+  Usage: loadgen [-c connections] [-d seconds] [-r rate] [-n keys] [-s zipf_s]
+                 [-o origin_host:port] [-A admin_port] <proxy_port>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_BYTES 65536
+#define MAX_WORKERS 1024
+
+struct Worker
+{
+    pthread_t tid;
+    int id;
+    unsigned int seed;
+    long *latency_us; // one entry per completed request
+    long count, cap;
+    long errors;
+    long bytes;
+};
+
+int proxy_port;
+int admin_port = 0;
+const char *origin = "127.0.0.1:9000";
+int connections = 16;
+int duration = 10;
+double rate = 0;   // total requests per second, 0 for closed loop
+int keys = 10000;
+double zipf_s = 0.99;
+double *zipf_cdf;  // cumulative probability of keys 0..k
+long start_us, stop_us;
+
+long nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Precomputes the Zipf CDF; key k has weight 1 / (k + 1)^s
+ */
+void zipfInit()
+{
+    zipf_cdf = (double *)malloc(keys * sizeof(double));
+    double total = 0;
+    for (int k = 0; k < keys; k++)
+    {
+        total += 1.0 / pow(k + 1, zipf_s);
+        zipf_cdf[k] = total;
+    }
+    for (int k = 0; k < keys; k++)
+        zipf_cdf[k] /= total;
+}
+
+/**
+ * @brief Draws a key by binary search of the CDF
+ */
+int zipfNext(unsigned int *seed)
+{
+    double u = rand_r(seed) / (RAND_MAX + 1.0);
+    int lo = 0, hi = keys - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int connectLocal(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/**
+ * @brief Sends one request and reads the response to the end
+ * @return Response bytes read, -1 on error or non-2xx status
+ */
+long fetch(int port, const char *request, int request_len, char *buf)
+{
+    int fd = connectLocal(port);
+    if (fd < 0)
+        return -1;
+    long total = 0;
+    int ok = send(fd, request, request_len, MSG_NOSIGNAL) == request_len;
+    while (ok)
+    {
+        int n = recv(fd, buf, MAX_BYTES, 0);
+        if (n <= 0)
+            break;
+        if (total == 0)
+            ok = n > 9 && buf[9] == '2';
+        total += n;
+    }
+    close(fd);
+    return ok && total > 0 ? total : -1;
+}
+
+void *work(void *arg)
+{
+    struct Worker *w = (struct Worker *)arg;
+    char *buf = (char *)malloc(MAX_BYTES);
+    char request[512];
+    long interval_us = rate > 0 ? (long)(connections * 1e6 / rate) : 0;
+    long due = start_us + (interval_us * w->id) / connections; // stagger the workers
+
+    while (1)
+    {
+        long now = nowUs();
+        if (interval_us > 0)
+        {
+            if (due >= stop_us)
+                break;
+            if (due > now)
+                usleep(due - now);
+        }
+        else if (now >= stop_us)
+            break;
+
+        long began = interval_us > 0 ? due : nowUs();
+        int len = snprintf(request, sizeof(request),
+                           "GET http://%s/obj/%d HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                           origin, zipfNext(&w->seed), origin);
+        long bytes = fetch(proxy_port, request, len, buf);
+        if (bytes < 0)
+            w->errors++;
+        else
+        {
+            w->bytes += bytes;
+            if (w->count == w->cap)
+            {
+                w->cap = w->cap ? 2 * w->cap : 4096;
+                w->latency_us = (long *)realloc(w->latency_us, w->cap * sizeof(long));
+            }
+            w->latency_us[w->count++] = nowUs() - began;
+        }
+        due += interval_us;
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief Reads a counter from the proxy's /metrics, -1 if unavailable
+ */
+long scrape(const char *name)
+{
+    if (admin_port == 0)
+        return -1;
+    static char buf[1 << 20];
+    const char *request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    int fd = connectLocal(admin_port);
+    if (fd < 0)
+        return -1;
+    send(fd, request, strlen(request), MSG_NOSIGNAL);
+    long total = 0;
+    int n;
+    while (total < (long)sizeof(buf) - 1 && (n = recv(fd, buf + total, sizeof(buf) - 1 - total, 0)) > 0)
+        total += n;
+    buf[total] = '\0';
+    close(fd);
+
+    char pattern[128];
+    snprintf(pattern, sizeof(pattern), "\n%s ", name);
+    char *line = strstr(buf, pattern);
+    return line != NULL ? atol(line + strlen(pattern)) : -1;
+}
+
+int compareLong(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:r:n:s:o:A:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'n':
+            keys = atoi(optarg);
+            break;
+        case 's':
+            zipf_s = atof(optarg);
+            break;
+        case 'o':
+            origin = optarg;
+            break;
+        case 'A':
+            admin_port = atoi(optarg);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1 || connections < 1 || connections > MAX_WORKERS || keys < 1 || duration < 1)
+    {
+        fprintf(stderr, "Usage: %s [-c connections] [-d seconds] [-r rate] [-n keys] [-s zipf_s] "
+                        "[-o origin_host:port] [-A admin_port] <proxy_port>\n", argv[0]);
+        exit(1);
+    }
+    proxy_port = atoi(argv[optind]);
+    zipfInit();
+
+    long hits_before = scrape("proxy_cache_hits_total");
+    long misses_before = scrape("proxy_cache_misses_total");
+
+    struct Worker *workers = (struct Worker *)calloc(connections, sizeof(struct Worker));
+    start_us = nowUs();
+    stop_us = start_us + duration * 1000000L;
+    for (int i = 0; i < connections; i++)
+    {
+        workers[i].id = i;
+        workers[i].seed = 12345 + i;
+        pthread_create(&workers[i].tid, NULL, work, &workers[i]);
+    }
+
+    long count = 0, errors = 0, bytes = 0;
+    for (int i = 0; i < connections; i++)
+    {
+        pthread_join(workers[i].tid, NULL);
+        count += workers[i].count;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+    }
+    double elapsed = (nowUs() - start_us) / 1e6;
+
+    long *all = (long *)malloc((count ? count : 1) * sizeof(long));
+    long n = 0;
+    for (int i = 0; i < connections; i++)
+    {
+        memcpy(all + n, workers[i].latency_us, workers[i].count * sizeof(long));
+        n += workers[i].count;
+        free(workers[i].latency_us);
+    }
+    qsort(all, count, sizeof(long), compareLong);
+
+    printf("mode        %s\n", rate > 0 ? "open loop" : "closed loop");
+    printf("connections %d\n", connections);
+    printf("requests    %ld (%ld errors)\n", count, errors);
+    printf("rps         %.1f\n", count / elapsed);
+    printf("throughput  %.1f MB/s\n", bytes / elapsed / (1 << 20));
+    if (count > 0)
+    {
+        printf("latency p50 %.3f ms\n", all[(long)(count * 0.50)] / 1e3);
+        printf("latency p99 %.3f ms\n", all[(long)(count * 0.99)] / 1e3);
+        printf("latency p999 %.3f ms\n", all[(long)(count * 0.999)] / 1e3);
+        printf("latency max %.3f ms\n", all[count - 1] / 1e3);
+    }
+
+    long hits = scrape("proxy_cache_hits_total") - hits_before;
+    long misses = scrape("proxy_cache_misses_total") - misses_before;
+    if (hits_before >= 0 && hits + misses > 0)
+        printf("hit ratio   %.3f\n", (double)hits / (hits + misses));
+
+    free(all);
+    free(workers);
+    free(zipf_cdf);
+    return errors > 0 && count == 0;
+}
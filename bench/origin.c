@@ -0,0 +1,220 @@
+/*
+  origin.c -- configurable origin server for benchmarking the proxy.
+
+  Serves any GET/HEAD path with a body of 'x' whose size is drawn from a
+  distribution. The size is seeded by the path, so the same URL always has
+  the same size and a cached copy stays valid. Every response can be
+  delayed and carries the configured Cache-Control header.
+
+  Usage: origin [-s size_spec] [-d delay_spec] [-c cache_control] <port>
+    size_spec  fixed:N | uniform:MIN:MAX | pareto:MIN:ALPHA   (default fixed:4096)
+    delay_spec fixed:MS | uniform:MIN:MAX                     (default fixed:0)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+
+#define MAX_BYTES 4096
+#define MAX_BODY (64 * (1 << 20))
+
+enum
+{
+    DIST_FIXED,
+    DIST_UNIFORM,
+    DIST_PARETO
+};
+
+struct Distribution
+{
+    int kind;
+    double a, b;
+};
+
+struct Distribution size_dist = {DIST_FIXED, 4096, 0};
+struct Distribution delay_dist = {DIST_FIXED, 0, 0};
+const char *cache_control = "max-age=3600";
+char *body; // MAX_BODY bytes of 'x', shared by every response
+
+/**
+ * @brief Parses "kind:a[:b]" into a distribution
+ * @return 0 if successful, -1 if spec is malformed
+ */
+int parseDistribution(const char *spec, struct Distribution *dist)
+{
+    double a = 0, b = 0;
+    if (sscanf(spec, "fixed:%lf", &a) == 1)
+        dist->kind = DIST_FIXED;
+    else if (sscanf(spec, "uniform:%lf:%lf", &a, &b) == 2 && b >= a)
+        dist->kind = DIST_UNIFORM;
+    else if (sscanf(spec, "pareto:%lf:%lf", &a, &b) == 2 && a > 0 && b > 0)
+        dist->kind = DIST_PARETO;
+    else
+        return -1;
+    dist->a = a;
+    dist->b = b;
+    return 0;
+}
+
+/**
+ * @brief Draws from a distribution using a uniform number u in [0, 1)
+ */
+double sample(struct Distribution *dist, double u)
+{
+    switch (dist->kind)
+    {
+    case DIST_UNIFORM:
+        return dist->a + u * (dist->b - dist->a);
+    case DIST_PARETO:
+        return dist->a / pow(1.0 - u, 1.0 / dist->b);
+    default:
+        return dist->a;
+    }
+}
+
+/**
+ * @brief FNV-1a hash of a path mapped to [0, 1), so sizes are stable per URL
+ */
+double pathUniform(const char *path, int len)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (int i = 0; i < len; i++)
+        h = (h ^ (unsigned char)path[i]) * 1099511628211ULL;
+    return (h >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void *serve(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char req[MAX_BYTES + 1];
+    int len = 0;
+    unsigned int seed = (unsigned int)fd;
+
+    // Requests from the proxy are one per connection; headers fit in MAX_BYTES
+    while (len < MAX_BYTES)
+    {
+        int n = recv(fd, req + len, MAX_BYTES - len, 0);
+        if (n <= 0)
+            break;
+        len += n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL)
+            break;
+    }
+
+    char *path = strchr(req, ' ');
+    char *path_end = path != NULL ? strchr(path + 1, ' ') : NULL;
+    if (len == 0 || path_end == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    path++;
+
+    long size = (long)sample(&size_dist, pathUniform(path, path_end - path));
+    if (size < 0)
+        size = 0;
+    if (size > MAX_BODY)
+        size = MAX_BODY;
+
+    long delay_ms = (long)sample(&delay_dist, rand_r(&seed) / (RAND_MAX + 1.0));
+    if (delay_ms > 0)
+        usleep(delay_ms * 1000);
+
+    char head[512];
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                            "Content-Length: %ld\r\nCache-Control: %s\r\nConnection: close\r\n\r\n",
+                            size, cache_control);
+    send(fd, head, head_len, MSG_NOSIGNAL);
+    if (strncmp(req, "HEAD ", 5))
+    {
+        long sent = 0;
+        while (sent < size)
+        {
+            int n = send(fd, body + sent, size - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+    }
+    shutdown(fd, SHUT_WR);
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "s:d:c:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            if (parseDistribution(optarg, &size_dist) < 0)
+            {
+                fprintf(stderr, "Bad size distribution %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'd':
+            if (parseDistribution(optarg, &delay_dist) < 0 || delay_dist.kind == DIST_PARETO)
+            {
+                fprintf(stderr, "Bad delay distribution %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'c':
+            cache_control = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s size_spec] [-d delay_spec] [-c cache_control] <port>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "Usage: %s [-s size_spec] [-d delay_spec] [-c cache_control] <port>\n", argv[0]);
+        exit(1);
+    }
+
+    body = (char *)malloc(MAX_BODY);
+    memset(body, 'x', MAX_BODY);
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(atoi(argv[optind]));
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 1024) < 0)
+    {
+        perror("origin: bind");
+        exit(1);
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (1)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+            continue;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, serve, (void *)(intptr_t)fd) != 0)
+            close(fd);
+    }
+    return 0;
+}
@@ -0,0 +1,36 @@
+#!/bin/sh
+# run.sh -- benchmark the proxy against the local origin stub.
+#
+# Starts bench/origin and ./proxy (with its admin port for the hit ratio),
+# runs bench/loadgen and prints RPS, hit ratio and p50/p99/p999 latency.
+# Everything listens on the loopback; build first with `make bench`.
+#
+# Settings come from the environment:
+#   PROXY_PORT ADMIN_PORT ORIGIN_PORT  ports (8080 9100 9000)
+#   SIZES DELAY CACHE_CONTROL          origin -s, -d and -c
+#   CONNECTIONS DURATION RATE KEYS ZIPF  loadgen -c, -d, -r, -n and -s
+#   PROXY_ARGS                         extra proxy options
+
+PROXY_PORT=${PROXY_PORT:-8080}
+ADMIN_PORT=${ADMIN_PORT:-9100}
+ORIGIN_PORT=${ORIGIN_PORT:-9000}
+SIZES=${SIZES:-pareto:2048:1.2}
+DELAY=${DELAY:-fixed:1}
+CACHE_CONTROL=${CACHE_CONTROL:-max-age=3600}
+CONNECTIONS=${CONNECTIONS:-16}
+DURATION=${DURATION:-10}
+RATE=${RATE:-0}
+KEYS=${KEYS:-10000}
+ZIPF=${ZIPF:-0.99}
+
+cd "$(dirname "$0")/.." || exit 1
+
+./bench/origin -s "$SIZES" -d "$DELAY" -c "$CACHE_CONTROL" "$ORIGIN_PORT" &
+ORIGIN_PID=$!
+./proxy -l error -A "$ADMIN_PORT" $PROXY_ARGS "$PROXY_PORT" >/dev/null &
+PROXY_PID=$!
+trap 'kill $ORIGIN_PID $PROXY_PID 2>/dev/null' EXIT INT TERM
+sleep 1
+
+./bench/loadgen -c "$CONNECTIONS" -d "$DURATION" -r "$RATE" -n "$KEYS" -s "$ZIPF" \
+    -o "127.0.0.1:$ORIGIN_PORT" -A "$ADMIN_PORT" "$PROXY_PORT"
@@ -0,0 +1,110 @@
+/*
+  buffer_pool.c -- reusable I/O buffers for connection handling.
+*/
+
+#include "buffer_pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Header in front of every buffer handed out */
+struct PoolBuffer
+{
+    struct PoolBuffer *next; // next free buffer of the same class
+    size_t cap;              // usable bytes after the header
+    int cls;                 // size class, -1 for oversized buffers
+};
+
+static struct PoolBuffer *header_of(char *buf)
+{
+    return (struct PoolBuffer *)buf - 1;
+}
+
+static int class_of(size_t size)
+{
+    int cls = 0;
+    while (cls < BUFFER_POOL_CLASSES && ((size_t)1 << (BUFFER_POOL_MIN_SHIFT + cls)) < size)
+        cls++;
+    return cls < BUFFER_POOL_CLASSES ? cls : -1;
+}
+
+void BufferPool_init(struct BufferPool *pool)
+{
+    memset(pool, 0, sizeof(*pool));
+}
+
+void BufferPool_destroy(struct BufferPool *pool)
+{
+    for (int i = 0; i < BUFFER_POOL_CLASSES; i++)
+    {
+        while (pool->free[i] != NULL)
+        {
+            struct PoolBuffer *pb = pool->free[i];
+            pool->free[i] = pb->next;
+            free(pb);
+        }
+        pool->nfree[i] = 0;
+    }
+}
+
+char *BufferPool_get(struct BufferPool *pool, size_t size, size_t *cap)
+{
+    int cls = class_of(size);
+    struct PoolBuffer *pb;
+
+    if (cls >= 0 && pool->free[cls] != NULL)
+    {
+        pb = pool->free[cls];
+        pool->free[cls] = pb->next;
+        pool->nfree[cls]--;
+    }
+    else
+    {
+        size_t bytes = cls >= 0 ? (size_t)1 << (BUFFER_POOL_MIN_SHIFT + cls) : size;
+        pb = (struct PoolBuffer *)malloc(sizeof(struct PoolBuffer) + bytes);
+        if (pb == NULL)
+            return NULL;
+        pb->cap = bytes;
+        pb->cls = cls;
+    }
+    pb->next = NULL;
+    if (cap != NULL)
+        *cap = pb->cap;
+    return (char *)(pb + 1);
+}
+
+char *BufferPool_grow(struct BufferPool *pool, char *buf, size_t used,
+                      size_t size, size_t *cap)
+{
+    if (buf != NULL && header_of(buf)->cap >= size)
+    {
+        if (cap != NULL)
+            *cap = header_of(buf)->cap;
+        return buf;
+    }
+
+    char *bigger = BufferPool_get(pool, size, cap);
+    if (bigger == NULL)
+        return NULL;
+    if (buf != NULL)
+    {
+        memcpy(bigger, buf, used);
+        BufferPool_put(pool, buf);
+    }
+    return bigger;
+}
+
+void BufferPool_put(struct BufferPool *pool, char *buf)
+{
+    if (buf == NULL)
+        return;
+
+    struct PoolBuffer *pb = header_of(buf);
+    if (pb->cls < 0 || pool->nfree[pb->cls] >= BUFFER_POOL_KEEP)
+    {
+        free(pb);
+        return;
+    }
+    pb->next = pool->free[pb->cls];
+    pool->free[pb->cls] = pb;
+    pool->nfree[pb->cls]++;
+}
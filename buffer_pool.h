@@ -0,0 +1,52 @@
+/*
+ * buffer_pool.h -- reusable I/O buffers for connection handling.
+ *
+ * A BufferPool keeps freed buffers on per size class free lists so that a
+ * worker handling one connection after another stops going back to malloc.
+ * Size classes double from BUFFER_POOL_MIN; growing a buffer moves its
+ * contents into a buffer of the next class that fits. A pool is owned by a
+ * single worker at a time and does no locking.
+ */
+
+#include <stddef.h>
+
+#ifndef PROXY_BUFFER_POOL
+#define PROXY_BUFFER_POOL
+
+#define BUFFER_POOL_MIN_SHIFT 12 // smallest class is 4KB
+#define BUFFER_POOL_CLASSES 5    // 4KB .. 64KB
+#define BUFFER_POOL_KEEP 4       // free buffers kept per class
+
+struct PoolBuffer;
+
+struct BufferPool
+{
+    struct PoolBuffer *free[BUFFER_POOL_CLASSES]; // free lists, one per class
+    int nfree[BUFFER_POOL_CLASSES];               // length of each free list
+};
+
+/* Initialise an empty pool */
+void BufferPool_init(struct BufferPool *pool);
+
+/* Release every buffer kept by the pool */
+void BufferPool_destroy(struct BufferPool *pool);
+
+/*
+   Get a buffer of at least size bytes. Its actual capacity, which may be
+   larger, is stored in *cap when cap is not NULL. Returns NULL if out of
+   memory.
+ */
+char *BufferPool_get(struct BufferPool *pool, size_t size, size_t *cap);
+
+/*
+   Grow buf to at least size bytes keeping its first used bytes. buf is
+   returned to the pool; the new buffer (or NULL if out of memory, in which
+   case buf is left untouched) is returned and its capacity stored in *cap.
+ */
+char *BufferPool_grow(struct BufferPool *pool, char *buf, size_t used,
+                      size_t size, size_t *cap);
+
+/* Give a buffer obtained from BufferPool_get/grow back to the pool */
+void BufferPool_put(struct BufferPool *pool, char *buf);
+
+#endif
@@ -0,0 +1,798 @@
+/*
+  cache.c -- the proxy's LRU response cache.
+*/
+
+#include "cache.h"
+#include "metrics.h"
+#include "log.h"
+#include "trace.h"
+#include "prof.h"
+#include "shm_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <ctype.h>
+
+/*
+   Read-side state of one thread: the epoch it entered its read section in
+   (0 outside of one) and its buffer of recent hits, a single producer ring
+   drained by the maintenance thread.
+ */
+struct CacheReader
+{
+    unsigned long epoch;
+    int in_use;                // claimed by a thread, released when it exits
+    unsigned long access_head; // next hit to record, advanced by the reader
+    char pad[40];              // keep the reader's and the drainer's indexes on separate lines
+    unsigned long access_tail; // next hit to promote, advanced by the maintenance thread
+    unsigned long access[CACHE_ACCESS_BUFFER];
+} __attribute__((aligned(64)));
+
+/* A recent failure to reach an origin, in a direct-mapped table */
+struct OriginFailure
+{
+    unsigned long hash; // of "host:port"
+    time_t expires;
+    int reason;         // ORIGIN_*
+};
+
+/* A worker slot's L1 cache; only the thread holding the slot uses it */
+struct L1Cache
+{
+    cache_element **entries; // pinned shared entries, indexed by hash
+    unsigned long mask;
+    cache_element *lent;     // L1 hit handed out by find() and not yet released
+};
+
+// sem_t cache_lock;
+struct ProfLock lock = PROF_LOCK_INITIALIZER("cache", H_CACHE_LOCK_WAIT, H_CACHE_LOCK_HOLD); // serializes writers
+
+cache_element *buckets[CACHE_BUCKETS]; // hash index, read without the lock
+cache_element *head;                   // pointer to the head of the LRU list (most recent)
+cache_element *tail;                   // least recently used element, evicted first
+cache_element *retired;                // unlinked elements waiting to be freed, chained by lru_next
+long cache_size;                       // bytes allocated to the elements in the cache
+int cache_count;                       // number of elements in the cache
+long cache_retired_size;               // bytes allocated to unlinked elements not freed yet
+static int negative_ttl = NEGATIVE_TTL; // seconds failures are remembered
+static struct OriginFailure origin_failures[ORIGIN_FAILURES];
+static pthread_mutex_t origin_failures_lock = PTHREAD_MUTEX_INITIALIZER;
+static long capacity = MAX_SIZE;       // cache_size limit
+static long max_element_size = MAX_ELEMENT_SIZE;
+
+static unsigned long global_epoch = 1;
+static struct CacheReader readers[CACHE_MAX_READERS];
+static __thread struct CacheReader *thread_reader;
+static pthread_key_t reader_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static struct L1Cache *l1_caches;
+static __thread struct L1Cache *thread_l1;
+
+static void *maintenance_thread(void *arg);
+
+/* Gives the reader record of an exiting thread back */
+static void release_reader(void *arg)
+{
+    struct CacheReader *r = (struct CacheReader *)arg;
+    __atomic_store_n(&r->epoch, 0UL, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void cache_start()
+{
+    pthread_key_create(&reader_key, release_reader);
+    pthread_t tid;
+    pthread_create(&tid, NULL, maintenance_thread, NULL);
+    pthread_detach(tid);
+}
+
+/* The calling thread's reader record, claimed on first use; NULL if all are taken */
+static struct CacheReader *reader()
+{
+    if (thread_reader != NULL)
+        return thread_reader;
+    pthread_once(&cache_once, cache_start);
+    for (int i = 0; i < CACHE_MAX_READERS; i++)
+    {
+        int expected = 0;
+        if (!__atomic_load_n(&readers[i].in_use, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&readers[i].in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            thread_reader = &readers[i];
+            pthread_setspecific(reader_key, thread_reader);
+            return thread_reader;
+        }
+    }
+    return NULL;
+}
+
+/* 64-bit FNV-1a hash of a URL */
+unsigned long hash_url(const char *url)
+{
+    unsigned long h = 1469598103934665603UL;
+    for (; *url; url++)
+        h = (h ^ (unsigned char)*url) * 1099511628211UL;
+    return h;
+}
+
+/* Copies a request header value lowercase and without blanks; -1 if it does not fit */
+static int normalize_value(const char *value, char *out, size_t len)
+{
+    size_t n = 0;
+    for (; value != NULL && *value; value++)
+    {
+        if (*value == ' ' || *value == '\t')
+            continue;
+        if (*value == '\n' || n + 1 >= len)
+            return -1;
+        out[n++] = tolower((unsigned char)*value);
+    }
+    out[n] = '\0';
+    return n;
+}
+
+int cache_variant(const char *vary, CacheRequestHeader header, void *request, char *out, size_t len)
+{
+    size_t n = 0;
+    out[0] = '\0';
+    if (vary == NULL)
+        return 0;
+    while (*vary)
+    {
+        char name[64], value[CACHE_MAX_VARIANT_KEY];
+        size_t name_len = 0;
+        while (*vary == ' ' || *vary == '\t' || *vary == ',')
+            vary++;
+        for (; *vary && *vary != ',' && *vary != ' ' && *vary != '\t'; vary++)
+        {
+            if (name_len + 1 >= sizeof(name))
+                return -1;
+            name[name_len++] = tolower((unsigned char)*vary);
+        }
+        name[name_len] = '\0';
+        if (name_len == 0)
+            continue;
+        if (!strcmp(name, "*"))
+            return -1; // varies on things other than request headers
+        if (normalize_value(header != NULL ? header(request, name) : NULL, value, sizeof(value)) < 0)
+            return -1;
+        int w = snprintf(out + n, len - n, "%s=%s\n", name, value);
+        if (w < 0 || (size_t)w >= len - n)
+            return -1;
+        n += w;
+    }
+    return n > 0;
+}
+
+/* Whether a request selects the stored variant key */
+int variant_matches(const char *variant, CacheRequestHeader header, void *request)
+{
+    const char *line = variant;
+    if (line == NULL)
+        return 1;
+    while (*line)
+    {
+        char name[64], value[CACHE_MAX_VARIANT_KEY];
+        const char *eq = strchr(line, '=');
+        const char *eol = strchr(eq, '\n');
+        memcpy(name, line, eq - line);
+        name[eq - line] = '\0';
+        int n = normalize_value(header != NULL ? header(request, name) : NULL, value, sizeof(value));
+        if (n != eol - eq - 1 || memcmp(value, eq + 1, n))
+            return 0;
+        line = eol + 1;
+    }
+    return 1;
+}
+
+/* Whether two variant keys select on the same request headers */
+int same_vary(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    while (*a && *b)
+    {
+        size_t name = strchr(a, '=') - a;
+        if (strncmp(a, b, name + 1))
+            return 0;
+        a = strchr(a, '\n') + 1;
+        b = strchr(b, '\n') + 1;
+    }
+    return *a == *b;
+}
+
+/* Walks the bucket of hash for a variant of url matching the request; safe without the lock inside a read section */
+static cache_element *lookup(unsigned long hash, const char *url, CacheRequestHeader header, void *request)
+{
+    cache_element *site = __atomic_load_n(&buckets[hash % CACHE_BUCKETS], __ATOMIC_ACQUIRE);
+    for (; site != NULL; site = __atomic_load_n(&site->next, __ATOMIC_ACQUIRE))
+    {
+        if (site->hash == hash && !strcmp(site->url, url) && variant_matches(site->variant, header, request))
+            return site;
+    }
+    return NULL;
+}
+
+/* Records a hit for promotion; dropped when the buffer is full */
+static void record_access(struct CacheReader *r, unsigned long hash)
+{
+    unsigned long at = r->access_head;
+    if (at - __atomic_load_n(&r->access_tail, __ATOMIC_ACQUIRE) < CACHE_ACCESS_BUFFER)
+    {
+        r->access[at % CACHE_ACCESS_BUFFER] = hash;
+        __atomic_store_n(&r->access_head, at + 1, __ATOMIC_RELEASE);
+    }
+}
+
+void set_l1_cache(int workers, int entries)
+{
+    if (entries <= 0 || ShmCache_enabled())
+        return; // a shared entry cannot be pinned past release in another process
+    l1_caches = (struct L1Cache *)calloc(workers, sizeof(struct L1Cache));
+    for (int i = 0; i < workers; i++)
+    {
+        l1_caches[i].entries = (cache_element **)calloc(entries, sizeof(cache_element *));
+        l1_caches[i].mask = entries - 1;
+    }
+}
+
+void bind_l1_cache(int slot)
+{
+    if (l1_caches != NULL)
+        thread_l1 = &l1_caches[slot];
+}
+
+/* Whether a cached failure has outlived its TTL */
+static int expired(cache_element *site)
+{
+    return site->expires != 0 && time(NULL) >= site->expires;
+}
+
+/* Unpins an L1 entry the shared cache replaced, evicted, invalidated or expired since it was kept; 1 if it did */
+static int l1_drop_stale(cache_element **entry)
+{
+    cache_element *site = *entry;
+    if (site == NULL || (__atomic_load_n(&site->retired, __ATOMIC_ACQUIRE) == 0 && !expired(site)))
+        return 0;
+    __atomic_sub_fetch(&site->refs, 1, __ATOMIC_RELEASE);
+    *entry = NULL;
+    return 1;
+}
+
+void unbind_l1_cache()
+{
+    // Let go of what went stale, a retired entry is not freed while an L1 pins it
+    for (unsigned long i = 0; thread_l1 != NULL && i <= thread_l1->mask; i++)
+        l1_drop_stale(&thread_l1->entries[i]);
+    thread_l1 = NULL;
+}
+
+/* The L1 entry of url, dropping a stale one; NULL if there is none */
+static cache_element *l1_lookup(struct L1Cache *l1, unsigned long hash, const char *url,
+                                CacheRequestHeader header, void *request)
+{
+    cache_element **entry = &l1->entries[hash & l1->mask];
+    cache_element *site = *entry;
+    if (site == NULL || l1_drop_stale(entry))
+        return NULL;
+    if (site->hash != hash || strcmp(site->url, url) || !variant_matches(site->variant, header, request))
+        return NULL;
+    return site;
+}
+
+/* Keeps a small shared hit in the L1, with a pin of its own */
+static void l1_keep(struct L1Cache *l1, cache_element *site)
+{
+    if (site->len > L1_MAX_OBJECT)
+        return;
+    cache_element **entry = &l1->entries[site->hash & l1->mask];
+    if (*entry != NULL)
+        __atomic_sub_fetch(&(*entry)->refs, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&site->refs, 1, __ATOMIC_RELAXED);
+    *entry = site;
+}
+
+/**
+ * @brief Searches for URL in the worker's L1 cache, then in the cache without taking the cache lock
+ * @param url URL to search for
+ * @param header Gives the request's header values to select a variant, NULL if it has none
+ * @param request Passed to header
+ * @return Pinned cache element if found, NULL otherwise
+ */
+cache_element *find(char *url, CacheRequestHeader header, void *request)
+{
+    cache_element *site = NULL;
+    unsigned long hash = hash_url(url);
+    struct CacheReader *r = ShmCache_enabled() ? NULL : reader();
+    struct L1Cache *l1 = thread_l1;
+
+    Trace_enter(T_CACHE_LOOKUP);
+    if (ShmCache_enabled())
+        site = ShmCache_find(url, header, request);
+    else if (l1 != NULL && (site = l1_lookup(l1, hash, url, header, request)) != NULL)
+    {
+        // The L1 pin covers the caller too, release_cache_element() only takes it back
+        l1->lent = site;
+        if (r != NULL)
+            record_access(r, hash);
+        Metrics_add(M_CACHE_L1_HITS, 1);
+    }
+    else if (r == NULL)
+    {
+        // Every reader record is taken, look up under the lock instead
+        Prof_lock(&lock, "find");
+        site = lookup(hash, url, header, request);
+        if (site != NULL && expired(site))
+            site = NULL;
+        if (site != NULL)
+            __atomic_add_fetch(&site->refs, 1, __ATOMIC_RELAXED);
+        Prof_unlock(&lock);
+    }
+    else
+    {
+        // Enter a read section: nothing unlinked from now on is freed until we leave it
+        __atomic_store_n(&r->epoch, __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        site = lookup(hash, url, header, request);
+        if (site != NULL && expired(site))
+            site = NULL; // left for the next add of the URL to replace
+        if (site != NULL)
+        {
+            __atomic_add_fetch(&site->refs, 1, __ATOMIC_RELAXED);
+            record_access(r, hash);
+        }
+        __atomic_store_n(&r->epoch, 0UL, __ATOMIC_RELEASE);
+    }
+    if (site != NULL && l1 != NULL && l1->lent != site)
+        l1_keep(l1, site);
+    Trace_leave(T_CACHE_LOOKUP);
+
+    LOG(LOG_DEBUG, "url %s: %s\n", site != NULL ? "found" : "not found", url);
+    return site;
+}
+
+/**
+ * @brief Unpins an element returned by find()
+ * @param element Element to release
+ */
+void release_cache_element(cache_element *element)
+{
+    if (ShmCache_enabled())
+    {
+        ShmCache_release(element);
+        return;
+    }
+    if (thread_l1 != NULL && thread_l1->lent == element)
+    {
+        thread_l1->lent = NULL;
+        return;
+    }
+    __atomic_sub_fetch(&element->refs, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Removes an element from the index and the LRU list and retires it; caller holds lock
+ */
+static void unlink_element(cache_element *element)
+{
+    cache_element **link = &buckets[element->hash % CACHE_BUCKETS];
+    while (*link != element)
+        link = &(*link)->next;
+    // Readers standing on element still follow its next pointer, which stays intact
+    __atomic_store_n(link, element->next, __ATOMIC_RELEASE);
+
+    if (element->lru_prev != NULL)
+        element->lru_prev->lru_next = element->lru_next;
+    else
+        head = element->lru_next;
+    if (element->lru_next != NULL)
+        element->lru_next->lru_prev = element->lru_prev;
+    else
+        tail = element->lru_prev;
+
+    cache_size -= element->charge; // Updating the cache size
+    cache_count--;
+    __atomic_add_fetch(&cache_retired_size, element->charge, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&element->retired, __atomic_load_n(&global_epoch, __ATOMIC_RELAXED), __ATOMIC_RELEASE);
+    element->lru_prev = NULL;
+    element->lru_next = retired;
+    retired = element;
+}
+
+/* Moves element to the head of the LRU list; caller holds lock */
+static void promote(cache_element *element)
+{
+    if (element == head)
+        return;
+    element->lru_prev->lru_next = element->lru_next;
+    if (element->lru_next != NULL)
+        element->lru_next->lru_prev = element->lru_prev;
+    else
+        tail = element->lru_prev;
+    element->lru_prev = NULL;
+    element->lru_next = head;
+    head->lru_prev = element;
+    head = element;
+}
+
+/**
+ * @brief Unlinks the least recently used element; caller holds lock
+ */
+static void evict_lru()
+{
+    if (tail != NULL)
+    {
+        unlink_element(tail);
+        Metrics_add(M_CACHE_EVICTIONS, 1);
+    }
+}
+
+/**
+ * @brief Removes least recently used element from cache with thread safety
+ */
+void remove_cache_element()
+{
+    if (ShmCache_enabled())
+    {
+        ShmCache_evict();
+        return;
+    }
+    // sem_wait(&cache_lock);
+    int temp_lock_val = Prof_lock(&lock, "remove_cache_element");
+    LOG(LOG_DEBUG, "Remove Cache Lock Acquired %d\n", temp_lock_val);
+    evict_lru();
+    // sem_post(&cache_lock);
+    temp_lock_val = Prof_unlock(&lock);
+    LOG(LOG_DEBUG, "Remove Cache Lock Unlocked %d\n", temp_lock_val);
+}
+
+/**
+ * @brief Makes room among the variants of a new element's URL; caller holds lock
+ *
+ * The variant it replaces and variants selected on other headers (the
+ * origin changed its Vary) are dropped, then the least recently promoted
+ * ones while the URL has CACHE_MAX_VARIANTS.
+ */
+static void drop_variants(cache_element *element)
+{
+    int count = 0;
+    cache_element *oldest = NULL;
+    cache_element *site = buckets[element->hash % CACHE_BUCKETS];
+    while (site != NULL)
+    {
+        cache_element *next = site->next;
+        if (site->hash == element->hash && !strcmp(site->url, element->url))
+        {
+            if (!same_vary(site->variant, element->variant) ||
+                (site->variant == NULL || !strcmp(site->variant, element->variant)))
+                unlink_element(site);
+            else
+            {
+                count++;
+                if (oldest == NULL || site->lru_time_track <= oldest->lru_time_track)
+                    oldest = site;
+            }
+        }
+        site = next;
+    }
+    if (count >= CACHE_MAX_VARIANTS)
+        unlink_element(oldest);
+}
+
+/**
+ * @brief Adds new element to cache with thread safety
+ * @param data Response data to cache
+ * @param size Size of response data
+ * @param url Request URL as cache key
+ * @param ttl Seconds the element may be served, 0 for as long as it stays cached
+ * @param variant Variant key from cache_variant(), NULL or empty if the response has no Vary
+ * @return 1 if successful, 0 if element too large or the cache is being shrunk
+ */
+int add_cache_element(char *data, int size, char *url, int ttl, const char *variant)
+{
+    size_t url_len = strlen(url);
+    size_t variant_len = variant != NULL && *variant ? strlen(variant) + 1 : 0;
+    if ((long)(size + url_len + variant_len + sizeof(cache_element)) > max_element_size)
+        return 0;
+    if (ShmCache_enabled())
+        return ShmCache_add(data, size, url, ttl, variant, max_element_size);
+
+    // Built before locking, readers see it only once it is complete. Element, key and
+    // response share one allocation, which is what the element is charged for.
+    pthread_once(&cache_once, cache_start);
+    cache_element *element = (cache_element *)malloc(sizeof(cache_element) + url_len + 1 + variant_len + size + 1);
+    if (element == NULL)
+        return 0;
+    element->charge = malloc_usable_size(element) + CACHE_CHUNK_OVERHEAD;
+    if ((long)element->charge > max_element_size)
+    {
+        free(element);
+        return 0;
+    }
+    element->url = (char *)(element + 1);
+    memcpy(element->url, url, url_len + 1);
+    element->variant = variant_len > 0 ? element->url + url_len + 1 : NULL;
+    if (element->variant != NULL)
+        memcpy(element->variant, variant, variant_len);
+    element->data = element->url + url_len + 1 + variant_len;
+    memcpy(element->data, data, size);
+    element->data[size] = '\0';
+    element->lru_time_track = time(NULL); // Updating the time_track
+    element->expires = ttl > 0 ? element->lru_time_track + ttl : 0;
+    element->len = size;
+    element->hash = hash_url(url);
+    element->refs = 0;
+    element->retired = 0;
+
+    int temp_lock_val = Prof_lock(&lock, "add_cache_element");
+    LOG(LOG_DEBUG, "Add Cache Lock Acquired %d\n", temp_lock_val);
+    drop_variants(element);
+    if (cache_size > capacity)
+    {
+        // Shrinking: leave the eviction to the maintenance thread, one batch at a time
+        temp_lock_val = Prof_unlock(&lock);
+        free(element);
+        return 0;
+    }
+    while (cache_size + (long)element->charge > capacity && tail != NULL)
+    {
+        // If the cache is full, remove the least recently used element (the lock is already held)
+        evict_lru();
+    }
+    cache_element **bucket = &buckets[element->hash % CACHE_BUCKETS];
+    element->next = *bucket;
+    __atomic_store_n(bucket, element, __ATOMIC_RELEASE);
+    element->lru_prev = NULL;
+    element->lru_next = head;
+    if (head != NULL)
+        head->lru_prev = element;
+    else
+        tail = element;
+    head = element;
+    cache_size += element->charge;
+    cache_count++;
+    temp_lock_val = Prof_unlock(&lock);
+    LOG(LOG_DEBUG, "Add Cache Lock Unlocked %d\n", temp_lock_val);
+    return 1;
+}
+
+/**
+ * @brief Removes the entry of a URL from cache with thread safety
+ * @param url Cache key of the URL to invalidate
+ */
+void invalidate_cache_element(char *url)
+{
+    if (ShmCache_enabled())
+    {
+        ShmCache_invalidate(url);
+        return;
+    }
+    unsigned long hash = hash_url(url);
+    int temp_lock_val = Prof_lock(&lock, "invalidate_cache_element");
+    LOG(LOG_DEBUG, "Invalidate Cache Lock Acquired %d\n", temp_lock_val);
+    cache_element *site = buckets[hash % CACHE_BUCKETS];
+    while (site != NULL)
+    {
+        cache_element *next = site->next;
+        if (site->hash == hash && !strcmp(site->url, url))
+            unlink_element(site); // every variant
+        site = next;
+    }
+    temp_lock_val = Prof_unlock(&lock);
+    LOG(LOG_DEBUG, "Invalidate Cache Lock Unlocked %d\n", temp_lock_val);
+}
+
+/**
+ * @brief Pins every element of the cache, least recently used first
+ * @param elements Set to a malloc'd array of the pinned elements, to release and free
+ * @return Number of elements, 0 when the cache is shared
+ */
+int cache_snapshot(cache_element ***elements)
+{
+    *elements = NULL;
+    if (ShmCache_enabled())
+        return 0;
+    Prof_lock(&lock, "cache_snapshot");
+    cache_element **all = (cache_element **)malloc((cache_count + 1) * sizeof(cache_element *));
+    int n = 0;
+    for (cache_element *site = tail; site != NULL && all != NULL; site = site->lru_prev)
+    {
+        __atomic_add_fetch(&site->refs, 1, __ATOMIC_RELAXED);
+        all[n++] = site;
+    }
+    Prof_unlock(&lock);
+    *elements = all;
+    return n;
+}
+
+int set_cache_capacity(long bytes)
+{
+    if (ShmCache_enabled())
+        return ShmCache_setCapacity(bytes);
+    if (bytes <= 0)
+        return -1;
+    __atomic_store_n(&capacity, bytes, __ATOMIC_RELAXED);
+    return 0;
+}
+
+long cache_capacity() { return ShmCache_enabled() ? ShmCache_capacity() : capacity; }
+
+int set_cache_max_element(long bytes)
+{
+    if (bytes <= (long)sizeof(cache_element))
+        return -1;
+    __atomic_store_n(&max_element_size, bytes, __ATOMIC_RELAXED);
+    return 0;
+}
+
+long cache_max_element() { return max_element_size; }
+
+int set_negative_ttl(long seconds)
+{
+    if (seconds < 0)
+        return -1;
+    negative_ttl = seconds;
+    return 0;
+}
+
+long negative_cache_ttl() { return negative_ttl; }
+
+static unsigned long hash_origin(const char *host, int port)
+{
+    char origin[300];
+    snprintf(origin, sizeof(origin), "%s:%d", host, port);
+    return hash_url(origin);
+}
+
+/**
+ * @brief Remembers that an origin could not be reached
+ * @param host Origin host name
+ * @param port Origin port
+ * @param reason ORIGIN_UNRESOLVED or ORIGIN_UNREACHABLE
+ */
+void remember_origin_failure(const char *host, int port, int reason)
+{
+    if (negative_ttl == 0)
+        return;
+    unsigned long hash = hash_origin(host, port);
+    struct OriginFailure *f = &origin_failures[hash % ORIGIN_FAILURES];
+    pthread_mutex_lock(&origin_failures_lock);
+    f->hash = hash;
+    f->expires = time(NULL) + negative_ttl;
+    f->reason = reason;
+    pthread_mutex_unlock(&origin_failures_lock);
+}
+
+/**
+ * @brief Checks for a recent failure to reach an origin
+ * @param host Origin host name
+ * @param port Origin port
+ * @return ORIGIN_UNRESOLVED or ORIGIN_UNREACHABLE while the failure is remembered, 0 otherwise
+ */
+int origin_failure(const char *host, int port)
+{
+    unsigned long hash = hash_origin(host, port);
+    struct OriginFailure *f = &origin_failures[hash % ORIGIN_FAILURES];
+    int reason = 0;
+    pthread_mutex_lock(&origin_failures_lock);
+    if (f->hash == hash && time(NULL) < f->expires)
+        reason = f->reason;
+    pthread_mutex_unlock(&origin_failures_lock);
+    return reason;
+}
+
+/* Evicts down to the capacity, CACHE_EVICT_BATCH elements per hold of the lock */
+static void trim()
+{
+    while (__atomic_load_n(&cache_size, __ATOMIC_RELAXED) > capacity)
+    {
+        Prof_lock(&lock, "trim");
+        for (int i = 0; i < CACHE_EVICT_BATCH && cache_size > capacity; i++)
+            evict_lru();
+        Prof_unlock(&lock);
+    }
+}
+
+/* Promotes the hits buffered by every reader */
+static void drain_accesses()
+{
+    unsigned long hashes[CACHE_ACCESS_BUFFER];
+    time_t now = time(NULL);
+
+    for (int i = 0; i < CACHE_MAX_READERS; i++)
+    {
+        struct CacheReader *r = &readers[i];
+        unsigned long at = r->access_tail;
+        unsigned long end = __atomic_load_n(&r->access_head, __ATOMIC_ACQUIRE);
+        int n = 0;
+        for (; at != end; at++)
+            hashes[n++] = r->access[at % CACHE_ACCESS_BUFFER];
+        __atomic_store_n(&r->access_tail, end, __ATOMIC_RELEASE);
+        if (n == 0)
+            continue;
+
+        Prof_lock(&lock, "promote");
+        for (int j = 0; j < n; j++)
+        {
+            cache_element *site = buckets[hashes[j] % CACHE_BUCKETS];
+            for (; site != NULL; site = site->next)
+            {
+                if (site->hash == hashes[j])
+                {
+                    site->lru_time_track = now;
+                    promote(site);
+                }
+            }
+        }
+        Prof_unlock(&lock);
+    }
+}
+
+/* Frees retired elements no reader can still reach */
+static void reclaim()
+{
+    if (__atomic_load_n(&retired, __ATOMIC_RELAXED) == NULL)
+        return;
+    Prof_lock(&lock, "reclaim");
+    cache_element *pending = retired;
+    retired = NULL;
+    Prof_unlock(&lock);
+    if (pending == NULL)
+        return;
+
+    // Readers entering from now on cannot find anything retired so far
+    __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned long oldest = ~0UL; // oldest epoch a reader is still in
+    for (int i = 0; i < CACHE_MAX_READERS; i++)
+    {
+        unsigned long epoch = __atomic_load_n(&readers[i].epoch, __ATOMIC_ACQUIRE);
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    cache_element *keep = NULL;
+    while (pending != NULL)
+    {
+        cache_element *element = pending;
+        pending = element->lru_next;
+        if (element->retired < oldest && __atomic_load_n(&element->refs, __ATOMIC_ACQUIRE) == 0)
+        {
+            __atomic_sub_fetch(&cache_retired_size, element->charge, __ATOMIC_RELAXED);
+            free(element); // key and response are freed with it
+        }
+        else
+        {
+            element->lru_next = keep;
+            keep = element;
+        }
+    }
+
+    if (keep != NULL)
+    {
+        Prof_lock(&lock, "reclaim");
+        cache_element *last = keep;
+        while (last->lru_next != NULL)
+            last = last->lru_next;
+        last->lru_next = retired;
+        retired = keep;
+        Prof_unlock(&lock);
+    }
+}
+
+static void *maintenance_thread(void *arg)
+{
+    (void)arg;
+    struct timespec interval = {0, CACHE_MAINTENANCE_MS * 1000000L};
+    while (1)
+    {
+        drain_accesses();
+        trim();
+        reclaim();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
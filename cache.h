@@ -0,0 +1,219 @@
+/*
+ * cache.h -- the proxy's LRU response cache.
+ *
+ * Complete responses are indexed by URL in a fixed-size hash table. Lookups
+ * take no lock: a reader walks a bucket chain inside an epoch-protected
+ * section and pins the entry it found with a reference count, and writers
+ * (add, evict, invalidate) serialize on the cache lock and retire unlinked
+ * entries instead of freeing them. A maintenance thread frees retired
+ * entries once every reader that could have seen them has left its section
+ * and the entry is unpinned. Recency is recorded lazily: a hit appends the
+ * key hash to the reader's lossy access buffer, and the maintenance thread
+ * promotes buffered keys in the LRU list. When a new entry does not fit in
+ * the capacity, the least recently used entries are evicted first.
+ *
+ * An entry is one allocation holding the element, its key and the response,
+ * and is charged what malloc actually reserved for it (usable size plus the
+ * chunk header). Capacity and the largest element are set at runtime;
+ * when the capacity shrinks below the cache size, the maintenance thread
+ * evicts the excess in batches and adds are refused until it is done.
+ *
+ * Optionally every worker slot also keeps a small direct-mapped L1 of
+ * pinned entries no larger than L1_MAX_OBJECT. An L1 hit touches no shared
+ * state but the entry's retire stamp: once the shared cache has replaced,
+ * evicted or invalidated the entry, the stamp is set and the L1 drops it. *
+ * In prefork mode (-W) these functions hand over to shm_cache.h, which keeps
+ * the cache in memory shared by the worker processes; there is no L1 then.
+ */
+
+#include <time.h>
+#include <stddef.h>
+
+#ifndef PROXY_CACHE
+#define PROXY_CACHE
+
+#define MAX_SIZE 200 * (1 << 20)        // default cache size
+#define MAX_ELEMENT_SIZE 10 * (1 << 20) // default max size of an element in cache
+#define CACHE_CHUNK_OVERHEAD sizeof(size_t) // malloc's header in front of every allocation
+#define CACHE_EVICT_BATCH 64            // most elements trimmed per hold of the cache lock
+#define CACHE_BUCKETS (1 << 17)         // hash index buckets
+#define CACHE_MAX_READERS 256           // threads that can look up at the same time
+#define CACHE_ACCESS_BUFFER 64          // buffered hits per reader, extra hits are not recorded
+#define CACHE_MAINTENANCE_MS 10         // promotion and reclamation interval
+#define L1_MAX_OBJECT (16 * 1024)       // largest response kept in a worker's L1 cache
+#define CACHE_MAX_VARIANTS 4            // variants kept per URL
+#define CACHE_MAX_VARIANT_KEY 512       // longest variant key, longer ones are not cached
+#define NEGATIVE_TTL 5                  // default seconds a failure is cached
+#define ORIGIN_FAILURES 1024            // origins whose last failure can be remembered
+
+enum
+{
+    ORIGIN_UNRESOLVED = 1, // the host name did not resolve
+    ORIGIN_UNREACHABLE     // connect() was refused or timed out
+};
+
+typedef struct cache_element cache_element;
+
+/* Gives the value of a request header, NULL if the request does not have it */
+typedef const char *(*CacheRequestHeader)(void *request, const char *name);
+
+/**
+ * @brief Represents a cache entry storing HTTP response data
+ */
+struct cache_element
+{
+    char *data;            // data stores response
+    int len;               // length of data i.e.. sizeof(data)...
+    char *url;             // url stores the request
+    char *variant;         // variant key, NULL if the response has no Vary
+    time_t lru_time_track; // lru_time_track stores the latest time the element was promoted
+    cache_element *next;   // pointer to next element in the hash bucket
+    unsigned long hash;    // hash of url
+    cache_element *lru_prev; // recency list, most recent first, guarded by the cache lock
+    cache_element *lru_next;
+    int refs;              // pins taken by find() and not yet released
+    unsigned long retired; // epoch the element was unlinked in, 0 while it is indexed
+    size_t charge;         // bytes allocated to the element, key and response included
+    time_t expires;        // no longer served from then on, 0 if it does not expire
+};
+
+/**
+ * @brief Searches for a URL in the cache without locking
+ * @param url The URL to search for
+ * @param header Gives the request's header values to select a variant, NULL if it has none
+ * @param request Passed to header
+ * @return Pinned cache element if found (release with release_cache_element), NULL otherwise
+ */
+cache_element *find(char *url, CacheRequestHeader header, void *request);
+
+/**
+ * @brief Hashes a cache key
+ * @param url The key
+ * @return 64-bit FNV-1a hash of url
+ */
+unsigned long hash_url(const char *url);
+
+/**
+ * @brief Checks whether a request selects a stored variant
+ * @param variant Variant key from cache_variant(), NULL if the response has no Vary
+ * @param header Gives the request's header values, NULL if it has none
+ * @param request Passed to header
+ * @return 1 if the variant answers the request, 0 otherwise
+ */
+int variant_matches(const char *variant, CacheRequestHeader header, void *request);
+
+/**
+ * @brief Checks whether two variant keys select on the same request headers
+ * @return 1 if they do (or both are NULL), 0 otherwise
+ */
+int same_vary(const char *a, const char *b);
+
+/**
+ * @brief Builds the variant key of a response for the request it answers
+ * @param vary Vary header of the response, NULL if it has none
+ * @param header Gives the request's header values
+ * @param request Passed to header
+ * @param out Buffer receiving the key
+ * @param len Size of out
+ * @return 1 if out holds a key, 0 if there is no Vary, -1 if the response cannot be cached (Vary: *, key too long)
+ */
+int cache_variant(const char *vary, CacheRequestHeader header, void *request, char *out, size_t len);
+
+/**
+ * @brief Unpins an element returned by find(); it may be freed afterwards
+ * @param element Element to release
+ */
+void release_cache_element(cache_element *element);
+
+/**
+ * @brief Gives every worker slot an L1 cache in front of the shared one
+ * @param workers Number of worker slots
+ * @param entries Entries per slot, a power of two; 0 disables the L1 caches
+ */
+void set_l1_cache(int workers, int entries);
+
+/**
+ * @brief Makes find() on the calling thread use the L1 cache of a worker slot
+ * @param slot Worker slot, held by the caller until unbind_l1_cache()
+ */
+void bind_l1_cache(int slot);
+
+/**
+ * @brief Detaches the calling thread from its L1 cache, unpinning the entries that went stale
+ */
+void unbind_l1_cache();
+
+/**
+ * @brief Adds a new element to the cache
+ * @param data Response data to cache
+ * @param size Size of the response data
+ * @param url Request URL to use as cache key
+ * @param ttl Seconds the element may be served, 0 for as long as it stays cached
+ * @param variant Variant key from cache_variant(), NULL or empty if the response has no Vary
+ * @return 1 if successful, 0 if element too large or the cache is being shrunk
+ */
+int add_cache_element(char *data, int size, char *url, int ttl, const char *variant);
+
+/**
+ * @brief Removes the least recently used element from cache
+ */
+void remove_cache_element();
+
+/**
+ * @brief Drops the cache entry of a URL, if any
+ * @param url Cache key of the URL to invalidate
+ */
+void invalidate_cache_element(char *url);
+
+/**
+ * @brief Pins every element of the cache, least recently used first
+ * @param elements Set to a malloc'd array of the pinned elements, to release and free
+ * @return Number of elements, 0 when the cache is shared
+ */
+int cache_snapshot(cache_element ***elements);
+
+/**
+ * @brief Sets the cache capacity; a smaller one is reached by evicting in the background
+ * @param bytes New capacity
+ * @return 0, or -1 if bytes is not positive
+ */
+int set_cache_capacity(long bytes);
+long cache_capacity();
+
+/**
+ * @brief Sets the largest element added to the cache, as charged
+ * @param bytes New limit
+ * @return 0, or -1 if it could not hold any element
+ */
+int set_cache_max_element(long bytes);
+long cache_max_element();
+
+/**
+ * @brief Sets how long failures are cached
+ * @param seconds TTL, 0 disables negative caching
+ * @return 0, or -1 if negative
+ */
+int set_negative_ttl(long seconds);
+long negative_cache_ttl();
+
+/**
+ * @brief Remembers that an origin could not be reached, for the negative TTL
+ * @param host Origin host name
+ * @param port Origin port
+ * @param reason ORIGIN_UNRESOLVED or ORIGIN_UNREACHABLE
+ */
+void remember_origin_failure(const char *host, int port, int reason);
+
+/**
+ * @brief Checks for a remembered failure to reach an origin
+ * @param host Origin host name
+ * @param port Origin port
+ * @return The ORIGIN_* reason while the failure is remembered, 0 otherwise
+ */
+int origin_failure(const char *host, int port);
+
+extern long cache_size;         // bytes allocated to the elements in the cache
+extern int cache_count;         // number of elements in the cache
+extern long cache_retired_size; // bytes of removed elements still waiting to be freed
+
+#endif
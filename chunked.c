@@ -0,0 +1,133 @@
+/*
+  chunked.c -- streaming decoder for HTTP/1.1 chunked transfer-coding.
+*/
+
+#include "chunked.h"
+#include <ctype.h>
+#include <string.h>
+
+// Largest chunk size we accept, keeps the size arithmetic from overflowing
+#define MAX_CHUNK_SIZE ((size_t)1 << 40)
+
+// States of the chunk framing
+enum
+{
+    CHUNK_START,        // first hex digit of the chunk size
+    CHUNK_SIZE,         // further hex digits of the chunk size
+    CHUNK_EXT,          // chunk extensions up to the CR
+    CHUNK_SIZE_LF,      // LF ending the size line
+    CHUNK_DATA,         // chunk payload
+    CHUNK_DATA_CR,      // CR after the payload
+    CHUNK_DATA_LF,      // LF after the payload
+    CHUNK_TRAILER,      // start of a trailer line (or of the final CRLF)
+    CHUNK_TRAILER_LINE, // inside a trailer field
+    CHUNK_TRAILER_LF,   // LF of the final CRLF
+    CHUNK_DONE          // body complete
+};
+
+void ChunkedDecoder_init(struct ChunkedDecoder *dec)
+{
+    dec->state = CHUNK_START;
+    dec->remaining = 0;
+    dec->body_len = 0;
+}
+
+int ChunkedDecoder_done(struct ChunkedDecoder *dec)
+{
+    return dec->state == CHUNK_DONE;
+}
+
+int ChunkedDecoder_feed(struct ChunkedDecoder *dec, const char *in, int len,
+                        char *out, int *outlen)
+{
+    int i = 0;
+    int o = 0;
+
+    while (i < len && dec->state != CHUNK_DONE)
+    {
+        char c = in[i];
+        switch (dec->state)
+        {
+        case CHUNK_START:
+            // A size line without digits is not a last chunk, it is malformed
+            if (!isxdigit((unsigned char)c))
+                return -1;
+            dec->state = CHUNK_SIZE;
+            // fall through
+        case CHUNK_SIZE:
+            if (isxdigit((unsigned char)c))
+            {
+                dec->remaining = dec->remaining * 16 +
+                                 (isdigit((unsigned char)c) ? c - '0' : tolower((unsigned char)c) - 'a' + 10);
+                if (dec->remaining > MAX_CHUNK_SIZE)
+                    return -1;
+            }
+            else if (c == ';' || c == ' ' || c == '\t')
+                dec->state = CHUNK_EXT;
+            else if (c == '\r')
+                dec->state = CHUNK_SIZE_LF;
+            else
+                return -1;
+            break;
+
+        case CHUNK_EXT:
+            if (c == '\r')
+                dec->state = CHUNK_SIZE_LF;
+            break;
+
+        case CHUNK_SIZE_LF:
+            if (c != '\n')
+                return -1;
+            dec->state = dec->remaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+            break;
+
+        case CHUNK_DATA:
+        {
+            // Payload is copied in one go rather than byte by byte
+            size_t avail = (size_t)(len - i);
+            size_t n = avail < dec->remaining ? avail : dec->remaining;
+            if (out != NULL)
+                memmove(out + o, in + i, n);
+            o += n;
+            i += n;
+            dec->remaining -= n;
+            dec->body_len += n;
+            if (dec->remaining == 0)
+                dec->state = CHUNK_DATA_CR;
+            continue;
+        }
+
+        case CHUNK_DATA_CR:
+            if (c != '\r')
+                return -1;
+            dec->state = CHUNK_DATA_LF;
+            break;
+
+        case CHUNK_DATA_LF:
+            if (c != '\n')
+                return -1;
+            dec->state = CHUNK_START;
+            break;
+
+        case CHUNK_TRAILER:
+            dec->state = (c == '\r') ? CHUNK_TRAILER_LF : CHUNK_TRAILER_LINE;
+            break;
+
+        case CHUNK_TRAILER_LINE:
+            if (c == '\n')
+                dec->state = CHUNK_TRAILER;
+            break;
+
+        case CHUNK_TRAILER_LF:
+            if (c != '\n')
+                return -1;
+            dec->state = CHUNK_DONE;
+            break;
+        }
+        i++;
+    }
+
+    if (outlen != NULL)
+        *outlen = o;
+    return i;
+}
@@ -0,0 +1,44 @@
+/*
+ * chunked.h -- streaming decoder for HTTP/1.1 chunked transfer-coding.
+ *
+ * The decoder is fed the body bytes as they arrive from a socket and keeps
+ * just enough state to follow the chunk framing across reads, so a body can
+ * be relayed, measured or de-chunked without ever being buffered whole.
+ */
+
+#include <stddef.h>
+
+#ifndef PROXY_CHUNKED
+#define PROXY_CHUNKED
+
+/*
+   ChunkedDecoder tracks where in the chunked framing the next byte falls.
+   body_len counts the payload bytes decoded so far, which is the
+   Content-Length the message would have had without the chunked coding.
+ */
+struct ChunkedDecoder
+{
+    int state;        // position in the framing, see chunked.c
+    size_t remaining; // bytes left in the current chunk (or its size while parsing it)
+    size_t body_len;  // payload bytes decoded so far
+};
+
+/* Reset a decoder to the start of a chunked body */
+void ChunkedDecoder_init(struct ChunkedDecoder *dec);
+
+/*
+   Feed len bytes of the chunked body to the decoder. If out is not NULL the
+   payload carried by those bytes is written to out (out may alias in, the
+   payload is never longer than its encoding) and its length to *outlen.
+
+   Returns the number of bytes of in that belong to the body; this is less
+   than len only when the body ends inside in. Returns -1 on malformed
+   framing.
+ */
+int ChunkedDecoder_feed(struct ChunkedDecoder *dec, const char *in, int len,
+                        char *out, int *outlen);
+
+/* 1 once the last chunk and the trailer section have been consumed */
+int ChunkedDecoder_done(struct ChunkedDecoder *dec);
+
+#endif
@@ -0,0 +1,150 @@
+/*
+  config.c -- runtime settings of the proxy.
+*/
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+struct config_setting
+{
+    const char *name;
+    const char *help;
+    long (*get)();
+    ConfigSetter set;
+};
+
+static struct config_setting settings[CONFIG_MAX_SETTINGS];
+static int nsettings;
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER; // one change at a time
+
+int Config_register(const char *name, const char *help, long (*get)(), ConfigSetter set)
+{
+    if (nsettings == CONFIG_MAX_SETTINGS)
+        return -1;
+    settings[nsettings].name = name;
+    settings[nsettings].help = help;
+    settings[nsettings].get = get;
+    settings[nsettings].set = set;
+    nsettings++;
+    return 0;
+}
+
+/* Parse an integer with an optional K, M or G suffix; -1 if malformed */
+static int parse_value(const char *s, long *value)
+{
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (end == s)
+        return -1;
+    if (*end == 'K' || *end == 'k')
+        v <<= 10, end++;
+    else if (*end == 'M' || *end == 'm')
+        v <<= 20, end++;
+    else if (*end == 'G' || *end == 'g')
+        v <<= 30, end++;
+    while (isspace((unsigned char)*end))
+        end++;
+    if (*end != '\0')
+        return -1;
+    *value = v;
+    return 0;
+}
+
+static struct config_setting *find_setting(const char *name, size_t len)
+{
+    for (int i = 0; i < nsettings; i++)
+    {
+        if (strlen(settings[i].name) == len && !strncmp(settings[i].name, name, len))
+            return &settings[i];
+    }
+    return NULL;
+}
+
+static int set_value(struct config_setting *s, const char *text)
+{
+    long value;
+    if (parse_value(text, &value) < 0)
+        return -1;
+    pthread_mutex_lock(&config_lock);
+    int ret = s->set(value);
+    pthread_mutex_unlock(&config_lock);
+    return ret;
+}
+
+int Config_apply(const char *assignment)
+{
+    const char *eq = strchr(assignment, '=');
+    if (eq == NULL)
+        return -1;
+    const char *name = assignment;
+    while (isspace((unsigned char)*name))
+        name++;
+    const char *name_end = eq;
+    while (name_end > name && isspace((unsigned char)name_end[-1]))
+        name_end--;
+    struct config_setting *s = find_setting(name, name_end - name);
+    if (s == NULL)
+        return -1;
+    const char *value = eq + 1;
+    while (isspace((unsigned char)*value))
+        value++;
+    return set_value(s, value);
+}
+
+int Config_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    char line[256];
+    int lineno = 0;
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f) != NULL)
+    {
+        lineno++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+        char *p = line;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p != '\0' && Config_apply(p) < 0)
+            ret = lineno;
+    }
+    fclose(f);
+    return ret;
+}
+
+void Config_render(const char *method, const char *query, const char *body,
+                   struct AdminReply *reply)
+{
+    (void)body;
+    if (!strcmp(method, "POST"))
+    {
+        char value[64];
+        int changed = 0;
+        for (int i = 0; i < nsettings; i++)
+        {
+            if (!Admin_queryParam(query, settings[i].name, value, sizeof(value)))
+                continue;
+            if (set_value(&settings[i], value) < 0)
+            {
+                reply->status = 400;
+                Admin_printf(reply, "bad value %s for %s\n", value, settings[i].name);
+                return;
+            }
+            changed++;
+        }
+        if (changed == 0)
+        {
+            reply->status = 400;
+            Admin_printf(reply, "expected ?name=value for a setting below\n");
+        }
+    }
+    for (int i = 0; i < nsettings; i++)
+        Admin_printf(reply, "%-20s %12ld  # %s\n", settings[i].name, settings[i].get(), settings[i].help);
+}
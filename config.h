@@ -0,0 +1,38 @@
+/*
+ * config.h -- runtime settings of the proxy.
+ *
+ * Modules register the limits they own (cache capacity, connection count,
+ * ...) as named integer settings with a getter and a setter. Settings are
+ * read from a config file of "name = value" lines and from -s name=value on
+ * the command line, and can be listed and changed at runtime on the admin
+ * /config page. Values take K, M or G suffixes.
+ */
+
+#include "admin.h"
+
+#ifndef PROXY_CONFIG
+#define PROXY_CONFIG
+
+#define CONFIG_MAX_SETTINGS 16
+
+/* Setter of a setting; returns 0, or -1 to reject the value */
+typedef int (*ConfigSetter)(long value);
+
+/* Register a setting; returns -1 if the table is full */
+int Config_register(const char *name, const char *help, long (*get)(), ConfigSetter set);
+
+/* Apply "name=value" (blanks around both allowed); -1 if unknown, malformed or rejected */
+int Config_apply(const char *assignment);
+
+/*
+   Apply every line of a config file; blank lines and '#' comments are
+   skipped. Returns 0, -1 if the file cannot be read, or the number of the
+   first line that could not be applied.
+ */
+int Config_load(const char *path);
+
+/* Admin handler: GET lists the settings, POST ?name=value&... changes them */
+void Config_render(const char *method, const char *query, const char *body,
+                   struct AdminReply *reply);
+
+#endif
@@ -0,0 +1,993 @@
+/*
+  h2.c -- HTTP/2 over cleartext TCP (h2c) between clients and the proxy.
+*/
+
+#include "h2.h"
+#include "hpack.h"
+#include "chunked.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+enum
+{
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+enum
+{
+    ERR_PROTOCOL = 0x1,
+    ERR_INTERNAL = 0x2,
+    ERR_FLOW_CONTROL = 0x3,
+    ERR_FRAME_SIZE = 0x6,
+    ERR_REFUSED_STREAM = 0x7,
+    ERR_COMPRESSION = 0x9,
+    ERR_ENHANCE_YOUR_CALM = 0xb
+};
+
+enum
+{
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4
+};
+
+#define H2_MAX_WINDOW 0x7fffffffL     // largest flow control window
+#define H2_MAX_RESPONSE_HEAD 65536    // longest response head read from a stream
+
+struct H2Stream
+{
+    unsigned int id;  // 0 while the slot is free
+    int fd;           // our end of the socketpair, -1 until the request is complete
+    long window;      // bytes we may still send on the stream
+    char *head;       // request head as it is built, then the response head as it is read
+    size_t head_len;
+    size_t head_size;
+    char *body;       // request body
+    size_t body_len;
+    size_t body_size;
+    long content_length; // the request's content-length, -1 without one
+    char *request;    // complete HTTP/1.1 request, until written to fd
+    size_t request_len;
+    size_t request_sent;
+    int headers_sent; // the response HEADERS went out
+    int chunked;      // the response body uses the chunked coding
+    struct ChunkedDecoder decoder;
+    int eof;          // the response body ended
+    char pending[H2_FRAME_SIZE]; // body bytes read but held back by flow control
+    size_t pending_off;
+    size_t pending_len;
+};
+
+struct H2Conn
+{
+    int socket;
+    H2StartRequest start;
+    struct HpackDecoder decoder;
+    struct H2Stream streams[H2_MAX_STREAMS];
+    long window;           // bytes we may still send on the connection
+    long initial_window;   // the client's SETTINGS_INITIAL_WINDOW_SIZE
+    unsigned int last_id;  // highest stream the client opened
+    int preface;           // bytes of the client preface received
+    int goaway;            // the client opens no more streams
+    unsigned char in[9 + H2_FRAME_SIZE]; // frame being received
+    size_t in_len;
+    char *block;           // header block being received
+    size_t block_len;
+    size_t block_size;
+    unsigned int block_id; // its stream, 0 unless a block is open
+    int block_flags;       // flags of the HEADERS frame that opened it
+};
+
+/* Pseudo-header and regular fields of a request, as the decoder hands them out */
+struct RequestFields
+{
+    char method[32];
+    char scheme[16];
+    char authority[256];
+    char path[HPACK_MAX_STRING + 1];
+    char *headers; // regular fields as HTTP/1.1 header lines
+    size_t headers_len;
+    size_t headers_size;
+    char *cookie;  // cookie fields, which HTTP/1.1 wants in one header
+    size_t cookie_len;
+    size_t cookie_size;
+    long content_length; // -1 without one
+    int bad;       // malformed, the stream is reset
+};
+
+/* Fields that only mean something on one HTTP/1.1 connection and are not carried over HTTP/2 */
+static const char *connection_fields[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding",
+                                          "upgrade", "te", "http2-settings"};
+
+static int connection_field(const char *name, size_t len)
+{
+    for (size_t i = 0; i < sizeof(connection_fields) / sizeof(connection_fields[0]); i++)
+    {
+        if (strlen(connection_fields[i]) == len && !strncasecmp(connection_fields[i], name, len))
+            return 1;
+    }
+    return 0;
+}
+
+static int append(char **buf, size_t *len, size_t *size, const void *data, size_t n)
+{
+    if (*len + n > *size)
+    {
+        size_t want = *size > 0 ? *size : 1024;
+        while (want < *len + n)
+            want *= 2;
+        char *bigger = (char *)realloc(*buf, want);
+        if (bigger == NULL)
+            return -1;
+        *buf = bigger;
+        *size = want;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_frame(struct H2Conn *c, int type, int flags, unsigned int id, const void *payload, size_t len)
+{
+    unsigned char frame[9 + H2_FRAME_SIZE];
+    frame[0] = len >> 16;
+    frame[1] = len >> 8;
+    frame[2] = len;
+    frame[3] = type;
+    frame[4] = flags;
+    frame[5] = (id >> 24) & 0x7f;
+    frame[6] = id >> 16;
+    frame[7] = id >> 8;
+    frame[8] = id;
+    if (len > 0)
+        memcpy(frame + 9, payload, len);
+    return write_all(c->socket, frame, 9 + len);
+}
+
+static int send_u32(struct H2Conn *c, int type, unsigned int id, unsigned long value)
+{
+    unsigned char payload[4] = {(unsigned char)(value >> 24), (unsigned char)(value >> 16),
+                                (unsigned char)(value >> 8), (unsigned char)value};
+    return send_frame(c, type, 0, id, payload, 4);
+}
+
+/* Sends GOAWAY; returns -1, which ends the connection */
+static int connection_error(struct H2Conn *c, int code)
+{
+    unsigned char payload[8] = {(unsigned char)(c->last_id >> 24), (unsigned char)(c->last_id >> 16),
+                                (unsigned char)(c->last_id >> 8), (unsigned char)c->last_id,
+                                0, 0, 0, (unsigned char)code};
+    send_frame(c, FRAME_GOAWAY, 0, 0, payload, 8);
+    return -1;
+}
+
+/* Sends a header block as HEADERS and as many CONTINUATION frames as it takes */
+static int send_headers(struct H2Conn *c, unsigned int id, const unsigned char *block, size_t len, int end_stream)
+{
+    size_t off = 0;
+    int type = FRAME_HEADERS;
+    do
+    {
+        size_t n = len - off > H2_FRAME_SIZE ? H2_FRAME_SIZE : len - off;
+        int flags = off + n == len ? FLAG_END_HEADERS : 0;
+        if (type == FRAME_HEADERS && end_stream)
+            flags |= FLAG_END_STREAM;
+        if (send_frame(c, type, flags, id, block + off, n) < 0)
+            return -1;
+        off += n;
+        type = FRAME_CONTINUATION;
+    } while (off < len);
+    return 0;
+}
+
+static struct H2Stream *find_stream(struct H2Conn *c, unsigned int id)
+{
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if (c->streams[i].id == id)
+            return &c->streams[i];
+    }
+    return NULL;
+}
+
+static struct H2Stream *new_stream(struct H2Conn *c, unsigned int id)
+{
+    struct H2Stream *s = find_stream(c, 0);
+    if (s == NULL)
+        return NULL;
+    s->id = id;
+    s->window = c->initial_window;
+    s->content_length = -1;
+    ChunkedDecoder_init(&s->decoder);
+    return s;
+}
+
+static void free_stream(struct H2Stream *s)
+{
+    if (s->fd >= 0)
+        close(s->fd); // the proxy thread serving it sees the connection go
+    free(s->head);
+    free(s->body);
+    free(s->request);
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+}
+
+static int reset_stream(struct H2Conn *c, struct H2Stream *s, int code)
+{
+    unsigned int id = s->id;
+    free_stream(s);
+    return send_u32(c, FRAME_RST_STREAM, id, code);
+}
+
+/* Answers a stream with a bodiless status of our own */
+static int respond_status(struct H2Conn *c, struct H2Stream *s, int status)
+{
+    unsigned char block[64];
+    int n = Hpack_encodeStatus(block, sizeof(block), status);
+    n += Hpack_encode(block + n, sizeof(block) - n, "content-length", 14, "0", 1);
+    unsigned int id = s->id;
+    free_stream(s);
+    return send_headers(c, id, block, n, 1);
+}
+
+static void copy_pseudo(char *dst, size_t size, const char *value, int *bad)
+{
+    if (dst[0] != '\0' || value[0] == '\0' || strlen(value) >= size)
+        *bad = 1; // repeated, empty or too long
+    else
+        strcpy(dst, value);
+}
+
+/* A regular field name as RFC 9113 8.2.1 allows it: lowercase, no separators or whitespace */
+static int valid_name(const char *name)
+{
+    if (name[0] == '\0' || strpbrk(name, ": \t\r\n\v\f") != NULL)
+        return 0;
+    for (const char *p = name; *p != '\0'; p++)
+    {
+        if (*p >= 'A' && *p <= 'Z')
+            return 0;
+    }
+    return 1;
+}
+
+/* A content-length value, digits only; -1 if malformed */
+static long parse_length(const char *value)
+{
+    char *end;
+    errno = 0;
+    long n = strtol(value, &end, 10);
+    if (value[0] < '0' || value[0] > '9' || *end != '\0' || errno == ERANGE)
+        return -1;
+    return n;
+}
+
+static int collect_field(void *arg, const char *name, const char *value)
+{
+    struct RequestFields *f = (struct RequestFields *)arg;
+    if (strpbrk(value, "\r\n") != NULL)
+    {
+        f->bad = 1; // would split the HTTP/1.1 request line or header
+        return 0;
+    }
+    if (name[0] == ':')
+    {
+        if (!strcmp(name, ":method"))
+            copy_pseudo(f->method, sizeof(f->method), value, &f->bad);
+        else if (!strcmp(name, ":scheme"))
+            copy_pseudo(f->scheme, sizeof(f->scheme), value, &f->bad);
+        else if (!strcmp(name, ":authority"))
+            copy_pseudo(f->authority, sizeof(f->authority), value, &f->bad);
+        else if (!strcmp(name, ":path"))
+            copy_pseudo(f->path, sizeof(f->path), value, &f->bad);
+        else
+            f->bad = 1;
+        return 0;
+    }
+    if (!valid_name(name))
+    {
+        f->bad = 1; // would smuggle extra lines into the HTTP/1.1 head
+        return 0;
+    }
+    if (!strcmp(name, "host"))
+    {
+        if (f->authority[0] == '\0' && strlen(value) < sizeof(f->authority))
+            strcpy(f->authority, value);
+        return 0;
+    }
+    if (connection_field(name, strlen(name)))
+        return 0;
+    if (!strcmp(name, "cookie"))
+    {
+        if ((f->cookie_len > 0 && append(&f->cookie, &f->cookie_len, &f->cookie_size, "; ", 2) < 0) ||
+            append(&f->cookie, &f->cookie_len, &f->cookie_size, value, strlen(value)) < 0)
+            f->bad = 1;
+        return 0;
+    }
+    if (!strcmp(name, "content-length"))
+    {
+        long n = parse_length(value);
+        if (n < 0 || (f->content_length >= 0 && n != f->content_length))
+            f->bad = 1; // malformed, or repeated with another value
+        if (f->content_length >= 0)
+            return 0; // forwarded once
+        f->content_length = n;
+    }
+    if (append(&f->headers, &f->headers_len, &f->headers_size, name, strlen(name)) < 0 ||
+        append(&f->headers, &f->headers_len, &f->headers_size, ": ", 2) < 0 ||
+        append(&f->headers, &f->headers_len, &f->headers_size, value, strlen(value)) < 0 ||
+        append(&f->headers, &f->headers_len, &f->headers_size, "\r\n", 2) < 0)
+        f->bad = 1;
+    return 0;
+}
+
+static int valid_request(struct RequestFields *f)
+{
+    return !f->bad && f->method[0] != '\0' && f->path[0] == '/' && f->authority[0] != '\0' &&
+           strpbrk(f->method, " \t") == NULL && strpbrk(f->path, " \t") == NULL &&
+           strpbrk(f->authority, " \t/") == NULL && strpbrk(f->scheme, " \t:/") == NULL;
+}
+
+/* Start the stream's HTTP/1.1 request head, in absolute form as a forward proxy receives it */
+static int build_request(struct H2Stream *s, struct RequestFields *f)
+{
+    const char *scheme = f->scheme[0] != '\0' ? f->scheme : "http";
+    size_t size = strlen(f->method) + strlen(scheme) + 2 * strlen(f->authority) + strlen(f->path) + 32;
+    char *line = (char *)malloc(size);
+    if (line == NULL)
+        return -1;
+    int n = snprintf(line, size, "%s %s://%s%s HTTP/1.1\r\nHost: %s\r\n", f->method, scheme, f->authority,
+                     f->path, f->authority);
+    int r = append(&s->head, &s->head_len, &s->head_size, line, n);
+    free(line);
+    if (r == 0 && f->headers_len > 0)
+        r = append(&s->head, &s->head_len, &s->head_size, f->headers, f->headers_len);
+    if (r == 0 && f->cookie_len > 0)
+    {
+        if (append(&s->head, &s->head_len, &s->head_size, "Cookie: ", 8) < 0 ||
+            append(&s->head, &s->head_len, &s->head_size, f->cookie, f->cookie_len) < 0 ||
+            append(&s->head, &s->head_len, &s->head_size, "\r\n", 2) < 0)
+            r = -1;
+    }
+    s->content_length = f->content_length;
+    return r;
+}
+
+/* Hand the complete request in s->head to the proxy over a new socketpair */
+static int open_request(struct H2Conn *c, struct H2Stream *s)
+{
+    s->request = s->head;
+    s->request_len = s->head_len;
+    s->request_sent = 0;
+    s->head = NULL;
+    s->head_len = s->head_size = 0;
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+        return reset_stream(c, s, ERR_INTERNAL);
+    fcntl(pair[1], F_SETFL, O_NONBLOCK);
+    if (c->start(pair[0]) < 0)
+    {
+        close(pair[1]);
+        return reset_stream(c, s, ERR_REFUSED_STREAM);
+    }
+    s->fd = pair[1];
+    return 0;
+}
+
+/* The client ended the stream: finish the request head, append the body and send it */
+static int start_request(struct H2Conn *c, struct H2Stream *s)
+{
+    char tail[64];
+    int n = 0;
+    if (s->content_length >= 0 && s->body_len != (size_t)s->content_length)
+        return reset_stream(c, s, ERR_PROTOCOL); // the body disagrees with content-length
+    if (s->body_len > 0 && s->content_length < 0)
+        n = snprintf(tail, sizeof(tail), "Content-Length: %zu\r\n", s->body_len);
+    n += snprintf(tail + n, sizeof(tail) - n, "Connection: close\r\n\r\n");
+    if (append(&s->head, &s->head_len, &s->head_size, tail, n) < 0 ||
+        (s->body_len > 0 && append(&s->head, &s->head_len, &s->head_size, s->body, s->body_len) < 0))
+        return reset_stream(c, s, ERR_INTERNAL);
+    free(s->body);
+    s->body = NULL;
+    s->body_len = s->body_size = 0;
+    return open_request(c, s);
+}
+
+static int on_request_headers(struct H2Conn *c, unsigned int id, int end_stream)
+{
+    struct RequestFields *f = (struct RequestFields *)calloc(1, sizeof(struct RequestFields));
+    if (f == NULL)
+        return connection_error(c, ERR_INTERNAL);
+    f->content_length = -1;
+    // Blocks of streams that are refused or gone are decoded all the same, they update the dynamic table
+    if (Hpack_decode(&c->decoder, (const unsigned char *)c->block, c->block_len, collect_field, f) < 0)
+    {
+        free(f->headers);
+        free(f->cookie);
+        free(f);
+        return connection_error(c, ERR_COMPRESSION);
+    }
+
+    int r = 0;
+    struct H2Stream *s = find_stream(c, id);
+    if (s != NULL)
+    {
+        // Trailers: their fields are dropped, the request is complete
+        if (end_stream && s->fd < 0)
+            r = start_request(c, s);
+    }
+    else if (id > c->last_id)
+    {
+        c->last_id = id;
+        if (c->goaway || (s = new_stream(c, id)) == NULL)
+            r = send_u32(c, FRAME_RST_STREAM, id, ERR_REFUSED_STREAM);
+        else if (!strcmp(f->method, "CONNECT"))
+            r = respond_status(c, s, 501); // no tunnels over HTTP/2
+        else if (!valid_request(f))
+            r = reset_stream(c, s, ERR_PROTOCOL);
+        else if (build_request(s, f) < 0)
+            r = reset_stream(c, s, ERR_INTERNAL);
+        else if (end_stream)
+            r = start_request(c, s);
+    }
+    free(f->headers);
+    free(f->cookie);
+    free(f);
+    return r;
+}
+
+static int on_block(struct H2Conn *c, const unsigned char *p, size_t len, int end_headers)
+{
+    if (c->block_len + len > H2_MAX_REQUEST || append(&c->block, &c->block_len, &c->block_size, p, len) < 0)
+        return connection_error(c, ERR_ENHANCE_YOUR_CALM);
+    if (!end_headers)
+        return 0;
+    unsigned int id = c->block_id;
+    c->block_id = 0;
+    return on_request_headers(c, id, c->block_flags & FLAG_END_STREAM);
+}
+
+static int on_headers(struct H2Conn *c, int flags, unsigned int id, const unsigned char *p, size_t len)
+{
+    if (id == 0 || id % 2 == 0)
+        return connection_error(c, ERR_PROTOCOL);
+    size_t pad = 0;
+    if (flags & FLAG_PADDED)
+    {
+        if (len < 1)
+            return connection_error(c, ERR_FRAME_SIZE);
+        pad = p[0];
+        p++;
+        len--;
+    }
+    if (flags & FLAG_PRIORITY)
+    {
+        if (len < 5)
+            return connection_error(c, ERR_FRAME_SIZE);
+        p += 5; // priorities are ignored
+        len -= 5;
+    }
+    if (pad > len)
+        return connection_error(c, ERR_PROTOCOL);
+    c->block_id = id;
+    c->block_flags = flags;
+    c->block_len = 0;
+    return on_block(c, p, len - pad, flags & FLAG_END_HEADERS);
+}
+
+static int on_data(struct H2Conn *c, int flags, unsigned int id, const unsigned char *p, size_t len)
+{
+    if (id == 0)
+        return connection_error(c, ERR_PROTOCOL);
+    // Received bytes are credited back at once, the body is buffered up to H2_MAX_REQUEST anyway
+    size_t frame_len = len;
+    if (frame_len > 0 && send_u32(c, FRAME_WINDOW_UPDATE, 0, frame_len) < 0)
+        return -1;
+    size_t pad = 0;
+    if (flags & FLAG_PADDED)
+    {
+        if (len < 1)
+            return connection_error(c, ERR_FRAME_SIZE);
+        pad = p[0];
+        p++;
+        len--;
+    }
+    if (pad > len)
+        return connection_error(c, ERR_PROTOCOL);
+    len -= pad;
+
+    struct H2Stream *s = find_stream(c, id);
+    if (s == NULL || s->fd >= 0)
+        return 0; // reset, answered already or its request is complete
+    if (s->content_length >= 0 && s->body_len + len > (size_t)s->content_length)
+        return reset_stream(c, s, ERR_PROTOCOL); // more than content-length announced
+    if (s->body_len + len > H2_MAX_REQUEST)
+        return respond_status(c, s, 413);
+    if (append(&s->body, &s->body_len, &s->body_size, p, len) < 0)
+        return reset_stream(c, s, ERR_INTERNAL);
+    if (flags & FLAG_END_STREAM)
+        return start_request(c, s);
+    if (frame_len > 0)
+        return send_u32(c, FRAME_WINDOW_UPDATE, id, frame_len);
+    return 0;
+}
+
+static int apply_settings(struct H2Conn *c, const unsigned char *p, size_t len)
+{
+    for (size_t i = 0; i + 6 <= len; i += 6)
+    {
+        int key = p[i] << 8 | p[i + 1];
+        unsigned long value = (unsigned long)p[i + 2] << 24 | p[i + 3] << 16 | p[i + 4] << 8 | p[i + 5];
+        if (key != SETTINGS_INITIAL_WINDOW_SIZE)
+            continue; // the rest bound what we send, which never exceeds their defaults
+        if (value > (unsigned long)H2_MAX_WINDOW)
+            return -1;
+        long delta = (long)value - c->initial_window;
+        for (int j = 0; j < H2_MAX_STREAMS; j++)
+        {
+            if (c->streams[j].id != 0)
+                c->streams[j].window += delta;
+        }
+        c->initial_window = value;
+    }
+    return 0;
+}
+
+static int on_window_update(struct H2Conn *c, unsigned int id, const unsigned char *p, size_t len)
+{
+    if (len != 4)
+        return connection_error(c, ERR_FRAME_SIZE);
+    long increment = (long)(p[0] & 0x7f) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    if (id == 0)
+    {
+        if (increment == 0)
+            return connection_error(c, ERR_PROTOCOL);
+        if (c->window + increment > H2_MAX_WINDOW)
+            return connection_error(c, ERR_FLOW_CONTROL);
+        c->window += increment;
+        return 0;
+    }
+    struct H2Stream *s = find_stream(c, id);
+    if (s == NULL)
+        return 0;
+    if (increment == 0 || s->window + increment > H2_MAX_WINDOW)
+        return reset_stream(c, s, increment == 0 ? ERR_PROTOCOL : ERR_FLOW_CONTROL);
+    s->window += increment;
+    return 0;
+}
+
+static int handle_frame(struct H2Conn *c, int type, int flags, unsigned int id, const unsigned char *p, size_t len)
+{
+    if (c->block_id != 0 && (type != FRAME_CONTINUATION || id != c->block_id))
+        return connection_error(c, ERR_PROTOCOL); // nothing may interrupt a header block
+    switch (type)
+    {
+    case FRAME_DATA:
+        return on_data(c, flags, id, p, len);
+    case FRAME_HEADERS:
+        return on_headers(c, flags, id, p, len);
+    case FRAME_CONTINUATION:
+        if (c->block_id == 0)
+            return connection_error(c, ERR_PROTOCOL);
+        return on_block(c, p, len, flags & FLAG_END_HEADERS);
+    case FRAME_SETTINGS:
+        if (id != 0)
+            return connection_error(c, ERR_PROTOCOL);
+        if (flags & FLAG_ACK)
+            return 0;
+        if (len % 6 != 0)
+            return connection_error(c, ERR_FRAME_SIZE);
+        if (apply_settings(c, p, len) < 0)
+            return connection_error(c, ERR_FLOW_CONTROL);
+        return send_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+    case FRAME_PING:
+        if (id != 0 || len != 8)
+            return connection_error(c, id != 0 ? ERR_PROTOCOL : ERR_FRAME_SIZE);
+        if (flags & FLAG_ACK)
+            return 0;
+        return send_frame(c, FRAME_PING, FLAG_ACK, 0, p, 8);
+    case FRAME_WINDOW_UPDATE:
+        return on_window_update(c, id, p, len);
+    case FRAME_RST_STREAM:
+    {
+        struct H2Stream *s = id != 0 ? find_stream(c, id) : NULL;
+        if (s != NULL)
+            free_stream(s);
+        return 0;
+    }
+    case FRAME_GOAWAY:
+        c->goaway = 1; // streams already open are still answered
+        return 0;
+    case FRAME_PUSH_PROMISE:
+        return connection_error(c, ERR_PROTOCOL); // clients do not push
+    default:
+        return 0; // PRIORITY and unknown types are ignored
+    }
+}
+
+/* Feed bytes received from the client: the preface, then frames */
+static int consume(struct H2Conn *c, const unsigned char *data, size_t len)
+{
+    while (len > 0)
+    {
+        if (c->preface < H2_PREFACE_LEN)
+        {
+            size_t n = len < (size_t)(H2_PREFACE_LEN - c->preface) ? len : H2_PREFACE_LEN - c->preface;
+            if (memcmp(data, H2_PREFACE + c->preface, n) != 0)
+                return -1;
+            c->preface += n;
+            data += n;
+            len -= n;
+            continue;
+        }
+        size_t n = len < sizeof(c->in) - c->in_len ? len : sizeof(c->in) - c->in_len;
+        memcpy(c->in + c->in_len, data, n);
+        c->in_len += n;
+        data += n;
+        len -= n;
+
+        size_t off = 0;
+        while (c->in_len - off >= 9)
+        {
+            const unsigned char *h = c->in + off;
+            size_t frame_len = h[0] << 16 | h[1] << 8 | h[2];
+            if (frame_len > H2_FRAME_SIZE)
+                return connection_error(c, ERR_FRAME_SIZE);
+            if (c->in_len - off < 9 + frame_len)
+                break;
+            unsigned int id = (unsigned int)(h[5] & 0x7f) << 24 | h[6] << 16 | h[7] << 8 | h[8];
+            if (handle_frame(c, h[3], h[4], id, h + 9, frame_len) < 0)
+                return -1;
+            off += 9 + frame_len;
+        }
+        memmove(c->in, c->in + off, c->in_len - off);
+        c->in_len -= off;
+    }
+    return 0;
+}
+
+/* Send the stream's pending body bytes as far as the windows allow, and end the stream after the last */
+static int flush_stream(struct H2Conn *c, struct H2Stream *s)
+{
+    while (s->pending_off < s->pending_len && s->window > 0 && c->window > 0)
+    {
+        size_t n = s->pending_len - s->pending_off;
+        if ((long)n > s->window)
+            n = s->window;
+        if ((long)n > c->window)
+            n = c->window;
+        int last = s->eof && s->pending_off + n == s->pending_len;
+        if (send_frame(c, FRAME_DATA, last ? FLAG_END_STREAM : 0, s->id, s->pending + s->pending_off, n) < 0)
+            return -1;
+        s->pending_off += n;
+        s->window -= n;
+        c->window -= n;
+        if (last)
+        {
+            free_stream(s);
+            return 0;
+        }
+    }
+    if (s->pending_off < s->pending_len)
+        return 0;
+    s->pending_off = s->pending_len = 0;
+    if (!s->eof)
+        return 0;
+    unsigned int id = s->id;
+    free_stream(s);
+    return send_frame(c, FRAME_DATA, FLAG_END_STREAM, id, NULL, 0);
+}
+
+static int feed_body(struct H2Conn *c, struct H2Stream *s, const char *data, size_t len)
+{
+    memcpy(s->pending, data, len); // pending is empty, and len no larger than it
+    int out = len;
+    if (s->chunked)
+    {
+        if (ChunkedDecoder_feed(&s->decoder, s->pending, len, s->pending, &out) < 0)
+            return reset_stream(c, s, ERR_INTERNAL);
+        if (ChunkedDecoder_done(&s->decoder))
+            s->eof = 1;
+    }
+    s->pending_off = 0;
+    s->pending_len = out;
+    return flush_stream(c, s);
+}
+
+/* Frame a complete HTTP/1.1 response head as HEADERS */
+static int send_response_headers(struct H2Conn *c, struct H2Stream *s, int status, const char *head, size_t head_len)
+{
+    size_t room = 2 * head_len + 64;
+    unsigned char *block = (unsigned char *)malloc(room);
+    if (block == NULL)
+        return reset_stream(c, s, ERR_INTERNAL);
+    int n = Hpack_encodeStatus(block, room, status);
+    const char *end = head + head_len;
+    const char *line = (const char *)memchr(head, '\n', head_len) + 1;
+    while (n >= 0 && line < end)
+    {
+        const char *eol = (const char *)memchr(line, '\n', end - line);
+        const char *stop = eol > line && eol[-1] == '\r' ? eol - 1 : eol;
+        if (stop == line)
+            break; // the blank line ending the head
+        const char *colon = (const char *)memchr(line, ':', stop - line);
+        if (colon != NULL)
+        {
+            const char *value = colon + 1;
+            while (value < stop && (*value == ' ' || *value == '\t'))
+                value++;
+            const char *value_end = stop;
+            while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+                value_end--;
+            if (colon - line == 17 && !strncasecmp(line, "transfer-encoding", 17) &&
+                memmem(value, value_end - value, "chunked", 7) != NULL)
+                s->chunked = 1;
+            if (!connection_field(line, colon - line))
+            {
+                int w = Hpack_encode(block + n, room - n, line, colon - line, value, value_end - value);
+                n = w < 0 ? -1 : n + w;
+            }
+        }
+        line = eol + 1;
+    }
+    int r = n < 0 ? reset_stream(c, s, ERR_INTERNAL) : send_headers(c, s->id, block, n, 0);
+    free(block);
+    if (n >= 0)
+        s->headers_sent = 1;
+    return r;
+}
+
+static int read_head(struct H2Conn *c, struct H2Stream *s, const char *data, size_t len)
+{
+    if (s->head_len + len > H2_MAX_RESPONSE_HEAD || append(&s->head, &s->head_len, &s->head_size, data, len) < 0)
+        return reset_stream(c, s, ERR_INTERNAL);
+    char *end;
+    while ((end = (char *)memmem(s->head, s->head_len, "\r\n\r\n", 4)) != NULL)
+    {
+        size_t head_len = end + 4 - s->head;
+        int status = 0;
+        if (sscanf(s->head, "HTTP/%*d.%*d %3d", &status) != 1 || status < 100 || status > 999)
+            return reset_stream(c, s, ERR_INTERNAL);
+        if (status < 200)
+        {
+            // An interim response, the final one follows
+            memmove(s->head, s->head + head_len, s->head_len - head_len);
+            s->head_len -= head_len;
+            continue;
+        }
+        if (send_response_headers(c, s, status, s->head, head_len) < 0)
+            return -1;
+        if (s->id == 0)
+            return 0; // reset
+        char rest[H2_FRAME_SIZE];
+        size_t rest_len = s->head_len - head_len; // from the last read, so at most a frame
+        memcpy(rest, s->head + head_len, rest_len);
+        free(s->head);
+        s->head = NULL;
+        s->head_len = s->head_size = 0;
+        return feed_body(c, s, rest, rest_len);
+    }
+    return 0;
+}
+
+/* Read what the proxy wrote back on the stream's socket */
+static int read_response(struct H2Conn *c, struct H2Stream *s)
+{
+    char buf[H2_FRAME_SIZE];
+    size_t want = sizeof(buf);
+    if (s->headers_sent)
+    {
+        // Body bytes are read no faster than the client lets us send them
+        if ((long)want > s->window)
+            want = s->window;
+        if ((long)want > c->window)
+            want = c->window;
+    }
+    ssize_t n = recv(s->fd, buf, want, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (n <= 0)
+    {
+        if (!s->headers_sent)
+            return reset_stream(c, s, ERR_INTERNAL); // no complete response
+        s->eof = 1;
+        return flush_stream(c, s);
+    }
+    if (!s->headers_sent)
+        return read_head(c, s, buf, n);
+    return feed_body(c, s, buf, n);
+}
+
+/* Write as much of the stream's request to the proxy as its socket takes */
+static void write_request(struct H2Stream *s)
+{
+    ssize_t n = send(s->fd, s->request + s->request_sent, s->request_len - s->request_sent, MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n > 0)
+        s->request_sent += n;
+    if (n <= 0 || s->request_sent == s->request_len)
+    {
+        free(s->request); // sent, or the proxy answered without reading it all
+        s->request = NULL;
+    }
+}
+
+static int readable(struct H2Conn *c, struct H2Stream *s)
+{
+    return s->fd >= 0 && s->request == NULL && !s->eof && s->pending_off == s->pending_len &&
+           (!s->headers_sent || (s->window > 0 && c->window > 0));
+}
+
+static int base64url_decode(const char *in, unsigned char *out, size_t room)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    unsigned long bits = 0;
+    int count = 0;
+    size_t n = 0;
+    for (; *in != '\0' && *in != '='; in++)
+    {
+        const char *digit = strchr(alphabet, *in);
+        if (digit == NULL)
+            return -1;
+        bits = bits << 6 | (digit - alphabet);
+        count += 6;
+        if (count >= 8)
+        {
+            count -= 8;
+            if (n == room)
+                return -1;
+            out[n++] = bits >> count;
+            bits &= (1UL << count) - 1;
+        }
+    }
+    return n;
+}
+
+int H2_isPreface(const char *buf, int len)
+{
+    return len >= 18 && !memcmp(buf, H2_PREFACE, 18); // "PRI * HTTP/2.0\r\n\r\n"
+}
+
+void H2_serve(int socket, const char *early, int early_len, const char *request, int request_len,
+              const char *settings, H2StartRequest start)
+{
+    struct H2Conn *c = (struct H2Conn *)calloc(1, sizeof(struct H2Conn));
+    if (c == NULL)
+        return;
+    c->socket = socket;
+    c->start = start;
+    c->window = H2_WINDOW;
+    c->initial_window = H2_WINDOW;
+    Hpack_init(&c->decoder);
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+        c->streams[i].fd = -1;
+
+    int ok = 1;
+    if (request != NULL)
+    {
+        static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        unsigned char payload[256];
+        int n = base64url_decode(settings, payload, sizeof(payload));
+        ok = n >= 0 && n % 6 == 0 && apply_settings(c, payload, n) == 0 &&
+             write_all(socket, switching, sizeof(switching) - 1) == 0;
+    }
+    unsigned char ours[6] = {0, SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_MAX_STREAMS};
+    ok = ok && send_frame(c, FRAME_SETTINGS, 0, 0, ours, sizeof(ours)) == 0;
+    if (ok && request != NULL)
+    {
+        // The upgraded request is stream 1, which the client has half closed
+        struct H2Stream *s = new_stream(c, 1);
+        c->last_id = 1;
+        ok = append(&s->head, &s->head_len, &s->head_size, request, request_len) == 0 && open_request(c, s) == 0;
+    }
+    if (ok && early_len > 0)
+        ok = consume(c, (const unsigned char *)early, early_len) == 0;
+
+    struct pollfd fds[1 + H2_MAX_STREAMS];
+    struct H2Stream *polled[1 + H2_MAX_STREAMS];
+    unsigned char buf[H2_FRAME_SIZE];
+    while (ok)
+    {
+        int n = 1;
+        int open = 0;
+        fds[0].fd = socket;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        for (int i = 0; i < H2_MAX_STREAMS; i++)
+        {
+            struct H2Stream *s = &c->streams[i];
+            if (s->id == 0)
+                continue;
+            open++;
+            short events = (s->request != NULL ? POLLOUT : 0) | (readable(c, s) ? POLLIN : 0);
+            if (events == 0)
+                continue;
+            fds[n].fd = s->fd;
+            fds[n].events = events;
+            fds[n].revents = 0;
+            polled[n++] = s;
+        }
+        if (c->goaway && open == 0)
+            break;
+        if (poll(fds, n, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (int i = 1; i < n && ok; i++)
+        {
+            struct H2Stream *s = polled[i];
+            if (fds[i].revents == 0 || s->fd != fds[i].fd)
+                continue;
+            if (s->request != NULL)
+                write_request(s);
+            if (readable(c, s) && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                ok = read_response(c, s) == 0;
+        }
+        if (ok && fds[0].revents != 0)
+        {
+            ssize_t got = recv(socket, buf, sizeof(buf), 0);
+            if (got < 0 && errno == EINTR)
+                continue;
+            ok = got > 0 && consume(c, buf, got) == 0;
+            // WINDOW_UPDATE and SETTINGS may have opened the windows of held back streams
+            for (int i = 0; ok && i < H2_MAX_STREAMS; i++)
+            {
+                struct H2Stream *s = &c->streams[i];
+                if (s->id != 0 && s->pending_off < s->pending_len)
+                    ok = flush_stream(c, s) == 0;
+            }
+        }
+    }
+
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if (c->streams[i].id != 0)
+            free_stream(&c->streams[i]);
+    }
+    free(c->block);
+    Hpack_free(&c->decoder);
+    free(c);
+}
@@ -0,0 +1,42 @@
+/*
+ * h2.h -- HTTP/2 over cleartext TCP (h2c) between clients and the proxy.
+ *
+ * A client connection that opens with the HTTP/2 connection preface, or that
+ * upgrades an HTTP/1.1 request with "Upgrade: h2c", is served by one thread
+ * that multiplexes its streams. The header block of every stream is HPACK
+ * decoded into an HTTP/1.1 request, which is written to one end of a
+ * socketpair whose other end is handed to the proxy as a client connection
+ * of its own: a stream is served by the same code as any request, cache,
+ * routes, cluster peers, limits and access log included. The HTTP/1.1
+ * response read back is framed as HEADERS and DATA, and a stream's socket is
+ * only read while the client's stream and connection windows have room, so
+ * cache hits and relayed responses alike follow the client's flow control.
+ */
+
+#ifndef PROXY_H2
+#define PROXY_H2
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_MAX_STREAMS 32        // concurrent streams per connection, announced in SETTINGS
+#define H2_FRAME_SIZE 16384      // largest frame payload, the HTTP/2 default
+#define H2_WINDOW 65535          // initial flow control window, the HTTP/2 default
+#define H2_MAX_REQUEST (1 << 20) // largest header block, and largest request body buffered
+
+/* Serves a connection carrying one request, as accept() would; closes socket and returns -1 on failure */
+typedef int (*H2StartRequest)(int socket);
+
+/* 1 if buf starts with the part of the preface that reads as an HTTP/1.1 request head */
+int H2_isPreface(const char *buf, int len);
+
+/*
+   Serve an HTTP/2 connection until the client closes it. early holds the
+   bytes already received, from the preface on. For an upgrade, request is
+   the HTTP/1.1 request to answer as stream 1 and settings the value of its
+   HTTP2-Settings header; both are NULL for a prior knowledge connection.
+   Each stream's request is handed to start. socket is not closed.
+ */
+void H2_serve(int socket, const char *early, int early_len, const char *request, int request_len,
+              const char *settings, H2StartRequest start);
+
+#endif
@@ -0,0 +1,395 @@
+/*
+  hpack.c -- HPACK header compression for HTTP/2 (RFC 7541).
+*/
+
+#include "hpack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#define STATIC_ENTRIES 61
+
+/* RFC 7541 Appendix A, indexed from 1 */
+static const char *static_table[STATIC_ENTRIES + 1][2] = {
+    {NULL, NULL},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/*
+   Code lengths of the Huffman code of RFC 7541 Appendix B, symbol 256 is
+   EOS. The code is canonical: codes are handed out in order of length,
+   then of symbol, so the lengths are all it takes to decode.
+ */
+static const unsigned char huffman_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30};
+
+#define HUFFMAN_MAX_LEN 30
+
+// Canonical decoding tables, built once from huffman_len
+static unsigned int first_code[HUFFMAN_MAX_LEN + 1];  // code of the first symbol of each length
+static unsigned int code_count[HUFFMAN_MAX_LEN + 1];  // symbols of each length
+static int first_symbol[HUFFMAN_MAX_LEN + 1];         // where they start in by_length
+static unsigned short by_length[257];                 // symbols ordered by length, then value
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_init()
+{
+    int n = 0;
+    for (int len = 1; len <= HUFFMAN_MAX_LEN; len++)
+    {
+        first_symbol[len] = n;
+        for (int sym = 0; sym < 257; sym++)
+        {
+            if (huffman_len[sym] == len)
+                by_length[n++] = sym;
+        }
+        code_count[len] = n - first_symbol[len];
+    }
+    unsigned int code = 0;
+    for (int len = 1; len <= HUFFMAN_MAX_LEN; len++)
+    {
+        first_code[len] = code;
+        code = (code + code_count[len]) << 1;
+    }
+}
+
+/* Decodes a Huffman coded string into out; its length, or -1 if malformed or longer than room */
+static int huffman_decode(const unsigned char *in, size_t len, char *out, size_t room)
+{
+    unsigned int code = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        for (int b = 7; b >= 0; b--)
+        {
+            code = (code << 1) | ((in[i] >> b) & 1);
+            if (++bits > HUFFMAN_MAX_LEN)
+                return -1;
+            if (code - first_code[bits] < code_count[bits])
+            {
+                int sym = by_length[first_symbol[bits] + code - first_code[bits]];
+                if (sym == 256 || n == room)
+                    return -1; // EOS must not appear in a string
+                out[n++] = sym;
+                code = 0;
+                bits = 0;
+            }
+        }
+    }
+    // Padding is the most significant bits of EOS: up to 7 one bits
+    if (bits > 7 || code != (1U << bits) - 1)
+        return -1;
+    return n;
+}
+
+void Hpack_init(struct HpackDecoder *d)
+{
+    pthread_once(&huffman_once, huffman_init);
+    memset(d, 0, sizeof(*d));
+    d->max_size = HPACK_TABLE_SIZE;
+}
+
+static void evict_oldest(struct HpackDecoder *d)
+{
+    struct HpackEntry *e = &d->entries[(d->first + d->count - 1) % HPACK_MAX_ENTRIES];
+    d->size -= e->size;
+    free(e->name);
+    free(e->value);
+    d->count--;
+}
+
+void Hpack_free(struct HpackDecoder *d)
+{
+    while (d->count > 0)
+        evict_oldest(d);
+}
+
+static void add_entry(struct HpackDecoder *d, const char *name, const char *value)
+{
+    size_t size = strlen(name) + strlen(value) + 32;
+    while (d->count > 0 && d->size + size > d->max_size)
+        evict_oldest(d);
+    if (size > d->max_size)
+        return; // an entry larger than the table empties it and is not added
+    d->first = (d->first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    struct HpackEntry *e = &d->entries[d->first];
+    e->name = strdup(name);
+    e->value = strdup(value);
+    e->size = size;
+    d->size += size;
+    d->count++;
+}
+
+/* Field at a static or dynamic table index; -1 if there is none */
+static int lookup(struct HpackDecoder *d, size_t index, const char **name, const char **value)
+{
+    if (index >= 1 && index <= STATIC_ENTRIES)
+    {
+        *name = static_table[index][0];
+        *value = static_table[index][1];
+        return 0;
+    }
+    if (index <= STATIC_ENTRIES || index - STATIC_ENTRIES > (size_t)d->count)
+        return -1;
+    struct HpackEntry *e = &d->entries[(d->first + index - STATIC_ENTRIES - 1) % HPACK_MAX_ENTRIES];
+    *name = e->name;
+    *value = e->value;
+    return 0;
+}
+
+/* Decodes an integer with an N-bit prefix, advancing *p */
+static int decode_int(const unsigned char **p, const unsigned char *end, int prefix, size_t *value)
+{
+    if (*p >= end)
+        return -1;
+    size_t max = (1U << prefix) - 1;
+    size_t v = *(*p)++ & max;
+    if (v < max)
+    {
+        *value = v;
+        return 0;
+    }
+    for (int shift = 0; *p < end && shift <= 28; shift += 7)
+    {
+        unsigned char b = *(*p)++;
+        v += (size_t)(b & 127) << shift;
+        if (!(b & 128))
+        {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Decodes a string literal into out (HPACK_MAX_STRING + 1 bytes), advancing *p */
+static int decode_string(const unsigned char **p, const unsigned char *end, char *out)
+{
+    if (*p >= end)
+        return -1;
+    int huffman = **p & 0x80;
+    size_t len;
+    if (decode_int(p, end, 7, &len) < 0 || len > (size_t)(end - *p))
+        return -1;
+    int n;
+    if (huffman)
+        n = huffman_decode(*p, len, out, HPACK_MAX_STRING);
+    else if (len > HPACK_MAX_STRING)
+        n = -1;
+    else
+    {
+        memcpy(out, *p, len);
+        n = len;
+    }
+    if (n < 0 || memchr(out, '\0', n) != NULL)
+        return -1; // fields are handed out, and tabled, as C strings
+    out[n] = '\0';
+    *p += len;
+    return 0;
+}
+
+int Hpack_decode(struct HpackDecoder *d, const unsigned char *block, size_t len, HpackField field, void *arg)
+{
+    const unsigned char *p = block, *end = block + len;
+    char name[HPACK_MAX_STRING + 1], value[HPACK_MAX_STRING + 1];
+    while (p < end)
+    {
+        unsigned char b = *p;
+        size_t index;
+        const char *n, *v;
+        if (b & 0x80)
+        {
+            // Indexed field
+            if (decode_int(&p, end, 7, &index) < 0 || lookup(d, index, &n, &v) < 0)
+                return -1;
+            if (field(arg, n, v) < 0)
+                return -1;
+            continue;
+        }
+        if ((b & 0xe0) == 0x20)
+        {
+            // Dynamic table size update
+            if (decode_int(&p, end, 5, &index) < 0 || index > HPACK_TABLE_SIZE)
+                return -1;
+            d->max_size = index;
+            while (d->count > 0 && d->size > d->max_size)
+                evict_oldest(d);
+            continue;
+        }
+
+        // Literal field, with incremental indexing or without (never indexed is the same to us)
+        int indexing = (b & 0xc0) == 0x40;
+        if (decode_int(&p, end, indexing ? 6 : 4, &index) < 0)
+            return -1;
+        if (index > 0)
+        {
+            if (lookup(d, index, &n, &v) < 0)
+                return -1;
+            strcpy(name, n); // the entry may be evicted by the add below
+        }
+        else if (decode_string(&p, end, name) < 0)
+            return -1;
+        if (decode_string(&p, end, value) < 0)
+            return -1;
+        if (indexing)
+            add_entry(d, name, value);
+        if (field(arg, name, value) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int encode_int(unsigned char *out, size_t room, unsigned char flags, int prefix, size_t v)
+{
+    size_t max = (1U << prefix) - 1;
+    size_t n = 0;
+    if (room == 0)
+        return -1;
+    if (v < max)
+    {
+        out[n++] = flags | v;
+        return n;
+    }
+    out[n++] = flags | max;
+    for (v -= max; v >= 128; v >>= 7)
+    {
+        if (n == room)
+            return -1;
+        out[n++] = (v & 127) | 128;
+    }
+    if (n == room)
+        return -1;
+    out[n++] = v;
+    return n;
+}
+
+/* Writes a string literal, not Huffman coded, optionally lowercased */
+static int encode_string(unsigned char *out, size_t room, const char *s, size_t len, int lower)
+{
+    int n = encode_int(out, room, 0, 7, len);
+    if (n < 0 || room - n < len)
+        return -1;
+    for (size_t i = 0; i < len; i++)
+        out[n + i] = lower ? tolower((unsigned char)s[i]) : s[i];
+    return n + len;
+}
+
+int Hpack_encode(unsigned char *out, size_t room, const char *name, size_t name_len,
+                 const char *value, size_t value_len)
+{
+    int index = 0;
+    for (int i = 1; i <= STATIC_ENTRIES && index == 0; i++)
+    {
+        if (strlen(static_table[i][0]) == name_len && !strncasecmp(static_table[i][0], name, name_len))
+            index = i;
+    }
+    // Literal without indexing, 4-bit name index prefix
+    int n = encode_int(out, room, 0, 4, index);
+    if (n < 0)
+        return -1;
+    if (index == 0)
+    {
+        int m = encode_string(out + n, room - n, name, name_len, 1);
+        if (m < 0)
+            return -1;
+        n += m;
+    }
+    int m = encode_string(out + n, room - n, value, value_len, 0);
+    return m < 0 ? -1 : n + m;
+}
+
+int Hpack_encodeStatus(unsigned char *out, size_t room, int status)
+{
+    for (int i = 8; i <= 14; i++)
+    {
+        if (atoi(static_table[i][1]) == status)
+            return encode_int(out, room, 0x80, 7, i);
+    }
+    char value[16];
+    int len = snprintf(value, sizeof(value), "%d", status);
+    int n = encode_int(out, room, 0, 4, 8);
+    if (n < 0)
+        return -1;
+    int m = encode_string(out + n, room - n, value, len, 0);
+    return m < 0 ? -1 : n + m;
+}
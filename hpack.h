@@ -0,0 +1,53 @@
+/*
+ * hpack.h -- HPACK header compression for HTTP/2 (RFC 7541).
+ *
+ * The decoder keeps the dynamic table of one direction of a connection and
+ * turns header blocks into name/value pairs, Huffman coded strings
+ * included. The encoder is stateless: it writes every field as a literal
+ * that is not indexed, naming it by its static table index when there is
+ * one, so the peer's dynamic table is never used.
+ */
+
+#include <stddef.h>
+
+#ifndef PROXY_HPACK
+#define PROXY_HPACK
+
+#define HPACK_TABLE_SIZE 4096   // dynamic table size, the HTTP/2 default
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32) // every entry costs at least 32 bytes
+#define HPACK_MAX_STRING 8192   // longest name or value decoded
+
+struct HpackEntry
+{
+    char *name;
+    char *value;
+    size_t size; // name and value lengths plus 32, as RFC 7541 counts it
+};
+
+/* Dynamic table of a decoder, a ring with the newest entry at first */
+struct HpackDecoder
+{
+    struct HpackEntry entries[HPACK_MAX_ENTRIES];
+    int first;
+    int count;
+    size_t size;     // sum of the entries' sizes
+    size_t max_size; // set by table size updates, at most HPACK_TABLE_SIZE
+};
+
+/* Receives a decoded field; returns -1 to stop decoding */
+typedef int (*HpackField)(void *arg, const char *name, const char *value);
+
+void Hpack_init(struct HpackDecoder *d);
+void Hpack_free(struct HpackDecoder *d);
+
+/* Decode a complete header block; returns 0, or -1 on a compression error or a NUL in a string */
+int Hpack_decode(struct HpackDecoder *d, const unsigned char *block, size_t len, HpackField field, void *arg);
+
+/* Append name (lowercased) and value as a literal field; returns bytes written, -1 if out is too small */
+int Hpack_encode(unsigned char *out, size_t room, const char *name, size_t name_len,
+                 const char *value, size_t value_len);
+
+/* Append a :status field; returns bytes written, -1 if out is too small */
+int Hpack_encodeStatus(unsigned char *out, size_t room, int status);
+
+#endif
@@ -0,0 +1,282 @@
+/*
+  log.c -- asynchronous leveled logger and access log.
+*/
+
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#define LOG_FLUSH_INTERVAL_NS 10000000 // flusher wakes up every 10ms
+
+enum
+{
+    RECORD_MESSAGE,
+    RECORD_ACCESS
+};
+
+struct LogRecord
+{
+    struct timespec ts; // wall clock when queued
+    short type;         // RECORD_*
+    short level;
+    union
+    {
+        char text[LOG_RECORD_TEXT];
+        struct AccessRecord access;
+    };
+};
+
+struct LogRing
+{
+    unsigned long head; // next record to write, advanced by the producer
+    char pad[56];       // keep producer and consumer indexes on separate lines
+    unsigned long tail; // next record to read, advanced by the flusher
+    struct LogRecord records[LOG_RING_RECORDS];
+};
+
+int log_level = LOG_INFO;
+
+static struct LogRing *rings[LOG_MAX_RINGS];
+static pthread_mutex_t shared_ring_lock = PTHREAD_MUTEX_INITIALIZER; // ring 0 has many producers
+static pthread_mutex_t ring_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct LogRing *thread_ring;
+static FILE *access_file;
+static FILE *replay_file;
+static long dropped;
+
+static const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+static struct LogRing *ring_at(int index)
+{
+    struct LogRing *ring = __atomic_load_n(&rings[index], __ATOMIC_ACQUIRE);
+    if (ring != NULL)
+        return ring;
+
+    pthread_mutex_lock(&ring_alloc_lock);
+    ring = rings[index];
+    if (ring == NULL)
+    {
+        ring = (struct LogRing *)calloc(1, sizeof(struct LogRing));
+        __atomic_store_n(&rings[index], ring, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&ring_alloc_lock);
+    return ring;
+}
+
+void Log_bindRing(int slot)
+{
+    thread_ring = ring_at(slot + 1);
+}
+
+void Log_unbindRing()
+{
+    thread_ring = NULL;
+}
+
+long Log_dropped()
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+/* Reserve the next record of the caller's ring, NULL if it is full */
+static struct LogRecord *record_begin(struct LogRing **ringp)
+{
+    struct LogRing *ring = thread_ring;
+    if (ring == NULL)
+    {
+        ring = ring_at(0);
+        pthread_mutex_lock(&shared_ring_lock);
+    }
+    *ringp = ring;
+
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ring->head - tail == LOG_RING_RECORDS)
+    {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        if (ring == rings[0])
+            pthread_mutex_unlock(&shared_ring_lock);
+        return NULL;
+    }
+    struct LogRecord *record = &ring->records[ring->head % LOG_RING_RECORDS];
+    clock_gettime(CLOCK_REALTIME, &record->ts);
+    return record;
+}
+
+/* Publish the record reserved by record_begin */
+static void record_commit(struct LogRing *ring)
+{
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    if (ring == rings[0])
+        pthread_mutex_unlock(&shared_ring_lock);
+}
+
+void Log_vwrite(int level, const char *format, va_list args)
+{
+    struct LogRing *ring;
+    struct LogRecord *record = record_begin(&ring);
+    if (record == NULL)
+        return;
+    record->type = RECORD_MESSAGE;
+    record->level = level;
+    vsnprintf(record->text, sizeof(record->text), format, args);
+    record_commit(ring);
+}
+
+void Log_write(int level, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    Log_vwrite(level, format, args);
+    va_end(args);
+}
+
+void Log_access(const struct AccessRecord *access)
+{
+    if (access_file == NULL && replay_file == NULL)
+        return;
+
+    struct LogRing *ring;
+    struct LogRecord *record = record_begin(&ring);
+    if (record == NULL)
+        return;
+    record->type = RECORD_ACCESS;
+    record->level = LOG_INFO;
+    record->access = *access;
+    record_commit(ring);
+}
+
+/* Write s as the contents of a JSON string */
+static void json_escape(FILE *out, const char *s)
+{
+    for (; *s; s++)
+    {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+}
+
+static void flush_record(struct LogRecord *record)
+{
+    char when[32];
+    struct tm tm;
+    gmtime_r(&record->ts.tv_sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    if (record->type == RECORD_MESSAGE)
+    {
+        size_t len = strlen(record->text);
+        fprintf(stderr, "%s.%03ldZ %-5s %s%s", when, record->ts.tv_nsec / 1000000,
+                level_names[record->level], record->text,
+                len > 0 && record->text[len - 1] == '\n' ? "" : "\n");
+        return;
+    }
+
+    struct AccessRecord *a = &record->access;
+    if (replay_file != NULL && a->key_hash != 0)
+    {
+        struct ReplayRecord replay;
+        replay.ts_ms = record->ts.tv_sec * 1000UL + record->ts.tv_nsec / 1000000;
+        replay.key_hash = a->key_hash;
+        replay.size = a->object_size > 0 ? (unsigned int)a->object_size : 0;
+        replay.key_len = a->key_len;
+        replay.flags = a->replay_flags;
+        fwrite(&replay, sizeof(replay), 1, replay_file);
+    }
+    if (access_file == NULL)
+        return;
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &a->client_ip, ip, sizeof(ip));
+    fprintf(access_file, "{\"ts\":\"%s.%03ldZ\",\"client\":\"%s\",\"method\":\"", when,
+            record->ts.tv_nsec / 1000000, ip);
+    json_escape(access_file, a->method);
+    fprintf(access_file, "\",\"url\":\"");
+    json_escape(access_file, a->url);
+    fprintf(access_file, "\",\"status\":%d,\"bytes\":%ld,\"duration_us\":%ld,\"cache\":\"%c\"}\n",
+            a->status, a->bytes, a->duration_us, a->cache);
+}
+
+static void *flusher_thread(void *arg)
+{
+    (void)arg;
+    struct timespec interval = {0, LOG_FLUSH_INTERVAL_NS};
+
+    while (1)
+    {
+        int wrote = 0;
+        for (int i = 0; i < LOG_MAX_RINGS; i++)
+        {
+            struct LogRing *ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+            if (ring == NULL)
+                continue;
+            unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            for (unsigned long t = ring->tail; t != head; t++)
+                flush_record(&ring->records[t % LOG_RING_RECORDS]);
+            if (ring->tail != head)
+                wrote = 1;
+            __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+        }
+        if (wrote)
+        {
+            fflush(stderr);
+            if (access_file != NULL)
+                fflush(access_file);
+            if (replay_file != NULL)
+                fflush(replay_file);
+        }
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+int Log_levelByName(const char *name)
+{
+    for (int i = LOG_ERROR; i <= LOG_DEBUG; i++)
+    {
+        if (!strcasecmp(name, level_names[i]))
+            return i;
+    }
+    return -1;
+}
+
+unsigned long Log_keyHash(const char *key)
+{
+    unsigned long h = 1469598103934665603UL;
+    for (; *key; key++)
+        h = (h ^ (unsigned char)*key) * 1099511628211UL;
+    return h != 0 ? h : 1;
+}
+
+int Log_init(int level, const char *access_path, const char *replay_path)
+{
+    log_level = level;
+    if (access_path != NULL)
+    {
+        access_file = fopen(access_path, "a");
+        if (access_file == NULL)
+            return -1;
+    }
+    if (replay_path != NULL)
+    {
+        replay_file = fopen(replay_path, "ab");
+        if (replay_file == NULL)
+            return -1;
+    }
+    ring_at(0);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, flusher_thread, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * log.h -- asynchronous leveled logger and access log.
+ *
+ * Logging threads never write to a file or take a shared lock: a record is
+ * formatted into the ring buffer of the worker slot the thread holds (single
+ * producer, single consumer) and a background flusher thread drains every
+ * ring in batches. A full ring drops the record and counts it rather than
+ * stalling a request. Access log entries are queued as binary records and
+ * only turned into JSON lines by the flusher, which can also write them to
+ * a replay trace for offline cache simulation (bench/cachesim).
+ */
+
+#include <stdarg.h>
+
+#ifndef PROXY_LOG
+#define PROXY_LOG
+
+#define LOG_MAX_RINGS 64      // ring 0 is shared by threads without a slot
+#define LOG_RING_RECORDS 512  // records per ring
+#define LOG_RECORD_TEXT 240   // longest message kept
+
+enum
+{
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+};
+
+/* Current level, messages above it are skipped before being formatted */
+extern int log_level;
+
+/* Log a message if level is enabled; arguments are not evaluated otherwise */
+#define LOG(level, ...)                   \
+    do                                    \
+    {                                     \
+        if ((level) <= log_level)         \
+            Log_write(level, __VA_ARGS__); \
+    } while (0)
+
+/*
+   One access log entry, filled in while a request is served. cache is 'H'
+   (hit), 'M' (miss), 'B' (bypass) or '-' (request not served).
+ */
+struct AccessRecord
+{
+    unsigned int client_ip; // IPv4 address in network order
+    int status;             // status sent to the client, 0 if none
+    long bytes;             // response bytes sent to the client
+    long duration_us;       // headers read to response sent
+    char cache;
+    char method[11];
+    char url[192];
+    unsigned long key_hash;      // Log_keyHash() of the cache key, 0 if the request had none
+    long object_size;            // bytes the response takes (or would take) in the cache
+    unsigned short key_len;      // length of the cache key
+    unsigned short replay_flags; // REPLAY_*
+};
+
+enum
+{
+    REPLAY_LOOKUP = 1,     // GET or HEAD that looked the key up in the cache
+    REPLAY_CACHEABLE = 2,  // the response was complete and storable
+    REPLAY_INVALIDATE = 4, // a successful unsafe method dropped the key
+};
+
+/* One request in a replay trace; the file is a plain array of these */
+struct ReplayRecord
+{
+    unsigned long ts_ms;    // wall clock when the request finished
+    unsigned long key_hash; // the URL itself is never written
+    unsigned int size;      // object_size
+    unsigned short key_len;
+    unsigned short flags;
+};
+
+/*
+   Start the flusher thread. Messages go to stderr; access records to
+   access_path as JSON lines and to replay_path as struct ReplayRecord, or
+   nowhere if a path is NULL. Returns -1 if a file cannot be opened.
+ */
+int Log_init(int level, const char *access_path, const char *replay_path);
+
+/* 64-bit FNV-1a hash of a cache key, as written to the replay trace */
+unsigned long Log_keyHash(const char *key);
+
+/* Parse a level name (error, warn, info, debug); -1 if unknown */
+int Log_levelByName(const char *name);
+
+/* Make the calling thread log into ring slot + 1 */
+void Log_bindRing(int slot);
+
+/* Detach the calling thread from its ring */
+void Log_unbindRing();
+
+/* Queue a message; use LOG() to skip disabled levels cheaply */
+void Log_write(int level, const char *format, ...);
+void Log_vwrite(int level, const char *format, va_list args);
+
+/* Queue an access log entry (no-op without an access log or replay trace) */
+void Log_access(const struct AccessRecord *record);
+
+/* Records dropped because a ring was full */
+long Log_dropped();
+
+#endif
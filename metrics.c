@@ -0,0 +1,185 @@
+/*
+  metrics.c -- counters and latency histograms, exported in Prometheus
+  text format.
+*/
+
+#include "metrics.h"
+#include <string.h>
+#include <time.h>
+
+#define METRICS_MAX_GAUGES 16
+
+struct MetricsShard
+{
+    unsigned long counters[M_COUNTERS];
+    unsigned long buckets[H_HISTOGRAMS][METRICS_BUCKETS];
+    unsigned long sum_us[H_HISTOGRAMS];
+} __attribute__((aligned(64)));
+
+struct metrics_gauge
+{
+    const char *name;
+    const char *help;
+    long (*read)();
+};
+
+static const char *counter_names[M_COUNTERS][2] = {
+    {"proxy_requests_total", "Requests received"},
+    {"proxy_cache_hits_total", "Requests answered from the cache"},
+    {"proxy_cache_misses_total", "Cacheable requests not found in the cache"},
+    {"proxy_cache_bypass_total", "Requests that do not use the cache"},
+    {"proxy_cache_bytes_served_total", "Response bytes sent from the cache"},
+    {"proxy_origin_bytes_served_total", "Response bytes relayed from origins"},
+    {"proxy_cache_evictions_total", "Cache entries evicted to make room"},
+    {"proxy_origin_errors_total", "Origins that could not be reached"},
+    {"proxy_blocked_recv_microseconds_total", "Time workers spent blocked in recv"},
+    {"proxy_blocked_send_microseconds_total", "Time workers spent blocked in send"},
+    {"proxy_blocked_connect_microseconds_total", "Time workers spent blocked in connect"},
+    {"proxy_blocked_semaphore_microseconds_total", "Time connections waited for a client slot"},
+    {"proxy_cache_l1_hits_total", "Cache hits answered from a worker's L1 cache"},
+    {"proxy_negative_cache_hits_total", "Requests answered from a cached origin failure"},
+    {"proxy_peer_fetches_total", "Requests sent to the cluster node owning their key"},
+    {"proxy_peer_failures_total", "Requests whose owning node could not be reached"},
+    {"proxy_requests_shed_total", "Requests answered 503 because no client slot freed up in time"},
+    {"proxy_shed_cache_hits_total", "Requests served from the cache without waiting for a client slot"},
+    {"proxy_rate_limited_total", "Requests answered 429 for exceeding a client or host rate limit"},
+    {"proxy_cache_too_large_total", "Cacheable responses streamed without being stored for exceeding max_element_size"},
+};
+
+static const char *histogram_names[H_HISTOGRAMS][2] = {
+    {"proxy_request_duration_seconds", "Time from request headers read to response sent"},
+    {"proxy_upstream_connect_seconds", "Origin name resolution and connect time"},
+    {"proxy_upstream_ttfb_seconds", "Time from request sent to first origin response byte"},
+    {"proxy_cache_lock_wait_seconds", "Time waiting to acquire the cache lock"},
+    {"proxy_cache_lock_hold_seconds", "Time the cache lock was held"},
+    {"proxy_semaphore_wait_seconds", "Time connections waited for a client slot"},
+};
+
+static struct MetricsShard shards[METRICS_MAX_SHARDS];
+static __thread struct MetricsShard *thread_shard;
+static struct metrics_gauge gauges[METRICS_MAX_GAUGES];
+static int ngauges;
+
+void Metrics_bindShard(int slot)
+{
+    thread_shard = &shards[slot + 1];
+}
+
+void Metrics_unbindShard()
+{
+    thread_shard = NULL;
+}
+
+int Metrics_shard()
+{
+    return thread_shard != NULL ? (int)(thread_shard - shards) - 1 : -1;
+}
+
+unsigned long Metrics_shardCounter(int slot, int counter)
+{
+    return __atomic_load_n(&shards[slot + 1].counters[counter], __ATOMIC_RELAXED);
+}
+
+static struct MetricsShard *shard()
+{
+    return thread_shard != NULL ? thread_shard : &shards[0];
+}
+
+void Metrics_add(int counter, unsigned long n)
+{
+    __atomic_fetch_add(&shard()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+int Metrics_bucket(long usec)
+{
+    if (usec < METRICS_SUB_BUCKETS)
+        return usec < 0 ? 0 : (int)usec;
+    int msb = 63 - __builtin_clzl((unsigned long)usec);
+    int sub = (int)((usec >> (msb - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1));
+    int bucket = METRICS_SUB_BUCKETS + (msb - METRICS_SUB_BITS) * METRICS_SUB_BUCKETS + sub;
+    return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+long Metrics_bucketLimit(int bucket)
+{
+    if (bucket < METRICS_SUB_BUCKETS)
+        return bucket + 1;
+    int major = (bucket - METRICS_SUB_BUCKETS) / METRICS_SUB_BUCKETS;
+    int sub = (bucket - METRICS_SUB_BUCKETS) % METRICS_SUB_BUCKETS;
+    return (long)(METRICS_SUB_BUCKETS + sub + 1) << major;
+}
+
+void Metrics_observe(int histogram, long usec)
+{
+    struct MetricsShard *s = shard();
+    __atomic_fetch_add(&s->buckets[histogram][Metrics_bucket(usec)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->sum_us[histogram], usec > 0 ? usec : 0, __ATOMIC_RELAXED);
+}
+
+void Metrics_gauge(const char *name, const char *help, long (*read)())
+{
+    if (ngauges < METRICS_MAX_GAUGES)
+    {
+        gauges[ngauges].name = name;
+        gauges[ngauges].help = help;
+        gauges[ngauges].read = read;
+        ngauges++;
+    }
+}
+
+long Metrics_nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void Metrics_render(const char *method, const char *query, const char *body,
+                    struct AdminReply *reply)
+{
+    (void)method;
+    (void)query;
+    (void)body;
+    reply->content_type = "text/plain; version=0.0.4";
+
+    for (int c = 0; c < M_COUNTERS; c++)
+    {
+        unsigned long total = 0;
+        for (int s = 0; s < METRICS_MAX_SHARDS; s++)
+            total += __atomic_load_n(&shards[s].counters[c], __ATOMIC_RELAXED);
+        Admin_printf(reply, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n",
+                     counter_names[c][0], counter_names[c][1], counter_names[c][0],
+                     counter_names[c][0], total);
+    }
+
+    for (int g = 0; g < ngauges; g++)
+    {
+        Admin_printf(reply, "# HELP %s %s\n# TYPE %s gauge\n%s %ld\n",
+                     gauges[g].name, gauges[g].help, gauges[g].name, gauges[g].name, gauges[g].read());
+    }
+
+    for (int h = 0; h < H_HISTOGRAMS; h++)
+    {
+        const char *name = histogram_names[h][0];
+        unsigned long merged[METRICS_BUCKETS];
+        unsigned long sum = 0;
+
+        memset(merged, 0, sizeof(merged));
+        for (int s = 0; s < METRICS_MAX_SHARDS; s++)
+        {
+            for (int b = 0; b < METRICS_BUCKETS; b++)
+                merged[b] += __atomic_load_n(&shards[s].buckets[h][b], __ATOMIC_RELAXED);
+            sum += __atomic_load_n(&shards[s].sum_us[h], __ATOMIC_RELAXED);
+        }
+
+        Admin_printf(reply, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_names[h][1], name);
+        unsigned long cumulative = 0;
+        for (int b = 0; b < METRICS_BUCKETS; b++)
+        {
+            cumulative += merged[b];
+            Admin_printf(reply, "%s_bucket{le=\"%g\"} %lu\n", name, Metrics_bucketLimit(b) / 1e6, cumulative);
+        }
+        Admin_printf(reply, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %g\n%s_count %lu\n",
+                     name, cumulative, name, sum / 1e6, name, cumulative);
+    }
+}
@@ -0,0 +1,90 @@
+/*
+ * metrics.h -- counters and latency histograms, exported in Prometheus
+ * text format.
+ *
+ * Updates go to a shard owned by the worker slot the calling thread holds,
+ * so workers never write to the same cache line; a scrape sums all shards.
+ * Histograms use HDR-style log-linear buckets: every power of two of
+ * microseconds is split into METRICS_SUB_BUCKETS equal buckets, which keeps
+ * the relative error of any quantile under 25% from 1us to ~35 minutes.
+ */
+
+#ifndef PROXY_METRICS
+#define PROXY_METRICS
+
+#include "admin.h"
+
+#define METRICS_MAX_SHARDS 64 // shard 0 is shared by threads without a slot
+#define METRICS_SUB_BITS 2
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS (METRICS_SUB_BUCKETS + 29 * METRICS_SUB_BUCKETS) // up to 2^31us
+
+enum MetricsCounter
+{
+    M_REQUESTS,         // requests received
+    M_CACHE_HITS,       // answered from the cache
+    M_CACHE_MISSES,     // cacheable lookups that went to the origin
+    M_CACHE_BYPASS,     // requests that never consult the cache
+    M_BYTES_FROM_CACHE, // response bytes sent from the cache
+    M_BYTES_FROM_ORIGIN,// response bytes relayed from origins
+    M_CACHE_EVICTIONS,  // entries evicted to make room
+    M_ORIGIN_ERRORS,    // origins that could not be reached
+    M_BLOCKED_RECV_US,  // time blocked in recv(), in this order as enum ProfBlocked
+    M_BLOCKED_SEND_US,  // ... in send()
+    M_BLOCKED_CONNECT_US,// ... in connect()
+    M_BLOCKED_SEMAPHORE_US,// ... waiting for a client slot
+    M_CACHE_L1_HITS,    // cache hits answered from the worker's L1 cache
+    M_NEGATIVE_HITS,    // requests answered from a cached failure
+    M_PEER_FETCHES,     // requests sent to the cluster node owning their key
+    M_PEER_FAILURES,    // owners that could not be reached, the origin was asked instead
+    M_SHED,             // requests answered 503 after giving up on a client slot
+    M_SHED_HITS,        // requests that gave up on a client slot and hit the cache
+    M_RATE_LIMITED,     // requests answered 429
+    M_CACHE_TOO_LARGE,  // cacheable responses streamed uncached for exceeding max_element_size
+    M_COUNTERS
+};
+
+enum MetricsHistogram
+{
+    H_REQUEST,         // whole request, headers read to response sent
+    H_UPSTREAM_CONNECT,// name resolution and connect to the origin
+    H_TTFB,            // request sent to first response byte from the origin
+    H_CACHE_LOCK_WAIT, // waiting to acquire the cache lock
+    H_CACHE_LOCK_HOLD, // cache lock held
+    H_SEMAPHORE_WAIT,  // waiting for a client slot
+    H_HISTOGRAMS
+};
+
+/* Make the calling thread update shard slot (0 <= slot < METRICS_MAX_SHARDS - 1) */
+void Metrics_bindShard(int slot);
+
+/* Detach the calling thread from its shard */
+void Metrics_unbindShard();
+
+/* Slot of the calling thread's shard, -1 if it has none */
+int Metrics_shard();
+
+/* Value of a counter in the shard of slot (-1 for the shared shard) */
+unsigned long Metrics_shardCounter(int slot, int counter);
+
+/* Add n to a counter */
+void Metrics_add(int counter, unsigned long n);
+
+/* Record a duration in microseconds in a histogram */
+void Metrics_observe(int histogram, long usec);
+
+/* Export a gauge computed at scrape time */
+void Metrics_gauge(const char *name, const char *help, long (*read)());
+
+/* Monotonic clock in microseconds */
+long Metrics_nowUs();
+
+/* Bucket of a value and the (exclusive) upper bound of a bucket, in us */
+int Metrics_bucket(long usec);
+long Metrics_bucketLimit(int bucket);
+
+/* Admin handler writing every metric in Prometheus text format */
+void Metrics_render(const char *method, const char *query, const char *body,
+                    struct AdminReply *reply);
+
+#endif
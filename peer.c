@@ -0,0 +1,156 @@
+/*
+  peer.c -- cooperative caching between proxy nodes (cluster mode).
+*/
+
+#include "peer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+struct RingPoint
+{
+    unsigned long hash;
+    int node;
+};
+
+struct HotKey
+{
+    unsigned long hash;
+    int misses;
+    time_t since;
+};
+
+// Nodes are only added at startup, before any worker runs
+static struct PeerNode nodes[PEER_MAX_NODES];
+static int nnodes;
+static struct RingPoint ring[PEER_MAX_NODES * PEER_VNODES];
+static int npoints;
+static char self_name[300];
+static struct HotKey hot_keys[PEER_HOT_KEYS];
+static pthread_mutex_t hot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* 64-bit FNV-1a, finished with a mix so that nearby names spread over the ring */
+static unsigned long hash_string(const char *s)
+{
+    unsigned long h = 1469598103934665603UL;
+    for (; *s; s++)
+        h = (h ^ (unsigned char)*s) * 1099511628211UL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int compare_points(const void *a, const void *b)
+{
+    unsigned long x = ((const struct RingPoint *)a)->hash, y = ((const struct RingPoint *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+static void add_node(const char *host, size_t host_len, int port, int self)
+{
+    struct PeerNode *node = &nodes[nnodes];
+    memcpy(node->host, host, host_len);
+    node->host[host_len] = '\0';
+    node->port = port;
+    node->self = self;
+    for (int i = 0; i < PEER_VNODES; i++)
+    {
+        char point[300];
+        snprintf(point, sizeof(point), "%s:%d#%d", node->host, port, i);
+        ring[npoints].hash = hash_string(point);
+        ring[npoints].node = nnodes;
+        npoints++;
+    }
+    nnodes++;
+    qsort(ring, npoints, sizeof(struct RingPoint), compare_points);
+}
+
+int Peer_add(const char *spec)
+{
+    const char *colon = strrchr(spec, ':');
+    if (colon == NULL || nnodes == PEER_MAX_NODES - 1 || (size_t)(colon - spec) >= sizeof(nodes[0].host))
+        return -1;
+    int port = atoi(colon + 1);
+    if (colon == spec || port <= 0 || port > 65535)
+        return -1;
+    add_node(spec, colon - spec, port, 0);
+    return 0;
+}
+
+int Peer_setSelf(const char *host, int port)
+{
+    if (strlen(host) >= sizeof(nodes[0].host))
+        return -1;
+    snprintf(self_name, sizeof(self_name), "%s:%d", host, port);
+    add_node(host, strlen(host), port, 1);
+    return 0;
+}
+
+int Peer_count()
+{
+    return nnodes > 0 ? nnodes - 1 : 0;
+}
+
+const char *Peer_selfName()
+{
+    return self_name;
+}
+
+struct PeerNode *Peer_owner(const char *key)
+{
+    unsigned long hash = hash_string(key);
+    int total = 0;
+    for (int i = 0; i < nnodes; i++)
+        total += __atomic_load_n(&nodes[i].active, __ATOMIC_RELAXED);
+    // ceil(c * (load + 1) / n): the request being placed counts too; c is taken in hundredths
+    long factor = (long)(PEER_LOAD_FACTOR * 100 + 0.5);
+    int limit = (int)((factor * (total + 1) + 100L * nnodes - 1) / (100L * nnodes));
+
+    // First point at or after the key's hash, wrapping around
+    int lo = 0, hi = npoints;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    struct PeerNode *owner = &nodes[ring[lo % npoints].node];
+    for (int i = 0; i < npoints; i++)
+    {
+        struct PeerNode *node = &nodes[ring[(lo + i) % npoints].node];
+        if (__atomic_load_n(&node->active, __ATOMIC_RELAXED) < limit)
+        {
+            owner = node;
+            break;
+        }
+    }
+    __atomic_add_fetch(&owner->active, 1, __ATOMIC_RELAXED);
+    return owner;
+}
+
+void Peer_release(struct PeerNode *node)
+{
+    __atomic_sub_fetch(&node->active, 1, __ATOMIC_RELAXED);
+}
+
+int Peer_hot(const char *key)
+{
+    unsigned long hash = hash_string(key);
+    struct HotKey *k = &hot_keys[hash % PEER_HOT_KEYS];
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&hot_lock);
+    if (k->hash != hash || now - k->since >= PEER_HOT_WINDOW)
+    {
+        k->hash = hash;
+        k->misses = 0;
+        k->since = now;
+    }
+    int hot = ++k->misses >= PEER_HOT_MISSES;
+    pthread_mutex_unlock(&hot_lock);
+    return hot;
+}
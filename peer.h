@@ -0,0 +1,60 @@
+/*
+ * peer.h -- cooperative caching between proxy nodes (cluster mode).
+ *
+ * With -P, the nodes of a cluster share one consistent-hash ring: every
+ * node, this one included, gets PEER_VNODES points on it, placed by hashing
+ * its address, so all nodes agree on the ring without talking to each
+ * other. A cache key belongs to the first node clockwise from the key's
+ * hash whose load stays under PEER_LOAD_FACTOR times the average (consistent
+ * hashing with bounded loads); the load of a node is the number of requests
+ * this node has in flight to it. A request missing the cache on a node that
+ * does not own its key is sent through the owner, marked with PEER_HEADER so
+ * the owner serves it itself. The owner caches the response; the other node
+ * only keeps a replica, for PEER_REPLICA_TTL seconds, of keys that missed
+ * on it PEER_HOT_MISSES times within PEER_HOT_WINDOW seconds.
+ */
+
+#include <time.h>
+
+#ifndef PROXY_PEER
+#define PROXY_PEER
+
+#define PEER_MAX_NODES 16       // nodes in a cluster, this one included
+#define PEER_VNODES 64          // ring points per node
+#define PEER_LOAD_FACTOR 1.25   // most load a node takes, relative to the average
+#define PEER_HOT_MISSES 3       // misses making a key hot enough to replicate
+#define PEER_HOT_WINDOW 10      // seconds misses of a key are counted over
+#define PEER_HOT_KEYS 4096      // keys whose misses are counted
+#define PEER_REPLICA_TTL 30     // seconds a replica of a peer's object is served
+#define PEER_HEADER "X-Proxy-Peer" // marks requests sent by a peer, names the sender
+
+struct PeerNode
+{
+    char host[256];
+    int port;
+    int self;   // this node
+    int active; // requests in flight to it (atomic)
+};
+
+/* Add a node given as "host:port"; returns -1 on a bad spec or a full cluster */
+int Peer_add(const char *spec);
+
+/* Name this node on the ring as host:port, as the other nodes list it; call after Peer_add */
+int Peer_setSelf(const char *host, int port);
+
+/* Number of other nodes, 0 unless running in cluster mode */
+int Peer_count();
+
+/* "host:port" of this node */
+const char *Peer_selfName();
+
+/* Owner of key under bounded loads, counting a request in flight to it */
+struct PeerNode *Peer_owner(const char *key);
+
+/* End a request counted by Peer_owner */
+void Peer_release(struct PeerNode *node);
+
+/* Count a miss of key fetched from a peer; 1 if the key is now hot enough to replicate */
+int Peer_hot(const char *key);
+
+#endif
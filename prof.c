@@ -0,0 +1,147 @@
+/*
+  prof.c -- lock contention and off-CPU accounting.
+*/
+
+#include "prof.h"
+#include <string.h>
+#include <errno.h>
+
+static struct ProfLock *locks[PROF_MAX_LOCKS];
+static int nlocks;
+static pthread_mutex_t locks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *blocked_names[PROF_BLOCKED_KINDS] = {"recv", "send", "connect", "semaphore"};
+
+/* Statistics of site in l, added on first use; the caller holds l */
+static struct ProfSite *site_of(struct ProfLock *l, const char *site)
+{
+    for (int i = 0; i < l->nsites; i++)
+    {
+        if (l->sites[i].name == site || !strcmp(l->sites[i].name, site))
+            return &l->sites[i];
+    }
+    if (l->nsites == PROF_MAX_SITES)
+        return &l->sites[PROF_MAX_SITES - 1]; // the last site collects the overflow
+    struct ProfSite *s = &l->sites[l->nsites];
+    s->name = site;
+    __atomic_store_n(&l->nsites, l->nsites + 1, __ATOMIC_RELEASE);
+    return s;
+}
+
+int Prof_lock(struct ProfLock *l, const char *site)
+{
+    long waited = 0;
+    int contended = 0;
+    const char *blamed = NULL;
+    int ret = pthread_mutex_trylock(&l->mutex);
+    if (ret == EBUSY)
+    {
+        contended = 1;
+        blamed = __atomic_load_n(&l->holder, __ATOMIC_RELAXED);
+        long started = Metrics_nowUs();
+        ret = pthread_mutex_lock(&l->mutex);
+        waited = Metrics_nowUs() - started;
+        PROF_PROBE3(lock_wait, l->name, site, waited);
+    }
+    if (ret != 0)
+        return ret;
+
+    // Everything below is guarded by l itself
+    if (!l->registered)
+    {
+        pthread_mutex_lock(&locks_lock);
+        if (nlocks < PROF_MAX_LOCKS)
+            locks[nlocks++] = l;
+        pthread_mutex_unlock(&locks_lock);
+        l->registered = 1;
+    }
+    struct ProfSite *s = site_of(l, site);
+    s->acquisitions++;
+    if (contended)
+    {
+        s->contended++;
+        s->wait_us += waited;
+        if (blamed != NULL)
+            site_of(l, blamed)->blamed_us += waited;
+    }
+    Metrics_observe(l->wait_histogram, waited);
+
+    l->held_since = Metrics_nowUs();
+    l->holder_slot = Metrics_shard();
+    __atomic_store_n(&l->holder, site, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int Prof_unlock(struct ProfLock *l)
+{
+    long held = Metrics_nowUs() - l->held_since;
+    struct ProfSite *s = site_of(l, l->holder);
+    s->hold_us += held;
+    if ((unsigned long)held > s->max_hold_us)
+        s->max_hold_us = held;
+    Metrics_observe(l->hold_histogram, held);
+    PROF_PROBE3(lock_hold, l->name, l->holder, held);
+    __atomic_store_n(&l->holder, (const char *)NULL, __ATOMIC_RELAXED);
+    return pthread_mutex_unlock(&l->mutex);
+}
+
+void Prof_blocked(int kind, long us)
+{
+    if (us > 0)
+        Metrics_add(M_BLOCKED_RECV_US + kind, us);
+    PROF_PROBE2(blocked, kind, us);
+}
+
+void Prof_render(const char *method, const char *query, const char *body,
+                 struct AdminReply *reply)
+{
+    (void)method;
+    (void)query;
+    (void)body;
+    long now = Metrics_nowUs();
+
+    // Lock statistics are read without the lock, so a row may be a few updates behind
+    pthread_mutex_lock(&locks_lock);
+    for (int i = 0; i < nlocks; i++)
+    {
+        struct ProfLock *l = locks[i];
+        const char *holder = __atomic_load_n(&l->holder, __ATOMIC_RELAXED);
+        if (holder != NULL)
+            Admin_printf(reply, "lock %s: held by %s (worker %d) for %ld us\n", l->name, holder,
+                         l->holder_slot, now - l->held_since);
+        else
+            Admin_printf(reply, "lock %s: free\n", l->name);
+        Admin_printf(reply, "  %-24s %12s %10s %12s %12s %12s %14s\n", "site", "acquisitions", "contended",
+                     "wait_us", "hold_us", "max_hold_us", "blamed_wait_us");
+        int nsites = __atomic_load_n(&l->nsites, __ATOMIC_ACQUIRE);
+        for (int j = 0; j < nsites; j++)
+        {
+            struct ProfSite *s = &l->sites[j];
+            Admin_printf(reply, "  %-24s %12lu %10lu %12lu %12lu %12lu %14lu\n", s->name, s->acquisitions,
+                         s->contended, s->wait_us, s->hold_us, s->max_hold_us, s->blamed_us);
+        }
+        Admin_printf(reply, "\n");
+    }
+    pthread_mutex_unlock(&locks_lock);
+
+    Admin_printf(reply, "blocked time per worker (us)\n  %-8s", "worker");
+    for (int k = 0; k < PROF_BLOCKED_KINDS; k++)
+        Admin_printf(reply, " %14s", blocked_names[k]);
+    Admin_printf(reply, "\n");
+    for (int slot = -1; slot < METRICS_MAX_SHARDS - 1; slot++)
+    {
+        unsigned long values[PROF_BLOCKED_KINDS];
+        unsigned long total = 0;
+        for (int k = 0; k < PROF_BLOCKED_KINDS; k++)
+            total += values[k] = Metrics_shardCounter(slot, M_BLOCKED_RECV_US + k);
+        if (total == 0)
+            continue;
+        if (slot < 0)
+            Admin_printf(reply, "  %-8s", "none");
+        else
+            Admin_printf(reply, "  %-8d", slot);
+        for (int k = 0; k < PROF_BLOCKED_KINDS; k++)
+            Admin_printf(reply, " %14lu", values[k]);
+        Admin_printf(reply, "\n");
+    }
+}
@@ -0,0 +1,101 @@
+/*
+ * prof.h -- lock contention and off-CPU accounting.
+ *
+ * A ProfLock is a mutex that records, per call site, how long each
+ * acquisition waited and how long the lock was then held. It also
+ * remembers which site holds it, so a waiter's time is blamed on the site
+ * it waited for. Time that workers spend blocked in recv/send/connect and
+ * on the client semaphore is added to per-worker counters. Results go to
+ * Prometheus histograms and counters and to the admin /contention page.
+ * When built with <sys/sdt.h>, they also fire USDT probes under provider
+ * "proxy" (see PROF_PROBE below).
+ */
+
+#include "metrics.h"
+#include <pthread.h>
+
+#ifndef PROXY_PROF
+#define PROXY_PROF
+
+#define PROF_MAX_SITES 16 // call sites tracked per lock
+#define PROF_MAX_LOCKS 8
+
+/* Statistics of one call site of a ProfLock */
+struct ProfSite
+{
+    const char *name;
+    unsigned long acquisitions;
+    unsigned long contended;   // acquisitions that had to wait
+    unsigned long wait_us;     // time this site waited
+    unsigned long hold_us;     // time this site held the lock
+    unsigned long max_hold_us;
+    unsigned long blamed_us;   // time others waited while this site held the lock
+};
+
+struct ProfLock
+{
+    pthread_mutex_t mutex;
+    const char *name;
+    int wait_histogram; // metrics histograms of wait and hold times
+    int hold_histogram;
+    const char *holder; // site holding the lock, NULL when free
+    int holder_slot;    // worker slot of the holder, -1 if it has none
+    long held_since;
+    int registered;     // listed on the /contention page
+    int nsites;
+    struct ProfSite sites[PROF_MAX_SITES];
+};
+
+#define PROF_LOCK_INITIALIZER(name, wait_histogram, hold_histogram) \
+    {PTHREAD_MUTEX_INITIALIZER, name, wait_histogram, hold_histogram, NULL, -1, 0, 0, 0, {}}
+
+enum ProfBlocked
+{
+    PROF_RECV,
+    PROF_SEND,
+    PROF_CONNECT,
+    PROF_SEMAPHORE,
+    PROF_BLOCKED_KINDS
+};
+
+/*
+   USDT probes, e.g. `bpftrace -e 'usdt:./proxy:proxy:lock_wait { @[str(arg1)] = hist(arg2); }'`:
+     proxy:lock_wait(lock, site, wait_us)     an acquisition that had to wait
+     proxy:lock_hold(lock, site, hold_us)     a release
+     proxy:blocked(kind, us)                  a blocking call (enum ProfBlocked)
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROF_PROBE2(name, a, b) DTRACE_PROBE2(proxy, name, a, b)
+#define PROF_PROBE3(name, a, b, c) DTRACE_PROBE3(proxy, name, a, b, c)
+#endif
+#endif
+#ifndef PROF_PROBE2
+#define PROF_PROBE2(name, a, b) ((void)0)
+#define PROF_PROBE3(name, a, b, c) ((void)0)
+#endif
+
+/* Lock l from call site site (a string literal); returns the pthread result */
+int Prof_lock(struct ProfLock *l, const char *site);
+
+/* Unlock l, charging the hold time to the site that locked it */
+int Prof_unlock(struct ProfLock *l);
+
+/* Charge us microseconds blocked in kind to the calling worker */
+void Prof_blocked(int kind, long us);
+
+/* Evaluate a blocking call and charge its duration to kind */
+#define PROF_BLOCKING(kind, call)                    \
+    ({                                               \
+        long prof_started_ = Metrics_nowUs();        \
+        __typeof__(call) prof_ret_ = (call);         \
+        Prof_blocked(kind, Metrics_nowUs() - prof_started_); \
+        prof_ret_;                                   \
+    })
+
+/* Admin handler: per lock and per site contention, per worker blocked time */
+void Prof_render(const char *method, const char *query, const char *body,
+                 struct AdminReply *reply);
+
+#endif
@@ -6,7 +6,6 @@
 #include "proxy_parse.h"
 
 #define DEFAULT_NHDRS 8
-#define MAX_REQ_LEN 65535
 #define MIN_REQ_LEN 4
 
 static const char *root_abs_path = "/";
@@ -18,14 +17,21 @@ int ParsedRequest_printRequestLine(struct ParsedRequest *pr,
 size_t ParsedRequest_requestLineLen(struct ParsedRequest *pr);
 
 /*
- * debug() prints out debugging info if DEBUG is set to 1
+ * debug() hands debugging info to debug_hook, or prints it out if DEBUG
+ * is set to 1
  *
  * parameter format: same as printf 
  *
  */
+void (*debug_hook)(const char *format, va_list args) = NULL;
+
 void debug(const char * format, ...) {
      va_list args;
-     if (DEBUG) {
+     if (debug_hook) {
+	  va_start(args, format);
+	  debug_hook(format, args);
+	  va_end(args);
+     } else if (DEBUG) {
 	  va_start(args, format);
 	  vfprintf(stderr, format, args);
 	  va_end(args);
@@ -79,7 +85,7 @@ struct ParsedHeader* ParsedHeader_get(struct ParsedRequest *pr,
      while(pr->headersused > i)
      {
 	  tmp = pr->headers + i;
-	  if(tmp->key && key && strcmp(tmp->key, key) == 0)
+	  if(tmp->key && key && strcasecmp(tmp->key, key) == 0)
 	  {
 	       return tmp;
 	  }
@@ -247,6 +253,18 @@ int ParsedHeader_parse(struct ParsedRequest * pr, char * line)
      memcpy(value, index1, (index2-index1));
      value[index2-index1] = '\0';
 
+     /* Only the last of repeated headers is kept, so Content-Lengths that
+	disagree would frame the body one way here and another upstream */
+     struct ParsedHeader *length = ParsedHeader_get(pr, key);
+     if (length != NULL && strcasecmp(key, "Content-Length") == 0 &&
+	 strcmp(length->value, value) != 0)
+     {
+	  debug("Conflicting Content-Length headers\n");
+	  free(key);
+	  free(value);
+	  return -1;
+     }
+
      ParsedHeader_set(pr, key, value);
      free(key);
      free(value);
@@ -257,6 +275,19 @@ int ParsedHeader_parse(struct ParsedRequest * pr, char * line)
   ParsedRequest Public Methods
 */
 
+/* A method is an RFC 7230 token; we only accept the upper case ones */
+int ParsedRequest_validMethod(const char *method)
+{
+     const char *c;
+     if (method == NULL || *method == '\0')
+	  return 0;
+     for (c = method; *c; c++) {
+	  if (!isupper((unsigned char)*c))
+	       return 0;
+     }
+     return 1;
+}
+
 void ParsedRequest_destroy(struct ParsedRequest *pr)
 {
      if(pr->buf != NULL)
@@ -288,6 +319,7 @@ struct ParsedRequest* ParsedRequest_create()
 	  pr->version = NULL;
 	  pr->buf = NULL;
 	  pr->buflen = 0;
+	  pr->origin_form = 0;
      }
      return pr;
 }
@@ -335,6 +367,195 @@ size_t ParsedRequest_totalLen(struct ParsedRequest *pr)
 }
 
 
+/*
+   Parse an absolute-form request target ("http://host[:port]/path") into
+   protocol, host, port and path. On failure the partially parsed request is
+   released along with tmp_buf, as ParsedRequest_parse does.
+*/
+static int
+ParsedRequest_parseAbsoluteURI(struct ParsedRequest *parse, char *full_addr,
+			       char *tmp_buf)
+{
+     char *saveptr;
+
+     parse->protocol = strtok_r(full_addr, "://", &saveptr);
+     if (parse->protocol == NULL) {
+	  debug( "invalid request line, missing host\n");
+	  free(tmp_buf);
+	  free(parse->buf);
+	  parse->buf = NULL;
+	  return -1;
+     }
+     
+     const char *rem = full_addr + strlen(parse->protocol) + strlen("://");
+     size_t abs_uri_len = strlen(rem);
+
+     parse->host = strtok_r(NULL, "/", &saveptr);
+     if (parse->host == NULL) {
+	  debug( "invalid request line, missing host\n");
+	  free(tmp_buf);
+	  free(parse->buf);
+	  parse->buf = NULL;
+	  return -1;
+     }
+     
+     if (strlen(parse->host) == abs_uri_len) {
+	  debug("invalid request line, missing absolute path\n");
+	  free(tmp_buf);
+	  free(parse->buf);
+	  parse->buf = NULL;
+	  return -1;
+     }
+
+     parse->path = strtok_r(NULL, " ", &saveptr);
+     if (parse->path == NULL) {          // replace empty abs_path with "/"
+	  int rlen = strlen(root_abs_path);
+	  parse->path = (char *)malloc(rlen + 1);
+	  strncpy(parse->path, root_abs_path, rlen + 1);
+     } else if (strncmp(parse->path, root_abs_path, strlen(root_abs_path)) == 0) {
+	  debug("invalid request line, path cannot begin "
+		"with two slash characters\n");
+	  free(tmp_buf);
+	  free(parse->buf);
+	  parse->buf = NULL;
+	  parse->path = NULL;
+	  return -1;
+     } else {
+	  // copy parse->path, prefix with a slash
+	  char *tmp_path = parse->path;
+	  int rlen = strlen(root_abs_path);
+	  int plen = strlen(parse->path);
+	  parse->path = (char *)malloc(rlen + plen + 1);
+	  strncpy(parse->path, root_abs_path, rlen);
+	  strncpy(parse->path + rlen, tmp_path, plen + 1);
+     }
+
+     parse->host = strtok_r(parse->host, ":", &saveptr);
+     parse->port = strtok_r(NULL, "/", &saveptr);
+
+     if (parse->host == NULL) {
+	  debug( "invalid request line, missing host\n");
+	  free(tmp_buf);
+	  free(parse->buf);
+	  free(parse->path);
+	  parse->buf = NULL;
+	  parse->path = NULL;
+	  return -1;
+     }
+
+     if (parse->port != NULL) {
+	  int port = strtol (parse->port, (char **)NULL, 10);
+	  if (port == 0 && errno == EINVAL) {
+	       debug("invalid request line, bad port: %s\n", parse->port);
+	       free(tmp_buf);
+	       free(parse->buf);
+	       free(parse->path);
+	       parse->buf = NULL;
+	       parse->path = NULL;
+	       return -1;
+	  }
+     }
+     return 0;
+}
+
+/*
+   Parse an origin-form request target ("/path"), as sent to a reverse
+   proxy. The host and port are taken from the Host header and copied into
+   parse->buf behind the request line, which was sized for it.
+*/
+static int
+ParsedRequest_parseOriginForm(struct ParsedRequest *parse, char *full_addr,
+			      char *tmp_buf, const char *host_hdr,
+			      size_t host_len)
+{
+     char *saveptr;
+     char *host_copy;
+
+     if (host_hdr == NULL || host_len == 0) {
+	  debug("invalid request, origin-form target without Host\n");
+	  free(tmp_buf);
+	  free(parse->buf);
+	  parse->buf = NULL;
+	  return -1;
+     }
+
+     /* request line tokens were NUL separated in place, so skip past them */
+     host_copy = parse->version + strlen(parse->version) + 1;
+     memcpy(host_copy, host_hdr, host_len);
+     host_copy[host_len] = '\0';
+
+     parse->origin_form = 1;
+     parse->protocol = (char *)"http";
+     parse->host = strtok_r(host_copy, ":", &saveptr);
+     parse->port = strtok_r(NULL, "", &saveptr);
+
+     if (parse->port != NULL) {
+	  int port = strtol (parse->port, (char **)NULL, 10);
+	  if (port <= 0 || port > 65535) {
+	       debug("invalid Host header, bad port: %s\n", parse->port);
+	       free(tmp_buf);
+	       free(parse->buf);
+	       parse->buf = NULL;
+	       return -1;
+	  }
+     }
+
+     parse->path = (char *)malloc(strlen(full_addr) + 1);
+     strcpy(parse->path, full_addr);
+     return 0;
+}
+
+/*
+   Parse an authority-form request target ("host:port"), only used by
+   CONNECT. There is no protocol or path; both are left NULL.
+*/
+static int
+ParsedRequest_parseAuthority(struct ParsedRequest *parse, char *full_addr,
+			     char *tmp_buf)
+{
+     char *saveptr;
+     int port = 0;
+
+     parse->host = strtok_r(full_addr, ":", &saveptr);
+     parse->port = strtok_r(NULL, "", &saveptr);
+     if (parse->port != NULL)
+	  port = strtol (parse->port, (char **)NULL, 10);
+
+     if (parse->host == NULL || port <= 0 || port > 65535) {
+	  debug("invalid CONNECT target %s\n", full_addr);
+	  free(tmp_buf);
+	  free(parse->buf);
+	  parse->buf = NULL;
+	  return -1;
+     }
+     return 0;
+}
+
+/*
+   Locate the value of the Host header in a NUL terminated request buffer.
+   Returns NULL if there is none, otherwise stores the value length in *len.
+*/
+static const char *
+ParsedRequest_findHost(const char *tmp_buf, size_t *len)
+{
+     const char *line = strstr(tmp_buf, "\r\n");
+     while (line != NULL && line[2] != '\r' && line[2] != '\0') {
+	  line += 2;
+	  if (strncasecmp(line, "Host:", 5) == 0) {
+	       const char *value = line + 5;
+	       while (*value == ' ' || *value == '\t')
+		    value++;
+	       const char *end = strstr(value, "\r\n");
+	       *len = end - value;
+	       while (*len > 0 && (value[*len - 1] == ' ' || value[*len - 1] == '\t'))
+		    (*len)--;
+	       return value;
+	  }
+	  line = strstr(line, "\r\n");
+     }
+     return NULL;
+}
+
 /* 
    Parse request buffer
  
@@ -379,10 +600,13 @@ ParsedRequest_parse(struct ParsedRequest * parse, const char *buf,
 	  return -1;
      }
    
-     /* Copy request line into parse->buf */
+     /* Copy request line into parse->buf, leaving room for a copy of the
+	Host header in case the target is in origin-form */
+     size_t host_len = 0;
+     const char *host_hdr = ParsedRequest_findHost(tmp_buf, &host_len);
      index = strstr(tmp_buf, "\r\n");
      if (parse->buf == NULL) {
-	  parse->buf = (char *) malloc((index-tmp_buf)+1);
+	  parse->buf = (char *) malloc((index-tmp_buf)+1+host_len+1);
 	  parse->buflen = (index-tmp_buf)+1;
      }
      memcpy(parse->buf, tmp_buf, index-tmp_buf);
@@ -397,8 +621,8 @@ ParsedRequest_parse(struct ParsedRequest * parse, const char *buf,
 	  parse->buf = NULL;
 	  return -1;
      }
-     if (strcmp (parse->method, "GET")) {
-	  debug( "invalid request line, method not 'GET': %s\n", 
+     if (!ParsedRequest_validMethod(parse->method)) {
+	  debug( "invalid request line, bad method token: %s\n", 
 		 parse->method);
 	  free(tmp_buf);
 	  free(parse->buf);
@@ -435,85 +659,18 @@ ParsedRequest_parse(struct ParsedRequest * parse, const char *buf,
      }
 
 
-     parse->protocol = strtok_r(full_addr, "://", &saveptr);
-     if (parse->protocol == NULL) {
-	  debug( "invalid request line, missing host\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
-	  return -1;
-     }
-     
-     const char *rem = full_addr + strlen(parse->protocol) + strlen("://");
-     size_t abs_uri_len = strlen(rem);
-
-     parse->host = strtok_r(NULL, "/", &saveptr);
-     if (parse->host == NULL) {
-	  debug( "invalid request line, missing host\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
-	  return -1;
-     }
-     
-     if (strlen(parse->host) == abs_uri_len) {
-	  debug("invalid request line, missing absolute path\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
-	  return -1;
-     }
-
-     parse->path = strtok_r(NULL, " ", &saveptr);
-     if (parse->path == NULL) {          // replace empty abs_path with "/"
-	  int rlen = strlen(root_abs_path);
-	  parse->path = (char *)malloc(rlen + 1);
-	  strncpy(parse->path, root_abs_path, rlen + 1);
-     } else if (strncmp(parse->path, root_abs_path, strlen(root_abs_path)) == 0) {
-	  debug("invalid request line, path cannot begin "
-		"with two slash characters\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
-	  parse->path = NULL;
-	  return -1;
-     } else {
-	  // copy parse->path, prefix with a slash
-	  char *tmp_path = parse->path;
-	  int rlen = strlen(root_abs_path);
-	  int plen = strlen(parse->path);
-	  parse->path = (char *)malloc(rlen + plen + 1);
-	  strncpy(parse->path, root_abs_path, rlen);
-	  strncpy(parse->path + rlen, tmp_path, plen + 1);
-     }
-
-     parse->host = strtok_r(parse->host, ":", &saveptr);
-     parse->port = strtok_r(NULL, "/", &saveptr);
-
-     if (parse->host == NULL) {
-	  debug( "invalid request line, missing host\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  free(parse->path);
-	  parse->buf = NULL;
-	  parse->path = NULL;
-	  return -1;
-     }
-
-     if (parse->port != NULL) {
-	  int port = strtol (parse->port, (char **)NULL, 10);
-	  if (port == 0 && errno == EINVAL) {
-	       debug("invalid request line, bad port: %s\n", parse->port);
-	       free(tmp_buf);
-	       free(parse->buf);
-	       free(parse->path);
-	       parse->buf = NULL;
-	       parse->path = NULL;
+     if (strcmp(parse->method, "CONNECT") == 0) {
+	  if (ParsedRequest_parseAuthority(parse, full_addr, tmp_buf) < 0)
 	       return -1;
-	  }
+     } else if (full_addr[0] == '/') {
+	  if (ParsedRequest_parseOriginForm(parse, full_addr, tmp_buf,
+					    host_hdr, host_len) < 0)
+	       return -1;
+     } else if (ParsedRequest_parseAbsoluteURI(parse, full_addr,
+					       tmp_buf) < 0) {
+	  return -1;
      }
 
-   
      /* Parse headers */
      int ret = 0;
      currentHeader = strstr(tmp_buf, "\r\n")+2;
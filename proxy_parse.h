@@ -13,11 +13,17 @@
 #include <errno.h>
 
 #include <ctype.h>
+#include <strings.h>
 
 #ifndef PROXY_PARSE
 #define PROXY_PARSE
 
-#define DEBUG 1
+#ifndef DEBUG
+#define DEBUG 0
+#endif
+
+/* Largest request (line + headers) ParsedRequest_parse accepts */
+#define MAX_REQ_LEN (1 << 20)
 
 /* 
    ParsedRequest objects are created from parsing a buffer containing a HTTP
@@ -42,6 +48,8 @@ struct ParsedRequest {
      struct ParsedHeader *headers;
      size_t headersused;
      size_t headerslen;
+     int origin_form;		/* target was "/path", host and port come from
+				   the Host header (reverse proxy requests) */
 };
 
 /* 
@@ -65,6 +73,9 @@ struct ParsedRequest* ParsedRequest_create();
 int ParsedRequest_parse(struct ParsedRequest * parse, const char *buf,
 			int buflen);
 
+/* Returns 1 if method is a well formed request method token, 0 otherwise */
+int ParsedRequest_validMethod(const char *method);
+
 /* Destroy the parsing object. */
 void ParsedRequest_destroy(struct ParsedRequest *pr);
 
@@ -95,15 +106,18 @@ size_t ParsedRequest_totalLen(struct ParsedRequest *pr);
  */
 size_t ParsedHeader_headersLen(struct ParsedRequest *pr);
 
-/* Set, get, and remove null-terminated header keys and values */
+/* Set, get, and remove null-terminated header keys and values. Keys are
+ * matched case-insensitively. */
 int ParsedHeader_set(struct ParsedRequest *pr, const char * key, 
 		      const char * value);
 struct ParsedHeader* ParsedHeader_get(struct ParsedRequest *pr, 
 				      const char * key);
 int ParsedHeader_remove (struct ParsedRequest *pr, const char * key);
 
-/* debug() prints out debugging info if DEBUG is set to 1 */
+/* debug() passes debugging info to debug_hook if set, or prints it to
+ * stderr if DEBUG is set to 1 */
 void debug(const char * format, ...);
+extern void (*debug_hook)(const char *format, va_list args);
 
 /* Example usage:
 
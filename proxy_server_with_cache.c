@@ -1,4 +1,22 @@
 #include "proxy_parse.h"
+#include "chunked.h"
+#include "buffer_pool.h"
+#include "upstream.h"
+#include "tunnel.h"
+#include "admin.h"
+#include "metrics.h"
+#include "log.h"
+#include "trace.h"
+#include "cache.h"
+#include "prof.h"
+#include "config.h"
+#include "peer.h"
+#include "shm_cache.h"
+#include "upgrade.h"
+#include "h2.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "spool.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,60 +29,60 @@
 #include <fcntl.h>
 #include <time.h>
 #include <sys/wait.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#include <poll.h>
 #include <errno.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <time.h>
+#include <stdint.h>
+
+#define MAX_BYTES 4096                  // default (and smallest) size of a relay read
+#define MAX_IO_BUFFER 65536             // largest relay read, the largest buffer pool class
+#define MAX_CLIENTS 63                  // most client requests served at once, one metrics shard each
+#define DEFAULT_CLIENTS 20              // default number of client requests served at once
+#define MAX_RESPONSE_HEAD 65536         // max size of a response status line and headers
+#define MAX_REQUEST_HEAD 65536          // default max size of a request line and headers
+#define TUNNEL_IDLE_SECONDS 300         // default idle timeout of a CONNECT tunnel
 
-#define MAX_BYTES 4096                  // max allowed size of request/response
-#define MAX_CLIENTS 20                  // max number of client requests
-#define MAX_SIZE 200 * (1 << 20)        // cache size
-#define MAX_ELEMENT_SIZE 10 * (1 << 20) // max size of an element in cache
-typedef struct cache_element cache_element;
 /**
- * @brief Represents a cache entry storing HTTP response data
+ * @brief A client connection handed from the accept loop to its thread
  */
-struct cache_element
+struct ClientConnection
 {
-    char *data;            // data stores response
-    int len;               // length of data i.e.. sizeof(data)...
-    char *url;             // url stores the request
-    time_t lru_time_track; // lru_time_track stores the latest time the element is  accesed
-    cache_element *next;   // pointer to next element
+    int socket;             // client socket descriptor
+    long accepted_us;       // Metrics_nowUs() when accept() returned it
+    unsigned int client_ip; // IPv4 address in network byte order, 0 if unknown
 };
 
-// Function declarations with documentation
-/**
- * @brief Searches for a URL in the cache
- * @param url The URL to search for
- * @return Pointer to cache element if found, NULL otherwise
- */
-cache_element *find(char *url);
-
-/**
- * @brief Adds a new element to the cache
- * @param data Response data to cache
- * @param size Size of the response data
- * @param url Request URL to use as cache key
- * @return 1 if successful, 0 if element too large
- */
-int add_cache_element(char *data, int size, char *url);
-
-/**
- * @brief Removes the least recently used element from cache
- */
-void remove_cache_element();
-
-int port_number = 8080;     // Default Port
-int proxy_socketId;         // socket descriptor of proxy server
-pthread_t tid[MAX_CLIENTS]; // array to store the thread ids of clients
-sem_t seamaphore;           // controls access to the threads
-
-// sem_t cache_lock;
-pthread_mutex_t lock; // lock is used for locking the cache
-
-cache_element *head; // pointer to the head of the cache LL
-int cache_size;      // current size of the cache
+int port_number = 8080;                     // Default Port
+int proxy_socketId;                         // socket descriptor of proxy server
+sem_t seamaphore;                           // controls access to the threads
+int max_clients = DEFAULT_CLIENTS;          // slots of seamaphore
+int clients_owed;                           // slots to take back from connections as they finish
+pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER; // guards max_clients and clients_owed
+int io_buffer_size = MAX_BYTES;             // bytes read from a socket at a time when relaying
+int max_request_head = MAX_REQUEST_HEAD;    // buffer for the request line + headers, their terminating NUL included
+struct BufferPool worker_pools[MAX_CLIENTS]; // one buffer pool per semaphore slot
+unsigned long worker_pools_busy;            // bitmap of the pools currently in use
+__thread struct BufferPool *thread_pool;    // pool of the connection this thread serves
+int tunnel_idle_seconds = TUNNEL_IDLE_SECONDS; // CONNECT tunnels silent this long are closed
+int admin_port = 0;                           // admin (metrics) port, 0 when disabled
+const char *access_log_path = NULL;           // JSON lines access log, none by default
+const char *replay_path = NULL;               // request trace for bench/cachesim, none by default
+int trace_every = 0;                          // trace one request in every trace_every, 0 disables
+const char *self_host = "127.0.0.1";          // host part of this node's name in cluster mode
+int l1_entries = 0;                           // entries of every worker's L1 cache, 0 disables them
+int worker_processes = 0;                     // prefork worker processes sharing the cache, 0 for none
+const char *upgrade_path = NULL;              // Unix socket a successor takes over on, none by default
+int upgrade_fd = -1;                          // listening on upgrade_path
+int drain_pipe[2] = {-1, -1};                 // written to stop accepting and drain
+int open_connections;                         // client connections accepted and not closed yet
+pthread_attr_t client_attr;                   // client threads are never joined
+__thread struct AccessRecord *thread_access;  // access log entry of the request being served
+__thread unsigned int thread_client_ip;       // client of the connection this thread serves
+__thread int client_detached;                 // the spool writer finishes the response and closes the client
 
 /**
  * @brief Sends an HTTP error response to the client
@@ -81,48 +99,77 @@ int sendErrorMessage(int socket, int status_code)
     struct tm data = *gmtime(&now);
     strftime(currentTime, sizeof(currentTime), "%a, %d %b %Y %H:%M:%S %Z", &data);
 
+    if (thread_access != NULL)
+        thread_access->status = status_code;
+
     switch (status_code)
     {
     // Sending the respective error message to the client
     case 400:
         snprintf(str, sizeof(str), "HTTP/1.1 400 Bad Request\r\nContent-Length: 95\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: RONIN/14785\r\n\r\n<HTML><HEAD><TITLE>400 Bad Request</TITLE></HEAD>\n<BODY><H1>400 Bad Rqeuest</H1>\n</BODY></HTML>", currentTime);
-        printf("400 Bad Request\n");
+        LOG(LOG_DEBUG, "400 Bad Request\n");
         send(socket, str, strlen(str), 0);
         break;
 
     case 403:
         snprintf(str, sizeof(str), "HTTP/1.1 403 Forbidden\r\nContent-Length: 112\r\nContent-Type: text/html\r\nConnection: keep-alive\r\nDate: %s\r\nServer: RONIN/14785\r\n\r\n<HTML><HEAD><TITLE>403 Forbidden</TITLE></HEAD>\n<BODY><H1>403 Forbidden</H1><br>Permission Denied\n</BODY></HTML>", currentTime);
-        printf("403 Forbidden\n");
+        LOG(LOG_DEBUG, "403 Forbidden\n");
         send(socket, str, strlen(str), 0);
         break;
 
     case 404:
         snprintf(str, sizeof(str), "HTTP/1.1 404 Not Found\r\nContent-Length: 91\r\nContent-Type: text/html\r\nConnection: keep-alive\r\nDate: %s\r\nServer: RONIN/14785\r\n\r\n<HTML><HEAD><TITLE>404 Not Found</TITLE></HEAD>\n<BODY><H1>404 Not Found</H1>\n</BODY></HTML>", currentTime);
-        printf("404 Not Found\n");
+        LOG(LOG_DEBUG, "404 Not Found\n");
         send(socket, str, strlen(str), 0);
         break;
 
+    case 429:
+        snprintf(str, sizeof(str), "HTTP/1.1 429 Too Many Requests\r\nContent-Length: 107\r\nConnection: close\r\nRetry-After: 1\r\nContent-Type: text/html\r\nDate: %s\r\nServer: RONIN/14785\r\n\r\n<HTML><HEAD><TITLE>429 Too Many Requests</TITLE></HEAD>\n<BODY><H1>429 Too Many Requests</H1>\n</BODY></HTML>", currentTime);
+        LOG(LOG_DEBUG, "429 Too Many Requests\n");
+        send(socket, str, strlen(str), MSG_NOSIGNAL);
+        break;
+
+    case 431:
+        snprintf(str, sizeof(str), "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 135\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nServer: RONIN/14785\r\n\r\n<HTML><HEAD><TITLE>431 Request Header Fields Too Large</TITLE></HEAD>\n<BODY><H1>431 Request Header Fields Too Large</H1>\n</BODY></HTML>", currentTime);
+        LOG(LOG_DEBUG, "431 Request Header Fields Too Large\n");
+        send(socket, str, strlen(str), MSG_NOSIGNAL); // the client over-sent and may be gone already
+        break;
+
     case 500:
         snprintf(str, sizeof(str), "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 115\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: RONIN/14785\r\n\r\n<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>\n<BODY><H1>500 Internal Server Error</H1>\n</BODY></HTML>", currentTime);
-        // printf("500 Internal Server Error\n");
+        LOG(LOG_DEBUG, "500 Internal Server Error\n");
         send(socket, str, strlen(str), 0);
         break;
 
     case 501:
         snprintf(str, sizeof(str), "HTTP/1.1 501 Not Implemented\r\nContent-Length: 103\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: RONIN/14785\r\n\r\n<HTML><HEAD><TITLE>404 Not Implemented</TITLE></HEAD>\n<BODY><H1>501 Not Implemented</H1>\n</BODY></HTML>", currentTime);
-        printf("501 Not Implemented\n");
+        LOG(LOG_DEBUG, "501 Not Implemented\n");
         send(socket, str, strlen(str), 0);
         break;
 
+    case 502:
+        snprintf(str, sizeof(str), "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 95\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nServer: RONIN/14785\r\n\r\n<HTML><HEAD><TITLE>502 Bad Gateway</TITLE></HEAD>\n<BODY><H1>502 Bad Gateway</H1>\n</BODY></HTML>", currentTime);
+        LOG(LOG_DEBUG, "502 Bad Gateway\n");
+        send(socket, str, strlen(str), MSG_NOSIGNAL);
+        break;
+
+    case 503:
+        snprintf(str, sizeof(str), "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 111\r\nConnection: close\r\nRetry-After: %d\r\nContent-Type: text/html\r\nDate: %s\r\nServer: RONIN/14785\r\n\r\n<HTML><HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>\n<BODY><H1>503 Service Unavailable</H1>\n</BODY></HTML>", ADMISSION_RETRY_AFTER, currentTime);
+        LOG(LOG_DEBUG, "503 Service Unavailable\n");
+        send(socket, str, strlen(str), MSG_NOSIGNAL);
+        break;
+
     case 505:
         snprintf(str, sizeof(str), "HTTP/1.1 505 HTTP Version Not Supported\r\nContent-Length: 125\r\nConnection: keep-alive\r\nContent-Type: text/html\r\nDate: %s\r\nServer: RONIN/14785\r\n\r\n<HTML><HEAD><TITLE>505 HTTP Version Not Supported</TITLE></HEAD>\n<BODY><H1>505 HTTP Version Not Supported</H1>\n</BODY></HTML>", currentTime);
-        printf("505 HTTP Version Not Supported\n");
+        LOG(LOG_DEBUG, "505 HTTP Version Not Supported\n");
         send(socket, str, strlen(str), 0);
         break;
 
     default:
         return -1;
     }
+    if (thread_access != NULL)
+        thread_access->bytes = strlen(str);
     return 1;
 }
 
@@ -134,498 +181,1990 @@ int sendErrorMessage(int socket, int status_code)
  */
 int connectRemoteServer(char *host_addr, int port_num)
 {
+    long started = Metrics_nowUs();
 
-    int remoteSocket = socket(AF_INET, SOCK_STREAM, 0);
-
-    if (remoteSocket < 0)
+    // A failure seen within the negative TTL is not retried
+    int failure = origin_failure(host_addr, port_num);
+    if (failure != 0)
     {
-        printf("Bravo-6 to Echo 3-1. The socket couldn't be created\n");
+        LOG(LOG_DEBUG, "%s:%d failed recently (%s), not retried\n", host_addr, port_num,
+            failure == ORIGIN_UNRESOLVED ? "unresolved" : "unreachable");
+        Metrics_add(M_NEGATIVE_HITS, 1);
         return -1;
     }
 
-    struct hostent *host = gethostbyname(host_addr);
-    if (host == NULL)
+    // getaddrinfo() is thread-safe, gethostbyname() returns a shared static struct
+    struct addrinfo hints, *addrs = NULL;
+    char port[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", port_num);
+    Trace_enter(T_RESOLVE);
+    int resolved = getaddrinfo(host_addr, port, &hints, &addrs);
+    Trace_leave(T_RESOLVE);
+    if (resolved != 0)
     {
-        fprintf(stderr, "Echo 3-1 to Bravo-6. The host doesn't exist\n");
+        LOG(LOG_WARN, "Echo 3-1 to Bravo-6. The host %s doesn't exist: %s\n", host_addr, gai_strerror(resolved));
+        Metrics_add(M_ORIGIN_ERRORS, 1);
+        if (resolved == EAI_NONAME || resolved == EAI_FAIL || resolved == EAI_AGAIN)
+            remember_origin_failure(host_addr, port_num, ORIGIN_UNRESOLVED);
         return -1;
     }
 
-    // inserts ip address and port number of host in struct `server_addr`
-    struct sockaddr_in server_addr;
-
-    bzero((char *)&server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port_num);
-
-    bcopy((char *)host->h_addr_list, (char *)&server_addr.sin_addr.s_addr, host->h_length);
+    // Try and connect to Remote server, each resolved address in turn
+    int remoteSocket = -1;
+    int error = 0;
+    Trace_enter(T_CONNECT);
+    for (struct addrinfo *a = addrs; a != NULL && remoteSocket < 0; a = a->ai_next)
+    {
+        remoteSocket = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (remoteSocket < 0)
+        {
+            LOG(LOG_ERROR, "Bravo-6 to Echo 3-1. The socket couldn't be created: %s\n", strerror(errno));
+            break;
+        }
+        if (PROF_BLOCKING(PROF_CONNECT, connect(remoteSocket, a->ai_addr, a->ai_addrlen)) < 0)
+        {
+            error = errno;
+            close(remoteSocket);
+            remoteSocket = -1;
+        }
+    }
+    Trace_leave(T_CONNECT);
+    freeaddrinfo(addrs);
 
-    // Try and connect to Remote server
-    if (connect(remoteSocket, (struct sockaddr *)&server_addr, (socklen_t)sizeof(server_addr)) < 0)
+    if (remoteSocket < 0)
     {
-        fprintf(stderr, "Bravo-6 to Echo 3-1.The connection has not been established!\n");
+        LOG(LOG_WARN, "Bravo-6 to Echo 3-1. The connection to %s:%d has not been established: %s\n",
+            host_addr, port_num, strerror(error));
+        Metrics_add(M_ORIGIN_ERRORS, 1);
+        if (error == ECONNREFUSED || error == ETIMEDOUT || error == EHOSTUNREACH || error == ENETUNREACH)
+            remember_origin_failure(host_addr, port_num, ORIGIN_UNREACHABLE);
         return -1;
     }
-    // free(host_addr);
+    Metrics_observe(H_UPSTREAM_CONNECT, Metrics_nowUs() - started);
     return remoteSocket;
 }
 
 /**
- * @brief Processes an HTTP request and forwards it to remote server
- * @param clientSocket Client socket descriptor
- * @param request Parsed HTTP request
- * @param tempReq Original raw request string
- * @return 0 if successful, -1 on error
+ * @brief Sends a whole buffer, retrying on short writes
+ * @param socket Socket descriptor
+ * @param data Bytes to send
+ * @param len Number of bytes to send
+ * @return len if successful, -1 on error
  */
-int handle_request(int clientSocket, struct ParsedRequest *request, char *tempReq)
+int send_all(int socket, const char *data, int len)
 {
-    char *buf = (char *)malloc(sizeof(char) * MAX_BYTES);
-    strcpy(buf, "GET ");
-    strcat(buf, request->path);
-    strcat(buf, " ");
-    strcat(buf, request->version);
-    strcat(buf, "\r\n");
-
-    size_t len = strlen(buf);
-
-    if (ParsedHeader_set(request, "Connection", "close") < 0)
-    {
-        printf("Bravo-6 to Gold Eagle Actual. The set is offline\n");
-    }
-
-    if (ParsedHeader_get(request, "Host") == NULL)
+    int sent = 0;
+    while (sent < len)
     {
-        if (ParsedHeader_set(request, "Host", request->host) < 0)
+        int n = PROF_BLOCKING(PROF_SEND, send(socket, data + sent, len - sent, MSG_NOSIGNAL));
+        if (n < 0)
         {
-            printf("Set \"Host\" header key not working\n");
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
+        sent += n;
     }
+    return sent;
+}
 
-    if (ParsedRequest_unparse_headers(request, buf + len, (size_t)MAX_BYTES - len) < 0)
+/**
+ * @brief Checks whether the proxy knows how to forward a request method
+ * @param method Request method token
+ * @return 1 if supported, 0 otherwise
+ */
+int isSupportedMethod(const char *method)
+{
+    static const char *methods[] = {"GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH", NULL};
+    for (int i = 0; methods[i] != NULL; i++)
     {
-        printf("Gold Eagle Actual to Bravo-6. The unparse is fucked John.\n");
-        // return -1;				// If this happens Still try to send request without header
+        if (!strcmp(method, methods[i]))
+            return 1;
     }
+    return 0;
+}
 
-    int server_port = 80; // Default Remote Server Port
-    if (request->port != NULL)
-        server_port = atoi(request->port);
+/**
+ * @brief Parses a Content-Length value (RFC 7230 3.3.2)
+ *
+ * Only digits are a length: "5abc" or "5, 7" would have us forward a body
+ * of another length than the header we pass on says.
+ *
+ * @param value Header value, trailing blanks allowed
+ * @return The length, or -1 if it is not a number or does not fit a long
+ */
+long contentLength(const char *value)
+{
+    char *end;
+    errno = 0;
+    long n = strtol(value, &end, 10);
+    if (*value < '0' || *value > '9' || errno == ERANGE)
+        return -1;
+    end += strspn(end, " \t");
+    return *end == '\0' ? n : -1;
+}
 
-    int remoteSocketID = connectRemoteServer(request->host, server_port);
+/**
+ * @brief Works out how the body of a request is framed (RFC 7230 3.3.3)
+ *
+ * The parser keeps the last of repeated headers, so only one of each is
+ * forwarded, and refuses repeated Content-Lengths that disagree; a
+ * Content-Length that is not a number, or a Transfer-Encoding that does not
+ * end in chunked, cannot be framed at all and is refused.
+ *
+ * @param request Parsed HTTP request
+ * @return 1 for chunked, 0 for Content-Length or no body, -1 if unsupported
+ */
+int requestFraming(struct ParsedRequest *request)
+{
+    struct ParsedHeader *cl = ParsedHeader_get(request, "Content-Length");
+    if (cl != NULL && contentLength(cl->value) < 0)
+        return -1;
+    struct ParsedHeader *te = ParsedHeader_get(request, "Transfer-Encoding");
+    if (te == NULL)
+        return 0;
 
-    if (remoteSocketID < 0)
+    // Only chunked is decoded, and it has to be the final coding
+    const char *last = strrchr(te->value, ',');
+    last = last != NULL ? last + 1 : te->value;
+    last += strspn(last, " \t");
+    if (strncasecmp(last, "chunked", 7))
         return -1;
+    last += 7;
+    return last[strspn(last, " \t")] == '\0' ? 1 : -1;
+}
+
+/**
+ * @brief Checks whether a method may modify the resource on the origin
+ * @param method Request method token
+ * @return 1 for unsafe methods (POST, PUT, ...), 0 for safe ones
+ */
+int isUnsafeMethod(const char *method)
+{
+    return strcmp(method, "GET") && strcmp(method, "HEAD") &&
+           strcmp(method, "OPTIONS") && strcmp(method, "TRACE");
+}
+
+/**
+ * @brief Builds the cache key of a request, shared by all methods on a URL
+ * @param request Parsed HTTP request
+ * @param key Buffer receiving the key
+ * @param keylen Size of the key buffer
+ */
+void cacheKey(struct ParsedRequest *request, char *key, size_t keylen)
+{
+    snprintf(key, keylen, "%s://%s%s%s%s", request->protocol, request->host,
+             request->port ? ":" : "", request->port ? request->port : "", request->path);
+}
 
-    int bytes_send = send(remoteSocketID, buf, strlen(buf), 0);
+/**
+ * @brief Extracts the status code from the start of a response
+ * @param data Response bytes (status line first)
+ * @param len Number of bytes available
+ * @return Status code, or -1 if the status line is malformed
+ */
+int responseStatus(const char *data, int len)
+{
+    if (len < 12 || strncmp(data, "HTTP/1.", 7) != 0 || data[8] != ' ')
+        return -1;
+    if (!isdigit(data[9]) || !isdigit(data[10]) || !isdigit(data[11]))
+        return -1;
+    return (data[9] - '0') * 100 + (data[10] - '0') * 10 + (data[11] - '0');
+}
 
-    bzero(buf, MAX_BYTES);
+/**
+ * @brief Streams a Content-Length delimited request body to the remote server
+ * @param clientSocket Client socket descriptor
+ * @param remoteSocket Remote server socket descriptor
+ * @param prefix Body bytes already received together with the headers
+ * @param prefix_len Number of bytes in prefix
+ * @param length Declared Content-Length of the body
+ * @return 0 if successful, -1 on error
+ */
+int relay_fixed_body(int clientSocket, int remoteSocket, const char *prefix, int prefix_len, long length)
+{
+    long remaining = length;
+    int n = prefix_len < remaining ? prefix_len : (int)remaining;
 
-    bytes_send = recv(remoteSocketID, buf, MAX_BYTES - 1, 0);
-    char *temp_buffer = (char *)malloc(sizeof(char) * MAX_BYTES); // temp buffer
-    int temp_buffer_size = MAX_BYTES;
-    int temp_buffer_index = 0;
+    if (n > 0 && send_all(remoteSocket, prefix, n) < 0)
+        return -1;
+    remaining -= n;
 
-    while (bytes_send > 0)
+    size_t io_size;
+    char *buf = BufferPool_get(thread_pool, io_buffer_size, &io_size);
+    int ret = 0;
+    while (remaining > 0 && ret == 0)
     {
-        bytes_send = send(clientSocket, buf, bytes_send, 0);
-
-        for (int i = 0; i < bytes_send / sizeof(char); i++)
-        {
-            temp_buffer[temp_buffer_index] = buf[i];
-            // printf("%c",buf[i]); // Response Printing
-            temp_buffer_index++;
-        }
-        temp_buffer_size += MAX_BYTES;
-        temp_buffer = (char *)realloc(temp_buffer, temp_buffer_size);
+        n = PROF_BLOCKING(PROF_RECV, recv(clientSocket, buf, remaining < (long)io_size ? remaining : io_size, 0));
+        if (n <= 0 || send_all(remoteSocket, buf, n) < 0)
+            ret = -1;
+        remaining -= n;
+    }
+    BufferPool_put(thread_pool, buf);
+    return ret;
+}
 
-        if (bytes_send < 0)
+/**
+ * @brief Streams a chunked request body to the remote server, chunk framing included
+ * @param clientSocket Client socket descriptor
+ * @param remoteSocket Remote server socket descriptor
+ * @param prefix Body bytes already received together with the headers
+ * @param prefix_len Number of bytes in prefix
+ * @return 0 if successful, -1 on error
+ */
+int relay_chunked_body(int clientSocket, int remoteSocket, const char *prefix, int prefix_len)
+{
+    struct ChunkedDecoder dec;
+    const char *data = prefix;
+    int n = prefix_len;
+    size_t io_size;
+    char *buf = BufferPool_get(thread_pool, io_buffer_size, &io_size);
+    int ret = -1;
+
+    ChunkedDecoder_init(&dec);
+    while (1)
+    {
+        int used = ChunkedDecoder_feed(&dec, data, n, NULL, NULL);
+        if (used < 0)
+            break;
+        if (used > 0 && send_all(remoteSocket, data, used) < 0)
+            break;
+        if (ChunkedDecoder_done(&dec))
         {
-            perror("Bravo-6 to Gold Eagle Actual. Couldn't send to client socket.\n");
+            ret = 0;
             break;
         }
-        bzero(buf, MAX_BYTES);
 
-        bytes_send = recv(remoteSocketID, buf, MAX_BYTES - 1, 0);
+        n = PROF_BLOCKING(PROF_RECV, recv(clientSocket, buf, io_size, 0));
+        if (n <= 0)
+            break;
+        data = buf;
     }
-    temp_buffer[temp_buffer_index] = '\0';
-    free(buf);
-    add_cache_element(temp_buffer, strlen(temp_buffer), tempReq);
-    printf("Done\n");
-    free(temp_buffer);
+    BufferPool_put(thread_pool, buf);
+    return ret;
+}
 
-    close(remoteSocketID);
-    return 0;
+/**
+ * @brief Sends response bytes to the client, through its write-behind spool if it has one
+ * @param socket Client socket descriptor
+ * @param spool Write-behind spool of the response, NULL to send directly
+ * @param data Bytes to send
+ * @param len Number of bytes
+ * @return 0 or more if successful, -1 on error
+ */
+int send_client(int socket, struct Spool *spool, const char *data, int len)
+{
+    return spool != NULL ? Spool_write(spool, data, len) : send_all(socket, data, len);
 }
 
 /**
- * @brief Validates HTTP version in request
- * @param msg HTTP version string
- * @return 1 if valid version (1.0/1.1), -1 otherwise
+ * @brief Looks up a header in a raw response head
+ * @param head Response status line and headers
+ * @param head_len Length of the head including the final CRLF
+ * @param name Header name (case-insensitive)
+ * @param value Buffer receiving the header value
+ * @param value_len Size of the value buffer
+ * @return 1 if the header is present, 0 otherwise
  */
-int checkHTTPversion(char *msg)
+int responseHeader(const char *head, int head_len, const char *name, char *value, int value_len)
 {
-    int version = -1;
+    size_t name_len = strlen(name);
+    const char *end = head + head_len;
+    const char *line = (const char *)memmem(head, head_len, "\r\n", 2);
 
-    if (strncmp(msg, "HTTP/1.1", 8) == 0)
+    while (line != NULL && line + 2 < end)
     {
-        version = 1;
+        line += 2;
+        const char *eol = (const char *)memmem(line, end - line, "\r\n", 2);
+        if (eol == NULL || eol == line)
+            break;
+        if ((size_t)(eol - line) > name_len && line[name_len] == ':' && !strncasecmp(line, name, name_len))
+        {
+            const char *v = line + name_len + 1;
+            while (v < eol && (*v == ' ' || *v == '\t'))
+                v++;
+            int n = eol - v < value_len - 1 ? eol - v : value_len - 1;
+            memcpy(value, v, n);
+            value[n] = '\0';
+            return 1;
+        }
+        line = eol;
     }
-    else if (strncmp(msg, "HTTP/1.0", 8) == 0)
+    return 0;
+}
+
+/**
+ * @brief Request header lookup for the cache's variant selection
+ * @param request The struct ParsedRequest being served
+ * @param name Header name (case-insensitive)
+ * @return Header value, NULL if the request does not have it
+ */
+const char *requestHeader(void *request, const char *name)
+{
+    struct ParsedHeader *h = ParsedHeader_get((struct ParsedRequest *)request, name);
+    return h != NULL ? h->value : NULL;
+}
+
+/**
+ * @brief Seconds an error response may be cached: 404, 410 and 5xx up to the negative TTL
+ * @param head Response status line and headers
+ * @param head_len Length of the head including the final CRLF
+ * @param status Response status code
+ * @return TTL in seconds, 0 if the response must not be cached
+ */
+int negativeTtl(const char *head, int head_len, int status)
+{
+    if (status != 404 && status != 410 && status < 500)
+        return 0;
+    int ttl = negative_cache_ttl();
+    char value[256];
+    if (responseHeader(head, head_len, "Cache-Control", value, sizeof(value)))
     {
-        version = 1; // Handling this similar to version 1.1
+        if (strcasestr(value, "no-store") || strcasestr(value, "no-cache") || strcasestr(value, "private"))
+            return 0;
+        // An explicit lifetime can only shorten the TTL; s-maxage applies to shared caches
+        const char *age = strcasestr(value, "s-maxage=");
+        if (age != NULL)
+            age += 9;
+        else if ((age = strcasestr(value, "max-age=")) != NULL)
+            age += 8;
+        if (age != NULL && atoi(age) < ttl)
+            ttl = atoi(age);
     }
-    else
-        version = -1;
-
-    return version;
+    return ttl;
 }
 
 /**
- * @brief Thread handler function for processing client requests
- * @param socketNew Pointer to client socket descriptor
- * @return NULL
+ * @brief Copies a response head, replacing its framing with a Content-Length
+ * @param head Response status line and headers
+ * @param head_len Length of the head including the final CRLF
+ * @param out Buffer receiving the new head (head_len + 64 bytes is enough)
+ * @param content_length Body length to declare, or -1 to declare none
+ * @return Length of the new head
  */
-void *thread_fn(void *socketNew)
+int rewriteResponseHead(const char *head, int head_len, char *out, long content_length)
 {
-    sem_wait(&seamaphore);
-    int p;
-    sem_getvalue(&seamaphore, &p);
-    printf("semaphore value:%d\n", p);
-    int *t = (int *)(socketNew);
-    int socket = *t;            // Socket is socket descriptor of the connected Client
-    int bytes_send_client, len; // Number of bytes to be transferred
+    static const char *dropped[] = {"Transfer-Encoding", "Content-Length", "Connection",
+                                    "Keep-Alive", "Proxy-Connection", NULL};
+    const char *end = head + head_len - 2; // the blank line is appended below
+    const char *line = head;
+    int o = 0;
+
+    while (line < end)
+    {
+        const char *eol = (const char *)memmem(line, end - line, "\r\n", 2);
+        eol = eol == NULL ? end : eol + 2;
+        int keep = 1;
+        for (int i = 0; line != head && dropped[i] != NULL && keep; i++)
+        {
+            size_t n = strlen(dropped[i]);
+            if ((size_t)(eol - line) > n && line[n] == ':' && !strncasecmp(line, dropped[i], n))
+                keep = 0;
+        }
+        if (keep)
+        {
+            memcpy(out + o, line, eol - line);
+            o += eol - line;
+        }
+        line = eol;
+    }
+    if (content_length >= 0)
+        o += sprintf(out + o, "Content-Length: %ld\r\n", content_length);
+    o += sprintf(out + o, "Connection: close\r\n\r\n");
+    return o;
+}
 
-    char *buffer = (char *)calloc(MAX_BYTES, sizeof(char)); // Creating buffer of 4kb for a client
+/**
+ * @brief Relays the response of the remote server to the client, following its framing
+ *
+ * Chunked bodies are decoded on the fly: HTTP/1.1 clients get the origin's
+ * chunks unchanged, HTTP/1.0 clients get the plain payload delimited by the
+ * connection close. A cacheable response is stored de-chunked with a computed
+ * Content-Length so that a hit is a single length-delimited write.
+ *
+ * @param clientSocket Client socket descriptor
+ * @param remoteSocket Remote server socket descriptor
+ * @param request Parsed HTTP request the response answers
+ * @param key Cache key of the requested URL
+ * @param status Receives the response status code (-1 if unknown)
+ * @param sent_us Metrics_nowUs() when the request was sent, for the TTFB
+ * @param max_ttl Longest TTL to cache the response with, 0 for none, -1 to not cache it
+ * @return 0 if successful, -1 on error
+ */
+int relay_response(int clientSocket, int remoteSocket, struct ParsedRequest *request, char *key, int *status,
+                   long sent_us, int max_ttl)
+{
+    size_t head_size;
+    char *head = BufferPool_get(thread_pool, MAX_BYTES, &head_size);
+    int head_len = 0;
+    char *head_end = NULL;
+    int bytes = 0;
 
-    bzero(buffer, MAX_BYTES);                               // Setting the buffer to 0
-    bytes_send_client = recv(socket, buffer, MAX_BYTES, 0); // Receiving the request of client by proxy server
+    *status = -1;
 
-    while (bytes_send_client > 0)
+    // Read until the whole response head is in
+    while (head_end == NULL)
     {
-        len = strlen(buffer);
-        // loop until u find "\r\n\r\n" in the buffer
-        if (strstr(buffer, "\r\n\r\n") == NULL)
+        if ((size_t)head_len == head_size - 1)
         {
-            bytes_send_client = recv(socket, buffer + len, MAX_BYTES - len, 0);
+            if (head_size >= MAX_RESPONSE_HEAD)
+                break;
+            char *bigger = BufferPool_grow(thread_pool, head, head_len, 2 * head_size, &head_size);
+            if (bigger == NULL)
+                break;
+            head = bigger;
         }
-        else
-        {
+        bytes = PROF_BLOCKING(PROF_RECV, recv(remoteSocket, head + head_len, head_size - 1 - head_len, 0));
+        if (bytes <= 0)
             break;
+        if (head_len == 0)
+        {
+            Metrics_observe(H_TTFB, Metrics_nowUs() - sent_us);
+            Trace_leave(T_TTFB);
+            Trace_enter(T_SEND);
         }
+        head_len += bytes;
+        head[head_len] = '\0';
+        head_end = (char *)memmem(head, head_len, "\r\n\r\n", 4);
     }
 
-    char *tempReq = (char *)malloc(strlen(buffer) * sizeof(char) + 1);
-    // tempReq, buffer both store the http request sent by client
-    for (int i = 0; i < strlen(buffer); i++)
+    if (head_end == NULL)
     {
-        tempReq[i] = buffer[i];
+        // Not something we can frame, hand over whatever we got
+        int ret = head_len > 0 && send_all(clientSocket, head, head_len) >= 0 ? 0 : -1;
+        Trace_leave(T_SEND);
+        Metrics_add(M_BYTES_FROM_ORIGIN, head_len);
+        if (thread_access != NULL)
+            thread_access->bytes = head_len;
+        BufferPool_put(thread_pool, head);
+        return ret;
     }
 
-    // checking for the request in cache
-    struct cache_element *temp = find(tempReq);
+    int hdr_len = head_end + 4 - head;
+    char value[64];
+    *status = responseStatus(head, hdr_len);
+
+    int no_body = !strcmp(request->method, "HEAD") || *status == 204 || *status == 304 ||
+                  (*status >= 100 && *status < 200);
+    int chunked = !no_body && responseHeader(head, hdr_len, "Transfer-Encoding", value, sizeof(value)) &&
+                  strcasestr(value, "chunked") != NULL;
+    long remaining = -1; // Content-Length still to come, -1 if delimited by close
+    if (!no_body && !chunked && responseHeader(head, hdr_len, "Content-Length", value, sizeof(value)))
+        remaining = atol(value);
+    int dechunk = chunked && !strncmp(request->version, "HTTP/1.0", 8);
+
+    // Only complete GET responses are stored, errors for a short TTL; HEAD is answered from them
+    int ttl = !strcmp(request->method, "GET") ? negativeTtl(head, hdr_len, *status) : 0;
+    int cacheable = !strcmp(request->method, "GET") && (*status == 200 || ttl > 0) && max_ttl >= 0;
+    if (max_ttl > 0 && (ttl == 0 || ttl > max_ttl))
+        ttl = max_ttl;
+    char vary[256] = "";
+    char variant[CACHE_MAX_VARIANT_KEY]; // request values of the Vary headers, the response is one variant
+    if (cacheable && (cache_variant(responseHeader(head, hdr_len, "Vary", vary, sizeof(vary)) ? vary : NULL,
+                                    requestHeader, request, variant, sizeof(variant)) < 0 ||
+                      strlen(vary) == sizeof(vary) - 1))
+        cacheable = 0; // Vary: * or too long to key on
+    // A body that cannot fit in max_element_size is never captured, only streamed through
+    long capture_limit = cache_max_element() - hdr_len - 64;
+    if (cacheable && (capture_limit < 0 || remaining > capture_limit))
+    {
+        cacheable = 0;
+        Metrics_add(M_CACHE_TOO_LARGE, 1);
+    }
+    char *body = NULL;
+    long body_size = 0;
+    long body_len = 0;
+    if (cacheable)
+    {
+        body_size = remaining > 0 ? remaining : (MAX_BYTES < capture_limit ? MAX_BYTES : capture_limit);
+        body = (char *)malloc(body_size > 0 ? body_size : 1);
+    }
 
-    if (temp != NULL)
+    // The origin is read at its own pace, a slow client gets the rest from the spool writer
+    struct Spool *spool = Spool_open(clientSocket);
+    int ret = 0;
+    long relayed = 0; // bytes sent to the client
+    if (dechunk)
     {
-        // send respose as request has been found in the cache
-        int size = temp->len / sizeof(char);
-        int pos = 0;
-        char response[MAX_BYTES];
-        while (pos < size)
-        {
-            bzero(response, MAX_BYTES);
-            for (int i = 0; i < MAX_BYTES; i++)
-            {
-                response[i] = temp->data[pos];
-                pos++;
-            }
-            send(socket, response, MAX_BYTES, 0);
-        }
-        printf("Data has been received from the Cache\n\n");
-        printf("%s\n\n", response);
+        char *new_head = BufferPool_get(thread_pool, hdr_len + 64, NULL);
+        int new_len = rewriteResponseHead(head, hdr_len, new_head, -1);
+        ret = send_client(clientSocket, spool, new_head, new_len) < 0 ? -1 : 0;
+        relayed = new_len;
+        BufferPool_put(thread_pool, new_head);
+    }
+    else
+    {
+        ret = send_client(clientSocket, spool, head, hdr_len) < 0 ? -1 : 0;
+        relayed = hdr_len;
     }
 
-    else if (bytes_send_client > 0)
+    struct ChunkedDecoder dec;
+    ChunkedDecoder_init(&dec);
+    size_t io_size;
+    char *buf = BufferPool_get(thread_pool, io_buffer_size, &io_size);
+    char *decoded = chunked ? BufferPool_get(thread_pool, io_size, NULL) : NULL;
+    char *data = head + hdr_len;
+    int n = head_len - hdr_len;
+    int complete = no_body || remaining == 0;
+
+    while (ret == 0 && !complete)
     {
-        len = strlen(buffer);
-        // Parsing the request
-        struct ParsedRequest *request = ParsedRequest_create();
-        if (ParsedRequest_parse(request, buffer, len) < 0)
-        {
-            printf("Parsing failed\n");
-        }
-        else
+        while (n > 0 && ret == 0 && !complete)
         {
-            bzero(buffer, MAX_BYTES);
-            if (!strcmp(request->method, "GET"))
+            int take = n < (int)io_size ? n : (int)io_size;
+            const char *payload = data;
+            int payload_len = take;
+
+            if (chunked)
             {
-                if (request->host && request->path && (checkHTTPversion(request->version) == 1))
+                take = ChunkedDecoder_feed(&dec, data, take, decoded, &payload_len);
+                if (take < 0)
                 {
-                    bytes_send_client = handle_request(socket, request, tempReq); // Handle GET request
-                    if (bytes_send_client == -1)
-                    {
-                        sendErrorMessage(socket, 500);
-                    }
+                    ret = -1;
+                    break;
                 }
-                else
-                    sendErrorMessage(socket, 500); // 500 Internal Error
+                payload = decoded;
+                complete = ChunkedDecoder_done(&dec);
             }
-            else
+            else if (remaining >= 0)
+            {
+                take = take < remaining ? take : (int)remaining;
+                payload_len = take;
+                remaining -= take;
+                complete = remaining == 0;
+            }
+
+            if (dechunk ? send_client(clientSocket, spool, payload, payload_len) < 0
+                        : send_client(clientSocket, spool, data, take) < 0)
+            {
+                LOG(LOG_WARN, "Bravo-6 to Gold Eagle Actual. Couldn't send to client socket: %s\n", strerror(errno));
+                ret = -1;
+            }
+            relayed += dechunk ? payload_len : take;
+
+            if (body != NULL && payload_len > 0 && body_len + payload_len > capture_limit)
+            {
+                // Grew past the limit without a Content-Length: drop the copy, stream the rest
+                free(body);
+                body = NULL;
+                cacheable = 0;
+                Metrics_add(M_CACHE_TOO_LARGE, 1);
+            }
+            if (body != NULL && payload_len > 0)
             {
-                printf("This code doesn't support any method other than GET\n");
+                if (body_len + payload_len > body_size)
+                {
+                    body_size = 2 * body_size + payload_len;
+                    if (body_size > capture_limit)
+                        body_size = capture_limit;
+                    body = (char *)realloc(body, body_size);
+                }
+                memcpy(body + body_len, payload, payload_len);
+                body_len += payload_len;
             }
+            data += take;
+            n -= take;
         }
-        ParsedRequest_destroy(request);
+        if (ret < 0 || complete)
+            break;
+
+        n = PROF_BLOCKING(PROF_RECV, recv(remoteSocket, buf, io_size, 0));
+        data = buf;
+        if (n == 0 && !chunked && remaining < 0)
+            complete = 1; // close-delimited body ends with the connection
+        else if (n <= 0)
+            ret = -1;
     }
 
-    else if (bytes_send_client < 0)
+    if (spool != NULL && Spool_finish(spool))
+        client_detached = 1;
+
+    if (cacheable && complete && ret == 0)
     {
-        perror("Error in receiving from client.\n");
+        char *entry = (char *)malloc(hdr_len + 64 + body_len);
+        int entry_len = rewriteResponseHead(head, hdr_len, entry, body_len);
+        memcpy(entry + entry_len, body, body_len);
+        add_cache_element(entry, entry_len + body_len, key, ttl, variant);
+        free(entry);
+        if (thread_access != NULL && *status == 200)
+        {
+            thread_access->object_size = entry_len + body_len;
+            thread_access->replay_flags |= REPLAY_CACHEABLE;
+        }
     }
-    else if (bytes_send_client == 0)
+
+    Trace_leave(T_SEND);
+    Metrics_add(M_BYTES_FROM_ORIGIN, relayed);
+    if (thread_access != NULL)
     {
-        printf("Client disconnected!\n");
+        thread_access->status = *status;
+        thread_access->bytes = relayed;
+        if (thread_access->object_size == 0)
+            thread_access->object_size = relayed;
     }
-
-    shutdown(socket, SHUT_RDWR);
-    close(socket);
-    free(buffer);
-    sem_post(&seamaphore);
-
-    sem_getvalue(&seamaphore, &p);
-    printf("Semaphore post value:%d\n", p);
-    free(tempReq);
-    return NULL;
+    BufferPool_put(thread_pool, head);
+    BufferPool_put(thread_pool, buf);
+    BufferPool_put(thread_pool, decoded);
+    free(body);
+    return ret;
 }
 
 /**
- * @brief Main proxy server function
- * @param argc Argument count
- * @param argv Argument vector (expects port number)
- * @return 0 on successful execution
+ * @brief Processes an HTTP request and forwards it to remote server
+ * @param clientSocket Client socket descriptor
+ * @param request Parsed HTTP request
+ * @param key Cache key of the requested URL
+ * @param body Request body bytes received along with the headers
+ * @param body_len Number of bytes in body
+ * @param route Reverse proxy route to forward to, NULL to forward to request->host
+ * @param peer Cluster node owning key, NULL outside cluster mode; a peer is asked instead of the origin
+ * @return 0 if successful, -1 on error
  */
-int main(int argc, char *argv[])
+int handle_request(int clientSocket, struct ParsedRequest *request, char *key, char *body, int body_len,
+                   struct Route *route, struct PeerNode *peer)
 {
-
-    int client_socketId, client_len;             // client_socketId == to store the client socket id
-    struct sockaddr_in server_addr, client_addr; // Address of client and server to be assigned
-
-    sem_init(&seamaphore, 0, MAX_CLIENTS);
-    pthread_mutex_init(&lock, NULL);
-
-    if (argc == 2) // Checking if the port number is provided as an argument
+    if (ParsedHeader_set(request, "Connection", "close") < 0)
     {
-        port_number = atoi(argv[1]);
+        LOG(LOG_ERROR, "Bravo-6 to Gold Eagle Actual. The set is offline\n");
     }
-    else
+
+    if (ParsedHeader_get(request, "Host") == NULL)
     {
-        printf("Too few arguments\n");
-        exit(1);
+        if (ParsedHeader_set(request, "Host", request->host) < 0)
+        {
+            LOG(LOG_ERROR, "Set \"Host\" header key not working\n");
+        }
     }
 
-    printf("Setting Proxy Server Port : %d\n", port_number);
+    // Request body framing: chunked wins over Content-Length (RFC 7230 3.3.3), which is not sent on
+    int chunked = requestFraming(request) == 1;
+    if (chunked)
+        ParsedHeader_remove(request, "Content-Length");
+    struct ParsedHeader *cl = ParsedHeader_get(request, "Content-Length");
+    long content_length = cl != NULL ? contentLength(cl->value) : 0; // checked by requestFraming
+
+    // We stream the body right away, so answer the client's Expect ourselves
+    int send_continue = 0;
+    struct ParsedHeader *expect = ParsedHeader_get(request, "Expect");
+    if (expect != NULL && !strcasecmp(expect->value, "100-continue"))
+    {
+        ParsedHeader_remove(request, "Expect");
+        send_continue = chunked || content_length > body_len;
+    }
 
-    // Creating a socket for the proxy server
-    proxy_socketId = socket(AF_INET, SOCK_STREAM, 0);
+    ParsedHeader_remove(request, "Proxy-Connection"); // hop-by-hop, meant for us only
 
-    if (proxy_socketId < 0)
+    // The owner of the key fetches and caches it, we only replicate hot keys
+    int remoteSocketID = -1;
+    int max_ttl = 0;
+    if (peer != NULL && !peer->self)
     {
-        perror("Failed to create socket.\n");
-        exit(1);
+        remoteSocketID = connectRemoteServer(peer->host, peer->port);
+        if (remoteSocketID >= 0)
+        {
+            Metrics_add(M_PEER_FETCHES, 1);
+            ParsedHeader_set(request, PEER_HEADER, Peer_selfName());
+            max_ttl = Peer_hot(key) ? PEER_REPLICA_TTL : -1;
+        }
+        else
+            Metrics_add(M_PEER_FAILURES, 1); // go to the origin ourselves
     }
+    else
+        ParsedHeader_remove(request, PEER_HEADER);
 
-    int reuse = 1;
-    if (setsockopt(proxy_socketId, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) < 0)
-        perror("setsockopt(SO_REUSEADDR) failed\n");
+    // Sized for the outgoing request line and headers, taken from the worker's pool
+    // A peer is a proxy too and gets the absolute URL, which is the cache key
+    const char *target = remoteSocketID >= 0 ? key : request->path;
+    size_t buf_size = strlen(request->method) + strlen(target) + strlen(request->version) + 5 +
+                      ParsedHeader_headersLen(request);
+    char *buf = BufferPool_get(thread_pool, buf_size, NULL);
+    snprintf(buf, buf_size, "%s %s %s\r\n", request->method, target, request->version);
 
-    bzero((char *)&server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port_number); // Port number assigned to the server
-    server_addr.sin_addr.s_addr = INADDR_ANY;  // IP address of the server
+    size_t len = strlen(buf);
 
-    // Binding the socket to the port
-    if (bind(proxy_socketId, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    if (ParsedRequest_unparse_headers(request, buf + len, buf_size - len - 1) < 0)
     {
-        perror("Port is not free\n");
-        exit(1);
+        LOG(LOG_ERROR, "Gold Eagle Actual to Bravo-6. The unparse is fucked John.\n");
+        // return -1;				// If this happens Still try to send request without header
+        strcpy(buf + len, "\r\n");
+    }
+    else
+    {
+        buf[len + ParsedHeader_headersLen(request)] = '\0'; // unparse does not terminate
     }
-    printf("Binding on port: %d\n", port_number);
-
-    // Listening to the clients
-    int listen_status = listen(proxy_socketId, MAX_CLIENTS);
 
-    if (listen_status < 0)
+    struct Backend *backend = NULL;
+    if (remoteSocketID < 0 && route != NULL)
     {
-        perror("Error while Listening !\n");
-        exit(1);
+        // A refused connect is retried once on another backend, nothing was sent yet
+        struct Backend *refused = NULL;
+        for (int attempt = 0; attempt < 2 && remoteSocketID < 0; attempt++)
+        {
+            backend = Upstream_pick(route, refused);
+            if (backend == NULL)
+                break; // the refused backend is the route's only one
+            remoteSocketID = connectRemoteServer(backend->host, backend->port);
+            if (remoteSocketID < 0)
+            {
+                Upstream_release(backend, 0);
+                refused = backend;
+            }
+        }
     }
+    else if (remoteSocketID < 0)
+    {
+        int server_port = 80; // Default Remote Server Port
+        if (request->port != NULL)
+            server_port = atoi(request->port);
 
-    int i = 0;                           // Index for the thread array
-    int Connected_socketId[MAX_CLIENTS]; // Array to store the connected clients
+        remoteSocketID = connectRemoteServer(request->host, server_port);
+    }
 
-    // Infinite loop to accept the clients
-    while (1)
+    if (remoteSocketID < 0)
     {
+        BufferPool_put(thread_pool, buf);
+        return -1;
+    }
 
-        bzero((char *)&client_addr, sizeof(client_addr)); // Setting the client address to 0
-        client_len = sizeof(client_addr);
+    int bytes_send = send_all(remoteSocketID, buf, strlen(buf));
 
-        // Accepting the connection from the client
-        client_socketId = accept(proxy_socketId, (struct sockaddr *)&client_addr, (socklen_t *)&client_len); // Accepting the connection from the client
-        if (client_socketId < 0)
-        {
-            fprintf(stderr, "Error in Accepting connection !\n");
-            exit(1);
-        }
-        else
+    if (bytes_send >= 0 && send_continue)
+        send_all(clientSocket, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+
+    if (bytes_send >= 0 && chunked)
+        bytes_send = relay_chunked_body(clientSocket, remoteSocketID, body, body_len);
+    else if (bytes_send >= 0 && content_length > 0)
+        bytes_send = relay_fixed_body(clientSocket, remoteSocketID, body, body_len, content_length);
+
+    if (bytes_send < 0)
+    {
+        LOG(LOG_WARN, "Bravo-6 to Gold Eagle Actual. Request body relay failed.\n");
+        BufferPool_put(thread_pool, buf);
+        if (backend != NULL)
+            Upstream_release(backend, 1); // the client gave up, not the backend
+        close(remoteSocketID);
+        return -1;
+    }
+
+    BufferPool_put(thread_pool, buf);
+
+    int status;
+    Trace_enter(T_TTFB);
+    int ret = relay_response(clientSocket, remoteSocketID, request, key, &status, Metrics_nowUs(), max_ttl);
+    if (backend != NULL)
+        Upstream_release(backend, status > 0 && status != 502 && status != 503 && status != 504);
+    if (isUnsafeMethod(request->method) && status > 0 && status < 400)
+    {
+        invalidate_cache_element(key);
+        if (thread_access != NULL)
+            thread_access->replay_flags |= REPLAY_INVALIDATE;
+    }
+    LOG(LOG_DEBUG, "Done\n");
+
+    close(remoteSocketID);
+    // Once the response has started, a 500 would corrupt it
+    return ret < 0 && status < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Opens a CONNECT tunnel to the requested host and relays it until closed
+ * @param clientSocket Client socket descriptor
+ * @param request Parsed CONNECT request (host and port of the target)
+ * @param early Bytes the client sent after the request headers (e.g. a TLS hello)
+ * @param early_len Number of bytes in early
+ * @return 0 if the tunnel was established, -1 if the target could not be reached
+ */
+int handle_connect(int clientSocket, struct ParsedRequest *request, char *early, int early_len)
+{
+    int remoteSocketID = connectRemoteServer(request->host, atoi(request->port));
+    if (remoteSocketID < 0)
+        return -1;
+
+    const char *established = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    if (send_all(clientSocket, established, strlen(established)) < 0 ||
+        (early_len > 0 && send_all(remoteSocketID, early, early_len) < 0))
+    {
+        close(remoteSocketID);
+        return 0;
+    }
+
+    long relayed = Tunnel_relay(clientSocket, remoteSocketID, tunnel_idle_seconds);
+    if (thread_access != NULL)
+    {
+        thread_access->status = 200;
+        thread_access->bytes = relayed;
+    }
+    LOG(LOG_INFO, "Tunnel to %s:%s closed after %ld bytes\n", request->host, request->port, relayed);
+    close(remoteSocketID);
+    return 0;
+}
+
+/**
+ * @brief Sends a cached response to the client
+ * @param socket Client socket descriptor
+ * @param element Cache entry to send
+ * @param head_only Send only the status line and headers (HEAD request)
+ * @return Number of bytes sent, -1 on error
+ */
+int send_cached_response(int socket, cache_element *element, int head_only)
+{
+    int size = element->len;
+    if (head_only)
+    {
+        char *end = (char *)memmem(element->data, element->len, "\r\n\r\n", 4);
+        if (end != NULL)
+            size = end + 4 - element->data;
+    }
+    return send_all(socket, element->data, size);
+}
+
+/**
+ * @brief Validates HTTP version in request
+ * @param msg HTTP version string
+ * @return 1 if valid version (1.0/1.1), -1 otherwise
+ */
+int checkHTTPversion(char *msg)
+{
+    int version = -1;
+
+    if (strncmp(msg, "HTTP/1.1", 8) == 0)
+    {
+        version = 1;
+    }
+    else if (strncmp(msg, "HTTP/1.0", 8) == 0)
+    {
+        version = 1; // Handling this similar to version 1.1
+    }
+    else
+        version = -1;
+
+    return version;
+}
+
+/**
+ * @brief Claims a free worker buffer pool; one is free for every semaphore slot
+ * @return Index of the claimed pool in worker_pools
+ */
+int acquire_worker_pool()
+{
+    while (1)
+    {
+        unsigned long busy = __atomic_load_n(&worker_pools_busy, __ATOMIC_ACQUIRE);
+        for (int slot = 0; slot < MAX_CLIENTS; slot++)
         {
-            Connected_socketId[i] = client_socketId; // Storing the connected client socket id
+            if (!(busy & (1UL << slot)) &&
+                __atomic_compare_exchange_n(&worker_pools_busy, &busy, busy | (1UL << slot), 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return slot;
         }
+    }
+}
 
-        // Printing the client details
-        struct sockaddr_in *client_pt = (struct sockaddr_in *)&client_addr;
-        struct in_addr ip_addr = client_pt->sin_addr;
-        char str[INET_ADDRSTRLEN]; // String to store the IP address of the client
-        inet_ntop(AF_INET, &ip_addr, str, INET_ADDRSTRLEN);
-        printf("Client is connected with port number: %d and ip address: %s \n", ntohs(client_addr.sin_port), str);
+/**
+ * @brief Hands a worker buffer pool back for the next connection
+ * @param slot Index returned by acquire_worker_pool
+ */
+void release_worker_pool(int slot)
+{
+    __atomic_fetch_and(&worker_pools_busy, ~(1UL << slot), __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Gauge readers for the metrics endpoint
+ */
+long cacheBytesGauge() { return ShmCache_enabled() ? ShmCache_size() : cache_size; }
+long cacheElementsGauge() { return ShmCache_enabled() ? ShmCache_count() : cache_count; }
+long cacheRetiredGauge() { return ShmCache_enabled() ? ShmCache_retired() : cache_retired_size; }
+long activeClientsGauge()
+{
+    int free_slots;
+    sem_getvalue(&seamaphore, &free_slots);
+    pthread_mutex_lock(&clients_lock);
+    int active = max_clients + clients_owed - free_slots;
+    pthread_mutex_unlock(&clients_lock);
+    return active;
+}
 
-        pthread_create(&tid[i], NULL, thread_fn, (void *)&Connected_socketId[i]); // Creating a thread for the client
-        i++;
+/**
+ * @brief Changes how many client requests are served at once
+ * @param n New limit, at most MAX_CLIENTS
+ * @return 0, or -1 if n is out of range
+ */
+int setMaxClients(long n)
+{
+    if (n < 1 || n > MAX_CLIENTS)
+        return -1;
+    pthread_mutex_lock(&clients_lock);
+    int delta = n - max_clients;
+    max_clients = n;
+    for (; delta > 0 && clients_owed > 0; delta--)
+        clients_owed--;
+    for (; delta > 0; delta--)
+        sem_post(&seamaphore);
+    for (; delta < 0; delta++)
+    {
+        // Slots held by connections are taken back when they finish
+        if (sem_trywait(&seamaphore) < 0)
+            clients_owed++;
     }
-    close(proxy_socketId); // Close socket
+    pthread_mutex_unlock(&clients_lock);
     return 0;
 }
 
 /**
- * @brief Searches for URL in cache with thread safety
- * @param url URL to search for
- * @return Pointer to cache element if found, NULL otherwise
+ * @brief Hands the semaphore slot of a finished connection back, unless the limit was lowered
+ */
+void releaseClientSlot()
+{
+    pthread_mutex_lock(&clients_lock);
+    if (clients_owed > 0)
+        clients_owed--;
+    else
+        sem_post(&seamaphore);
+    pthread_mutex_unlock(&clients_lock);
+}
+
+long maxClientsSetting() { return max_clients; }
+
+int setIoBufferSize(long n)
+{
+    if (n < MAX_BYTES || n > MAX_IO_BUFFER)
+        return -1;
+    io_buffer_size = n;
+    return 0;
+}
+
+long ioBufferSetting() { return io_buffer_size; }
+
+/**
+ * @brief Checks for a request upgrading its connection to HTTP/2 ("Upgrade: h2c")
+ * @param request Parsed request; its upgrade headers are replaced by "Connection: close"
+ * @param body_len Bytes received after the headers
+ * @param settings Receives the HTTP2-Settings header
+ * @param settings_size Size of settings
+ * @param out_len Receives the length of the returned request
+ * @return The request to answer as stream 1 (heap allocated), or NULL to answer it over HTTP/1.1
+ */
+char *h2cUpgrade(struct ParsedRequest *request, int body_len, char *settings, size_t settings_size, int *out_len)
+{
+    struct ParsedHeader *upgrade = ParsedHeader_get(request, "Upgrade");
+    struct ParsedHeader *h2_settings = ParsedHeader_get(request, "HTTP2-Settings");
+    struct ParsedHeader *length = ParsedHeader_get(request, "Content-Length");
+    // A request with a body stays on HTTP/1.1, which a server may choose
+    if (upgrade == NULL || h2_settings == NULL || strcasecmp(upgrade->value, "h2c") != 0 ||
+        strlen(h2_settings->value) >= settings_size || request->host == NULL || request->path == NULL ||
+        body_len > 0 || (length != NULL && contentLength(length->value) != 0) ||
+        ParsedHeader_get(request, "Transfer-Encoding") != NULL)
+        return NULL;
+    strcpy(settings, h2_settings->value);
+    ParsedHeader_remove(request, "Upgrade");
+    ParsedHeader_remove(request, "HTTP2-Settings");
+    ParsedHeader_set(request, "Connection", "close");
+    size_t len = ParsedRequest_totalLen(request);
+    char *out = (char *)malloc(len);
+    if (out == NULL || ParsedRequest_unparse(request, out, len) < 0)
+    {
+        free(out);
+        return NULL;
+    }
+    *out_len = len;
+    return out;
+}
+
+/**
+ * @brief Fills in the method and url of an access log entry
+ * @param access Access log entry
+ * @param request Parsed request
+ */
+void recordRequest(struct AccessRecord *access, struct ParsedRequest *request)
+{
+    snprintf(access->method, sizeof(access->method), "%s", request->method);
+    snprintf(access->url, sizeof(access->url), "%s%s%s", request->host,
+             request->port ? ":" : "", request->port ? request->port : "");
+    if (request->path != NULL)
+        strncat(access->url, request->path, sizeof(access->url) - strlen(access->url) - 1);
+}
+
+/**
+ * @brief Waits for a client slot
+ * @param timeout_us Longest wait in microseconds, -1 to wait as long as it takes
+ * @return 1 once the slot is taken, 0 if the wait timed out
  */
-cache_element *find(char *url)
+int waitClientSlot(long timeout_us)
 {
+    if (timeout_us < 0)
+    {
+        sem_wait(&seamaphore);
+        return 1;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_us / 1000000;
+    deadline.tv_nsec += (timeout_us % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while (sem_timedwait(&seamaphore, &deadline) < 0)
+    {
+        if (errno != EINTR)
+            return 0;
+    }
+    return 1;
+}
 
-    // If cache is not empty searches for the node which has the least lru_time_track and deletes it
-    cache_element *site = NULL;
+int startConnection(int socket);
 
-    int temp_lock_val = pthread_mutex_lock(&lock);
-    printf("Remove Cache Lock Acquired %d\n", temp_lock_val);
-    if (head != NULL)
+/**
+ * @brief Answers a connection that gave up waiting for a client slot: from the cache on a hit, with 503 otherwise
+ * @param socket Client socket descriptor, closed here
+ * @param client_ip Client address, 0 if unknown
+ */
+void shedConnection(int socket, unsigned int client_ip)
+{
+    struct AccessRecord access;
+    memset(&access, 0, sizeof(access));
+    access.cache = '-';
+    thread_access = &access;
+
+    // An idle or slow client must not hold a shed thread: the head gets one admission interval to arrive
+    long interval_us = Admission_interval() * 1000;
+    struct timeval timeout = {interval_us / 1000000, interval_us % 1000000};
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    long deadline = Metrics_nowUs() + interval_us; // bytes trickling in do not extend it
+
+    // No slot, so no pooled buffer either
+    char *buffer = (char *)malloc(max_request_head);
+    int total = 0;
+    char *header_end = NULL;
+    int timed_out = 0;
+    int n = 0;
+    while (buffer != NULL && total < max_request_head - 1 &&
+           (n = PROF_BLOCKING(PROF_RECV, recv(socket, buffer + total, max_request_head - 1 - total, 0))) > 0)
     {
-        site = head;
-        while (site != NULL)
+        total += n;
+        buffer[total] = '\0';
+        if ((header_end = strstr(buffer, "\r\n\r\n")) != NULL)
+            break;
+        if (Metrics_nowUs() >= deadline)
         {
-            if (!strcmp(site->url, url))
+            timed_out = 1;
+            break;
+        }
+    }
+    if (buffer != NULL && header_end == NULL && n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        timed_out = 1;
+
+    if (timed_out)
+    {
+        Metrics_add(M_SHED, 1);
+        sendErrorMessage(socket, 503); // with Retry-After, rather than waiting any longer
+    }
+    else if (header_end != NULL && H2_isPreface(buffer, total))
+    {
+        thread_access = NULL;
+        thread_client_ip = client_ip;
+        H2_serve(socket, buffer, total, NULL, 0, NULL, startConnection); // its streams queue one by one
+    }
+    else if (header_end != NULL)
+    {
+        long started = Metrics_nowUs();
+        Metrics_add(M_REQUESTS, 1);
+        struct ParsedRequest *request = ParsedRequest_create();
+        cache_element *hit = NULL;
+        int limited = 0;
+        if (ParsedRequest_parse(request, buffer, header_end + 4 - buffer) == 0)
+        {
+            recordRequest(&access, request);
+            limited = !RateLimit_admitClient(client_ip);
+            if (!limited && request->host != NULL && request->path != NULL &&
+                (!strcmp(request->method, "GET") || !strcmp(request->method, "HEAD")) &&
+                (Upstream_routeCount() == 0 || Upstream_match(request->host, request->path) != NULL))
+            {
+                size_t key_size = strlen(request->protocol) + strlen(request->host) + strlen(request->path) +
+                                  (request->port ? strlen(request->port) : 0) + 5;
+                char *key = (char *)malloc(key_size);
+                cacheKey(request, key, key_size);
+                hit = find(key, requestHeader, request);
+                free(key);
+            }
+        }
+        if (hit != NULL)
+        {
+            int sent = send_cached_response(socket, hit, !strcmp(request->method, "HEAD"));
+            Metrics_add(M_CACHE_HITS, 1);
+            Metrics_add(M_SHED_HITS, 1);
+            access.cache = 'H';
+            if (sent > 0)
             {
-                printf("LRU Time Track Before : %ld", site->lru_time_track);
-                printf("\nurl found\n");
-                // Updating the time track of the accessed element
-                site->lru_time_track = time(NULL);
-                printf("LRU Time Track After : %ld", site->lru_time_track);
+                Metrics_add(M_BYTES_FROM_CACHE, sent);
+                access.bytes = sent;
+                access.status = responseStatus(hit->data, hit->len);
+                access.object_size = hit->len;
+            }
+            release_cache_element(hit);
+        }
+        else if (limited)
+        {
+            Metrics_add(M_RATE_LIMITED, 1);
+            sendErrorMessage(socket, 429);
+        }
+        else
+        {
+            Metrics_add(M_SHED, 1);
+            sendErrorMessage(socket, 503);
+        }
+        ParsedRequest_destroy(request);
+        access.duration_us = Metrics_nowUs() - started;
+        Metrics_observe(H_REQUEST, access.duration_us);
+        access.client_ip = client_ip;
+        RateLimit_charge(client_ip, access.bytes);
+        Log_access(&access);
+    }
+
+    thread_access = NULL;
+    free(buffer);
+    shutdown(socket, SHUT_RDWR);
+    close(socket);
+}
+
+/**
+ * @brief Thread handler function for processing client requests
+ * @param connNew Heap allocated struct ClientConnection, freed here
+ * @return NULL
+ */
+void *thread_fn(void *connNew)
+{
+    struct ClientConnection conn = *(struct ClientConnection *)connNew;
+    free(connNew);
+    long queued = Metrics_nowUs();
+    int admitted = waitClientSlot(Admission_timeoutUs());
+    long semaphore_wait = Metrics_nowUs() - queued;
+    Admission_observe(queued + semaphore_wait, semaphore_wait);
+    Metrics_observe(H_SEMAPHORE_WAIT, semaphore_wait);
+    if (!admitted)
+    {
+        shedConnection(conn.socket, conn.client_ip);
+        __atomic_sub_fetch(&open_connections, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    int p;
+    sem_getvalue(&seamaphore, &p);
+    LOG(LOG_DEBUG, "semaphore value:%d\n", p);
+    int socket = conn.socket;              // Socket is socket descriptor of the connected Client
+    thread_client_ip = conn.client_ip;     // HTTP/2 streams count against the connection's client
+    int bytes_send_client, len;            // Number of bytes to be transferred
+    int total = 0;                         // Number of bytes received so far
+    char *header_end = NULL;               // Points at the "\r\n\r\n" ending the headers
+    int slot = acquire_worker_pool();      // Buffers of this worker, reused across connections
+    thread_pool = &worker_pools[slot];
+    Metrics_bindShard(slot);
+    Log_bindRing(slot);
+    bind_l1_cache(slot);
+    Prof_blocked(PROF_SEMAPHORE, semaphore_wait); // charged to the worker that then serves it
+
+    struct AccessRecord access; // Filled in as the request is served, logged at the end
+    memset(&access, 0, sizeof(access));
+    access.cache = '-';
+    thread_access = &access;
+
+    Trace_begin(conn.accepted_us, slot);
+    Trace_leave(T_QUEUE);
+    Trace_enter(T_HEADERS);
+
+    char *h2_early = NULL;    // HTTP/2 bytes received so far, from the preface on
+    int h2_early_len = 0;
+    char *h2_request = NULL;  // request upgraded to HTTP/2, answered as stream 1
+    int h2_request_len = 0;
+    char h2_settings[256];    // its HTTP2-Settings
+
+    size_t buffer_size;
+    char *buffer = BufferPool_get(thread_pool, MAX_BYTES, &buffer_size); // Starts at 4kb, grows up to max_request_head
+
+    bytes_send_client = PROF_BLOCKING(PROF_RECV, recv(socket, buffer, buffer_size - 1, 0)); // Receiving the request of client by proxy server
+
+    while (bytes_send_client > 0)
+    {
+        total += bytes_send_client;
+        buffer[total] = '\0';
+        // loop until u find "\r\n\r\n" in the buffer
+        header_end = strstr(buffer, "\r\n\r\n");
+        if (header_end != NULL || total >= max_request_head - 1)
+        {
+            break;
+        }
+        if ((size_t)total == buffer_size - 1)
+        {
+            // Never past max_request_head, so the default 64KB stays in the largest pool class
+            size_t want = 2 * buffer_size < (size_t)max_request_head ? 2 * buffer_size : (size_t)max_request_head;
+            char *bigger = BufferPool_grow(thread_pool, buffer, total, want, &buffer_size);
+            if (bigger == NULL)
                 break;
+            buffer = bigger;
+        }
+        size_t room = buffer_size - 1 - total;
+        if (room > (size_t)(max_request_head - 1 - total))
+            room = max_request_head - 1 - total;
+        bytes_send_client = PROF_BLOCKING(PROF_RECV, recv(socket, buffer + total, room, 0));
+    }
+    Trace_leave(T_HEADERS);
+
+    if (header_end != NULL && H2_isPreface(buffer, total))
+    {
+        h2_early = (char *)malloc(total);
+        if (h2_early != NULL)
+            memcpy(h2_early, buffer, total);
+        h2_early_len = total;
+    }
+    else if (header_end != NULL)
+    {
+        len = header_end + 4 - buffer; // Request line and headers, the rest is body
+        long started = Metrics_nowUs();
+        Metrics_add(M_REQUESTS, 1);
+        // Parsing the request
+        struct ParsedRequest *request = ParsedRequest_create();
+        int parsed = ParsedRequest_parse(request, buffer, len);
+        if (parsed == 0)
+            recordRequest(&access, request);
+        if (parsed < 0)
+        {
+            LOG(LOG_INFO, "Parsing failed\n");
+            sendErrorMessage(socket, 400);
+        }
+        else if ((h2_request = h2cUpgrade(request, total - len, h2_settings, sizeof(h2_settings), &h2_request_len)) != NULL)
+        {
+            LOG(LOG_DEBUG, "Upgrading to HTTP/2\n"); // stream 1 is logged by the thread serving it
+        }
+        else if (!RateLimit_admitClient(conn.client_ip))
+        {
+            Metrics_add(M_RATE_LIMITED, 1);
+            sendErrorMessage(socket, 429);
+        }
+        else if (!strcmp(request->method, "CONNECT") && checkHTTPversion(request->version) == 1)
+        {
+            Metrics_add(M_CACHE_BYPASS, 1);
+            access.cache = 'B';
+            if (Upstream_routeCount() > 0)
+                sendErrorMessage(socket, 403); // a reverse proxy does not tunnel
+            else if (handle_connect(socket, request, header_end + 4, total - len) < 0)
+                sendErrorMessage(socket, 502);
+        }
+        else if (!(request->host && request->path && (checkHTTPversion(request->version) == 1)))
+        {
+            sendErrorMessage(socket, 500); // 500 Internal Error
+        }
+        else if (request->origin_form && Upstream_routeCount() == 0)
+        {
+            LOG(LOG_INFO, "Origin-form request but no reverse proxy routes\n");
+            sendErrorMessage(socket, 400);
+        }
+        else if (!isSupportedMethod(request->method))
+        {
+            LOG(LOG_INFO, "This code doesn't support the %s method\n", request->method);
+            sendErrorMessage(socket, 501);
+        }
+        else if (requestFraming(request) < 0)
+        {
+            LOG(LOG_INFO, "Ambiguous or unsupported request body framing\n");
+            sendErrorMessage(socket, 400);
+        }
+        else
+        {
+            size_t key_size = strlen(request->protocol) + strlen(request->host) + strlen(request->path) +
+                              (request->port ? strlen(request->port) : 0) + 5;
+            char *key = BufferPool_get(thread_pool, key_size, NULL);
+            cacheKey(request, key, key_size);
+            if (replay_path != NULL)
+            {
+                access.key_hash = Log_keyHash(key);
+                access.key_len = strlen(key);
+            }
+
+            // In reverse proxy mode only routed hosts are served
+            struct Route *route = NULL;
+            if (Upstream_routeCount() > 0)
+                route = Upstream_match(request->host, request->path);
+
+            // checking for the request in cache
+            struct cache_element *temp = NULL;
+            if (route != NULL || Upstream_routeCount() == 0)
+            {
+                if (!strcmp(request->method, "GET") || !strcmp(request->method, "HEAD"))
+                {
+                    temp = find(key, requestHeader, request);
+                    Metrics_add(temp != NULL ? M_CACHE_HITS : M_CACHE_MISSES, 1);
+                    access.cache = temp != NULL ? 'H' : 'M';
+                    access.replay_flags |= REPLAY_LOOKUP;
+                }
+                else
+                {
+                    Metrics_add(M_CACHE_BYPASS, 1);
+                    access.cache = 'B';
+                }
+            }
+
+            if (route == NULL && Upstream_routeCount() > 0)
+            {
+                LOG(LOG_INFO, "No route for %s%s\n", request->host, request->path);
+                sendErrorMessage(socket, 404);
+            }
+            else if (temp != NULL)
+            {
+                // send respose as request has been found in the cache
+                Trace_enter(T_SEND);
+                int sent = send_cached_response(socket, temp, !strcmp(request->method, "HEAD"));
+                Trace_leave(T_SEND);
+                if (sent > 0)
+                {
+                    Metrics_add(M_BYTES_FROM_CACHE, sent);
+                    access.bytes = sent;
+                    access.status = responseStatus(temp->data, temp->len);
+                    access.object_size = temp->len;
+                    if (access.status == 200)
+                        access.replay_flags |= REPLAY_CACHEABLE;
+                    else
+                        Metrics_add(M_NEGATIVE_HITS, 1); // a cached failure
+                }
+                LOG(LOG_DEBUG, "Data has been received from the Cache\n");
+                release_cache_element(temp);
+            }
+            else if (!RateLimit_admitHost(request->host))
+            {
+                Metrics_add(M_RATE_LIMITED, 1);
+                sendErrorMessage(socket, 429);
+            }
+            else
+            {
+                // In cluster mode misses and unsafe requests go through the key's owner, unless a peer sent them
+                struct PeerNode *peer = NULL;
+                if (Peer_count() > 0 && ParsedHeader_get(request, PEER_HEADER) == NULL)
+                    peer = Peer_owner(key);
+                bytes_send_client = handle_request(socket, request, key, header_end + 4, total - len, route, peer);
+                if (peer != NULL)
+                    Peer_release(peer);
+                if (bytes_send_client == -1)
+                {
+                    sendErrorMessage(socket, route != NULL ? 502 : 500);
+                }
             }
-            site = site->next;
+            BufferPool_put(thread_pool, key);
         }
+        ParsedRequest_destroy(request);
+        access.duration_us = Metrics_nowUs() - started;
+        Metrics_observe(H_REQUEST, access.duration_us);
+
+        access.client_ip = conn.client_ip;
+        RateLimit_charge(conn.client_ip, access.bytes);
+        if (h2_request == NULL)
+            Log_access(&access);
+    }
+
+    else if (bytes_send_client < 0)
+    {
+        LOG(LOG_WARN, "Error in receiving from client: %s\n", strerror(errno));
+    }
+    else if (bytes_send_client == 0)
+    {
+        LOG(LOG_DEBUG, "Client disconnected!\n");
     }
     else
     {
-        printf("\nurl not found\n");
+        sendErrorMessage(socket, 431); // Headers did not fit in max_request_head
+    }
+
+    Trace_end(access.status, access.method, access.url);
+
+    int h2 = h2_early != NULL || h2_request != NULL;
+    if (!h2)
+    {
+        if (!client_detached)
+            shutdown(socket, SHUT_RDWR); // else the spool writer's duplicate still sends the response
+        close(socket);
+        client_detached = 0;
+    }
+    BufferPool_put(thread_pool, buffer);
+    thread_pool = NULL;
+    thread_access = NULL;
+    Metrics_unbindShard();
+    Log_unbindRing();
+    unbind_l1_cache();
+    release_worker_pool(slot);
+    releaseClientSlot();
+    if (h2)
+    {
+        // The connection holds no slot while open, each stream's thread takes one as any client does
+        H2_serve(socket, h2_early, h2_early_len, h2_request, h2_request_len, h2_settings, startConnection);
+        free(h2_early);
+        free(h2_request);
+        shutdown(socket, SHUT_RDWR);
+        close(socket);
     }
+    __atomic_sub_fetch(&open_connections, 1, __ATOMIC_RELEASE);
 
-    temp_lock_val = pthread_mutex_unlock(&lock);
-    printf("Remove Cache Lock Unlocked %d\n", temp_lock_val);
-    return site;
+    sem_getvalue(&seamaphore, &p);
+    LOG(LOG_DEBUG, "Semaphore post value:%d\n", p);
+    return NULL;
 }
 
 /**
- * @brief Removes least recently used element from cache with thread safety
+ * @brief Starts a thread serving a client connection
+ * @param socket Client socket descriptor, closed if no thread could be started
+ * @param client_ip Client address, 0 if unknown
+ * @return 0, or -1 on error
  */
-void remove_cache_element()
+int startClient(int socket, unsigned int client_ip)
 {
-    // If cache is not empty searches for the node which has the least lru_time_track and deletes it
-    cache_element *p;
-    cache_element *q;
-    cache_element *temp;
-    // sem_wait(&cache_lock);
-    int temp_lock_val = pthread_mutex_lock(&lock);
-    printf("Remove Cache Lock Acquired %d\n", temp_lock_val);
-    if (head != NULL)
-    { // Cache != empty
-        for (q = head, p = head, temp = head; q->next != NULL;
-             q = q->next)
-        { // Finding the element with the least lru_time_track
-            if (((q->next)->lru_time_track) < (temp->lru_time_track))
-            {
-                temp = q->next;
-                p = q;
-            }
+    struct ClientConnection *conn = (struct ClientConnection *)malloc(sizeof(struct ClientConnection));
+    if (conn == NULL)
+    {
+        close(socket);
+        return -1;
+    }
+    conn->socket = socket;
+    conn->accepted_us = Metrics_nowUs();
+    conn->client_ip = client_ip;
+
+    pthread_t tid;
+    __atomic_add_fetch(&open_connections, 1, __ATOMIC_RELAXED);
+    if (pthread_create(&tid, &client_attr, thread_fn, conn) != 0) // Creating a thread for the client
+    {
+        LOG(LOG_ERROR, "Could not create a thread for the client\n");
+        close(socket);
+        free(conn);
+        __atomic_sub_fetch(&open_connections, 1, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Starts a thread serving a request of the connection the calling thread serves (an HTTP/2 stream)
+ * @param socket Socket carrying the request, closed if no thread could be started
+ * @return 0, or -1 on error
+ */
+int startConnection(int socket)
+{
+    return startClient(socket, thread_client_ip);
+}
+
+/**
+ * @brief Forks a prefork worker process
+ * @param index Worker index
+ * @return 0 in the worker, its pid (or -1) in the master
+ */
+pid_t spawnWorker(int index)
+{
+    fflush(stdout); // or the worker prints what the master buffered again
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        prctl(PR_SET_PDEATHSIG, SIGTERM); // go down with the master
+        if (upgrade_fd >= 0)
+        {
+            close(upgrade_fd); // successors talk to the master
+            upgrade_fd = -1;
         }
-        if (temp == head)
+        if (ShmCache_attach() < 0)
         {
-            head = head->next; /*Handle the base case*/
+            printf("Worker %d found no free slot in the shared cache\n", index);
+            exit(1);
+        }
+    }
+    else if (pid < 0)
+        perror("Could not fork a worker\n");
+    return pid;
+}
+
+/**
+ * @brief Hands the listener and the shared cache to a successor, then drains the workers and exits
+ * @param pids Worker pids
+ * @param workers Number of workers
+ * @return -1 if the hand-off failed
+ */
+int handOffWorkers(pid_t *pids, int workers)
+{
+    int conn = Upgrade_handOff(upgrade_fd, proxy_socketId, ShmCache_fd());
+    if (conn < 0)
+        return -1;
+    close(conn);
+    printf("Handed over to a new proxy, draining %d workers\n", workers);
+    for (int i = 0; i < workers; i++)
+        kill(pids[i], SIGUSR2);
+    for (int i = 0; i < workers; i++)
+    {
+        while (waitpid(pids[i], NULL, 0) < 0 && errno == EINTR)
+            ;
+        ShmCache_reap(pids[i]);
+    }
+    exit(0);
+}
+
+/**
+ * @brief Runs the prefork master
+ *
+ * The master forks the workers, which all accept on the listening socket,
+ * and replaces any that exits, until a successor takes over. It never
+ * returns.
+ *
+ * @param workers Number of worker processes
+ * @return Index of the worker, in the worker process
+ */
+int preforkWorkers(int workers)
+{
+    pid_t pids[SHM_MAX_PROCS];
+    time_t started[SHM_MAX_PROCS];
+
+    for (int i = 0; i < workers; i++)
+    {
+        started[i] = time(NULL);
+        if ((pids[i] = spawnWorker(i)) == 0)
+            return i;
+    }
+    printf("Started %d worker processes\n", workers);
+
+    while (1)
+    {
+        int status;
+        pid_t pid;
+        if (upgrade_fd >= 0)
+        {
+            // Wake up for a successor as well as for exiting workers
+            struct pollfd control = {upgrade_fd, POLLIN, 0};
+            if (poll(&control, 1, 1000) > 0 && handOffWorkers(pids, workers) < 0)
+                printf("Hand-off to a new proxy failed\n");
+            pid = waitpid(-1, &status, WNOHANG);
         }
         else
+            pid = waitpid(-1, &status, 0);
+        if (pid <= 0)
+        {
+            if (pid == 0 || errno == EINTR)
+                continue;
+            perror("waitpid failed\n");
+            exit(1);
+        }
+        for (int i = 0; i < workers; i++)
         {
-            p->next = temp->next;
+            if (pids[i] != pid)
+                continue;
+            ShmCache_reap(pid);
+            if (WIFSIGNALED(status))
+                printf("Worker %d (pid %d) killed by signal %d, restarting it\n", i, pid, WTERMSIG(status));
+            else
+                printf("Worker %d (pid %d) exited with status %d, restarting it\n", i, pid, WEXITSTATUS(status));
+            if (time(NULL) - started[i] < 1)
+                sleep(1); // do not spin on a worker that dies at startup
+            started[i] = time(NULL);
+            if ((pids[i] = spawnWorker(i)) == 0)
+                return i;
         }
-        cache_size = cache_size - (temp->len) - sizeof(cache_element) -
-                     strlen(temp->url) - 1; // Updating the cache size
-        free(temp->data);
-        free(temp->url); // Freeing the memory of the element
-        free(temp);
     }
-    // sem_post(&cache_lock);
-    temp_lock_val = pthread_mutex_unlock(&lock);
-    printf("Remove Cache Lock Unlocked %d\n", temp_lock_val);
 }
 
 /**
- * @brief Adds new element to cache with thread safety
- * @param data Response data to cache
- * @param size Size of response data
- * @param url Request URL as cache key
- * @return 1 if successful, 0 if element too large
+ * @brief Tells the accept loop of a prefork worker to stop, on SIGUSR2 from the master
+ */
+void drainSignal(int sig)
+{
+    (void)sig;
+    ssize_t n = write(drain_pipe[1], "d", 1);
+    (void)n;
+}
+
+/**
+ * @brief Streams the cache to a successor, then tells the accept loop to stop
+ * @param arg Connection to the successor
+ */
+void *handOffCache(void *arg)
+{
+    int conn = (int)(intptr_t)arg;
+    int sent = Upgrade_sendCache(conn);
+    LOG(LOG_INFO, "Handed %d cache entries over\n", sent);
+    close(conn);
+    ssize_t n = write(drain_pipe[1], "d", 1);
+    (void)n;
+    return NULL;
+}
+
+/**
+ * @brief Waits for the connections being served to finish, for at most UPGRADE_DRAIN_SECONDS
+ */
+void drainConnections()
+{
+    close(proxy_socketId); // the successor accepts on it now
+    for (int i = 0; i < UPGRADE_DRAIN_SECONDS * 10 &&
+                    (__atomic_load_n(&open_connections, __ATOMIC_ACQUIRE) > 0 || Spool_clients() > 0);
+         i++)
+        usleep(100000);
+    LOG(LOG_INFO, "Drained, exiting with %d connections open\n", __atomic_load_n(&open_connections, __ATOMIC_ACQUIRE));
+    if (ShmCache_enabled())
+        ShmCache_detach();
+}
+
+/**
+ * @brief Sends the parser's debug output to the logger
+ * @param format printf style format
+ * @param args Format arguments
+ */
+void parserDebug(const char *format, va_list args)
+{
+    if (LOG_DEBUG <= log_level)
+        Log_vwrite(LOG_DEBUG, format, args);
+}
+
+/**
+ * @brief Main proxy server function
+ * @param argc Argument count
+ * @param argv Argument vector (expects port number)
+ * @return 0 on successful execution
  */
-int add_cache_element(char *data, int size, char *url)
+int main(int argc, char *argv[])
 {
-    // Adds element to the cache
-    // sem_wait(&cache_lock);
-    int temp_lock_val = pthread_mutex_lock(&lock);
-    printf("Add Cache Lock Acquired %d\n", temp_lock_val);
-    int element_size = size + 1 + strlen(url) + sizeof(cache_element); // Calculating the size of the element to be added
-    if (element_size > MAX_ELEMENT_SIZE)
+
+    int client_socketId, client_len;             // client_socketId == to store the client socket id
+    struct sockaddr_in server_addr, client_addr; // Address of client and server to be assigned
+
+    // A peer gone mid-write must be an EPIPE, not the end of the process: splice() has no MSG_NOSIGNAL.
+    // Set before any thread or worker exists, so every one of them inherits it.
+    signal(SIGPIPE, SIG_IGN);
+
+    sem_init(&seamaphore, 0, max_clients);
+    Config_register("cache_size", "cache capacity in bytes", cache_capacity, set_cache_capacity);
+    Config_register("max_element_size", "largest response cached, in bytes", cache_max_element, set_cache_max_element);
+    Config_register("max_clients", "client requests served at once", maxClientsSetting, setMaxClients);
+    Config_register("negative_ttl", "seconds origin failures are cached, 0 disables", negative_cache_ttl, set_negative_ttl);
+    Config_register("io_buffer_size", "bytes read at a time when relaying", ioBufferSetting, setIoBufferSize);
+    Config_register("queue_target_ms", "queue delay beyond which connections are shed, 0 disables", Admission_target, Admission_setTarget);
+    Config_register("queue_interval_ms", "interval the queue delay is judged over", Admission_interval, Admission_setInterval);
+    Config_register("client_rps", "requests per second per client IP, 0 for no limit", RateLimit_clientRequests, RateLimit_setClientRequests);
+    Config_register("client_burst", "requests a client IP may send at once", RateLimit_clientBurst, RateLimit_setClientBurst);
+    Config_register("client_bandwidth", "response bytes per second per client IP, 0 for no limit", RateLimit_clientBytes, RateLimit_setClientBytes);
+    Config_register("write_behind", "response bytes queued in memory for a slow client before spilling to disk, 0 disables", Spool_memory, Spool_setMemory);
+    Config_register("spool_disk", "bytes all slow-client responses may spill to disk together", Spool_disk, Spool_setDisk);
+    Config_register("host_rps", "requests per second sent to one origin host, 0 for no limit", RateLimit_hostRequests, RateLimit_setHostRequests);
+    for (int slot = 0; slot < MAX_CLIENTS; slot++)
+        BufferPool_init(&worker_pools[slot]);
+
+    int opt;
+    int level = LOG_INFO;
+    while ((opt = getopt(argc, argv, "H:R:b:T:A:l:a:t:w:L:c:s:P:N:W:U:D:")) != -1)
     {
-        // sem_post(&cache_lock);
-        //  free(data);
-        //  printf("--\n");
-        temp_lock_val = pthread_mutex_unlock(&lock);
-        printf("Add Cache Lock Unlocked %d\n", temp_lock_val);
-        // free(data);
-        // printf("--\n");
-        // free(url);
-        return 0;
+        switch (opt)
+        {
+        case 'H': // Largest request line + headers accepted before answering 431
+            max_request_head = atoi(optarg);
+            if (max_request_head < MAX_BYTES || max_request_head > MAX_REQ_LEN)
+            {
+                printf("Header limit must be between %d and %d bytes\n", MAX_BYTES, MAX_REQ_LEN);
+                exit(1);
+            }
+            break;
+        case 'R': // Reverse proxy route, see Upstream_addRoute
+            if (Upstream_addRoute(optarg) < 0)
+            {
+                printf("Bad route %s, expected host[/prefix]=backend:port[,backend:port...]\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'b': // Backend balancing policy
+            if (!strcmp(optarg, "lc"))
+                Upstream_setPolicy(BALANCE_LEAST_CONN);
+            else if (!strcmp(optarg, "p2c"))
+                Upstream_setPolicy(BALANCE_P2C);
+            else
+            {
+                printf("Balancing policy must be lc or p2c\n");
+                exit(1);
+            }
+            break;
+        case 'T': // Idle timeout of CONNECT tunnels
+            tunnel_idle_seconds = atoi(optarg);
+            if (tunnel_idle_seconds <= 0)
+            {
+                printf("Tunnel idle timeout must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'A': // Admin port serving /metrics, on the loopback interface
+            admin_port = atoi(optarg);
+            break;
+        case 'w': // Replay trace of cache requests
+            replay_path = optarg;
+            break;
+        case 't': // Trace one request in every N
+            trace_every = atoi(optarg);
+            break;
+        case 'L': // Entries of every worker's L1 cache
+            l1_entries = atoi(optarg);
+            if (l1_entries < 0 || (l1_entries & (l1_entries - 1)))
+            {
+                printf("L1 cache entries must be a power of two\n");
+                exit(1);
+            }
+            break;
+        case 'c': // Config file of name = value settings
+        {
+            int line = Config_load(optarg);
+            if (line != 0)
+            {
+                if (line < 0)
+                    printf("Could not read config file %s\n", optarg);
+                else
+                    printf("%s:%d: unknown setting or bad value\n", optarg, line);
+                exit(1);
+            }
+            break;
+        }
+        case 's': // One setting, name=value
+            if (Config_apply(optarg) < 0)
+            {
+                printf("Unknown setting or bad value %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'P': // Another node of the cluster
+            if (Peer_add(optarg) < 0)
+            {
+                printf("Bad peer %s, expected host:port\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'N': // Address the other nodes know this one by
+            self_host = optarg;
+            break;
+        case 'U': // Unix socket to hand over to a new binary on, or to take over from
+            upgrade_path = optarg;
+            break;
+        case 'D': // Directory of the files responses to slow clients spill to
+            if (Spool_setDir(optarg) < 0)
+            {
+                printf("Spool directory %s is not writable\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'W': // Worker processes sharing one cache
+            worker_processes = atoi(optarg);
+            if (worker_processes < 1 || worker_processes > SHM_MAX_PROCS / 2)
+            {
+                printf("Worker processes must be between 1 and %d\n", SHM_MAX_PROCS / 2); // half the slots, for an upgrade
+                exit(1);
+            }
+            break;
+        case 'l': // Log level
+            level = Log_levelByName(optarg);
+            if (level < 0)
+            {
+                printf("Log level must be error, warn, info or debug\n");
+                exit(1);
+            }
+            break;
+        case 'a': // Access log file
+            access_log_path = optarg;
+            break;
+        default:
+            printf("Usage: %s [-H max_header_bytes] [-R route]... [-b lc|p2c] [-T tunnel_idle_seconds] [-A admin_port] [-l level] [-a access_log] [-t trace_every] [-w replay_trace] [-L l1_entries] [-c config_file] [-s name=value]... [-P peer_host:port]... [-N self_host] [-W worker_processes] [-U upgrade_socket] [-D spool_dir] <port>\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (optind == argc - 1) // Checking if the port number is provided as an argument
+    {
+        port_number = atoi(argv[optind]);
     }
     else
     {
-        while (cache_size + element_size > MAX_SIZE)
-        {
-            // If the cache is full, remove the least recently used element
-            remove_cache_element();
-        }
-        cache_element *element = (cache_element *)malloc(sizeof(cache_element)); // Allocating memory for the cache element
-        element->data = (char *)malloc(size + 1);                                // Allocating memory for the response to be stored in the cache element
-        strcpy(element->data, data);
-        element->url = (char *)malloc(1 + (strlen(url) * sizeof(char))); // Allocating memory for the request to be stored in the cache element (as a key)
-        strcpy(element->url, url);
-        element->lru_time_track = time(NULL); // Updating the time_track
-        element->next = head;
-        element->len = size;
-        head = element;
-        cache_size += element_size;
-        temp_lock_val = pthread_mutex_unlock(&lock);
-        printf("Add Cache Lock Unlocked %d\n", temp_lock_val);
-        // sem_post(&cache_lock);
-        //  free(data);
-        //  printf("--\n");
-        //  free(url);
-        return 1;
+        printf("Too few arguments\n");
+        exit(1);
+    }
+
+    printf("Setting Proxy Server Port : %d\n", port_number);
+    if (Peer_count() > 0 && Peer_setSelf(self_host, port_number) < 0)
+    {
+        printf("Bad node name %s\n", self_host);
+        exit(1);
+    }
+
+    // Take the listening socket (and the cache) over from a running proxy, if there is one
+    int upgrade_conn = -1, cache_fd = -1;
+    if (upgrade_path != NULL && (upgrade_conn = Upgrade_takeOver(upgrade_path, &proxy_socketId, &cache_fd)) >= 0)
+        printf("Taking over from the proxy on %s\n", upgrade_path);
+    else
+    {
+        // Creating a socket for the proxy server
+        proxy_socketId = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (proxy_socketId < 0)
+        {
+            perror("Failed to create socket.\n");
+            exit(1);
+        }
+
+        int reuse = 1;
+        if (setsockopt(proxy_socketId, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) < 0)
+            perror("setsockopt(SO_REUSEADDR) failed\n");
+
+        bzero((char *)&server_addr, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port_number); // Port number assigned to the server
+        server_addr.sin_addr.s_addr = INADDR_ANY;  // IP address of the server
+
+        // Binding the socket to the port
+        if (bind(proxy_socketId, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        {
+            perror("Port is not free\n");
+            exit(1);
+        }
+        printf("Binding on port: %d\n", port_number);
+
+        // Listening to the clients
+        int listen_status = listen(proxy_socketId, MAX_CLIENTS);
+
+        if (listen_status < 0)
+        {
+            perror("Error while Listening !\n");
+            exit(1);
+        }
+    }
+    fcntl(proxy_socketId, F_SETFL, O_NONBLOCK); // accept() may lose a race with another process
+
+    if (cache_fd >= 0 && ShmCache_adopt(cache_fd) < 0)
+    {
+        perror("Could not map the cache handed over\n");
+        exit(1);
+    }
+    if (worker_processes > 0 && !ShmCache_enabled() && ShmCache_create(cache_capacity(), cache_max_element()) < 0)
+    {
+        perror("Could not map the shared cache\n");
+        exit(1);
+    }
+    if (upgrade_conn >= 0)
+    {
+        if (cache_fd < 0)
+        {
+            // Warm the cache before accepting, the old proxy keeps serving meanwhile
+            if (ShmCache_enabled())
+                ShmCache_attach();
+            printf("Loaded %d cache entries\n", Upgrade_receiveCache(upgrade_conn));
+            if (ShmCache_enabled())
+                ShmCache_detach();
+        }
+        close(upgrade_conn);
+    }
+    if (upgrade_path != NULL && (upgrade_fd = Upgrade_listen(upgrade_path)) < 0)
+    {
+        perror("Could not listen for upgrades\n");
+        exit(1);
+    }
+
+    // In prefork mode only the workers go on from here, the master stays single threaded
+    int worker = 0;
+    if (worker_processes > 0)
+    {
+        worker = preforkWorkers(worker_processes);
+        signal(SIGUSR2, drainSignal);
+    }
+    else if (ShmCache_enabled())
+        ShmCache_attach(); // handed over by a prefork master
+    if (pipe(drain_pipe) < 0)
+    {
+        perror("pipe failed\n");
+        exit(1);
+    }
+
+    if (Log_init(level, access_log_path, replay_path) < 0)
+    {
+        perror("Could not open the access log or replay trace\n");
+        exit(1);
+    }
+    debug_hook = parserDebug;
+    Trace_setSampling(trace_every);
+    set_l1_cache(MAX_CLIENTS, l1_entries);
+
+    if (admin_port > 0)
+    {
+        Metrics_gauge("proxy_cache_size_bytes", "Bytes accounted to cache entries", cacheBytesGauge);
+        Metrics_gauge("proxy_cache_entries", "Entries in the cache", cacheElementsGauge);
+        Metrics_gauge("proxy_cache_capacity_bytes", "Cache capacity", cache_capacity);
+        Metrics_gauge("proxy_cache_retired_bytes", "Bytes of removed cache entries not freed yet", cacheRetiredGauge);
+        Metrics_gauge("proxy_active_clients", "Client connections being served", activeClientsGauge);
+        Metrics_gauge("proxy_log_dropped", "Log records dropped because a ring was full", Log_dropped);
+        Metrics_gauge("proxy_spooled_bytes", "Response bytes queued for slow clients", Spool_queuedBytes);
+        Metrics_gauge("proxy_spooled_disk_bytes", "Response bytes for slow clients held in spill files", Spool_diskBytes);
+        Metrics_gauge("proxy_spooled_clients", "Clients the spool writer is finishing responses to", Spool_clients);
+        Metrics_gauge("proxy_overloaded", "1 while connections give up on a client slot after the target queue delay", Admission_overloaded);
+        Admin_register("/metrics", Metrics_render);
+        Admin_register("/trace", Trace_render);
+        Admin_register("/contention", Prof_render);
+        Admin_register("/config", Config_render);
+        // After a takeover the old proxy still holds the port until it starts draining
+        if (Admin_start(admin_port + worker, upgrade_conn >= 0 ? UPGRADE_DRAIN_SECONDS : 0) < 0)
+        {
+            perror("Admin port is not free\n");
+            exit(1);
+        }
+        printf("Admin interface on 127.0.0.1:%d\n", admin_port + worker);
+    }
+
+    pthread_attr_init(&client_attr);
+    pthread_attr_setdetachstate(&client_attr, PTHREAD_CREATE_DETACHED);
+
+    // Accept the clients until a successor takes over
+    struct pollfd fds[3] = {{proxy_socketId, POLLIN, 0}, {drain_pipe[0], POLLIN, 0}, {upgrade_fd, POLLIN, 0}};
+    while (1)
+    {
+        if (poll(fds, 3, -1) < 0)
+            continue; // EINTR
+        if (fds[1].revents & POLLIN)
+            break;
+        if (fds[2].revents & POLLIN)
+        {
+            // The successor gets the listener now and the cache next, we accept until it has the cache
+            int conn = Upgrade_handOff(upgrade_fd, proxy_socketId, ShmCache_fd());
+            pthread_t tid;
+            if (conn < 0)
+            {
+                LOG(LOG_ERROR, "Hand-off to a new proxy failed\n");
+                continue;
+            }
+            Admin_stop(); // the successor binds the admin port as soon as it is up
+            if (ShmCache_enabled() || pthread_create(&tid, &client_attr, handOffCache, (void *)(intptr_t)conn) != 0)
+            {
+                close(conn);
+                break;
+            }
+            fds[2].fd = -1;
+            continue;
+        }
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        bzero((char *)&client_addr, sizeof(client_addr)); // Setting the client address to 0
+        client_len = sizeof(client_addr);
+
+        // Accepting the connection from the client
+        client_socketId = accept(proxy_socketId, (struct sockaddr *)&client_addr, (socklen_t *)&client_len); // Accepting the connection from the client
+        if (client_socketId < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+                continue; // taken by another process, or gone already
+            fprintf(stderr, "Error in Accepting connection !\n");
+            exit(1);
+        }
+
+        // Printing the client details
+        struct sockaddr_in *client_pt = (struct sockaddr_in *)&client_addr;
+        struct in_addr ip_addr = client_pt->sin_addr;
+        char str[INET_ADDRSTRLEN]; // String to store the IP address of the client
+        inet_ntop(AF_INET, &ip_addr, str, INET_ADDRSTRLEN);
+        LOG(LOG_DEBUG, "Client is connected with port number: %d and ip address: %s \n", ntohs(client_addr.sin_port), str);
+
+        startClient(client_socketId, client_addr.sin_addr.s_addr);
     }
+    Admin_stop(); // prefork workers learn of the hand-off only here
+    drainConnections();
     return 0;
 }
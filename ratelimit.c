@@ -0,0 +1,163 @@
+/*
+  ratelimit.c -- per-client and per-host rate limits.
+*/
+
+#include "ratelimit.h"
+#include "cache.h"
+#include <time.h>
+
+#define CLIENT_KEY(ip) ((unsigned long)(ip) | 1UL << 32) // never 0, never a host key
+#define HOST_KEY(hash) ((hash) | 1UL << 63)
+
+struct RateEntry
+{
+    unsigned long key; // 0 while free
+    long request_tat;  // microseconds: when the request bucket is full again
+    long byte_tat;     // ... the byte bucket
+};
+
+static struct RateEntry table[RATELIMIT_ENTRIES];
+static long client_requests; // per second, 0 for no limit
+static long client_burst = 10;
+static long client_bytes;    // per second, the burst is one second's worth
+static long host_requests;   // per second, burst as client_burst
+
+static long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static int idle(struct RateEntry *e, long now)
+{
+    return __atomic_load_n(&e->request_tat, __ATOMIC_RELAXED) <= now &&
+           __atomic_load_n(&e->byte_tat, __ATOMIC_RELAXED) <= now;
+}
+
+/* Entry of key, taken if need be; NULL if its probe window is busy, and then the key is not limited */
+static struct RateEntry *entry_of(unsigned long key, long now)
+{
+    unsigned long start = (key * 0x9E3779B97F4A7C15UL) >> 32;
+    struct RateEntry *reclaim = NULL;
+    for (int i = 0; i < RATELIMIT_PROBE; i++)
+    {
+        struct RateEntry *e = &table[(start + i) & (RATELIMIT_ENTRIES - 1)];
+        unsigned long k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+        if (k == key)
+            return e;
+        if (k == 0)
+        {
+            if (__atomic_compare_exchange_n(&e->key, &k, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || k == key)
+                return e;
+            continue;
+        }
+        if (reclaim == NULL && idle(e, now))
+            reclaim = e;
+    }
+    // An entry whose buckets are full again is as good as free
+    if (reclaim != NULL)
+    {
+        unsigned long k = __atomic_load_n(&reclaim->key, __ATOMIC_ACQUIRE);
+        if (idle(reclaim, now) && __atomic_compare_exchange_n(&reclaim->key, &k, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return reclaim;
+    }
+    return NULL;
+}
+
+/* Charge cost microseconds to a bucket unless that puts it more than tolerance ahead of now */
+static int take(long *tat, long now, long cost, long tolerance)
+{
+    long old = __atomic_load_n(tat, __ATOMIC_RELAXED);
+    long next;
+    do
+    {
+        next = (old > now ? old : now) + cost;
+        if (next - now > tolerance)
+            return 0;
+    } while (!__atomic_compare_exchange_n(tat, &old, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+static int admit(unsigned long key, long per_second, int check_bytes)
+{
+    long now = now_us();
+    struct RateEntry *e = entry_of(key, now);
+    if (e == NULL)
+        return 1;
+    long bytes = __atomic_load_n(&client_bytes, __ATOMIC_RELAXED);
+    // Bytes are charged after the response, a client is held back once a second's worth in debt
+    if (check_bytes && bytes > 0 && __atomic_load_n(&e->byte_tat, __ATOMIC_RELAXED) - now > 1000000)
+        return 0;
+    if (per_second == 0)
+        return 1;
+    long interval = 1000000 / per_second;
+    return take(&e->request_tat, now, interval, interval * __atomic_load_n(&client_burst, __ATOMIC_RELAXED));
+}
+
+int RateLimit_admitClient(unsigned int ip)
+{
+    long per_second = __atomic_load_n(&client_requests, __ATOMIC_RELAXED);
+    if (ip == 0 || (per_second == 0 && __atomic_load_n(&client_bytes, __ATOMIC_RELAXED) == 0))
+        return 1;
+    return admit(CLIENT_KEY(ip), per_second, 1);
+}
+
+int RateLimit_admitHost(const char *host)
+{
+    long per_second = __atomic_load_n(&host_requests, __ATOMIC_RELAXED);
+    if (per_second == 0)
+        return 1;
+    return admit(HOST_KEY(hash_url(host)), per_second, 0);
+}
+
+void RateLimit_charge(unsigned int ip, long bytes)
+{
+    long per_second = __atomic_load_n(&client_bytes, __ATOMIC_RELAXED);
+    if (ip == 0 || per_second == 0 || bytes <= 0)
+        return;
+    long now = now_us();
+    struct RateEntry *e = entry_of(CLIENT_KEY(ip), now);
+    if (e != NULL)
+        take(&e->byte_tat, now, bytes * 1000000 / per_second, __LONG_MAX__);
+}
+
+int RateLimit_setClientRequests(long per_second)
+{
+    if (per_second < 0 || per_second > 1000000)
+        return -1;
+    __atomic_store_n(&client_requests, per_second, __ATOMIC_RELAXED);
+    return 0;
+}
+
+long RateLimit_clientRequests() { return __atomic_load_n(&client_requests, __ATOMIC_RELAXED); }
+
+int RateLimit_setClientBurst(long requests)
+{
+    if (requests < 1 || requests > 1000000)
+        return -1;
+    __atomic_store_n(&client_burst, requests, __ATOMIC_RELAXED);
+    return 0;
+}
+
+long RateLimit_clientBurst() { return __atomic_load_n(&client_burst, __ATOMIC_RELAXED); }
+
+int RateLimit_setClientBytes(long per_second)
+{
+    if (per_second < 0)
+        return -1;
+    __atomic_store_n(&client_bytes, per_second, __ATOMIC_RELAXED);
+    return 0;
+}
+
+long RateLimit_clientBytes() { return __atomic_load_n(&client_bytes, __ATOMIC_RELAXED); }
+
+int RateLimit_setHostRequests(long per_second)
+{
+    if (per_second < 0 || per_second > 1000000)
+        return -1;
+    __atomic_store_n(&host_requests, per_second, __ATOMIC_RELAXED);
+    return 0;
+}
+
+long RateLimit_hostRequests() { return __atomic_load_n(&host_requests, __ATOMIC_RELAXED); }
@@ -0,0 +1,41 @@
+/*
+ * ratelimit.h -- per-client and per-host rate limits.
+ *
+ * Every client IP gets a token bucket for requests and one for response
+ * bytes, and every origin host one for the requests sent to it. A bucket is
+ * kept as its theoretical arrival time (GCRA): the time at which it would
+ * be full again, pushed forward by each request or byte charged to it, so
+ * it is one word updated with compare-and-swap and no lock is taken. The
+ * buckets live in a fixed open-addressed table that is never locked either:
+ * a key takes a free entry in its probe window, or else one whose buckets
+ * are full again, which is the same as never having been seen. Races
+ * between threads reclaiming or charging the same entry only make the
+ * counting approximate. A limit set to 0 is not enforced; over a limit the
+ * request gets 429.
+ */
+
+#ifndef PROXY_RATELIMIT
+#define PROXY_RATELIMIT
+
+#define RATELIMIT_ENTRIES 8192 // clients and hosts tracked at once, a power of two
+#define RATELIMIT_PROBE 8      // entries a key may take, from its hash on
+
+/* 1 if the client may start another request; charges one request to it */
+int RateLimit_admitClient(unsigned int ip);
+
+/* 1 if another request may go to host; charges one request to it */
+int RateLimit_admitHost(const char *host);
+
+/* Charge response bytes sent to the client */
+void RateLimit_charge(unsigned int ip, long bytes);
+
+int RateLimit_setClientRequests(long per_second); // -1 if out of range
+long RateLimit_clientRequests();
+int RateLimit_setClientBurst(long requests);      // -1 if out of range
+long RateLimit_clientBurst();
+int RateLimit_setClientBytes(long per_second);    // -1 if out of range
+long RateLimit_clientBytes();
+int RateLimit_setHostRequests(long per_second);   // -1 if out of range
+long RateLimit_hostRequests();
+
+#endif
@@ -0,0 +1,613 @@
+/*
+  shm_cache.c -- the response cache in shared memory, for prefork mode.
+*/
+
+#include "shm_cache.h"
+#include "metrics.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+
+enum
+{
+    SHM_FREE = 1, // on a free list
+    SHM_INDEXED,  // in the index and the LRU list
+    SHM_UNLINKED  // on the unlinked list, waiting for its pins to go
+};
+
+/* Header of every heap block; an entry's key and response follow it */
+struct ShmEntry
+{
+    unsigned int shift;     // the block is 1 << shift bytes
+    unsigned int state;     // SHM_*
+    unsigned long next;     // bucket chain, free list or unlinked list
+    unsigned long prev;     // free list
+    unsigned long lru_prev; // recency list, most recent first
+    unsigned long lru_next;
+    unsigned long hash;     // of the url
+    time_t lru_time_track;  // last time the entry was added or hit
+    time_t expires;         // no longer served from then on, 0 if it does not expire
+    int len;                // of the response
+    int url_len;
+    int variant_len;        // terminator included, 0 if the response has no Vary
+    char bytes[];           // url, variant key and response, each followed by '\0'
+};
+
+/* Pins of one worker process, indexed by worker slot */
+struct ShmProc
+{
+    pid_t pid;                          // 0 while no process holds the slot
+    unsigned long pins[SHM_PIN_SLOTS];  // entry handed out by the slot's lookup
+    unsigned long fills[SHM_PIN_SLOTS]; // block the slot is copying a response into
+};
+
+struct ShmHeader
+{
+    pthread_mutex_t lock;               // robust and process-shared, guards everything below
+    unsigned long generation;           // bumped by every rebuild
+    unsigned long heap_start, heap_end; // offsets of the heap, a whole number of top blocks
+    unsigned int top_shift;             // the largest blocks, the heap is cut in
+    unsigned long free_lists[SHM_MAX_SHIFT + 1];
+    unsigned long unlinked;             // blocks waiting for their pins to go, chained by next
+    unsigned long lru_head, lru_tail;
+    long capacity;                      // limit of size
+    long size;                          // bytes of the blocks of indexed entries
+    long count;                         // indexed entries
+    long retired;                       // bytes of the blocks on the unlinked list
+    struct ShmProc procs[SHM_MAX_PROCS];
+    unsigned long buckets[SHM_BUCKETS]; // hash index, chained by next
+};
+
+static struct ShmHeader *shm;        // NULL unless the cache is shared
+static int region_fd = -1;           // memfd of the region, handed to a successor on upgrade
+static struct ShmProc *proc;         // this process's pins
+static __thread cache_element shell; // handed out by ShmCache_find(), points into the region
+static char unbound_claimed[SHM_UNBOUND_PINS]; // unbound pin slots in use, claimed with compare-and-swap
+static __thread int unbound_pin = -1;          // the one the calling thread claimed
+
+/* Offsets are from the start of the region, 0 stands for none */
+#define ENTRY(off) ((struct ShmEntry *)((char *)shm + (off)))
+
+static const char *entry_variant(struct ShmEntry *e)
+{
+    return e->variant_len > 0 ? e->bytes + e->url_len + 1 : NULL;
+}
+
+/* Pin slot of the calling thread: its worker slot, else an unbound one it claims; -1 if none is free */
+static int pin_slot()
+{
+    int shard = Metrics_shard();
+    if (shard >= 0)
+        return shard + 1;
+    for (int i = 0; unbound_pin < 0 && i < SHM_UNBOUND_PINS; i++)
+    {
+        char taken = 0;
+        if (__atomic_compare_exchange_n(&unbound_claimed[i], &taken, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            unbound_pin = SHM_BOUND_PINS + i;
+    }
+    return unbound_pin;
+}
+
+/* Give an unbound pin slot back once it pins nothing */
+static void pin_done(int slot)
+{
+    if (slot < SHM_BOUND_PINS || __atomic_load_n(&proc->pins[slot], __ATOMIC_RELAXED) != 0 ||
+        __atomic_load_n(&proc->fills[slot], __ATOMIC_RELAXED) != 0)
+        return;
+    unbound_pin = -1;
+    __atomic_store_n(&unbound_claimed[slot - SHM_BOUND_PINS], 0, __ATOMIC_RELEASE);
+}
+
+/* Whether a pin of any process falls in the block at off */
+static int pinned(unsigned long off, unsigned long size)
+{
+    for (int p = 0; p < SHM_MAX_PROCS; p++)
+    {
+        struct ShmProc *other = &shm->procs[p];
+        if (__atomic_load_n(&other->pid, __ATOMIC_RELAXED) == 0)
+            continue;
+        for (int i = 0; i < SHM_PIN_SLOTS; i++)
+        {
+            unsigned long pin = __atomic_load_n(&other->pins[i], __ATOMIC_ACQUIRE);
+            unsigned long fill = __atomic_load_n(&other->fills[i], __ATOMIC_ACQUIRE);
+            if ((pin >= off && pin < off + size) || (fill >= off && fill < off + size))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+static void push_free(unsigned long off, unsigned int shift)
+{
+    struct ShmEntry *b = ENTRY(off);
+    b->shift = shift;
+    b->state = SHM_FREE;
+    b->prev = 0;
+    b->next = shm->free_lists[shift];
+    if (b->next != 0)
+        ENTRY(b->next)->prev = off;
+    shm->free_lists[shift] = off;
+}
+
+static void remove_free(unsigned long off)
+{
+    struct ShmEntry *b = ENTRY(off);
+    if (b->prev != 0)
+        ENTRY(b->prev)->next = b->next;
+    else
+        shm->free_lists[b->shift] = b->next;
+    if (b->next != 0)
+        ENTRY(b->next)->prev = b->prev;
+}
+
+/* A block of 1 << shift bytes, split off a larger free one if needed; 0 if none is free */
+static unsigned long alloc_block(unsigned int shift)
+{
+    unsigned int s = shift;
+    while (s <= shm->top_shift && shm->free_lists[s] == 0)
+        s++;
+    if (s > shm->top_shift)
+        return 0;
+    unsigned long off = shm->free_lists[s];
+    remove_free(off);
+    while (s > shift)
+    {
+        s--;
+        push_free(off + (1UL << s), s);
+    }
+    ENTRY(off)->shift = shift;
+    return off;
+}
+
+/* Frees a block, merging it with its buddy as long as that is free too */
+static void free_block(unsigned long off)
+{
+    unsigned int shift = ENTRY(off)->shift;
+    while (shift < shm->top_shift)
+    {
+        // The buddy always starts with a block header: it is whole or split, never part of a larger block
+        unsigned long buddy = shm->heap_start + ((off - shm->heap_start) ^ (1UL << shift));
+        struct ShmEntry *b = ENTRY(buddy);
+        if (b->state != SHM_FREE || b->shift != shift)
+            break;
+        remove_free(buddy);
+        if (buddy < off)
+            off = buddy;
+        shift++;
+    }
+    push_free(off, shift);
+}
+
+static void lru_remove(unsigned long off)
+{
+    struct ShmEntry *e = ENTRY(off);
+    if (e->lru_prev != 0)
+        ENTRY(e->lru_prev)->lru_next = e->lru_next;
+    else
+        shm->lru_head = e->lru_next;
+    if (e->lru_next != 0)
+        ENTRY(e->lru_next)->lru_prev = e->lru_prev;
+    else
+        shm->lru_tail = e->lru_prev;
+}
+
+static void lru_push(unsigned long off)
+{
+    struct ShmEntry *e = ENTRY(off);
+    e->lru_prev = 0;
+    e->lru_next = shm->lru_head;
+    if (shm->lru_head != 0)
+        ENTRY(shm->lru_head)->lru_prev = off;
+    else
+        shm->lru_tail = off;
+    shm->lru_head = off;
+}
+
+static void push_unlinked(unsigned long off)
+{
+    struct ShmEntry *e = ENTRY(off);
+    e->state = SHM_UNLINKED;
+    e->next = shm->unlinked;
+    shm->unlinked = off;
+    shm->retired += 1L << e->shift;
+}
+
+/* Removes an entry from the index and the LRU list, freeing it unless it is pinned */
+static void unlink_entry(unsigned long off)
+{
+    struct ShmEntry *e = ENTRY(off);
+    unsigned long *link = &shm->buckets[e->hash % SHM_BUCKETS];
+    while (*link != off)
+        link = &ENTRY(*link)->next;
+    *link = e->next;
+    lru_remove(off);
+    shm->size -= 1L << e->shift;
+    shm->count--;
+    if (pinned(off, 1UL << e->shift))
+        push_unlinked(off);
+    else
+        free_block(off);
+}
+
+static void evict_lru()
+{
+    if (shm->lru_tail != 0)
+    {
+        unlink_entry(shm->lru_tail);
+        Metrics_add(M_CACHE_EVICTIONS, 1);
+    }
+}
+
+/* Frees the unlinked blocks no process pins any more */
+static void reclaim()
+{
+    unsigned long *link = &shm->unlinked;
+    while (*link != 0)
+    {
+        unsigned long off = *link;
+        struct ShmEntry *e = ENTRY(off);
+        if (pinned(off, 1UL << e->shift))
+        {
+            link = &e->next;
+            continue;
+        }
+        *link = e->next;
+        shm->retired -= 1L << e->shift;
+        free_block(off);
+    }
+}
+
+/*
+   Recovers from a process that died holding the lock, leaving the lists in
+   any state: drops the index and rebuilds the heap from its top blocks. A
+   top block holding a pin is set aside whole on the unlinked list, the
+   pinned entry stays readable until it is released.
+ */
+static void rebuild()
+{
+    memset(shm->buckets, 0, sizeof(shm->buckets));
+    memset(shm->free_lists, 0, sizeof(shm->free_lists));
+    shm->unlinked = 0;
+    shm->lru_head = shm->lru_tail = 0;
+    shm->size = shm->count = shm->retired = 0;
+    unsigned long top = 1UL << shm->top_shift;
+    for (unsigned long off = shm->heap_start; off < shm->heap_end; off += top)
+    {
+        ENTRY(off)->shift = shm->top_shift;
+        if (pinned(off, top))
+            push_unlinked(off);
+        else
+            push_free(off, shm->top_shift);
+    }
+    shm->generation++;
+}
+
+static void shm_lock()
+{
+    if (pthread_mutex_lock(&shm->lock) == EOWNERDEAD)
+    {
+        LOG(LOG_ERROR, "A worker died holding the shared cache lock, the cache is emptied\n");
+        rebuild();
+        pthread_mutex_consistent(&shm->lock);
+    }
+}
+
+static void shm_unlock()
+{
+    pthread_mutex_unlock(&shm->lock);
+}
+
+int ShmCache_create(long capacity, long max_element)
+{
+    unsigned int top_shift = SHM_MIN_SHIFT;
+    while ((1L << top_shift) < max_element && top_shift < SHM_MAX_SHIFT)
+        top_shift++;
+    unsigned long top = 1UL << top_shift;
+    unsigned long heap_start = (sizeof(struct ShmHeader) + 63) & ~63UL;
+    unsigned long heap_end = heap_start + (capacity + top - 1) / top * top;
+
+    // Pages of the region are only allocated as the heap is used
+    int fd = memfd_create("proxy-cache", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, heap_end) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    void *region = mmap(NULL, heap_end, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    region_fd = fd;
+
+    shm = (struct ShmHeader *)region;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shm->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    shm->heap_start = heap_start;
+    shm->heap_end = heap_end;
+    shm->top_shift = top_shift;
+    shm->capacity = capacity;
+    for (unsigned long off = heap_start; off < heap_end; off += top)
+        push_free(off, top_shift);
+    return 0;
+}
+
+int ShmCache_adopt(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct ShmHeader))
+        return -1;
+    void *region = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED)
+        return -1;
+    shm = (struct ShmHeader *)region;
+    region_fd = fd;
+    for (int p = 0; p < SHM_MAX_PROCS; p++)
+    {
+        // Workers of a previous master that are gone without being reaped
+        pid_t pid = shm->procs[p].pid;
+        if (pid != 0 && kill(pid, 0) < 0 && errno == ESRCH)
+            ShmCache_reap(pid);
+    }
+    return 0;
+}
+
+int ShmCache_fd()
+{
+    return region_fd;
+}
+
+int ShmCache_attach()
+{
+    for (int p = 0; p < SHM_MAX_PROCS; p++)
+    {
+        // A free slot has no pins left, ShmCache_reap() clears them before the pid
+        pid_t expected = 0;
+        if (__atomic_compare_exchange_n(&shm->procs[p].pid, &expected, getpid(), 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            proc = &shm->procs[p];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void ShmCache_detach()
+{
+    ShmCache_reap(getpid());
+    proc = NULL;
+}
+
+void ShmCache_reap(pid_t pid)
+{
+    for (int p = 0; p < SHM_MAX_PROCS; p++)
+    {
+        struct ShmProc *dead = &shm->procs[p];
+        if (dead->pid != pid)
+            continue;
+        for (int i = 0; i < SHM_PIN_SLOTS; i++)
+        {
+            __atomic_store_n(&dead->pins[i], 0UL, __ATOMIC_RELEASE);
+            __atomic_store_n(&dead->fills[i], 0UL, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&dead->pid, 0, __ATOMIC_RELEASE);
+    }
+}
+
+int ShmCache_enabled()
+{
+    return shm != NULL;
+}
+
+cache_element *ShmCache_find(const char *url, CacheRequestHeader header, void *request)
+{
+    unsigned long hash = hash_url(url);
+    cache_element *found = NULL;
+    time_t now = time(NULL);
+    int slot = pin_slot();
+    if (slot < 0)
+        return NULL; // nothing to pin it with, ask the origin
+
+    shm_lock();
+    unsigned long off = shm->buckets[hash % SHM_BUCKETS];
+    for (; off != 0; off = ENTRY(off)->next)
+    {
+        struct ShmEntry *e = ENTRY(off);
+        if (e->hash == hash && !strcmp(e->bytes, url) && variant_matches(entry_variant(e), header, request))
+            break;
+    }
+    if (off != 0 && (ENTRY(off)->expires == 0 || now < ENTRY(off)->expires))
+    {
+        struct ShmEntry *e = ENTRY(off);
+        e->lru_time_track = now;
+        lru_remove(off);
+        lru_push(off);
+        __atomic_store_n(&proc->pins[slot], off, __ATOMIC_RELEASE);
+
+        shell.url = e->bytes;
+        shell.variant = (char *)entry_variant(e);
+        shell.data = e->bytes + e->url_len + 1 + e->variant_len;
+        shell.len = e->len;
+        shell.hash = e->hash;
+        shell.lru_time_track = e->lru_time_track;
+        shell.expires = e->expires;
+        shell.charge = 1UL << e->shift;
+        shell.refs = 1;
+        found = &shell;
+    }
+    shm_unlock();
+    if (found == NULL)
+        pin_done(slot);
+    return found;
+}
+
+void ShmCache_release(cache_element *element)
+{
+    if (element == &shell)
+    {
+        int slot = pin_slot();
+        __atomic_store_n(&proc->pins[slot], 0UL, __ATOMIC_RELEASE);
+        pin_done(slot);
+    }
+}
+
+/* Makes room among the variants of the new entry's URL, as drop_variants() in cache.c */
+static void drop_variants(struct ShmEntry *entry)
+{
+    int count = 0;
+    unsigned long oldest = 0;
+    const char *variant = entry_variant(entry);
+    unsigned long off = shm->buckets[entry->hash % SHM_BUCKETS];
+    while (off != 0)
+    {
+        struct ShmEntry *e = ENTRY(off);
+        unsigned long next = e->next;
+        if (e->hash == entry->hash && !strcmp(e->bytes, entry->bytes))
+        {
+            if (!same_vary(entry_variant(e), variant) || (variant == NULL || !strcmp(entry_variant(e), variant)))
+                unlink_entry(off);
+            else
+            {
+                count++;
+                if (oldest == 0 || e->lru_time_track <= ENTRY(oldest)->lru_time_track)
+                    oldest = off;
+            }
+        }
+        off = next;
+    }
+    if (count >= CACHE_MAX_VARIANTS)
+        unlink_entry(oldest);
+}
+
+int ShmCache_add(const char *data, int size, const char *url, int ttl, const char *variant, long max_element)
+{
+    size_t url_len = strlen(url);
+    size_t variant_len = variant != NULL && *variant ? strlen(variant) + 1 : 0;
+    size_t need = sizeof(struct ShmEntry) + url_len + 1 + variant_len + size + 1;
+    unsigned int shift = SHM_MIN_SHIFT;
+    while ((1UL << shift) < need)
+        shift++;
+    if (shift > shm->top_shift || (long)(1UL << shift) > max_element)
+        return 0;
+    int slot = pin_slot();
+    if (slot < 0)
+        return 0;
+
+    // Take a block and park it on the unlinked list under a fill pin while the response is copied
+    shm_lock();
+    reclaim();
+    if (shm->size > shm->capacity)
+    {
+        // Shrinking: every add evicts a batch, adds are refused until the cache fits
+        for (int i = 0; i < CACHE_EVICT_BATCH && shm->size > shm->capacity; i++)
+            evict_lru();
+        if (shm->size > shm->capacity)
+        {
+            shm_unlock();
+            pin_done(slot);
+            return 0;
+        }
+    }
+    while (shm->size + (1L << shift) > shm->capacity && shm->lru_tail != 0)
+        evict_lru();
+    unsigned long off;
+    while ((off = alloc_block(shift)) == 0 && shm->lru_tail != 0)
+        evict_lru(); // the free blocks are too small or held by pins
+    if (off == 0)
+    {
+        shm_unlock();
+        pin_done(slot);
+        return 0;
+    }
+    push_unlinked(off);
+    __atomic_store_n(&proc->fills[slot], off, __ATOMIC_RELEASE);
+    unsigned long generation = shm->generation;
+    shm_unlock();
+
+    struct ShmEntry *e = ENTRY(off);
+    e->hash = hash_url(url);
+    e->lru_time_track = time(NULL);
+    e->expires = ttl > 0 ? e->lru_time_track + ttl : 0;
+    e->len = size;
+    e->url_len = url_len;
+    e->variant_len = variant_len;
+    memcpy(e->bytes, url, url_len + 1);
+    if (variant_len > 0)
+        memcpy(e->bytes + url_len + 1, variant, variant_len);
+    char *body = e->bytes + url_len + 1 + variant_len;
+    memcpy(body, data, size);
+    body[size] = '\0';
+
+    shm_lock();
+    int added = shm->generation == generation; // else a rebuild set the block aside
+    if (added)
+    {
+        unsigned long *link = &shm->unlinked;
+        while (*link != off)
+            link = &ENTRY(*link)->next;
+        *link = e->next;
+        shm->retired -= 1L << shift;
+        drop_variants(e);
+        unsigned long *bucket = &shm->buckets[e->hash % SHM_BUCKETS];
+        e->next = *bucket;
+        *bucket = off;
+        e->state = SHM_INDEXED;
+        lru_push(off);
+        shm->size += 1L << shift;
+        shm->count++;
+    }
+    __atomic_store_n(&proc->fills[slot], 0UL, __ATOMIC_RELEASE);
+    shm_unlock();
+    pin_done(slot);
+    return added;
+}
+
+void ShmCache_invalidate(const char *url)
+{
+    unsigned long hash = hash_url(url);
+    shm_lock();
+    unsigned long off = shm->buckets[hash % SHM_BUCKETS];
+    while (off != 0)
+    {
+        struct ShmEntry *e = ENTRY(off);
+        unsigned long next = e->next;
+        if (e->hash == hash && !strcmp(e->bytes, url))
+            unlink_entry(off); // every variant
+        off = next;
+    }
+    shm_unlock();
+}
+
+void ShmCache_evict()
+{
+    shm_lock();
+    evict_lru();
+    shm_unlock();
+}
+
+int ShmCache_setCapacity(long bytes)
+{
+    if (bytes <= 0 || bytes > (long)(shm->heap_end - shm->heap_start))
+        return -1;
+    __atomic_store_n(&shm->capacity, bytes, __ATOMIC_RELAXED);
+    return 0;
+}
+
+long ShmCache_capacity() { return __atomic_load_n(&shm->capacity, __ATOMIC_RELAXED); }
+long ShmCache_size() { return __atomic_load_n(&shm->size, __ATOMIC_RELAXED); }
+long ShmCache_count() { return __atomic_load_n(&shm->count, __ATOMIC_RELAXED); }
+long ShmCache_retired() { return __atomic_load_n(&shm->retired, __ATOMIC_RELAXED); }
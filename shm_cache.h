@@ -0,0 +1,83 @@
+/*
+ * shm_cache.h -- the response cache in shared memory, for prefork mode.
+ *
+ * With -W, the proxy forks worker processes that all serve the same
+ * listening socket, and the cache moves into one memfd region mapped by
+ * every worker. The region holds a header, the hash index and a buddy heap
+ * of power-of-two blocks, all linked by offsets from the start of the
+ * region so that nothing depends on where a process mapped it. A robust,
+ * process-shared mutex guards the index, the LRU list and the heap.
+ *
+ * A lookup pins the entry it hands out in the caller's pin slot (one per
+ * worker process and worker slot, or one claimed from a small pool by
+ * threads serving without a worker slot; a lookup that finds the pool
+ * exhausted is a miss); an entry unlinked while pinned is kept
+ * on an unlinked list and freed once no slot pins it. A response is copied
+ * into its block outside the lock, under a fill pin of its own. When a
+ * worker process dies, the master clears its pins; if it died holding the
+ * lock, the next process to lock gets EOWNERDEAD and rebuilds the region:
+ * the index and the LRU list are dropped, heap blocks still pinned by
+ * another process are set aside until unpinned and the rest is freed.
+ * On a hot restart the memfd is handed to the new master, whose workers
+ * take free process slots next to the draining ones of the old master.
+ */
+
+#include "cache.h"
+#include <sys/types.h>
+
+#ifndef PROXY_SHM_CACHE
+#define PROXY_SHM_CACHE
+
+#define SHM_MAX_PROCS 32        // processes sharing the cache, the workers of two masters during an upgrade
+#define SHM_BOUND_PINS 64       // pin slots per process for worker slots (slot + 1)
+#define SHM_UNBOUND_PINS 32     // pin slots per process claimed by threads without a worker slot
+#define SHM_PIN_SLOTS (SHM_BOUND_PINS + SHM_UNBOUND_PINS)
+#define SHM_BUCKETS (1 << 16)   // hash index buckets
+#define SHM_MIN_SHIFT 6         // smallest heap block, 64 bytes
+#define SHM_MAX_SHIFT 40        // largest heap block class
+
+/* Map a region for a cache of the given capacity; call before forking. Returns -1 on error */
+int ShmCache_create(long capacity, long max_element);
+
+/* Map the region of a cache created by another master; -1 on error */
+int ShmCache_adopt(int fd);
+
+/* memfd of the region, -1 unless the cache is shared */
+int ShmCache_fd();
+
+/* Claim a free process slot for the calling process; -1 if all are taken */
+int ShmCache_attach();
+
+/* Give the calling process's slot back, dropping its pins */
+void ShmCache_detach();
+
+/* Clear the pins of a dead worker process; called by the master */
+void ShmCache_reap(pid_t pid);
+
+/* 1 once ShmCache_create() or ShmCache_adopt() succeeded */
+int ShmCache_enabled();
+
+/* Variant of url the request selects, pinned for the calling thread; NULL on a miss */
+cache_element *ShmCache_find(const char *url, CacheRequestHeader header, void *request);
+
+/* Unpin an element returned by ShmCache_find() */
+void ShmCache_release(cache_element *element);
+
+/* Add a response, see add_cache_element(); 1 if it was added */
+int ShmCache_add(const char *data, int size, const char *url, int ttl, const char *variant, long max_element);
+
+/* Drop every variant of url */
+void ShmCache_invalidate(const char *url);
+
+/* Evict the least recently used entry */
+void ShmCache_evict();
+
+/* Capacity, at most the heap size fixed by ShmCache_create(); -1 if out of range */
+int ShmCache_setCapacity(long bytes);
+long ShmCache_capacity();
+
+long ShmCache_size();    // bytes of the blocks holding indexed entries
+long ShmCache_count();   // indexed entries
+long ShmCache_retired(); // bytes of unlinked entries still pinned
+
+#endif
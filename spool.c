@@ -0,0 +1,416 @@
+/*
+  spool.c -- write-behind buffering of responses to slow clients.
+*/
+
+#include "spool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+
+struct SpoolChunk
+{
+    struct SpoolChunk *next;
+    size_t off; // first byte not sent yet
+    size_t len; // bytes filled
+    char data[SPOOL_CHUNK];
+};
+
+static long spool_memory = SPOOL_MEMORY;
+static long spool_disk = SPOOL_DISK;
+static char spool_dir[PATH_MAX] = SPOOL_DIR;
+static long queued_bytes;   // all spools, atomic
+static long disk_bytes;     // of them in spill files, atomic
+static long writer_clients; // spools owned by the writer, atomic
+
+static pthread_mutex_t chunks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct SpoolChunk *free_chunks; // kept for reuse, never given back to malloc
+static long chunks_out;                // bytes of chunks held by spools
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Spool *incoming; // handed over, not picked up by the writer yet
+static int wake_pipe[2] = {-1, -1};
+static int writer_running;
+
+/* A chunk from the pool, NULL if the memory of all spools is used up */
+static struct SpoolChunk *chunk_get()
+{
+    pthread_mutex_lock(&chunks_lock);
+    struct SpoolChunk *c = NULL;
+    if (chunks_out + SPOOL_CHUNK <= SPOOL_MAX_MEMORY)
+    {
+        c = free_chunks;
+        if (c != NULL)
+            free_chunks = c->next;
+        else
+            c = (struct SpoolChunk *)malloc(sizeof(struct SpoolChunk));
+        if (c != NULL)
+            chunks_out += SPOOL_CHUNK;
+    }
+    pthread_mutex_unlock(&chunks_lock);
+    if (c != NULL)
+    {
+        c->next = NULL;
+        c->off = c->len = 0;
+    }
+    return c;
+}
+
+static void chunk_put(struct SpoolChunk *c)
+{
+    pthread_mutex_lock(&chunks_lock);
+    c->next = free_chunks;
+    free_chunks = c;
+    chunks_out -= SPOOL_CHUNK;
+    pthread_mutex_unlock(&chunks_lock);
+}
+
+static void spool_free(struct Spool *s)
+{
+    while (s->first != NULL)
+    {
+        struct SpoolChunk *c = s->first;
+        s->first = c->next;
+        chunk_put(c);
+    }
+    if (s->file >= 0)
+        close(s->file);
+    __atomic_sub_fetch(&disk_bytes, s->file_write - s->file_read, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&queued_bytes, s->queued, __ATOMIC_RELAXED);
+    free(s);
+}
+
+/* Send queued bytes until the socket takes no more; -1 once the client is gone */
+static int flush(struct Spool *s)
+{
+    while (s->queued > 0)
+    {
+        const char *data;
+        size_t len;
+        char buf[SPOOL_CHUNK];
+        if (s->first != NULL)
+        {
+            data = s->first->data + s->first->off;
+            len = s->first->len - s->first->off;
+        }
+        else
+        {
+            ssize_t n = pread(s->file, buf, s->file_write - s->file_read < (off_t)sizeof(buf)
+                                                ? s->file_write - s->file_read : (off_t)sizeof(buf),
+                              s->file_read);
+            if (n <= 0)
+                return -1;
+            data = buf;
+            len = n;
+        }
+
+        ssize_t n = send(s->socket, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return 0;
+        if (n <= 0)
+            return -1;
+        s->progress = time(NULL);
+        s->queued -= n;
+        __atomic_sub_fetch(&queued_bytes, n, __ATOMIC_RELAXED);
+        if (s->first != NULL)
+        {
+            s->first->off += n;
+            if (s->first->off == s->first->len)
+            {
+                struct SpoolChunk *c = s->first;
+                s->first = c->next;
+                if (s->first == NULL)
+                    s->last = NULL;
+                s->memory -= SPOOL_CHUNK;
+                chunk_put(c);
+            }
+        }
+        else
+        {
+            __atomic_sub_fetch(&disk_bytes, n, __ATOMIC_RELAXED);
+            s->file_read += n;
+            if (s->file_read == s->file_write && ftruncate(s->file, 0) == 0)
+                s->file_read = s->file_write = 0; // start the file over
+        }
+    }
+    return 0;
+}
+
+/* Wait for the client to take everything queued, or until it idled out; -1 if it went away */
+static int flush_wait(struct Spool *s)
+{
+    while (flush(s) == 0 && s->queued > 0)
+    {
+        struct pollfd pfd = {s->socket, POLLOUT, 0};
+        int ready = poll(&pfd, 1, SPOOL_IDLE_SECONDS * 1000);
+        if (ready == 0)
+            return -1;
+        if (ready < 0 && errno != EINTR)
+            return -1;
+    }
+    return s->queued > 0 ? -1 : 0;
+}
+
+static int spill_file()
+{
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/proxy-spool-XXXXXX", spool_dir);
+    int fd = mkstemp(path);
+    if (fd >= 0)
+        unlink(path);
+    return fd;
+}
+
+/* Take len bytes of the disk budget of all spools; 0 if it is used up */
+static int disk_take(size_t len)
+{
+    if (__atomic_add_fetch(&disk_bytes, len, __ATOMIC_RELAXED) <= __atomic_load_n(&spool_disk, __ATOMIC_RELAXED))
+        return 1;
+    __atomic_sub_fetch(&disk_bytes, len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Send after everything queued, blocking at the client's pace */
+static int send_direct(struct Spool *s, const char *data, size_t len)
+{
+    if (flush_wait(s) < 0)
+        return -1;
+    while (len > 0)
+    {
+        ssize_t n = send(s->socket, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int enqueue(struct Spool *s, const char *data, size_t len)
+{
+    while (len > 0 && s->file < 0)
+    {
+        struct SpoolChunk *c = s->last;
+        if (c == NULL || c->len == SPOOL_CHUNK)
+        {
+            if (s->memory + SPOOL_CHUNK > __atomic_load_n(&spool_memory, __ATOMIC_RELAXED) || (c = chunk_get()) == NULL)
+            {
+                // Out of this response's share, or of all memory: the rest goes to disk
+                if ((s->file = spill_file()) < 0)
+                    return send_direct(s, data, len);
+                break;
+            }
+            if (s->last != NULL)
+                s->last->next = c;
+            else
+                s->first = c;
+            s->last = c;
+            s->memory += SPOOL_CHUNK;
+        }
+        size_t n = SPOOL_CHUNK - c->len < len ? SPOOL_CHUNK - c->len : len;
+        memcpy(c->data + c->len, data, n);
+        c->len += n;
+        data += n;
+        len -= n;
+        s->queued += n;
+        __atomic_add_fetch(&queued_bytes, n, __ATOMIC_RELAXED);
+    }
+    // Past its own or the shared disk bound, the origin is read no faster than the client takes it
+    if (len > 0 && (s->file_write - s->file_read + (off_t)len > SPOOL_MAX_DISK || !disk_take(len)))
+        return send_direct(s, data, len);
+    while (len > 0)
+    {
+        ssize_t n = pwrite(s->file, data, len, s->file_write);
+        if (n <= 0)
+        {
+            __atomic_sub_fetch(&disk_bytes, len, __ATOMIC_RELAXED);
+            return -1;
+        }
+        s->file_write += n;
+        data += n;
+        len -= n;
+        s->queued += n;
+        __atomic_add_fetch(&queued_bytes, n, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+struct Spool *Spool_open(int socket)
+{
+    if (__atomic_load_n(&spool_memory, __ATOMIC_RELAXED) == 0)
+        return NULL;
+    struct Spool *s = (struct Spool *)calloc(1, sizeof(struct Spool));
+    if (s == NULL)
+        return NULL;
+    s->socket = socket;
+    s->file = -1;
+    s->progress = time(NULL);
+    return s;
+}
+
+int Spool_write(struct Spool *s, const char *data, size_t len)
+{
+    if (flush(s) < 0)
+        return -1;
+    if (s->queued == 0)
+    {
+        // Nothing queued, the client takes what it can right away
+        ssize_t n = send(s->socket, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return -1;
+        if (n > 0)
+        {
+            data += n;
+            len -= n;
+        }
+    }
+    return len > 0 ? enqueue(s, data, len) : 0;
+}
+
+static void *writer(void *arg)
+{
+    struct Spool *spools = NULL;
+    int capacity = 0;
+    struct pollfd *fds = NULL;
+    struct Spool **polled = NULL;
+    while (1)
+    {
+        pthread_mutex_lock(&writer_lock);
+        while (incoming != NULL)
+        {
+            struct Spool *s = incoming;
+            incoming = s->next;
+            s->next = spools;
+            spools = s;
+        }
+        pthread_mutex_unlock(&writer_lock);
+
+        int count = 0;
+        for (struct Spool *s = spools; s != NULL; s = s->next)
+            count++;
+        if (count + 1 > capacity)
+        {
+            capacity = 2 * (count + 1);
+            fds = (struct pollfd *)realloc(fds, capacity * sizeof(struct pollfd));
+            polled = (struct Spool **)realloc(polled, capacity * sizeof(struct Spool *));
+        }
+        fds[0].fd = wake_pipe[0];
+        fds[0].events = POLLIN;
+        int n = 1;
+        for (struct Spool *s = spools; s != NULL; s = s->next)
+        {
+            fds[n].fd = s->socket;
+            fds[n].events = POLLOUT;
+            polled[n++] = s;
+        }
+        if (poll(fds, n, 1000) < 0 && errno != EINTR)
+            continue;
+        if (fds[0].revents & POLLIN)
+        {
+            char drain[64];
+            ssize_t r = read(wake_pipe[0], drain, sizeof(drain));
+            (void)r;
+        }
+
+        time_t now = time(NULL);
+        struct Spool **link = &spools;
+        int i = 1;
+        while (*link != NULL)
+        {
+            struct Spool *s = *link;
+            int ok = i < n && polled[i] == s && fds[i].revents != 0 ? flush(s) : 0;
+            if (i < n && polled[i] == s)
+                i++;
+            if (ok < 0 || s->queued == 0 || now - s->progress > SPOOL_IDLE_SECONDS)
+            {
+                *link = s->next;
+                shutdown(s->socket, SHUT_RDWR);
+                close(s->socket);
+                spool_free(s);
+                __atomic_sub_fetch(&writer_clients, 1, __ATOMIC_RELAXED);
+            }
+            else
+                link = &s->next;
+        }
+    }
+    return arg;
+}
+
+int Spool_finish(struct Spool *s)
+{
+    if (flush(s) < 0 || s->queued == 0)
+    {
+        spool_free(s);
+        return 0;
+    }
+
+    int dup_socket = dup(s->socket);
+    pthread_mutex_lock(&writer_lock);
+    if (dup_socket >= 0 && !writer_running)
+    {
+        pthread_t tid;
+        if ((wake_pipe[0] >= 0 || pipe(wake_pipe) == 0) && pthread_create(&tid, NULL, writer, NULL) == 0)
+        {
+            pthread_detach(tid);
+            writer_running = 1;
+        }
+    }
+    if (dup_socket < 0 || !writer_running)
+    {
+        pthread_mutex_unlock(&writer_lock);
+        if (dup_socket >= 0)
+            close(dup_socket);
+        flush_wait(s); // trickle it out from this thread then
+        spool_free(s);
+        return 0;
+    }
+    s->socket = dup_socket;
+    s->next = incoming;
+    incoming = s;
+    __atomic_add_fetch(&writer_clients, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&writer_lock);
+    ssize_t n = write(wake_pipe[1], "s", 1);
+    (void)n;
+    return 1;
+}
+
+int Spool_setMemory(long bytes)
+{
+    if (bytes < 0 || bytes > SPOOL_MAX_MEMORY)
+        return -1;
+    __atomic_store_n(&spool_memory, bytes, __ATOMIC_RELAXED);
+    return 0;
+}
+
+long Spool_memory() { return __atomic_load_n(&spool_memory, __ATOMIC_RELAXED); }
+
+int Spool_setDisk(long bytes)
+{
+    if (bytes < 0)
+        return -1;
+    __atomic_store_n(&spool_disk, bytes, __ATOMIC_RELAXED);
+    return 0;
+}
+
+long Spool_disk() { return __atomic_load_n(&spool_disk, __ATOMIC_RELAXED); }
+
+int Spool_setDir(const char *dir)
+{
+    if (strlen(dir) >= sizeof(spool_dir) || access(dir, W_OK | X_OK) < 0)
+        return -1;
+    strcpy(spool_dir, dir);
+    return 0;
+}
+
+long Spool_queuedBytes() { return __atomic_load_n(&queued_bytes, __ATOMIC_RELAXED); }
+
+long Spool_diskBytes() { return __atomic_load_n(&disk_bytes, __ATOMIC_RELAXED); }
+
+long Spool_clients() { return __atomic_load_n(&writer_clients, __ATOMIC_RELAXED); }
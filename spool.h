@@ -0,0 +1,74 @@
+/*
+ * spool.h -- write-behind buffering of responses to slow clients.
+ *
+ * A response relayed from an origin is written to the client through a
+ * Spool: what the client's socket takes right away is sent, the rest is
+ * queued in memory buffers shared by all spools, and spilled to an unlinked
+ * file once the response holds more than its memory share or the buffers
+ * run out. Spill files are bounded per response and for all responses
+ * together; past either bound the worker sends the rest itself, at the
+ * client's pace. The worker thus reads the origin as fast as the origin sends and
+ * closes the upstream connection as soon as the response is in. If bytes
+ * are still queued then, the spool is handed to a single writer thread
+ * that trickles them out to every such client with poll() and closes their
+ * sockets, and the worker moves on to its next connection.
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifndef PROXY_SPOOL
+#define PROXY_SPOOL
+
+#define SPOOL_CHUNK 65536            // bytes per memory buffer
+#define SPOOL_MEMORY (1L << 20)      // default memory one response may queue before spilling, 0 disables spooling
+#define SPOOL_MAX_MEMORY (64L << 20) // memory buffers of all spools together
+#define SPOOL_MAX_DISK (1L << 30)    // bytes one response may spill; past it the worker waits for the client
+#define SPOOL_DISK (4L << 30)        // default bytes all responses may spill together, same then
+#define SPOOL_IDLE_SECONDS 60        // a client taking nothing for this long is dropped
+#define SPOOL_DIR "/tmp"             // default directory of spill files (unlinked at once)
+
+struct SpoolChunk;
+
+struct Spool
+{
+    int socket;               // client socket, a duplicate of it once handed to the writer
+    struct SpoolChunk *first; // queued in memory, sent before the file
+    struct SpoolChunk *last;
+    long memory;              // bytes of memory buffers held
+    int file;                 // spill file, -1 until needed
+    off_t file_read;          // next byte of it to send
+    off_t file_write;         // its end
+    long queued;              // bytes not sent yet
+    time_t progress;          // last time the client took bytes
+    struct Spool *next;       // in the writer's list
+};
+
+/* Write-behind for a client socket; NULL while spooling is disabled */
+struct Spool *Spool_open(int socket);
+
+/* Send what the client takes now and queue the rest; 0, or -1 once the client is gone */
+int Spool_write(struct Spool *s, const char *data, size_t len);
+
+/*
+   End of the response. Returns 0 with everything sent (or the client gone)
+   and the spool freed, or 1 if the writer thread took the rest: it then
+   owns a duplicate of the socket, and the caller must close its descriptor
+   without shutting the connection down.
+ */
+int Spool_finish(struct Spool *s);
+
+int Spool_setMemory(long bytes); // -1 if out of range
+long Spool_memory();
+int Spool_setDisk(long bytes);   // -1 if out of range
+long Spool_disk();
+
+/* Create spill files in dir; -1 if it is not a writable directory */
+int Spool_setDir(const char *dir);
+
+long Spool_queuedBytes(); // bytes queued by all spools
+long Spool_diskBytes();   // bytes of them in spill files
+long Spool_clients();     // spools the writer thread is trickling out
+
+#endif
@@ -0,0 +1,151 @@
+/*
+  chunked_test.c -- tests for the streaming chunked decoder.
+
+  Every body is fed whole, then split at every byte offset into two reads,
+  then one byte at a time, and must decode to the same payload each way.
+  Malformed bodies must be rejected however they are split.
+
+  Usage: chunked_test
+*/
+
+#include "../chunked.h"
+#include <stdio.h>
+#include <string.h>
+
+static int failures;
+
+#define CHECK(cond, ...)                       \
+    do                                         \
+    {                                          \
+        if (!(cond))                           \
+        {                                      \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__);               \
+            printf("\n");                      \
+            failures++;                        \
+        }                                      \
+    } while (0)
+
+/*
+   Feed body in pieces cut at the given offsets (ascending, ncuts of them).
+   Returns the bytes of body consumed, or -1 if the decoder rejected it;
+   the decoded payload goes to out and its length to *outlen.
+ */
+static int feed_split(const char *body, int len, const int *cuts, int ncuts, char *out, int *outlen,
+                      struct ChunkedDecoder *dec)
+{
+    char buf[4096];
+    int start = 0;
+    int consumed = 0;
+    *outlen = 0;
+    ChunkedDecoder_init(dec);
+    for (int i = 0; i <= ncuts && !ChunkedDecoder_done(dec); i++)
+    {
+        int end = i < ncuts ? cuts[i] : len;
+        int piece;
+        memcpy(buf, body + start, end - start); // decoded in place, as relay_response does
+        int n = ChunkedDecoder_feed(dec, buf, end - start, buf, &piece);
+        if (n < 0)
+            return -1;
+        memcpy(out + *outlen, buf, piece);
+        *outlen += piece;
+        consumed += n;
+        start = end;
+    }
+    return consumed;
+}
+
+/* Decode body every way it can be split; it must carry payload and end trailing bytes before its end */
+static void expect_body(const char *name, const char *body, const char *payload, int trailing)
+{
+    int len = strlen(body);
+    int body_len = len - trailing;
+    char out[4096];
+    int outlen;
+    struct ChunkedDecoder dec;
+    int cuts[4096];
+
+    int n = feed_split(body, len, NULL, 0, out, &outlen, &dec);
+    CHECK(n == body_len, "%s: whole: consumed %d, expected %d", name, n, body_len);
+    CHECK(ChunkedDecoder_done(&dec), "%s: whole: not done", name);
+    CHECK(outlen == (int)strlen(payload) && !memcmp(out, payload, outlen), "%s: whole: wrong payload", name);
+    CHECK(dec.body_len == strlen(payload), "%s: whole: body_len %zu", name, dec.body_len);
+
+    for (int cut = 1; cut < len; cut++)
+    {
+        n = feed_split(body, len, &cut, 1, out, &outlen, &dec);
+        CHECK(n == body_len && ChunkedDecoder_done(&dec), "%s: split at %d: consumed %d", name, cut, n);
+        CHECK(outlen == (int)strlen(payload) && !memcmp(out, payload, outlen), "%s: split at %d: wrong payload",
+              name, cut);
+    }
+
+    for (int i = 0; i < len - 1; i++)
+        cuts[i] = i + 1;
+    n = feed_split(body, len, cuts, len - 1, out, &outlen, &dec);
+    CHECK(n == body_len && ChunkedDecoder_done(&dec), "%s: bytewise: consumed %d", name, n);
+    CHECK(outlen == (int)strlen(payload) && !memcmp(out, payload, outlen), "%s: bytewise: wrong payload", name);
+}
+
+/* Body must be rejected whole and split anywhere */
+static void expect_malformed(const char *name, const char *body)
+{
+    int len = strlen(body);
+    char out[4096];
+    int outlen;
+    struct ChunkedDecoder dec;
+
+    CHECK(feed_split(body, len, NULL, 0, out, &outlen, &dec) < 0, "%s: whole: accepted", name);
+    for (int cut = 1; cut < len; cut++)
+        CHECK(feed_split(body, len, &cut, 1, out, &outlen, &dec) < 0, "%s: split at %d: accepted", name, cut);
+}
+
+/* Body is fine so far but not complete */
+static void expect_incomplete(const char *name, const char *body)
+{
+    int len = strlen(body);
+    char out[4096];
+    int outlen;
+    struct ChunkedDecoder dec;
+
+    int n = feed_split(body, len, NULL, 0, out, &outlen, &dec);
+    CHECK(n == len && !ChunkedDecoder_done(&dec), "%s: consumed %d, done %d", name, n, ChunkedDecoder_done(&dec));
+}
+
+int main()
+{
+    expect_body("single chunk", "5\r\nhello\r\n0\r\n\r\n", "hello", 0);
+    expect_body("several chunks", "3\r\nabc\r\n4\r\ndefg\r\n1\r\nh\r\n0\r\n\r\n", "abcdefgh", 0);
+    expect_body("hex sizes", "A\r\n0123456789\r\nb\r\nabcdefghijk\r\n0\r\n\r\n", "0123456789abcdefghijk", 0);
+    expect_body("leading zeros", "0005\r\nhello\r\n000\r\n\r\n", "hello", 0);
+    expect_body("empty body", "0\r\n\r\n", "", 0);
+    expect_body("extensions", "5;name=value\r\nhello\r\n0;last\r\n\r\n", "hello", 0);
+    expect_body("blank before extension", "5 ;x\r\nhello\r\n0\r\n\r\n", "hello", 0);
+    expect_body("trailer", "5\r\nhello\r\n0\r\nX-Sum: 1\r\n\r\n", "hello", 0);
+    expect_body("trailers", "2\r\nhi\r\n0\r\nA: 1\r\nB: 2\r\n\r\n", "hi", 0);
+    expect_body("data after the body", "2\r\nhi\r\n0\r\n\r\nHTTP/1.1 200 OK\r\n", "hi", 17);
+    expect_body("payload with CRLF", "4\r\n\r\n\r\n\r\n0\r\n\r\n", "\r\n\r\n", 0);
+
+    expect_malformed("empty size line", "\r\n5\r\nhello\r\n0\r\n\r\n");
+    expect_malformed("empty size line after a chunk", "2\r\nhi\r\n\r\n\r\n");
+    expect_malformed("extension without size", ";x\r\n0\r\n\r\n");
+    expect_malformed("non-hex size", "g\r\nhello\r\n0\r\n\r\n");
+    expect_malformed("signed size", "-5\r\nhello\r\n0\r\n\r\n");
+    expect_malformed("bare LF after size", "5\nhello\r\n0\r\n\r\n");
+    expect_malformed("chunk longer than its size", "3\r\nhello\r\n0\r\n\r\n");
+    expect_malformed("missing CRLF after data", "5\r\nhelloX\r\n0\r\n\r\n");
+    expect_malformed("bad final CRLF", "0\r\n\rX");
+    expect_malformed("oversized chunk", "fffffffffffffffffff\r\n");
+
+    expect_incomplete("size only", "5\r\n");
+    expect_incomplete("inside data", "5\r\nhel");
+    expect_incomplete("before the trailer", "5\r\nhello\r\n0\r\n");
+    expect_incomplete("inside the trailer", "0\r\nX-Sum: 1\r\n");
+
+    if (failures > 0)
+    {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("chunked: all tests passed\n");
+    return 0;
+}
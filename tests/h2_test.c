@@ -0,0 +1,508 @@
+/*
+  h2_test.c -- tests for the HTTP/2 frame layer.
+
+  H2_serve runs in a thread on one end of a socketpair, the test plays the
+  client on the other end. Streams are handed to a responder that records
+  the HTTP/1.1 request and answers it, so a request goes through HEADERS,
+  CONTINUATION and DATA frames and its response comes back framed. Frames
+  that break the protocol must end the connection with the right GOAWAY.
+
+  Usage: h2_test
+*/
+
+#include "../h2.h"
+#include "../hpack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+static int failures;
+
+#define CHECK(cond, ...)                                \
+    do                                                  \
+    {                                                   \
+        if (!(cond))                                    \
+        {                                               \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__);                        \
+            printf("\n");                               \
+            failures++;                                 \
+        }                                               \
+    } while (0)
+
+enum
+{
+    DATA = 0x0,
+    HEADERS = 0x1,
+    SETTINGS = 0x4,
+    RST_STREAM = 0x3,
+    PING = 0x6,
+    GOAWAY = 0x7,
+    WINDOW_UPDATE = 0x8,
+    CONTINUATION = 0x9
+};
+
+#define END_STREAM 0x1
+#define ACK 0x1
+#define END_HEADERS 0x4
+#define PADDED 0x8
+
+// GET http://www.example.com/, RFC 7541 C.3.1
+static const unsigned char get_block[] = {0x82, 0x86, 0x84, 0x41, 0x0f, 'w', 'w', 'w', '.', 'e', 'x', 'a',
+                                          'm', 'p', 'l', 'e', '.', 'c', 'o', 'm'};
+// POST http://www.example.com/
+static const unsigned char post_block[] = {0x83, 0x86, 0x84, 0x41, 0x0f, 'w', 'w', 'w', '.', 'e', 'x', 'a',
+                                           'm', 'p', 'l', 'e', '.', 'c', 'o', 'm'};
+
+static const char response[] = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello";
+
+static pthread_mutex_t last_lock = PTHREAD_MUTEX_INITIALIZER;
+static char last_request[4096]; // what the responder read last
+
+/* Reads one request, head and Content-Length body, records it and answers it */
+static void *responder(void *arg)
+{
+    int fd = (int)(long)arg;
+    char buf[4096];
+    size_t len = 0;
+    char *end = NULL;
+    while (end == NULL && len < sizeof(buf) - 1)
+    {
+        ssize_t n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+        if (n <= 0)
+            break;
+        len += n;
+        buf[len] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+    }
+    if (end != NULL)
+    {
+        const char *cl = strstr(buf, "Content-Length: ");
+        size_t want = end + 4 - buf + (cl != NULL && cl < end ? atoi(cl + 16) : 0);
+        while (len < want && len < sizeof(buf) - 1)
+        {
+            ssize_t n = recv(fd, buf + len, want - len, 0);
+            if (n <= 0)
+                break;
+            len += n;
+        }
+        buf[len] = '\0';
+        pthread_mutex_lock(&last_lock);
+        strcpy(last_request, buf);
+        pthread_mutex_unlock(&last_lock);
+        send(fd, response, sizeof(response) - 1, MSG_NOSIGNAL);
+    }
+    close(fd);
+    return NULL;
+}
+
+static int start(int socket)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, responder, (void *)(long)socket) != 0)
+    {
+        close(socket);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+static void *server(void *arg)
+{
+    int fd = (int)(long)arg;
+    H2_serve(fd, NULL, 0, NULL, 0, NULL, start);
+    close(fd);
+    return NULL;
+}
+
+struct Client
+{
+    int fd;
+    pthread_t thread;
+};
+
+static int send_frame(struct Client *c, int type, int flags, unsigned int id, const void *payload, size_t len)
+{
+    unsigned char frame[9 + 65536];
+    frame[0] = len >> 16;
+    frame[1] = len >> 8;
+    frame[2] = len;
+    frame[3] = type;
+    frame[4] = flags;
+    frame[5] = id >> 24;
+    frame[6] = id >> 16;
+    frame[7] = id >> 8;
+    frame[8] = id;
+    memcpy(frame + 9, payload, len);
+    return send(c->fd, frame, 9 + len, MSG_NOSIGNAL) == (ssize_t)(9 + len) ? 0 : -1;
+}
+
+static int recv_all(int fd, unsigned char *buf, size_t len)
+{
+    for (size_t got = 0; got < len;)
+    {
+        ssize_t n = recv(fd, buf + got, len - got, 0);
+        if (n <= 0)
+            return -1;
+        got += n;
+    }
+    return 0;
+}
+
+/* Reads the next frame; its payload length, or -1 at the end of the connection or on a timeout */
+static int recv_frame(struct Client *c, int *type, int *flags, unsigned int *id, unsigned char *payload)
+{
+    unsigned char h[9];
+    if (recv_all(c->fd, h, 9) < 0)
+        return -1;
+    int len = h[0] << 16 | h[1] << 8 | h[2];
+    *type = h[3];
+    *flags = h[4];
+    *id = (unsigned int)(h[5] & 0x7f) << 24 | h[6] << 16 | h[7] << 8 | h[8];
+    if (len > 65536 || recv_all(c->fd, payload, len) < 0)
+        return -1;
+    return len;
+}
+
+/* Skips frames until one of the type arrives; its payload length, or -1 */
+static int recv_type(struct Client *c, int type, int *flags, unsigned int *id, unsigned char *payload)
+{
+    int t;
+    int len;
+    while ((len = recv_frame(c, &t, flags, id, payload)) >= 0 && t != type)
+        ;
+    return len;
+}
+
+/* Connects a client that has sent the preface and empty SETTINGS, and read the server's SETTINGS */
+static void client_open(struct Client *c)
+{
+    int pair[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    struct timeval timeout = {5, 0}; // a missing frame fails the test rather than hang it
+    setsockopt(pair[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    c->fd = pair[0];
+    pthread_create(&c->thread, NULL, server, (void *)(long)pair[1]);
+
+    send(c->fd, H2_PREFACE, H2_PREFACE_LEN, MSG_NOSIGNAL);
+    send_frame(c, SETTINGS, 0, 0, NULL, 0);
+    unsigned char payload[65536];
+    int type, flags;
+    unsigned int id;
+    int len = recv_frame(c, &type, &flags, &id, payload);
+    CHECK(len >= 0 && type == SETTINGS && !(flags & ACK) && id == 0, "server did not open with SETTINGS");
+    CHECK(len == 6 && payload[1] == 0x3 && payload[5] == H2_MAX_STREAMS, "SETTINGS without max streams");
+    len = recv_type(c, SETTINGS, &flags, &id, payload);
+    CHECK(len == 0 && (flags & ACK), "SETTINGS not acknowledged");
+}
+
+static void client_close(struct Client *c)
+{
+    shutdown(c->fd, SHUT_WR);
+    pthread_join(c->thread, NULL);
+    close(c->fd);
+}
+
+static int collect(void *arg, const char *name, const char *value)
+{
+    char *text = (char *)arg;
+    size_t len = strlen(text);
+    snprintf(text + len, 1024 - len, "%s: %s\n", name, value);
+    return 0;
+}
+
+/* Reads the response of a stream: its decoded header fields and its body */
+static void recv_response(const char *name, struct Client *c, unsigned int stream, char *fields, char *body)
+{
+    unsigned char payload[65536];
+    unsigned char block[65536];
+    size_t block_len = 0;
+    size_t body_len = 0;
+    int type, flags, len;
+    unsigned int id;
+    fields[0] = '\0';
+    for (int headers_done = 0, ended = 0; !ended;)
+    {
+        len = recv_frame(c, &type, &flags, &id, payload);
+        if (len < 0)
+        {
+            CHECK(0, "%s: connection ended before the response", name);
+            break;
+        }
+        if (id != stream)
+            continue;
+        if (type == HEADERS || type == CONTINUATION)
+        {
+            CHECK(!headers_done, "%s: header block after the headers", name);
+            memcpy(block + block_len, payload, len);
+            block_len += len;
+            headers_done = flags & END_HEADERS;
+        }
+        else if (type == DATA)
+        {
+            CHECK(headers_done, "%s: DATA before the headers", name);
+            memcpy(body + body_len, payload, len);
+            body_len += len;
+        }
+        ended = (type == HEADERS || type == DATA) && (flags & END_STREAM);
+    }
+    body[body_len] = '\0';
+    struct HpackDecoder d;
+    Hpack_init(&d);
+    CHECK(Hpack_decode(&d, block, block_len, collect, fields) == 0, "%s: response headers do not decode", name);
+    Hpack_free(&d);
+}
+
+static void expect_request(const char *name, const char *request)
+{
+    pthread_mutex_lock(&last_lock);
+    CHECK(!strcmp(last_request, request), "%s: proxy got\n%s\nexpected\n%s", name, last_request, request);
+    last_request[0] = '\0';
+    pthread_mutex_unlock(&last_lock);
+}
+
+static const char *get_request = "GET http://www.example.com/ HTTP/1.1\r\nHost: www.example.com\r\n"
+                                 "Connection: close\r\n\r\n";
+static const char *response_fields = ":status: 200\ncontent-length: 5\n";
+
+static void test_get()
+{
+    struct Client c;
+    char fields[1024], body[65536];
+    client_open(&c);
+    send_frame(&c, HEADERS, END_HEADERS | END_STREAM, 1, get_block, sizeof(get_block));
+    recv_response("GET", &c, 1, fields, body);
+    CHECK(!strcmp(fields, response_fields), "GET: response fields\n%s", fields);
+    CHECK(!strcmp(body, "hello"), "GET: body %s", body);
+    expect_request("GET", get_request);
+
+    // The dynamic table carries over: 0xbe is :authority www.example.com
+    unsigned char indexed[] = {0x82, 0x86, 0x84, 0xbe};
+    send_frame(&c, HEADERS, END_HEADERS | END_STREAM, 3, indexed, sizeof(indexed));
+    recv_response("indexed GET", &c, 3, fields, body);
+    CHECK(!strcmp(body, "hello"), "indexed GET: body %s", body);
+    expect_request("indexed GET", get_request);
+    client_close(&c);
+}
+
+static void test_continuation()
+{
+    struct Client c;
+    char fields[1024], body[65536];
+    client_open(&c);
+    send_frame(&c, HEADERS, END_STREAM, 1, get_block, 5);
+    send_frame(&c, CONTINUATION, 0, 1, get_block + 5, 7);
+    send_frame(&c, CONTINUATION, END_HEADERS, 1, get_block + 12, sizeof(get_block) - 12);
+    recv_response("CONTINUATION", &c, 1, fields, body);
+    CHECK(!strcmp(body, "hello"), "CONTINUATION: body %s", body);
+    expect_request("CONTINUATION", get_request);
+    client_close(&c);
+}
+
+static void test_data()
+{
+    struct Client c;
+    char fields[1024], body[65536];
+    client_open(&c);
+    send_frame(&c, HEADERS, END_HEADERS, 1, post_block, sizeof(post_block));
+    send_frame(&c, DATA, 0, 1, "abc", 3);
+    unsigned char padded[] = {4, 'd', 'e', 'f', 0, 0, 0, 0}; // pad length, data, padding
+    send_frame(&c, DATA, PADDED | END_STREAM, 1, padded, sizeof(padded));
+    recv_response("POST", &c, 1, fields, body);
+    CHECK(!strcmp(body, "hello"), "POST: body %s", body);
+    expect_request("POST", "POST http://www.example.com/ HTTP/1.1\r\nHost: www.example.com\r\n"
+                           "Content-Length: 6\r\nConnection: close\r\n\r\nabcdef");
+    client_close(&c);
+}
+
+static void test_ping()
+{
+    struct Client c;
+    unsigned char payload[65536];
+    int flags;
+    unsigned int id;
+    client_open(&c);
+    send_frame(&c, PING, 0, 0, "12345678", 8);
+    int len = recv_type(&c, PING, &flags, &id, payload);
+    CHECK(len == 8 && (flags & ACK) && !memcmp(payload, "12345678", 8), "PING not answered");
+    client_close(&c);
+}
+
+/* Appends a literal field, not indexed, with a new name; the new block length */
+static size_t add_field(unsigned char *block, size_t len, const char *name, const char *value)
+{
+    block[len++] = 0x00;
+    block[len++] = strlen(name);
+    memcpy(block + len, name, strlen(name));
+    len += strlen(name);
+    block[len++] = strlen(value);
+    memcpy(block + len, value, strlen(value));
+    return len + strlen(value);
+}
+
+/* GET with one more field, or POST with it when body is not NULL */
+static size_t request_with(unsigned char *block, const char *name, const char *value, const char *body)
+{
+    const unsigned char *base = body != NULL ? post_block : get_block;
+    memcpy(block, base, sizeof(get_block));
+    return add_field(block, sizeof(get_block), name, value);
+}
+
+/*
+   The request, with body sent in DATA if not NULL, must be reset with
+   PROTOCOL_ERROR before the proxy sees it, and the connection must go on.
+ */
+static void expect_reset(const char *name, const unsigned char *block, size_t len, const char *body)
+{
+    struct Client c;
+    unsigned char got[65536];
+    char fields[1024], response_body[65536];
+    int flags;
+    unsigned int id;
+    client_open(&c);
+    send_frame(&c, HEADERS, END_HEADERS | (body == NULL ? END_STREAM : 0), 1, block, len);
+    if (body != NULL)
+        send_frame(&c, DATA, END_STREAM, 1, body, strlen(body));
+    int n = recv_type(&c, RST_STREAM, &flags, &id, got);
+    CHECK(n == 4 && id == 1 && got[3] == 0x1, "%s: RST_STREAM %d on %u, expected PROTOCOL_ERROR on 1", name,
+          n == 4 ? got[3] : -1, id);
+    expect_request(name, "");
+
+    send_frame(&c, HEADERS, END_HEADERS | END_STREAM, 3, get_block, sizeof(get_block));
+    recv_response(name, &c, 3, fields, response_body);
+    CHECK(!strcmp(response_body, "hello"), "%s: next stream body %s", name, response_body);
+    expect_request(name, get_request);
+    client_close(&c);
+}
+
+static void test_malformed()
+{
+    unsigned char block[512];
+    size_t len;
+
+    len = request_with(block, "X-Upper", "1", NULL);
+    expect_reset("uppercase name", block, len, NULL);
+    len = request_with(block, "a: b\r\ntransfer-encoding", "chunked", NULL);
+    expect_reset("CRLF in a name", block, len, NULL);
+    len = request_with(block, "a:b", "1", NULL);
+    expect_reset("colon in a name", block, len, NULL);
+    len = request_with(block, "a b", "1", NULL);
+    expect_reset("space in a name", block, len, NULL);
+    len = request_with(block, "x-a", "1\r\nx-evil: 1", NULL);
+    expect_reset("CRLF in a value", block, len, NULL);
+    len = request_with(block, "x-a", "1\nx-evil: 1", NULL);
+    expect_reset("LF in a value", block, len, NULL);
+
+    // Pseudo-headers as literals: :method (2), :path (4) and :authority (1) by static index
+    static const unsigned char scheme_authority[] = {0x86, 0x01, 0x0f, 'w', 'w', 'w', '.', 'e', 'x', 'a',
+                                                     'm', 'p', 'l', 'e', '.', 'c', 'o', 'm'};
+    unsigned char bad_path[] = {0x82, 0x04, 0x09, '/', 'a', '\r', '\n', 'x', ':', ' ', 'y', '/'};
+    len = sizeof(bad_path);
+    memcpy(block, bad_path, len);
+    memcpy(block + len, scheme_authority, sizeof(scheme_authority));
+    expect_reset("CRLF in :path", block, len + sizeof(scheme_authority), NULL);
+    unsigned char bad_method[] = {0x02, 0x05, 'G', 'E', 'T', '\r', '\n', 0x84};
+    len = sizeof(bad_method);
+    memcpy(block, bad_method, len);
+    memcpy(block + len, scheme_authority, sizeof(scheme_authority));
+    expect_reset("CRLF in :method", block, len + sizeof(scheme_authority), NULL);
+    unsigned char bad_authority[] = {0x82, 0x86, 0x84, 0x01, 0x05, 'a', '\r', '\n', 'b', 'c'};
+    expect_reset("CRLF in :authority", bad_authority, sizeof(bad_authority), NULL);
+
+    len = request_with(block, "content-length", "5", "abc");
+    expect_reset("body shorter than content-length", block, len, "abc");
+    len = request_with(block, "content-length", "2", "abc");
+    expect_reset("body longer than content-length", block, len, "abc");
+    len = request_with(block, "content-length", "3", NULL);
+    expect_reset("content-length without a body", block, len, NULL);
+    len = request_with(block, "content-length", "3x", "abc");
+    expect_reset("content-length not a number", block, len, "abc");
+    len = request_with(block, "content-length", "99999999999999999999", "abc");
+    expect_reset("content-length overflow", block, len, "abc");
+    len = request_with(block, "content-length", "3", "abc");
+    len = add_field(block, len, "content-length", "4");
+    expect_reset("conflicting content-lengths", block, len, "abc");
+
+    // A content-length that matches is forwarded, once
+    struct Client c;
+    char fields[1024], body[65536];
+    client_open(&c);
+    len = request_with(block, "content-length", "3", "abc");
+    len = add_field(block, len, "content-length", "3");
+    send_frame(&c, HEADERS, END_HEADERS, 1, block, len);
+    send_frame(&c, DATA, END_STREAM, 1, "abc", 3);
+    recv_response("matching content-length", &c, 1, fields, body);
+    expect_request("matching content-length", "POST http://www.example.com/ HTTP/1.1\r\nHost: www.example.com\r\n"
+                                              "content-length: 3\r\nConnection: close\r\n\r\nabc");
+    client_close(&c);
+}
+
+/* The frame, sent inside a header block of stream 1 if open_block, must end the connection with GOAWAY code */
+static void expect_goaway(const char *name, int open_block, int type, int flags, unsigned int id,
+                          const void *payload, size_t len, int code)
+{
+    struct Client c;
+    unsigned char got[65536];
+    int got_flags;
+    unsigned int got_id;
+    client_open(&c);
+    if (open_block)
+        send_frame(&c, HEADERS, 0, 1, get_block, 5);
+    send_frame(&c, type, flags, id, payload, len);
+    int n = recv_type(&c, GOAWAY, &got_flags, &got_id, got);
+    CHECK(n == 8 && got[7] == code, "%s: GOAWAY %d, expected %d", name, n == 8 ? got[7] : -1, code);
+    // Unread frames reset rather than close a unix socket
+    n = recv(c.fd, got, 1, 0);
+    CHECK(n == 0 || (n < 0 && errno == ECONNRESET), "%s: connection not closed", name);
+    client_close(&c);
+}
+
+static void test_errors()
+{
+    static unsigned char big[H2_FRAME_SIZE + 1];
+    unsigned char zero[4] = {0, 0, 0, 0};
+    unsigned char bad_hpack[] = {0x80}; // index 0
+    unsigned char nul_value[] = {0x82, 0x86, 0x84, 0x01, 0x03, 'a', 0, 'b'}; // :authority a\0b
+    unsigned char headers_block[] = {0x82};
+    unsigned char settings[5] = {0, 0x4, 0, 0, 0};
+    unsigned char huge_window[6] = {0, 0x4, 0x80, 0, 0, 0}; // SETTINGS_INITIAL_WINDOW_SIZE of 2^31
+
+    expect_goaway("oversized frame", 0, DATA, 0, 1, big, sizeof(big), 0x6);
+    expect_goaway("HEADERS on stream 0", 0, HEADERS, END_HEADERS, 0, get_block, sizeof(get_block), 0x1);
+    expect_goaway("HEADERS on an even stream", 0, HEADERS, END_HEADERS, 2, get_block, sizeof(get_block), 0x1);
+    expect_goaway("CONTINUATION without HEADERS", 0, CONTINUATION, END_HEADERS, 1, headers_block, 1, 0x1);
+    expect_goaway("frame inside a header block", 1, PING, 0, 0, "12345678", 8, 0x1);
+    expect_goaway("CONTINUATION of another stream", 1, CONTINUATION, END_HEADERS, 3, headers_block, 1, 0x1);
+    expect_goaway("bad HPACK", 0, HEADERS, END_HEADERS | END_STREAM, 1, bad_hpack, sizeof(bad_hpack), 0x9);
+    expect_goaway("NUL in a value", 0, HEADERS, END_HEADERS | END_STREAM, 1, nul_value, sizeof(nul_value), 0x9);
+    expect_goaway("connection WINDOW_UPDATE of 0", 0, WINDOW_UPDATE, 0, 0, zero, sizeof(zero), 0x1);
+    expect_goaway("short WINDOW_UPDATE", 0, WINDOW_UPDATE, 0, 0, zero, 3, 0x6);
+    expect_goaway("PING on a stream", 0, PING, 0, 1, "12345678", 8, 0x1);
+    expect_goaway("PING of 7 bytes", 0, PING, 0, 0, "1234567", 7, 0x6);
+    expect_goaway("SETTINGS of 5 bytes", 0, SETTINGS, 0, 0, settings, sizeof(settings), 0x6);
+    expect_goaway("SETTINGS window too large", 0, SETTINGS, 0, 0, huge_window, sizeof(huge_window), 0x3);
+}
+
+int main()
+{
+    test_get();
+    test_continuation();
+    test_data();
+    test_ping();
+    test_malformed();
+    test_errors();
+
+    if (failures > 0)
+    {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("h2: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,314 @@
+/*
+  hpack_test.c -- tests for the HPACK decoder and encoder.
+
+  The decoder is run over the header block examples of RFC 7541 Appendix C,
+  one decoder per sequence of blocks so that the dynamic table carries over
+  as it does on a connection, and checked field by field and by table size.
+  Malformed blocks (bad indexes, oversized integers, table size updates and
+  Huffman padding) must be rejected. Encoded fields must decode back.
+
+  Usage: hpack_test
+*/
+
+#include "../hpack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures;
+
+#define CHECK(cond, ...)                                \
+    do                                                  \
+    {                                                   \
+        if (!(cond))                                    \
+        {                                               \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__);                        \
+            printf("\n");                               \
+            failures++;                                 \
+        }                                               \
+    } while (0)
+
+/* Decoded fields as "name: value\n" lines */
+struct Fields
+{
+    char text[4096];
+    size_t len;
+};
+
+static int collect(void *arg, const char *name, const char *value)
+{
+    struct Fields *f = (struct Fields *)arg;
+    int n = snprintf(f->text + f->len, sizeof(f->text) - f->len, "%s: %s\n", name, value);
+    if (n < 0 || (size_t)n >= sizeof(f->text) - f->len)
+        return -1;
+    f->len += n;
+    return 0;
+}
+
+/* Bytes of a hex dump such as "8286 8441", blanks ignored; their count */
+static size_t unhex(const char *hex, unsigned char *out)
+{
+    size_t n = 0;
+    for (const char *p = hex; *p != '\0';)
+    {
+        if (*p == ' ')
+        {
+            p++;
+            continue;
+        }
+        unsigned int b;
+        sscanf(p, "%2x", &b);
+        out[n++] = b;
+        p += 2;
+    }
+    return n;
+}
+
+/* Decode one block with d, expect its fields and the table size after it */
+static void expect_block(const char *name, struct HpackDecoder *d, const char *hex, const char *fields,
+                         size_t table_size)
+{
+    unsigned char block[1024];
+    size_t len = unhex(hex, block);
+    struct Fields f;
+    f.len = 0;
+    f.text[0] = '\0';
+    int r = Hpack_decode(d, block, len, collect, &f);
+    CHECK(r == 0, "%s: rejected", name);
+    CHECK(!strcmp(f.text, fields), "%s: decoded\n%s\nexpected\n%s", name, f.text, fields);
+    CHECK(d->size == table_size, "%s: table size %zu, expected %zu", name, d->size, table_size);
+}
+
+/* A fresh decoder must reject the block */
+static void expect_error(const char *name, const unsigned char *block, size_t len)
+{
+    struct HpackDecoder d;
+    struct Fields f;
+    f.len = 0;
+    Hpack_init(&d);
+    CHECK(Hpack_decode(&d, block, len, collect, &f) < 0, "%s: accepted", name);
+    Hpack_free(&d);
+}
+
+static void expect_error_hex(const char *name, const char *hex)
+{
+    unsigned char block[1024];
+    expect_error(name, block, unhex(hex, block));
+}
+
+static const char *request1 = ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n";
+static const char *request2 =
+    ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n";
+static const char *request3 =
+    ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n";
+static const char *response1 = ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                               "location: https://www.example.com\n";
+static const char *response2 = ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                               "location: https://www.example.com\n";
+static const char *response3 = ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\n"
+                               "location: https://www.example.com\ncontent-encoding: gzip\n"
+                               "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n";
+
+/* C.2: one block per decoder */
+static void test_fields()
+{
+    struct HpackDecoder d;
+    Hpack_init(&d);
+    expect_block("C.2.1", &d, "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572",
+                 "custom-key: custom-header\n", 55);
+    Hpack_free(&d);
+
+    Hpack_init(&d);
+    expect_block("C.2.2", &d, "040c 2f73 616d 706c 652f 7061 7468", ":path: /sample/path\n", 0);
+    Hpack_free(&d);
+
+    Hpack_init(&d);
+    expect_block("C.2.3", &d, "1008 7061 7373 776f 7264 0673 6563 7265 74", "password: secret\n", 0);
+    Hpack_free(&d);
+
+    Hpack_init(&d);
+    expect_block("C.2.4", &d, "82", ":method: GET\n", 0);
+    Hpack_free(&d);
+}
+
+/* C.3 and C.4: three requests on one connection, plain then Huffman coded */
+static void test_requests()
+{
+    struct HpackDecoder d;
+    Hpack_init(&d);
+    expect_block("C.3.1", &d, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", request1, 57);
+    expect_block("C.3.2", &d, "8286 84be 5808 6e6f 2d63 6163 6865", request2, 110);
+    expect_block("C.3.3", &d,
+                 "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+                 request3, 164);
+    CHECK(d.count == 3, "C.3: %d entries", d.count);
+    Hpack_free(&d);
+
+    Hpack_init(&d);
+    expect_block("C.4.1", &d, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", request1, 57);
+    expect_block("C.4.2", &d, "8286 84be 5886 a8eb 1064 9cbf", request2, 110);
+    expect_block("C.4.3", &d, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf", request3, 164);
+    Hpack_free(&d);
+}
+
+/* C.5 and C.6: three responses with a 256 byte table, so entries are evicted */
+static void test_responses()
+{
+    struct HpackDecoder d;
+    Hpack_init(&d);
+    d.max_size = 256; // as if SETTINGS_HEADER_TABLE_SIZE said so
+    expect_block("C.5.1", &d,
+                 "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133"
+                 "2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70"
+                 "6c65 2e63 6f6d",
+                 response1, 222);
+    expect_block("C.5.2", &d, "4803 3330 37c1 c0bf", response2, 222);
+    expect_block("C.5.3", &d,
+                 "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d"
+                 "54c0 5a04 677a 6970 7738 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049"
+                 "5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b 2076 6572 7369 6f6e"
+                 "3d31",
+                 response3, 215);
+    CHECK(d.count == 3, "C.5: %d entries", d.count);
+    Hpack_free(&d);
+
+    Hpack_init(&d);
+    d.max_size = 256;
+    expect_block("C.6.1", &d,
+                 "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6"
+                 "2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3",
+                 response1, 222);
+    expect_block("C.6.2", &d, "4883 640e ffc1 c0bf", response2, 222);
+    expect_block("C.6.3", &d,
+                 "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab"
+                 "77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f"
+                 "9587 3160 65c0 03ed 4ee5 b106 3d50 07",
+                 response3, 215);
+    Hpack_free(&d);
+}
+
+/* Table size updates evict, and the table never grows past its limit */
+static void test_table_size()
+{
+    struct HpackDecoder d;
+    Hpack_init(&d);
+    expect_block("fill", &d, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", request1, 57);
+    expect_block("shrink to 0", &d, "20", "", 0);
+    CHECK(d.count == 0, "shrink to 0: %d entries", d.count);
+    expect_block("grow to 4096", &d, "3fe1 1f 82", ":method: GET\n", 0);
+    unsigned char evicted[] = {0xbe}; // index 62, the evicted :authority
+    struct Fields f;
+    f.len = 0;
+    CHECK(Hpack_decode(&d, evicted, 1, collect, &f) < 0, "evicted entry still indexed");
+    Hpack_free(&d);
+
+    // An entry larger than the table is not added, a smaller one evicts what it must
+    Hpack_init(&d);
+    d.max_size = 56;
+    expect_block("entry too large", &d, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", request1, 0);
+    CHECK(d.count == 0, "entry too large: %d entries", d.count);
+    expect_block("entry fits", &d, "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572",
+                 "custom-key: custom-header\n", 55);
+    expect_block("entry evicts", &d, "4001 6101 62", "a: b\n", 34);
+    CHECK(d.count == 1, "entry evicts: %d entries", d.count);
+    Hpack_free(&d);
+
+    // Many small entries wrap around the ring
+    Hpack_init(&d);
+    unsigned char block[16] = {0x40, 1, 'a', 1, 'b'}; // a: b, 34 bytes each
+    for (int i = 0; i < 1000; i++)
+    {
+        struct Fields f;
+        f.len = 0;
+        CHECK(Hpack_decode(&d, block, 5, collect, &f) == 0, "ring: block %d rejected", i);
+    }
+    CHECK(d.count == HPACK_TABLE_SIZE / 34 && d.size == (size_t)d.count * 34, "ring: %d entries, %zu bytes",
+          d.count, d.size);
+    Hpack_free(&d);
+}
+
+static void test_errors()
+{
+    expect_error_hex("index 0", "80");
+    expect_error_hex("static index past the table", "ff00"); // 127 + 0 = 127, nothing there yet
+    expect_error_hex("truncated integer", "ff");
+    expect_error_hex("integer too long", "ff ffff ffff ffff ffff 7f");
+    expect_error_hex("table size update too large", "3fe2 1f"); // 4097
+    expect_error_hex("literal name index past the table", "7f 00 01 61"); // 63 + 0
+    expect_error_hex("string longer than the block", "400a 6375 7374");
+    expect_error_hex("string length overflow", "40 7f ffff ffff ffff ffff 7f");
+    expect_error_hex("missing value", "400a 6375 7374 6f6d 2d6b 6579");
+    expect_error_hex("NUL in a name", "4003 6100 62 01 61");
+    expect_error_hex("Huffman padding not ones", "4081 f0 01 61");      // "w" then a zero bit
+    expect_error_hex("Huffman padding over 7 bits", "4082 f1ff 01 61"); // "w" then nine one bits
+    expect_error_hex("Huffman EOS", "4084 ffff ffff 01 61");
+
+    // A value longer than HPACK_MAX_STRING
+    size_t len = HPACK_MAX_STRING + 1;
+    unsigned char *block = (unsigned char *)malloc(len + 16);
+    size_t n = 0;
+    block[n++] = 0x40;
+    block[n++] = 1;
+    block[n++] = 'a';
+    block[n++] = 0x7f; // length: 127 + continuation bytes
+    size_t rest = len - 127;
+    while (rest >= 128)
+    {
+        block[n++] = 0x80 | (rest & 0x7f);
+        rest >>= 7;
+    }
+    block[n++] = rest;
+    memset(block + n, 'x', len);
+    expect_error("value too long", block, n + len);
+    free(block);
+}
+
+/* What the encoder writes decodes back, names lowercased */
+static void test_encode()
+{
+    unsigned char block[512];
+    int n = Hpack_encodeStatus(block, sizeof(block), 200);
+    CHECK(n > 0, "encode :status 200");
+    int m = Hpack_encodeStatus(block + n, sizeof(block) - n, 404);
+    CHECK(m > 0, "encode :status 404");
+    n += m;
+    m = Hpack_encode(block + n, sizeof(block) - n, "Content-Type", 12, "text/html", 9);
+    CHECK(m > 0, "encode content-type");
+    n += m;
+    m = Hpack_encode(block + n, sizeof(block) - n, "X-Custom-Header", 15, "some value", 10);
+    CHECK(m > 0, "encode x-custom-header");
+    n += m;
+    unsigned char small[3];
+    CHECK(Hpack_encode(small, sizeof(small), "X-Custom-Header", 15, "some value", 10) < 0,
+          "encode into too little room");
+
+    struct HpackDecoder d;
+    struct Fields f;
+    f.len = 0;
+    f.text[0] = '\0';
+    Hpack_init(&d);
+    CHECK(Hpack_decode(&d, block, n, collect, &f) == 0, "encoded block rejected");
+    CHECK(!strcmp(f.text, ":status: 200\n:status: 404\ncontent-type: text/html\nx-custom-header: some value\n"),
+          "encoded block decoded to\n%s", f.text);
+    CHECK(d.count == 0, "encoder used the dynamic table");
+    Hpack_free(&d);
+}
+
+int main()
+{
+    test_fields();
+    test_requests();
+    test_responses();
+    test_table_size();
+    test_errors();
+    test_encode();
+
+    if (failures > 0)
+    {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("hpack: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,190 @@
+/*
+  trace.c -- sampled per-request phase timelines with Chrome trace-event
+  and binary export.
+*/
+
+#include "trace.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *phase_names[T_PHASES] = {
+    "queue", "read_headers", "cache_lookup", "resolve", "connect", "ttfb", "send",
+};
+
+static struct TraceRecord *ring; // TRACE_RING_RECORDS records, allocated on first use
+static unsigned long ring_next;  // sequence of the next record to publish
+static int trace_every;
+static unsigned long trace_counter;
+static __thread struct TraceRecord current;
+static __thread int sampled;
+
+void Trace_setSampling(int every)
+{
+    if (every > 0 && ring == NULL)
+    {
+        struct TraceRecord *records = (struct TraceRecord *)calloc(TRACE_RING_RECORDS, sizeof(struct TraceRecord));
+        struct TraceRecord *expected = NULL;
+        if (records != NULL &&
+            !__atomic_compare_exchange_n(&ring, &expected, records, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            free(records);
+        if (__atomic_load_n(&ring, __ATOMIC_ACQUIRE) == NULL)
+            return;
+    }
+    __atomic_store_n(&trace_every, every > 0 ? every : 0, __ATOMIC_RELAXED);
+}
+
+int Trace_begin(long accepted_us, int slot)
+{
+    int every = __atomic_load_n(&trace_every, __ATOMIC_RELAXED);
+    sampled = every > 0 && __atomic_fetch_add(&trace_counter, 1, __ATOMIC_RELAXED) % every == 0;
+    if (!sampled)
+        return 0;
+
+    current.start_us = accepted_us;
+    current.slot = slot;
+    current.status = 0;
+    for (int p = 0; p < T_PHASES; p++)
+        current.begin[p] = current.end[p] = -1;
+    current.begin[T_QUEUE] = 0; // the queue phase starts at accept
+    return 1;
+}
+
+void Trace_enter(int phase)
+{
+    if (sampled && current.begin[phase] < 0)
+        current.begin[phase] = (int)(Metrics_nowUs() - current.start_us);
+}
+
+void Trace_leave(int phase)
+{
+    if (sampled && current.begin[phase] >= 0)
+        current.end[phase] = (int)(Metrics_nowUs() - current.start_us);
+}
+
+void Trace_end(int status, const char *method, const char *url)
+{
+    if (!sampled)
+        return;
+    sampled = 0;
+
+    current.status = status;
+    current.duration_us = (int)(Metrics_nowUs() - current.start_us);
+    snprintf(current.method, sizeof(current.method), "%s", method != NULL ? method : "");
+    snprintf(current.url, sizeof(current.url), "%s", url != NULL ? url : "");
+
+    // Seqlock publication: readers skip a record whose seq is 0 or changes while they copy it
+    unsigned long seq = __atomic_fetch_add(&ring_next, 1, __ATOMIC_RELAXED) + 1;
+    struct TraceRecord *rec = &ring[(seq - 1) % TRACE_RING_RECORDS];
+    __atomic_store_n(&rec->seq, 0UL, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    current.seq = 0;
+    memcpy((char *)rec + sizeof(rec->seq), (char *)&current + sizeof(current.seq),
+           sizeof(current) - sizeof(current.seq));
+    __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+}
+
+/* Copy the published records out of the ring, oldest first; returns how many */
+static int snapshot(struct TraceRecord *out)
+{
+    if (ring == NULL)
+        return 0;
+    unsigned long last = __atomic_load_n(&ring_next, __ATOMIC_ACQUIRE);
+    unsigned long first = last > TRACE_RING_RECORDS ? last - TRACE_RING_RECORDS : 0;
+    int count = 0;
+
+    for (unsigned long seq = first + 1; seq <= last; seq++)
+    {
+        struct TraceRecord *rec = &ring[(seq - 1) % TRACE_RING_RECORDS];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != seq)
+            continue;
+        memcpy(&out[count], rec, sizeof(*rec));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq)
+            count++;
+    }
+    return count;
+}
+
+/* Append s as the contents of a JSON string */
+static void json_string(struct AdminReply *reply, const char *s)
+{
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            Admin_printf(reply, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            Admin_printf(reply, "\\u%04x", *s);
+        else
+            Admin_write(reply, s, 1);
+    }
+}
+
+void Trace_render(const char *method, const char *query, const char *body,
+                  struct AdminReply *reply)
+{
+    (void)body;
+    char value[16];
+
+    if (!strcmp(method, "POST"))
+    {
+        if (!Admin_queryParam(query, "every", value, sizeof(value)))
+        {
+            reply->status = 400;
+            Admin_printf(reply, "every=N is required\n");
+            return;
+        }
+        Trace_setSampling(atoi(value));
+        Admin_printf(reply, "tracing 1 in %d requests\n", __atomic_load_n(&trace_every, __ATOMIC_RELAXED));
+        return;
+    }
+
+    struct TraceRecord *records = (struct TraceRecord *)malloc(TRACE_RING_RECORDS * sizeof(struct TraceRecord));
+    if (records == NULL)
+    {
+        reply->status = 500;
+        return;
+    }
+    int count = snapshot(records);
+
+    if (Admin_queryParam(query, "format", value, sizeof(value)) && !strcmp(value, "bin"))
+    {
+        struct TraceDumpHeader header;
+        memcpy(header.magic, "PXTR", 4);
+        header.version = 1;
+        header.record_size = sizeof(struct TraceRecord);
+        header.phases = T_PHASES;
+        header.count = count;
+        reply->content_type = "application/octet-stream";
+        Admin_write(reply, (const char *)&header, sizeof(header));
+        Admin_write(reply, (const char *)records, count * sizeof(struct TraceRecord));
+        free(records);
+        return;
+    }
+
+    // Complete ("X") events, one per request and one per phase, on the lane of the worker slot
+    reply->content_type = "application/json";
+    Admin_printf(reply, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (int i = 0; i < count; i++)
+    {
+        struct TraceRecord *rec = &records[i];
+        Admin_printf(reply, "%s\n{\"name\":\"", i > 0 ? "," : "");
+        json_string(reply, rec->method);
+        Admin_printf(reply, " ");
+        json_string(reply, rec->url);
+        Admin_printf(reply, "\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%ld,\"dur\":%d,\"pid\":1,\"tid\":%d,"
+                            "\"args\":{\"status\":%d}}",
+                     rec->start_us, rec->duration_us, rec->slot, rec->status);
+        for (int p = 0; p < T_PHASES; p++)
+        {
+            if (rec->begin[p] < 0 || rec->end[p] < 0)
+                continue;
+            Admin_printf(reply, ",\n{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":%ld,\"dur\":%d,"
+                                "\"pid\":1,\"tid\":%d}",
+                         phase_names[p], rec->start_us + rec->begin[p], rec->end[p] - rec->begin[p], rec->slot);
+        }
+    }
+    Admin_printf(reply, "\n]}\n");
+    free(records);
+}
@@ -0,0 +1,74 @@
+/*
+ * trace.h -- sampled per-request phase timelines.
+ *
+ * One request in every trace_every is traced: the worker fills a private
+ * record with the monotonic begin and end of each phase it goes through and
+ * publishes it into a preallocated ring when the request finishes, so the
+ * hot path never allocates or takes a lock. The ring keeps the most recent
+ * TRACE_RING_RECORDS requests and is exported on demand, either as Chrome
+ * trace-event JSON (chrome://tracing, Perfetto) or as a raw binary dump.
+ */
+
+#include "admin.h"
+
+#ifndef PROXY_TRACE
+#define PROXY_TRACE
+
+#define TRACE_RING_RECORDS 4096
+#define TRACE_URL_LEN 96
+
+enum TracePhase
+{
+    T_QUEUE,        // accepted until a worker slot picks the connection up
+    T_HEADERS,      // reading the request line and headers
+    T_CACHE_LOOKUP, // cache lookup in find()
+    T_RESOLVE,      // gethostbyname() of the origin
+    T_CONNECT,      // connect() to the origin
+    T_TTFB,         // request sent until the first response byte
+    T_SEND,         // response written to the client
+    T_PHASES
+};
+
+/* Begin and end of each phase in us after start_us, -1 if not reached */
+struct TraceRecord
+{
+    unsigned long seq; // publication sequence, 0 while being written
+    long start_us;     // Metrics_nowUs() when the connection was accepted
+    int slot;          // worker slot, one timeline lane per slot
+    int status;        // response status, 0 if none was sent
+    int duration_us;   // accept to Trace_end()
+    int begin[T_PHASES];
+    int end[T_PHASES];
+    char method[12];
+    char url[TRACE_URL_LEN];
+};
+
+/* Header of the binary dump, followed by count struct TraceRecord */
+struct TraceDumpHeader
+{
+    char magic[4]; // "PXTR"
+    int version;
+    int record_size;
+    int phases;
+    int count;
+};
+
+/* Trace one request in every `every` (0 disables tracing) */
+void Trace_setSampling(int every);
+
+/* Start the calling thread's request, accepted at accepted_us; returns 1 if sampled */
+int Trace_begin(long accepted_us, int slot);
+
+/* Mark the begin or end of a phase of the current request (no-op if not sampled) */
+void Trace_enter(int phase);
+void Trace_leave(int phase);
+
+/* Publish the current request into the ring */
+void Trace_end(int status, const char *method, const char *url);
+
+/* Admin handler: GET /trace as Chrome JSON, /trace?format=bin as a binary dump,
+   POST /trace?every=N changes the sampling rate */
+void Trace_render(const char *method, const char *query, const char *body,
+                  struct AdminReply *reply);
+
+#endif
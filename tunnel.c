@@ -0,0 +1,130 @@
+/*
+  tunnel.c -- bidirectional byte relay for CONNECT tunnels.
+*/
+
+#include "tunnel.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define TUNNEL_PIPE_SIZE 65536 // bytes moved per splice() call
+
+/* One direction of the tunnel */
+struct tunnel_dir
+{
+    int from;       // socket read from
+    int to;         // socket written to
+    int pipefd[2];  // kernel buffer between the two
+    long pending;   // bytes sitting in the pipe
+    int eof;        // from has closed its write side
+    int shut;       // to has been shut down for writing
+};
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Move what is ready on one direction, returns bytes written or -1 on error */
+static long tunnel_pump(struct tunnel_dir *d, short from_events)
+{
+    long moved = 0;
+
+    if (!d->eof && d->pending < TUNNEL_PIPE_SIZE && (from_events & (POLLIN | POLLHUP | POLLERR)))
+    {
+        ssize_t n = splice(d->from, NULL, d->pipefd[1], NULL, TUNNEL_PIPE_SIZE - d->pending,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+            d->pending += n;
+        else if (n == 0)
+            d->eof = 1;
+        else if (errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+
+    // Drain right away, the peer is usually writable
+    if (d->pending > 0)
+    {
+        ssize_t n = splice(d->pipefd[0], NULL, d->to, NULL, d->pending,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+            d->pending -= n;
+            moved = n;
+        }
+        else if (n < 0 && errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+
+    if (d->eof && d->pending == 0 && !d->shut)
+    {
+        shutdown(d->to, SHUT_WR);
+        d->shut = 1;
+    }
+    return moved;
+}
+
+/*
+   splice() into a socket whose peer reset raises SIGPIPE, and unlike send()
+   it takes no MSG_NOSIGNAL. The relay relies on main() ignoring SIGPIPE so
+   that a dead end shows up as EPIPE in tunnel_pump and ends the tunnel.
+ */
+long Tunnel_relay(int a, int b, int idle_seconds)
+{
+    struct tunnel_dir dirs[2] = {{a, b, {-1, -1}, 0, 0, 0}, {b, a, {-1, -1}, 0, 0, 0}};
+    long total = 0;
+
+    if (set_nonblocking(a) < 0 || set_nonblocking(b) < 0 ||
+        pipe2(dirs[0].pipefd, O_NONBLOCK) < 0)
+        return -1;
+    if (pipe2(dirs[1].pipefd, O_NONBLOCK) < 0)
+    {
+        close(dirs[0].pipefd[0]);
+        close(dirs[0].pipefd[1]);
+        return -1;
+    }
+
+    while (!(dirs[0].shut && dirs[1].shut))
+    {
+        // pfd[0] is socket a, pfd[1] is socket b
+        struct pollfd pfd[2] = {{a, 0, 0}, {b, 0, 0}};
+        for (int i = 0; i < 2; i++)
+        {
+            struct tunnel_dir *d = &dirs[i];
+            if (!d->eof && d->pending < TUNNEL_PIPE_SIZE)
+                pfd[i].events |= POLLIN;
+            if (d->pending > 0)
+                pfd[1 - i].events |= POLLOUT;
+        }
+
+        int ready = poll(pfd, 2, idle_seconds * 1000);
+        if (ready == 0)
+            break; // idle timeout
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        long n0 = tunnel_pump(&dirs[0], pfd[0].revents);
+        long n1 = tunnel_pump(&dirs[1], pfd[1].revents);
+        if (n0 < 0 || n1 < 0)
+            break;
+        // A side that hung up after its EOF was relayed can take nothing more
+        if ((pfd[0].revents & (POLLERR | POLLHUP) && dirs[0].eof && dirs[0].pending == 0) ||
+            (pfd[1].revents & (POLLERR | POLLHUP) && dirs[1].eof && dirs[1].pending == 0))
+            break;
+        total += n0 + n1;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        close(dirs[i].pipefd[0]);
+        close(dirs[i].pipefd[1]);
+    }
+    return total;
+}
@@ -0,0 +1,20 @@
+/*
+ * tunnel.h -- bidirectional byte relay for CONNECT tunnels.
+ *
+ * Both directions of a tunnel are served by the calling thread: poll()
+ * tells which side can move, and the bytes go socket -> pipe -> socket with
+ * splice(), so the payload never gets copied through user space.
+ */
+
+#ifndef PROXY_TUNNEL
+#define PROXY_TUNNEL
+
+/*
+   Relay bytes between sockets a and b until both sides have closed, an
+   error occurs, or nothing moved for idle_seconds. Half-closes are passed
+   on with shutdown(SHUT_WR). Returns the total number of bytes relayed, or
+   -1 if the tunnel could not be set up. SIGPIPE must be ignored.
+ */
+long Tunnel_relay(int a, int b, int idle_seconds);
+
+#endif
@@ -0,0 +1,215 @@
+/*
+  upgrade.c -- handing a running proxy over to a new binary (hot restart).
+*/
+
+#include "upgrade.h"
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+enum
+{
+    UPGRADE_SHARED = 'M',  // the shared cache memfd comes along
+    UPGRADE_SNAPSHOT = 'S' // a snapshot of the cache follows
+};
+
+/* One cache entry of a snapshot, followed by its url, variant key and response */
+struct SnapshotRecord
+{
+    int len;         // of the response, -1 ends the snapshot
+    int url_len;
+    int variant_len; // 0 if the response has no Vary
+    int ttl;         // seconds left, 0 if it does not expire
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int control_address(const char *path, struct sockaddr_un *addr)
+{
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return -1;
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int Upgrade_takeOver(const char *path, int *listener, int *cache_fd)
+{
+    struct sockaddr_un addr;
+    if (control_address(path, &addr) < 0)
+        return -1;
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn < 0)
+        return -1;
+    if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(conn); // nobody to take over from
+        return -1;
+    }
+
+    char kind;
+    struct iovec iov = {&kind, 1};
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg;
+    if (recvmsg(conn, &msg, 0) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        close(conn);
+        return -1;
+    }
+    int fds[2] = {-1, -1};
+    memcpy(fds, CMSG_DATA(cmsg), cmsg->cmsg_len - CMSG_LEN(0));
+    *listener = fds[0];
+    *cache_fd = kind == UPGRADE_SHARED ? fds[1] : -1;
+    return conn;
+}
+
+int Upgrade_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    if (control_address(path, &addr) < 0)
+        return -1;
+    int control = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (control < 0)
+        return -1;
+    unlink(path); // left by the proxy taken over from, or by one that crashed
+    if (bind(control, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(control, 1) < 0)
+    {
+        close(control);
+        return -1;
+    }
+    return control;
+}
+
+int Upgrade_handOff(int control, int listener, int cache_fd)
+{
+    int conn = accept(control, NULL, NULL);
+    if (conn < 0)
+        return -1;
+
+    char kind = cache_fd >= 0 ? UPGRADE_SHARED : UPGRADE_SNAPSHOT;
+    int fds[2] = {listener, cache_fd};
+    int nfds = cache_fd >= 0 ? 2 : 1;
+    struct iovec iov = {&kind, 1};
+    char control_buf[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control_buf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != 1)
+    {
+        close(conn);
+        return -1;
+    }
+    return conn;
+}
+
+int Upgrade_sendCache(int conn)
+{
+    cache_element **elements;
+    int n = cache_snapshot(&elements);
+    int sent = 0;
+    time_t now = time(NULL);
+    for (int i = 0; i < n; i++)
+    {
+        cache_element *e = elements[i];
+        struct SnapshotRecord r;
+        r.len = e->len;
+        r.url_len = strlen(e->url);
+        r.variant_len = e->variant != NULL ? strlen(e->variant) : 0;
+        r.ttl = e->expires != 0 ? (int)(e->expires - now) : 0;
+        if (sent >= 0 && (e->expires == 0 || r.ttl > 0))
+        {
+            if (write_all(conn, &r, sizeof(r)) < 0 || write_all(conn, e->url, r.url_len) < 0 ||
+                write_all(conn, e->variant, r.variant_len) < 0 || write_all(conn, e->data, r.len) < 0)
+                sent = -1; // the successor went away, unpin the rest
+            else
+                sent++;
+        }
+        release_cache_element(e);
+    }
+    free(elements);
+    struct SnapshotRecord end = {-1, 0, 0, 0};
+    if (sent >= 0 && write_all(conn, &end, sizeof(end)) < 0)
+        sent = -1;
+    return sent;
+}
+
+int Upgrade_receiveCache(int conn)
+{
+    int added = 0;
+    struct SnapshotRecord r;
+    while (read_all(conn, &r, sizeof(r)) == 0 && r.len >= 0)
+    {
+        if (r.url_len <= 0 || r.variant_len < 0 || r.variant_len >= CACHE_MAX_VARIANT_KEY ||
+            r.len > cache_max_element())
+            break;
+        char *url = (char *)malloc(r.url_len + 1);
+        char *variant = (char *)malloc(r.variant_len + 1);
+        char *data = (char *)malloc(r.len + 1);
+        int ok = read_all(conn, url, r.url_len) == 0 && read_all(conn, variant, r.variant_len) == 0 &&
+                 read_all(conn, data, r.len) == 0;
+        if (ok)
+        {
+            url[r.url_len] = '\0';
+            variant[r.variant_len] = '\0';
+            added += add_cache_element(data, r.len, url, r.ttl, variant);
+        }
+        free(url);
+        free(variant);
+        free(data);
+        if (!ok)
+            break;
+    }
+    return added;
+}
@@ -0,0 +1,44 @@
+/*
+ * upgrade.h -- handing a running proxy over to a new binary (hot restart).
+ *
+ * A proxy started with -U path listens for its successor on a Unix socket
+ * at path. A new proxy started with the same -U connects there first and,
+ * if another proxy answers, takes over instead of binding the port: the old
+ * one sends the listening socket with SCM_RIGHTS, along with the memfd of
+ * the shared cache in prefork mode, or else streams a snapshot of its cache
+ * on the connection. The listening socket is never closed, so connections
+ * arriving meanwhile wait in its backlog. The new proxy loads the snapshot
+ * before it starts accepting, rebinds path for the next upgrade, and the
+ * old one stops accepting and drains the connections it is serving for at
+ * most UPGRADE_DRAIN_SECONDS before exiting.
+ */
+
+#ifndef PROXY_UPGRADE
+#define PROXY_UPGRADE
+
+#define UPGRADE_DRAIN_SECONDS 30 // longest wait for the old proxy's connections to finish
+
+/*
+   Take over from the proxy listening on path. Returns the connection to it,
+   with the listening socket and the shared cache memfd (-1 if the old proxy
+   streams a snapshot instead) received; -1 if no proxy answered.
+ */
+int Upgrade_takeOver(const char *path, int *listener, int *cache_fd);
+
+/* Listen for a successor on path, replacing a stale socket file; -1 on error */
+int Upgrade_listen(const char *path);
+
+/*
+   Accept a successor on the control socket and send it the listening
+   socket and the shared cache memfd (-1 to announce a snapshot). Returns
+   the connection to it, -1 on error.
+ */
+int Upgrade_handOff(int control, int listener, int cache_fd);
+
+/* Stream a snapshot of the cache, least recently used first; entries sent or -1 */
+int Upgrade_sendCache(int conn);
+
+/* Add the entries of a snapshot to the cache; entries added */
+int Upgrade_receiveCache(int conn);
+
+#endif
@@ -0,0 +1,180 @@
+/*
+  upstream.c -- backend pools for the reverse proxy (accelerator) mode.
+*/
+
+#include "upstream.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+// Routes are only added at startup, before any worker runs
+static struct Route routes[UPSTREAM_MAX_ROUTES];
+static int nroutes;
+static int balance_policy = BALANCE_LEAST_CONN;
+
+static __thread unsigned int pick_seed; // per-thread PRNG state for p2c
+
+int Upstream_addRoute(const char *spec)
+{
+    const char *eq = strchr(spec, '=');
+    if (eq == NULL || nroutes == UPSTREAM_MAX_ROUTES)
+        return -1;
+
+    struct Route *route = &routes[nroutes];
+    memset(route, 0, sizeof(*route));
+
+    // Match part: host, optionally followed by the path prefix
+    const char *slash = (const char *)memchr(spec, '/', eq - spec);
+    size_t host_len = (slash ? slash : eq) - spec;
+    size_t prefix_len = slash ? (size_t)(eq - slash) : 0;
+    if (host_len == 0 || host_len >= sizeof(route->host) || prefix_len >= sizeof(route->prefix))
+        return -1;
+    memcpy(route->host, spec, host_len);
+    if (slash)
+        memcpy(route->prefix, slash, prefix_len);
+    else
+        strcpy(route->prefix, "/");
+
+    // Backend list
+    char list[1024];
+    char *saveptr;
+    snprintf(list, sizeof(list), "%s", eq + 1);
+    for (char *b = strtok_r(list, ",", &saveptr); b != NULL; b = strtok_r(NULL, ",", &saveptr))
+    {
+        char *colon = strrchr(b, ':');
+        if (colon == NULL || route->nbackends == UPSTREAM_MAX_BACKENDS ||
+            (size_t)(colon - b) >= sizeof(route->backends[0].host))
+            return -1;
+        struct Backend *backend = &route->backends[route->nbackends];
+        memcpy(backend->host, b, colon - b);
+        backend->host[colon - b] = '\0';
+        backend->port = atoi(colon + 1);
+        if (backend->port <= 0 || backend->port > 65535)
+            return -1;
+        route->nbackends++;
+    }
+    if (route->nbackends == 0)
+        return -1;
+
+    nroutes++;
+    return 0;
+}
+
+int Upstream_routeCount()
+{
+    return nroutes;
+}
+
+void Upstream_setPolicy(int policy)
+{
+    balance_policy = policy;
+}
+
+struct Route *Upstream_match(const char *host, const char *path)
+{
+    struct Route *best = NULL;
+    size_t best_len = 0;
+    size_t host_len = strcspn(host, ":");
+
+    for (int i = 0; i < nroutes; i++)
+    {
+        struct Route *route = &routes[i];
+        size_t prefix_len = strlen(route->prefix);
+        int host_ok = !strcmp(route->host, "*") ||
+                      (strlen(route->host) == host_len && !strncasecmp(route->host, host, host_len));
+        if (!host_ok || strncmp(path, route->prefix, prefix_len) != 0)
+            continue;
+        // Longest prefix wins, an exact host beats the wildcard on a tie
+        if (best == NULL || prefix_len > best_len ||
+            (prefix_len == best_len && !strcmp(best->host, "*") && strcmp(route->host, "*")))
+        {
+            best = route;
+            best_len = prefix_len;
+        }
+    }
+    return best;
+}
+
+static int healthy(struct Backend *backend, time_t now)
+{
+    return __atomic_load_n(&backend->ejected_until, __ATOMIC_RELAXED) <= now;
+}
+
+static int load(struct Backend *backend)
+{
+    return __atomic_load_n(&backend->active, __ATOMIC_RELAXED);
+}
+
+struct Backend *Upstream_pick(struct Route *route, struct Backend *exclude)
+{
+    time_t now = time(NULL);
+    int candidates[UPSTREAM_MAX_BACKENDS];
+    int ncandidates = 0;
+
+    for (int i = 0; i < route->nbackends; i++)
+    {
+        if (&route->backends[i] != exclude && healthy(&route->backends[i], now))
+            candidates[ncandidates++] = i;
+    }
+    // Everything ejected: fail open rather than refuse all traffic
+    if (ncandidates == 0)
+    {
+        for (int i = 0; i < route->nbackends; i++)
+        {
+            if (&route->backends[i] != exclude)
+                candidates[ncandidates++] = i;
+        }
+    }
+    if (ncandidates == 0)
+        return NULL; // exclude was the only backend
+
+    if (pick_seed == 0)
+        pick_seed = (unsigned int)time(NULL) ^ (unsigned int)(unsigned long)pthread_self();
+
+    struct Backend *chosen;
+    if (balance_policy == BALANCE_P2C && ncandidates > 1)
+    {
+        int a = rand_r(&pick_seed) % ncandidates;
+        int b = rand_r(&pick_seed) % (ncandidates - 1);
+        if (b >= a)
+            b++;
+        struct Backend *x = &route->backends[candidates[a]];
+        struct Backend *y = &route->backends[candidates[b]];
+        chosen = load(x) <= load(y) ? x : y;
+    }
+    else
+    {
+        // Least connections; start at a random candidate so ties rotate
+        int start = rand_r(&pick_seed) % ncandidates;
+        chosen = &route->backends[candidates[start]];
+        for (int i = 1; i < ncandidates; i++)
+        {
+            struct Backend *b = &route->backends[candidates[(start + i) % ncandidates]];
+            if (load(b) < load(chosen))
+                chosen = b;
+        }
+    }
+
+    __atomic_fetch_add(&chosen->active, 1, __ATOMIC_RELAXED);
+    return chosen;
+}
+
+void Upstream_release(struct Backend *backend, int ok)
+{
+    __atomic_fetch_sub(&backend->active, 1, __ATOMIC_RELAXED);
+    if (ok)
+    {
+        __atomic_store_n(&backend->failures, 0, __ATOMIC_RELAXED);
+        return;
+    }
+    if (__atomic_add_fetch(&backend->failures, 1, __ATOMIC_RELAXED) >= UPSTREAM_MAX_FAILS)
+    {
+        __atomic_store_n(&backend->ejected_until, time(NULL) + UPSTREAM_EJECT_SECONDS, __ATOMIC_RELAXED);
+        __atomic_store_n(&backend->failures, 0, __ATOMIC_RELAXED);
+        LOG(LOG_WARN, "Backend %s:%d ejected for %d seconds\n", backend->host, backend->port,
+            UPSTREAM_EJECT_SECONDS);
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * upstream.h -- backend pools for the reverse proxy (accelerator) mode.
+ *
+ * A route maps a Host and a path prefix to a pool of backends. Requests are
+ * spread over the healthy backends of the best matching route, either to
+ * the one with the fewest requests in flight (least connections) or to the
+ * less loaded of two picked at random (power of two choices). Backends that
+ * keep failing are ejected for a while (passive health checking).
+ */
+
+#include <time.h>
+
+#ifndef PROXY_UPSTREAM
+#define PROXY_UPSTREAM
+
+#define UPSTREAM_MAX_ROUTES 32      // routes that can be configured
+#define UPSTREAM_MAX_BACKENDS 16    // backends per route
+#define UPSTREAM_MAX_FAILS 3        // consecutive failures before ejection
+#define UPSTREAM_EJECT_SECONDS 10   // how long an ejected backend sits out
+
+enum
+{
+    BALANCE_LEAST_CONN, // fewest requests in flight
+    BALANCE_P2C         // power of two random choices
+};
+
+struct Backend
+{
+    char host[256];
+    int port;
+    int active;           // requests in flight (atomic)
+    int failures;         // consecutive failures (atomic)
+    time_t ejected_until; // out of rotation until then (atomic)
+};
+
+struct Route
+{
+    char host[256];   // Host to match without port, "*" matches any
+    char prefix[256]; // path prefix to match
+    struct Backend backends[UPSTREAM_MAX_BACKENDS];
+    int nbackends;
+};
+
+/*
+   Add a route from a spec of the form "host/prefix=backend:port,...", e.g.
+   "api.example.com/v1=10.0.0.1:8000,10.0.0.2:8000" or "*=127.0.0.1:9000"
+   (a missing prefix means "/"). Returns 0 on success, -1 on a bad spec.
+ */
+int Upstream_addRoute(const char *spec);
+
+/* Number of configured routes, 0 unless running as a reverse proxy */
+int Upstream_routeCount();
+
+/* Select the balancing policy (BALANCE_*) */
+void Upstream_setPolicy(int policy);
+
+/* Route with the longest prefix matching host and path, or NULL */
+struct Route *Upstream_match(const char *host, const char *path);
+
+/* Pick a backend of route other than exclude (may be NULL) and count a request in flight on it; NULL if none */
+struct Backend *Upstream_pick(struct Route *route, struct Backend *exclude);
+
+/* End a request on backend; ok == 0 counts it towards ejection */
+void Upstream_release(struct Backend *backend, int ok);
+
+#endif